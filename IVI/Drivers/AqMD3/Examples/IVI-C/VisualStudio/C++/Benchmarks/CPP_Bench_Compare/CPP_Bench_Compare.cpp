@@ -0,0 +1,155 @@
+///
+/// Acqiris IVI-C Driver Benchmark Comparison Tool
+///
+/// Loads a JSON-lines benchmark results file (as written by the benchmark programs) and compares
+/// the candidate revision against a baseline revision, for every benchmark measured on the same
+/// platform (CPU model and compiler). A benchmark is flagged as a regression when the confidence
+/// interval of its relative change is entirely below -threshold (for "higher is better" units).
+///
+/// Usage: CPP_Bench_Compare [results-file] [baseline-revision] [candidate-revision]
+///
+/// Without revisions, the candidate is the revision of the most recent result and the baseline is
+/// the most recent other revision measured on the same platform. Results of the same revision are
+/// pooled. The exit code is 2 when at least one regression is found.
+///
+
+#include "../../include/LibTool.h"
+#include "../../include/BenchmarkResults.h"
+using LibTool::ToString;
+namespace Benchmark = LibTool::Benchmark;
+
+#include <iostream>
+using std::cout;
+using std::cerr;
+#include <map>
+#include <vector>
+#include <stdexcept>
+
+//! Merge the samples of all results of #benchmark measured at #revision on #platform.
+/*! \return false if no such result exists.*/
+bool PoolResults(std::vector<Benchmark::Result> const& results, std::string const& benchmark, std::string const& platform, std::string const& revision, Benchmark::Result& pooled);
+
+// name-space gathering all user-configurable parameters
+namespace
+{
+    std::string resultsFileName("BenchmarkResults.jsonl");
+
+    // Confidence level of intervals, and minimum relative slowdown reported as regression.
+    double const confidence = 0.99;
+    double const regressionThreshold = 0.02;
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        if (argc > 1)
+            resultsFileName = argv[1];
+        std::string baselineRevision = (argc > 2) ? argv[2] : "";
+        std::string candidateRevision = (argc > 3) ? argv[3] : "";
+
+        std::vector<Benchmark::Result> const results = Benchmark::LoadResults(resultsFileName);
+        if (results.empty())
+            throw std::runtime_error("No benchmark results found in " + resultsFileName);
+
+        if (candidateRevision.empty())
+            candidateRevision = results.back().environment.revision;
+
+        cout << "Benchmark comparison (" << resultsFileName << ")\n";
+        cout << "  Candidate revision: " << candidateRevision << '\n';
+        cout << "  Confidence:         " << confidence * 100 << "%\n";
+        cout << "  Threshold:          " << regressionThreshold * 100 << "%\n\n";
+
+        // (platform, benchmark) pairs measured at the candidate revision.
+        std::map<std::string, std::map<std::string, bool>> candidates;
+        for (auto const& result : results)
+            if (result.environment.revision == candidateRevision)
+                candidates[result.environment.GetPlatformKey()][result.benchmark] = true;
+
+        if (candidates.empty())
+            throw std::runtime_error("No result found for candidate revision " + candidateRevision);
+
+        int nbrRegressions = 0;
+        for (auto const& platform : candidates)
+        {
+            cout << "Platform: " << platform.first << '\n';
+
+            for (auto const& entry : platform.second)
+            {
+                std::string const& benchmark = entry.first;
+
+                // the baseline defaults to the most recent other revision of the same benchmark on the same platform.
+                std::string baseline = baselineRevision;
+                if (baseline.empty())
+                {
+                    for (auto it = results.rbegin(); it != results.rend(); ++it)
+                    {
+                        if (it->benchmark == benchmark && it->environment.GetPlatformKey() == platform.first && it->environment.revision != candidateRevision)
+                        {
+                            baseline = it->environment.revision;
+                            break;
+                        }
+                    }
+                }
+
+                Benchmark::Result candidate;
+                Benchmark::Result reference;
+                PoolResults(results, benchmark, platform.first, candidateRevision, candidate);
+                if (baseline.empty() || !PoolResults(results, benchmark, platform.first, baseline, reference))
+                {
+                    cout << "  " << std::left << std::setw(32) << benchmark << std::right << "  no baseline\n";
+                    continue;
+                }
+
+                if (candidate.samples.size() < 2 || reference.samples.size() < 2)
+                {
+                    cout << "  " << std::left << std::setw(32) << benchmark << std::right << "  not enough repetitions\n";
+                    continue;
+                }
+
+                Benchmark::Comparison const comparison = Benchmark::Compare(reference, candidate, confidence, regressionThreshold);
+                if (comparison.isRegression)
+                    ++nbrRegressions;
+
+                cout << "  " << std::left << std::setw(32) << benchmark << std::right << std::fixed << std::setprecision(2)
+                     << std::setw(10) << reference.GetMean() << " -> " << std::setw(10) << candidate.GetMean() << " " << std::setw(10) << std::left << candidate.unit << std::right
+                     << std::showpos << std::setw(8) << comparison.relativeChange * 100 << "% [" << comparison.lowerBound * 100 << "%, " << comparison.upperBound * 100 << "%]" << std::noshowpos
+                     << "  vs " << baseline
+                     << (comparison.isRegression ? "  REGRESSION" : (comparison.isSignificant ? "  significant" : ""))
+                     << '\n';
+            }
+        }
+
+        cout << '\n' << nbrRegressions << " regression(s) found.\n";
+        return (nbrRegressions > 0) ? 2 : 0;
+    }
+    catch (std::exception const& exc)
+    {
+        cerr << "Unexpected error: " << exc.what() << std::endl;
+        return 1;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Definition of local functions
+//
+
+bool PoolResults(std::vector<Benchmark::Result> const& results, std::string const& benchmark, std::string const& platform, std::string const& revision, Benchmark::Result& pooled)
+{
+    bool found = false;
+    for (auto const& result : results)
+    {
+        if (result.benchmark != benchmark || result.environment.GetPlatformKey() != platform || result.environment.revision != revision)
+            continue;
+
+        if (!found)
+        {
+            pooled = result;
+            found = true;
+        }
+        else
+            pooled.samples.insert(pooled.samples.end(), result.samples.begin(), result.samples.end());
+    }
+    return found;
+}
@@ -0,0 +1,254 @@
+///
+/// Acqiris IVI-C Driver Benchmark Program
+///
+/// Measures the host-side processing of the streaming examples (marker decoders, sample unpack
+/// kernels and the end-to-end record loop) and appends the results to a JSON-lines results file.
+///
+/// Usage: CPP_Bench_Streaming [results-file] [repetitions]
+///
+/// The benchmark does not require an instrument: streams are synthesized in memory (noise, pulses
+/// and matching markers). Compare results across revisions with CPP_Bench_Compare.
+///
+
+#include "../../include/LibTool.h"
+#include "../../include/BenchmarkResults.h"
+#include "../../include/SyntheticWaveform.h"
+using LibTool::ToString;
+using LibTool::ArraySegment;
+namespace Benchmark = LibTool::Benchmark;
+
+#include <iostream>
+using std::cout;
+using std::cerr;
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+
+typedef std::vector<int32_t> FetchBuffer;
+
+//! Build a standard-streaming marker stream of #nbrRecords trigger markers spaced by #recordSize samples.
+FetchBuffer BuildTriggerMarkerStream(int64_t nbrRecords, int64_t recordSize);
+
+//! Build a ZeroSuppress marker stream of #nbrRecords records with #nbrGatesPerRecord gates each on average.
+FetchBuffer BuildZeroSuppressMarkerStream(int64_t nbrRecords, int nbrGatesPerRecord);
+
+//! Build a sample stream of #nbrElements elements (two 16-bit samples per element) of noise and pulses.
+FetchBuffer BuildSampleStream(int64_t nbrElements);
+
+//! Return the waveform parameters of synthetic records: baseline noise and a Poisson pulse train of #pulsesPerRecord pulses per record.
+LibTool::Synthetic::WaveformParameters GetWaveformParameters(double pulsesPerRecord);
+
+// name-space gathering all user-configurable parameters
+namespace
+{
+    // Results file and number of measured repetitions of every benchmark.
+    std::string resultsFileName("BenchmarkResults.jsonl");
+    int repetitions = 10;
+
+    // Workload parameters, mirroring the streaming example configuration.
+    int64_t const recordSize = 18432;
+    int64_t const nbrSamplesPerElement = sizeof(int32_t) / sizeof(int16_t);
+    int64_t const nbrRecordElements = recordSize / nbrSamplesPerElement;
+    int64_t const nbrRecords = 4096;
+    int64_t const maxRecordsToFetchAtOnce = 15;
+    int const nbrGatesPerRecord = 4;
+
+    // Seed of the synthetic streams: all revisions are measured on the same data.
+    uint64_t const waveformSeed = 0x5eed;
+
+    // Number of passes over the in-memory streams per repetition, so that a repetition lasts long enough to be timed reliably.
+    int const nbrPasses = 64;
+}
+
+int main(int argc, char* argv[])
+{
+    cout << "Streaming processing benchmarks\n\n";
+
+    try
+    {
+        if (argc > 1)
+            resultsFileName = argv[1];
+        if (argc > 2)
+            repetitions = std::stoi(argv[2]);
+
+        FetchBuffer const triggerMarkers = BuildTriggerMarkerStream(nbrRecords, recordSize);
+        FetchBuffer const zsMarkers = BuildZeroSuppressMarkerStream(nbrRecords, nbrGatesPerRecord);
+        FetchBuffer const samples = BuildSampleStream(nbrRecordElements * maxRecordsToFetchAtOnce);
+
+        std::vector<Benchmark::Result> results;
+
+        // 1. Decoding of standard streaming trigger markers.
+        results.push_back(Benchmark::Run("decode.trigger_marker", "Mmarkers/s", 1e6, repetitions, [&]()
+        {
+            uint64_t checksum = 0;
+            for (int pass = 0; pass < nbrPasses; ++pass)
+            {
+                ArraySegment<int32_t> stream(triggerMarkers, 0, triggerMarkers.size());
+                while (stream.Size() > 0)
+                    checksum += LibTool::StandardStreaming::DecodeTriggerMarker(stream).absoluteSampleIndex;
+            }
+            Benchmark::DoNotOptimize(checksum);
+            return double(nbrRecords * nbrPasses);
+        }));
+
+        // 2. Decoding of ZeroSuppress marker streams into record descriptors.
+        results.push_back(Benchmark::Run("decode.zero_suppress_markers", "Mrecords/s", 1e6, repetitions, [&]()
+        {
+            size_t nbrDecoded = 0;
+            for (int pass = 0; pass < nbrPasses / 8; ++pass)
+            {
+                LibTool::ZeroSuppress::MarkerStreamDecoder decoder(LibTool::ZeroSuppress::MarkerStreamDecoder::Mode::ZeroSuppress);
+                ArraySegment<int32_t> stream(zsMarkers, 0, zsMarkers.size());
+                while (stream.Size() > 0)
+                    decoder.DecodeNextMarker(stream);
+                nbrDecoded += decoder.GetAvailableRecordCount();
+            }
+            Benchmark::DoNotOptimize(nbrDecoded);
+            return double(nbrDecoded);
+        }));
+
+        // 3. Unpack of 16-bit samples into float waveforms (kernel of the streaming example record loop).
+        std::vector<float> waveform(static_cast<size_t>(recordSize));
+        results.push_back(Benchmark::Run("unpack.int16_to_float", "MB/s", 1024.0 * 1024.0, repetitions, [&]()
+        {
+            for (int pass = 0; pass < nbrPasses / 8; ++pass)
+            {
+                ArraySegment<int32_t> segment(samples, 0, samples.size());
+                while (segment.Size() > 0)
+                {
+                    for (int64_t j = 0; j < nbrRecordElements; ++j)
+                    {
+                        int32_t const packed = segment[size_t(j)];
+                        waveform[size_t(2 * j)] = float(int16_t(packed & 0xFFFF));
+                        waveform[size_t(2 * j + 1)] = float(int16_t((packed >> 16) & 0xFFFF));
+                    }
+                    Benchmark::DoNotOptimize(waveform[0]);
+                    segment.PopFront(size_t(nbrRecordElements));
+                }
+            }
+            return double(samples.size() * sizeof(int32_t) * (nbrPasses / 8));
+        }));
+
+        // 4. End-to-end record loop: copy batches out of a simulated device memory, decode and validate markers, unpack records.
+        FetchBuffer markerBuffer(size_t(LibTool::StandardStreaming::NbrTriggerMarkerElements * maxRecordsToFetchAtOnce));
+        FetchBuffer sampleBuffer(size_t(nbrRecordElements * maxRecordsToFetchAtOnce));
+        results.push_back(Benchmark::Run("pipeline.standard_streaming", "MB/s", 1024.0 * 1024.0, repetitions, [&]()
+        {
+            int64_t expectedRecordIndex = 0;
+            size_t markerOffset = 0;
+            double totalBytes = 0.0;
+
+            while (markerOffset < triggerMarkers.size())
+            {
+                size_t const nbrMarkerElements = (std::min)(markerBuffer.size(), triggerMarkers.size() - markerOffset);
+                std::memcpy(markerBuffer.data(), triggerMarkers.data() + markerOffset, nbrMarkerElements * sizeof(int32_t));
+                markerOffset += nbrMarkerElements;
+
+                int64_t const nbrAvailableRecords = int64_t(nbrMarkerElements / LibTool::StandardStreaming::NbrTriggerMarkerElements);
+                size_t const nbrSampleElements = size_t(nbrAvailableRecords * nbrRecordElements);
+                std::memcpy(sampleBuffer.data(), samples.data(), nbrSampleElements * sizeof(int32_t));
+                totalBytes += double((nbrMarkerElements + nbrSampleElements) * sizeof(int32_t));
+
+                ArraySegment<int32_t> markerSegment(markerBuffer, 0, nbrMarkerElements);
+                ArraySegment<int32_t> sampleSegment(sampleBuffer, 0, nbrSampleElements);
+                for (int64_t i = 0; i < nbrAvailableRecords; ++i)
+                {
+                    LibTool::TriggerMarker const marker = LibTool::StandardStreaming::DecodeTriggerMarker(markerSegment);
+                    if ((expectedRecordIndex & LibTool::TriggerMarker::RecordIndexMask) != marker.recordIndex)
+                        throw std::runtime_error("Unexpected record index: expected=" + ToString(expectedRecordIndex) + ", got " + ToString(marker.recordIndex));
+
+                    for (int64_t j = 0; j < nbrRecordElements; ++j)
+                    {
+                        int32_t const packed = sampleSegment[size_t(j)];
+                        waveform[size_t(2 * j)] = float(int16_t(packed & 0xFFFF));
+                        waveform[size_t(2 * j + 1)] = float(int16_t((packed >> 16) & 0xFFFF));
+                    }
+                    Benchmark::DoNotOptimize(waveform[0]);
+
+                    sampleSegment.PopFront(size_t(nbrRecordElements));
+                    ++expectedRecordIndex;
+                }
+            }
+            return totalBytes;
+        }));
+
+        for (auto const& result : results)
+        {
+            cout << "  " << std::left << std::setw(32) << result.benchmark << std::right
+                 << std::fixed << std::setprecision(2) << std::setw(12) << result.GetMean() << " " << result.unit
+                 << "  (+/- " << result.GetStdDev() << ", n=" << result.samples.size() << ")\n";
+            Benchmark::AppendResult(resultsFileName, result);
+        }
+
+        cout << "\nRevision " << results.front().environment.revision << " appended to " << resultsFileName << "\n";
+        return 0;
+    }
+    catch (std::exception const& exc)
+    {
+        cerr << "Unexpected error: " << exc.what() << std::endl;
+        return 1;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Definition of local functions
+//
+
+FetchBuffer BuildTriggerMarkerStream(int64_t nbrRecords, int64_t recordSize)
+{
+    FetchBuffer stream;
+    stream.reserve(size_t(nbrRecords * LibTool::StandardStreaming::NbrTriggerMarkerElements));
+    for (int64_t i = 0; i < nbrRecords; ++i)
+        LibTool::Synthetic::AppendTriggerMarker(stream, LibTool::MarkerTag::TriggerNormal, uint32_t(i), uint64_t(1000 + i * recordSize), -0.25);
+    return stream;
+}
+
+FetchBuffer BuildZeroSuppressMarkerStream(int64_t nbrRecords, int nbrGatesPerRecord)
+{
+    LibTool::ZeroSuppress::ProcessingParameters const params(32, 16, 250e-12, 16, 16);
+    int32_t const threshold = -2000;
+    int32_t const hysteresis = 300;
+    LibTool::Synthetic::ZeroSuppress::RecordEncoder const encoder(params, threshold, hysteresis);
+    LibTool::Synthetic::WaveformGenerator generator(GetWaveformParameters(double(nbrGatesPerRecord)), waveformSeed);
+
+    FetchBuffer stream;
+    std::vector<int16_t> record(static_cast<size_t>(recordSize));
+    std::vector<int16_t> storedSamples;
+    for (int64_t i = 0; i < nbrRecords; ++i)
+    {
+        generator.Generate(record.data(), record.size());
+        encoder.Encode(uint32_t(i), uint64_t(generator.GetSampleIndex() - recordSize), record.data(), recordSize, stream, storedSamples);
+        storedSamples.clear();
+    }
+    return stream;
+}
+
+FetchBuffer BuildSampleStream(int64_t nbrElements)
+{
+    LibTool::Synthetic::WaveformGenerator generator(GetWaveformParameters(double(nbrGatesPerRecord)), waveformSeed);
+
+    size_t const nbrSamples = size_t(nbrElements * nbrSamplesPerElement);
+    std::vector<int16_t> samples(nbrSamples);
+    generator.Generate(samples.data(), nbrSamples);
+
+    FetchBuffer stream(static_cast<size_t>(nbrElements));
+    LibTool::Synthetic::PackSamples(samples.data(), nbrSamples, stream.data());
+    return stream;
+}
+
+LibTool::Synthetic::WaveformParameters GetWaveformParameters(double pulsesPerRecord)
+{
+    LibTool::Synthetic::WaveformParameters params;
+    params.baseline = -0.1;
+    params.noiseSigma = 0.002;
+    params.adcBits = 12;
+    params.pulses.rate = pulsesPerRecord / double(recordSize);
+    params.pulses.amplitudeMin = 0.1;
+    params.pulses.amplitudeMax = 0.6;
+    params.pulses.shape = LibTool::Synthetic::PulseShape::DoubleExponential;
+    params.pulses.riseSamples = 2.0;
+    params.pulses.decaySamples = 24.0;
+    params.saturationRate = 1e-7;
+    return params;
+}
@@ -0,0 +1,457 @@
+///
+/// Acqiris IVI-C Driver Example Program
+///
+/// Initializes the driver, reads a few Identity interface properties, and performs a gapless
+/// acquisition in continuous streaming mode.
+///
+/// For additional information on programming with IVI drivers in various IDEs, please see
+/// http://www.ivifoundation.org/resources/
+///
+/// The Example requires a real instrument having CST and input signal on "Channel1".
+///
+/// The sample stream is fetched in large granularity-aligned chunks from a dedicated thread, each
+/// chunk stamped with the running index of its first sample. Chunks are low-pass filtered and
+/// decimated (the filtered signal is saved to a binary file of float samples), and transformed into
+/// an averaged spectrogram computed on all processor cores (spectrogram frames are saved to a
+/// second binary file, the strongest bin is printed periodically). Processing has to keep up with
+/// the sample rate on average: the device memory absorbs short stalls, a stream overflow ends the
+/// acquisition with a gap error.
+///
+/// Optionally, pulses are shaped by a trapezoidal filter at the full sample rate and their energies
+/// are saved and accumulated into an energy spectrum, instead of storing the raw samples.
+///
+
+#include "../../include/LibTool.h"
+#include "../../include/ContinuousStreaming.h"
+#include "../../include/Spectrogram.h"
+#include "../../include/TaskScheduler.h"
+#include "../../include/TrapezoidalFilter.h"
+using LibTool::ToString;
+namespace ContinuousStreaming = LibTool::ContinuousStreaming;
+namespace Spectrogram = LibTool::Spectrogram;
+namespace Tasks = LibTool::Tasks;
+namespace Shaping = LibTool::Shaping;
+#include "AqMD3.h"
+
+#include <iomanip>
+#include <iostream>
+using std::cout;
+using std::cerr;
+using std::hex;
+#include <vector>
+using std::vector;
+#include <stdexcept>
+using std::runtime_error;
+#include <chrono>
+using std::chrono::seconds;
+using std::chrono::milliseconds;
+using std::chrono::microseconds;
+using std::chrono::system_clock;
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+
+#define checkApiCall( f ) do { ViStatus s = f; testApiCall( s, #f ); } while( false )
+
+//! Validate success status of the given functionName.
+void testApiCall( ViStatus status, char const * functionName );
+
+//! Return the index of the strongest bin of frame, DC excluded.
+size_t FindPeakBin(Spectrogram::Frame const& frame);
+
+// name-space gathering all user-configurable parameters
+namespace
+{
+    // Edit resource and options as needed. Resource is ignored if option has Simulate=true.
+    // An input signal is necessary if the example is run in non simulated mode.
+    ViChar resource[] = "PXI40::0::0::INSTR";
+    ViChar options[]  = "Simulate=true, DriverSetup= Model=SA220P";
+
+    // Acquisition configuration parameters
+    ViReal64 const sampleRate = 2.0e9;
+    ViInt32 const streamingMode = AQMD3_VAL_STREAMING_MODE_CONTINUOUS;
+    ViInt32 const acquisitionMode = AQMD3_VAL_ACQUISITION_MODE_NORMAL;
+
+    // Channel configuration parameters
+    ViReal64 const range = 2.5;
+    ViReal64 const offset = 0.0;
+    ViInt32 const coupling = AQMD3_VAL_VERTICAL_COUPLING_DC;
+
+    // Fetch parameters
+    ViConstString sampleStreamName = "StreamCh1";
+
+    /* Chunk size (in elements of two samples), rounded down to the stream granularity, and number of chunk buffers.
+       NOTE: large chunks reduce the per-fetch overhead; buffers let the fetch thread proceed while chunks are processed.*/
+    ViInt64 const chunkElements = 1024 * 1024;
+    size_t const nbrChunkBuffers = 8;
+
+    // Poll interval of the fetch thread while less than a chunk is available, and wait-time of the processing loop.
+    auto const pollInterval = microseconds(200);
+    auto const chunkWaitTime = milliseconds(500);
+
+    // Low-pass filter (cutoff expressed as fraction of the sample rate) and decimation of the saved signal.
+    size_t const nbrFilterTaps = 31;
+    double const filterCutoff = 0.025;
+    int const filterDecimation = 16;
+
+    /* Spectrogram: FFT size, hop between frames (half the FFT size for 50% overlap), window and number of averaged frames.
+       NOTE: the spectrogram output rate is sampleRate * (fftSize/2+1) / (hop*nbrAveragedFrames) values per second. A core transforms
+       about 0.04 to 0.09 GSamples/s with 50% overlap, depending on the vectorization by the compiler: keeping up with 2 GSamples/s
+       takes over 20 workers, or half as many with hop = fftSize.*/
+    size_t const fftSize = 4096;
+    size_t const fftHop = 2048;
+    Spectrogram::WindowType const fftWindow = Spectrogram::WindowType::Hann;
+    size_t const nbrAveragedFrames = 64;
+
+    // Capacity (in frames) of the spectrogram output ring.
+    size_t const spectrogramRingCapacity = 256;
+
+    /* Worker threads shared by the filter and the spectrogram (0 for one per hardware thread but the first), pinned to consecutive
+       cores from firstWorkerCore. NOTE: core 0 is left to the fetch thread by default.*/
+    size_t const nbrProcessingWorkers = 0;
+    size_t const firstWorkerCore = 1;
+
+    /* Energy shaping: trapezoidal filter (rise and flat top in samples), decay constant of the preamplifier pulses in samples for
+       the pole-zero correction, and trigger level on the rise of the trapezoid (ADC codes). Chunks are shaped in slices of
+       Shaping::Parameters::sliceSamples on the processing workers: at about 0.2 GSamples/s per core, keeping up with 2 GSamples/s
+       takes a dozen workers.*/
+    bool const shapingEnabled = false;
+    Shaping::Parameters const shapingParameters = { Shaping::Polarity::Negative, 200, 100, 5000.0, 50.0 };
+    size_t const nbrEnergyBins = 8192;
+    double const maxEnergy = 32768.0;
+
+    // Period of the spectrogram report.
+    auto const reportInterval = seconds(1);
+
+    // duration of the streaming session
+    auto const streamingDuration = seconds(60);
+
+    // Output file of filtered samples (float32, native endianness)
+    std::string const outputFileName("ContinuousStreaming.bin");
+
+    // Output file of spectrogram frames (fftSize/2+1 float32 values in dBFS per frame, native endianness)
+    std::string const spectrogramFileName("Spectrogram.bin");
+
+    // Output files of pulse energies (running sample index and energy per event) and energy spectrum (nbrEnergyBins uint64 counts)
+    std::string const energyFileName("Energies.bin");
+    std::string const energySpectrumFileName("EnergySpectrum.bin");
+}
+
+int main()
+{
+    cout << "Continuous Streaming \n\n";
+
+    // Initialize the driver. See driver help topic "Initializing the IVI-C Driver" for additional information.
+    ViSession session = VI_NULL;
+    ViBoolean const idQuery = VI_FALSE;
+    ViBoolean const reset   = VI_FALSE;
+
+    try
+    {
+        checkApiCall( AqMD3_InitWithOptions( resource, idQuery, reset, options, &session ) );
+
+        cout << "\nDriver session initialized\n";
+
+        // Read and output a few attributes.
+        ViChar str[128];
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_PREFIX,               sizeof( str ), str ) );
+        cout << "Driver prefix:      " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_REVISION,             sizeof( str ), str ) );
+        cout << "Driver revision:    " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_VENDOR,               sizeof( str ), str ) );
+        cout << "Driver vendor:      " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_DESCRIPTION,          sizeof( str ), str ) );
+        cout << "Driver description: " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_MODEL,                     sizeof( str ), str ) );
+        cout << "Instrument model:   " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_INFO_OPTIONS,              sizeof( str ), str ) );
+        cout << "Instrument options: " << str << '\n';
+        std::string const options(str);
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_FIRMWARE_REVISION,         sizeof( str ), str ) );
+        cout << "Firmware revision:  " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_INFO_SERIAL_NUMBER_STRING, sizeof( str ), str ) );
+        cout << "Serial number:      " << str << '\n';
+        cout << '\n';
+
+        // Abort execution if instrument is still in simulated mode.
+        ViBoolean simulate;
+        checkApiCall( AqMD3_GetAttributeViBoolean( session, "", AQMD3_ATTR_SIMULATE, &simulate ) );
+        if( simulate==VI_TRUE )
+        {
+            cout << "\nThe Streaming features are not supported in simulated mode.\n";
+            cout << "Please update the resource string (resource[]) to match your configuration,";
+            cout << " and update the init options string (options[]) to disable simulation.\n";
+
+            AqMD3_close( session );
+
+            return 1;
+        }
+
+        if (options.find("CST") == std::string::npos)
+        {
+            cout << "The required CST module option is missing from the instrument.\n";
+
+            AqMD3_close(session);
+
+            return 1;
+        }
+
+        // Configure the acquisition in continuous streaming mode.
+        cout << "Configuring Acquisition\n";
+        cout << "  Streaming mode:      Continuous\n";
+        cout << "  SampleRate:          " << sampleRate << '\n';
+        checkApiCall( AqMD3_SetAttributeViInt32( session, "", AQMD3_ATTR_STREAMING_MODE, streamingMode) );
+        checkApiCall( AqMD3_SetAttributeViReal64( session, "", AQMD3_ATTR_SAMPLE_RATE, sampleRate ) );
+        checkApiCall( AqMD3_SetAttributeViInt32( session, "", AQMD3_ATTR_ACQUISITION_MODE, acquisitionMode ) );
+
+        // Configure the channels.
+        cout << "Configuring Channel1\n";
+        cout << "  Range:              " << range << '\n';
+        cout << "  Offset:             " << offset << '\n';
+        cout << "  Coupling:           " << ( coupling?"DC":"AC" ) << '\n';
+        checkApiCall( AqMD3_ConfigureChannel( session, "Channel1", range, offset, coupling, VI_TRUE ) );
+
+        // Calibrate the instrument.
+        cout << "\nApply setup and run self-calibration\n";
+        checkApiCall( AqMD3_ApplySetup( session ) );
+        checkApiCall( AqMD3_SelfCalibrate( session ) );
+
+        // Prepare the chunk reader: chunks are aligned on the stream granularity.
+        ViInt64 sampleStreamGrain = 0;
+        checkApiCall( AqMD3_GetAttributeViInt64( session, sampleStreamName , AQMD3_ATTR_STREAM_GRANULARITY_IN_BYTES, &sampleStreamGrain) );
+        ViInt64 const sampleStreamGrainElements = sampleStreamGrain / sizeof(int32_t);
+
+        ContinuousStreaming::ChunkFetcher fetcher(AqMD3_StreamFetchDataInt32, session, sampleStreamName, chunkElements, sampleStreamGrainElements);
+        ContinuousStreaming::ChunkReader reader(fetcher, nbrChunkBuffers, pollInterval);
+        cout << "  Chunk size:         " << fetcher.GetChunkSamples() << " samples (" << double(fetcher.GetChunkSamples()) / sampleRate * 1e3 << " ms)\n";
+
+        // Processing stages, continuous across chunk boundaries.
+        ContinuousStreaming::FirFilter filter(ContinuousStreaming::FirFilter::DesignLowPass(nbrFilterTaps, filterCutoff), filterDecimation);
+        vector<float> filtered;
+        filtered.reserve(size_t(fetcher.GetChunkSamples() / filterDecimation + 1));
+
+        Spectrogram::Parameters stftParameters;
+        stftParameters.fftSize = fftSize;
+        stftParameters.hop = fftHop;
+        stftParameters.window = fftWindow;
+        stftParameters.nbrAveragedFrames = nbrAveragedFrames;
+        stftParameters.scale = Spectrogram::Scale::DecibelFullScale;
+        stftParameters.sampleRate = sampleRate;
+
+        Tasks::Parameters schedulerParameters;
+        schedulerParameters.nbrWorkers = (nbrProcessingWorkers != 0) ? nbrProcessingWorkers
+                                                                    : (std::max)(size_t(std::thread::hardware_concurrency()), size_t(2)) - 1;
+        schedulerParameters.pinWorkers = true;
+        schedulerParameters.firstCore = firstWorkerCore;
+        Tasks::TaskScheduler scheduler(schedulerParameters);
+
+        Spectrogram::FrameRing ring(spectrogramRingCapacity, Spectrogram::GetNbrBins(fftSize));
+        Spectrogram::StftEngine stft(stftParameters, scheduler, ring);
+        cout << "  Spectrogram:        " << fftSize << "-point FFT every " << fftHop << " samples, " << nbrAveragedFrames << " frames averaged\n";
+        cout << "  Processing workers: " << scheduler.GetNbrWorkers() << " from core " << firstWorkerCore << '\n';
+
+        Shaping::Shaper shaper(shapingParameters, scheduler);
+        Shaping::EnergyHistogram energySpectrum(nbrEnergyBins, maxEnergy);
+        vector<Shaping::EnergyEvent> energies;
+        std::ofstream energyFile;
+        if (shapingEnabled)
+        {
+            energyFile.open(energyFileName, std::ios::binary);
+            cout << "  Energy shaping:     rise " << shapingParameters.riseSamples << ", flat top " << shapingParameters.flatSamples << ", decay "
+                 << shapingParameters.decaySamples << " samples\n";
+        }
+
+        Spectrogram::Frame frame;
+        Spectrogram::Frame lastFrame;
+        uint64_t nbrFrames = 0;
+
+        std::ofstream outputFile(outputFileName, std::ios::binary);
+        std::ofstream spectrogramFile(spectrogramFileName, std::ios::binary);
+
+        // Start the acquisition.
+        cout << "\nInitiating acquisition\n";
+        checkApiCall( AqMD3_InitiateAcquisition( session ) );
+        reader.Start();
+        cout << "Acquisition is running\n\n";
+
+        auto const startTime = system_clock::now();
+        auto const endTime = startTime + streamingDuration;
+        auto nextReport = startTime + reportInterval;
+        while( system_clock::now() < endTime )
+        {
+            ContinuousStreaming::SampleChunk chunk;
+            if (!reader.WaitNext(chunk, chunkWaitTime))
+            {
+                cout << "waiting for data\n";
+                continue;
+            }
+
+            // 1. low-pass filter and decimate, ahead of the spectrogram tasks: the filter is sequential, the spectrogram is not.
+            Tasks::TaskGroup filterTask;
+            filtered.clear();
+            scheduler.Submit(filterTask, Tasks::Priority::High, Tasks::RecordRange{ 0, 1 }, [&](Tasks::RecordRange const&, size_t)
+            {
+                filter.Process(chunk, filtered);
+            });
+
+            // 1.1 trapezoidal shaping and energy picking: the task shapes slices of the chunk on the other workers while it waits.
+            Tasks::TaskGroup shapingTask;
+            energies.clear();
+            if (shapingEnabled)
+            {
+                scheduler.Submit(shapingTask, Tasks::Priority::High, Tasks::RecordRange{ 0, 1 }, [&](Tasks::RecordRange const&, size_t)
+                {
+                    shaper.Process(chunk, energies);
+                });
+            }
+
+            // 2. spectrogram frames, computed in parallel.
+            stft.Process(chunk);
+
+            // save the filtered signal.
+            scheduler.Wait(filterTask);
+            outputFile.write(reinterpret_cast<char const*>(filtered.data()), std::streamsize(filtered.size() * sizeof(float)));
+
+            // save the energies.
+            scheduler.Wait(shapingTask);
+            energySpectrum.Fill(energies);
+            energyFile.write(reinterpret_cast<char const*>(energies.data()), std::streamsize(energies.size() * sizeof(Shaping::EnergyEvent)));
+
+            // 3. return the chunk buffer to the fetch thread.
+            reader.Release();
+
+            // 4. save the spectrogram frames.
+            while (ring.Pop(frame))
+            {
+                spectrogramFile.write(reinterpret_cast<char const*>(frame.bins.data()), std::streamsize(frame.bins.size() * sizeof(float)));
+                std::swap(frame, lastFrame);
+                ++nbrFrames;
+            }
+
+            if (system_clock::now() >= nextReport && nbrFrames > 0)
+            {
+                size_t const peakBin = FindPeakBin(lastFrame);
+                cout << "Sample " << chunk.GetEndSampleIndex() << " (" << std::fixed << std::setprecision(3) << double(chunk.GetEndSampleIndex()) / sampleRate << " s)"
+                     << ", frame " << nbrFrames << " at " << lastFrame.firstSampleIndex << ": peak " << stft.GetBinFrequency(peakBin) / 1e6 << " MHz"
+                     << " at " << std::setprecision(1) << lastFrame.bins[peakBin] << " dBFS" << std::defaultfloat << '\n';
+                nextReport += reportInterval;
+            }
+        }
+
+        reader.Stop();
+
+        // output frames of the last chunks, pushed in the background.
+        stft.Finish();
+        while (ring.Pop(frame))
+        {
+            spectrogramFile.write(reinterpret_cast<char const*>(frame.bins.data()), std::streamsize(frame.bins.size() * sizeof(float)));
+            std::swap(frame, lastFrame);
+            ++nbrFrames;
+        }
+
+        outputFile.close();
+        spectrogramFile.close();
+        energyFile.close();
+
+        double const elapsedSeconds = std::chrono::duration<double>(system_clock::now() - startTime).count();
+        ContinuousStreaming::FetchStatistics const& statistics = fetcher.GetStatistics();
+        statistics.Print(cout, sampleRate);
+        cout << "  Peak queued chunks: " << reader.GetPeakQueuedChunks() << " of " << nbrChunkBuffers << '\n';
+        scheduler.GetStatistics().Print(cout);
+
+        ViInt64 const totalSampleData = ViInt64(statistics.nbrSamples * sizeof(int16_t));
+        cout << "\nTotal sample data read: " << (totalSampleData/(1024*1024)) << " MBytes.\n";
+        cout << "Duration: " << elapsedSeconds << " seconds.\n";
+        cout << "Data rate: " << double(totalSampleData)/(1024*1024)/elapsedSeconds << " MB/s.\n";
+        cout << "Filtered samples saved to " << outputFileName << " (" << sampleRate / filterDecimation << " samples/s)\n";
+        cout << "Spectrogram frames saved to " << spectrogramFileName << ": " << nbrFrames << " frames of " << stft.GetNbrBins() << " bins, "
+             << ring.GetDroppedCount() << " dropped\n";
+
+        if (shapingEnabled)
+        {
+            std::ofstream energySpectrumFile(energySpectrumFileName, std::ios::binary);
+            energySpectrum.Save(energySpectrumFile);
+            shaper.GetStatistics().Print(cout);
+            cout << "  Energies:           " << energyFileName << ", spectrum " << energySpectrumFileName << " (" << energySpectrum.GetNbrEntries() << " entries, "
+                 << energySpectrum.GetNbrOutOfRange() << " out of range)\n";
+        }
+
+        // Stop the acquisition.
+        cout << "\nStopping acquisition\n";
+        checkApiCall( AqMD3_Abort( session ) );
+
+        // Close the session.
+        checkApiCall( AqMD3_close( session ) );
+        cout << "\nDriver session closed\n";
+        return 0;
+    }
+    catch (ContinuousStreaming::StreamGapError const& exc)
+    {
+        std::cerr << "Gap in the continuous capture: " << exc.what() << std::endl;
+        std::cerr << "Processing did not keep up with the sample rate: use larger chunks, more chunk buffers or a larger decimation.\n";
+
+        if (session != VI_NULL)
+        {
+            AqMD3_Abort( session );
+            AqMD3_close( session );
+        }
+        return(1);
+    }
+    catch (std::exception const& exc)
+    {
+        std::cerr << "Unexpected error: " << exc.what() << std::endl;
+
+        if (session != VI_NULL)
+        {
+            // Abort any ongoing acquisition
+            ViInt32 acqStatus = AQMD3_VAL_ACQUISITION_STATUS_RESULT_TRUE;
+            if ( VI_SUCCESS != AqMD3_IsIdle( session, &acqStatus ) )
+                cerr << "Failed to read acquisition status\n";
+            else if (acqStatus != AQMD3_VAL_ACQUISITION_STATUS_RESULT_TRUE)
+            {
+                if ( VI_SUCCESS != AqMD3_Abort( session ) )
+                    cerr << "Failed to abort the acquisition\n";
+            }
+
+            // close the instrument
+            if ( VI_SUCCESS != AqMD3_close( session ) )
+                cerr << "Failed to close the instrument\n";
+        }
+
+        cout << "\nException handling complete.\n";
+
+        return(1);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Definition of local functions
+//
+
+// Utility function to check status error during driver API call.
+void testApiCall( ViStatus status, char const * functionName )
+{
+    ViInt32 ErrorCode;
+    ViChar ErrorMessage[512];
+
+    if( status>0 ) // Warning occurred.
+    {
+        AqMD3_GetError( VI_NULL, &ErrorCode, sizeof( ErrorMessage ), ErrorMessage );
+        cerr << "** Warning during " << functionName << ": 0x" << hex << ErrorCode << ", " << ErrorMessage << '\n';
+    }
+    else if( status<0 ) // Error occurred.
+    {
+        AqMD3_GetError( VI_NULL, &ErrorCode, sizeof( ErrorMessage ), ErrorMessage );
+        cerr << "** ERROR during " << functionName << ": 0x" << hex << ErrorCode << ", " << ErrorMessage << '\n';
+        throw runtime_error( ErrorMessage );
+    }
+}
+
+size_t FindPeakBin(Spectrogram::Frame const& frame)
+{
+    auto const begin = frame.bins.begin() + 1;
+    return size_t(std::max_element(begin, frame.bins.end()) - frame.bins.begin());
+}
@@ -0,0 +1,383 @@
+///
+/// Acqiris IVI-C Driver Example Program
+///
+/// Initializes the driver, reads a few Identity interface properties, lists the streams of the
+/// session and performs a long-duration acquisition of the min/max envelope of the signal.
+///
+/// For additional information on programming with IVI drivers in various IDEs, please see
+/// http://www.ivifoundation.org/resources/
+///
+/// The Example requires a real instrument having CST and input signal on "Channel1".
+///
+/// The min/max stream delivers the minimum and maximum of every frame of samples: only the
+/// envelope crosses PCIe, at a fraction of the raw sample bandwidth. Frames are accumulated in a
+/// multi-resolution overview store, queried periodically to print the envelope of the last
+/// seconds at a fixed number of points. The raw sample stream can optionally be streamed alongside.
+///
+
+#include "../../include/LibTool.h"
+#include "../../include/ContinuousStreaming.h"
+#include "../../include/MinMaxStream.h"
+using LibTool::ToString;
+namespace ContinuousStreaming = LibTool::ContinuousStreaming;
+namespace MinMax = LibTool::MinMax;
+#include "AqMD3.h"
+
+#include <iomanip>
+#include <iostream>
+using std::cout;
+using std::cerr;
+using std::hex;
+#include <vector>
+using std::vector;
+#include <stdexcept>
+using std::runtime_error;
+#include <chrono>
+using std::chrono::seconds;
+using std::chrono::milliseconds;
+using std::chrono::microseconds;
+using std::chrono::system_clock;
+#include <algorithm>
+#include <memory>
+
+
+#define checkApiCall( f ) do { ViStatus s = f; testApiCall( s, #f ); } while( false )
+
+//! Validate success status of the given functionName.
+void testApiCall( ViStatus status, char const * functionName );
+
+//! Print the envelope of span as minimum and maximum over groups of points.
+void PrintEnvelope(MinMax::Span const& span, double sampleRate, size_t nbrColumns);
+
+// name-space gathering all user-configurable parameters
+namespace
+{
+    // Edit resource and options as needed. Resource is ignored if option has Simulate=true.
+    // An input signal is necessary if the example is run in non simulated mode.
+    ViChar resource[] = "PXI40::0::0::INSTR";
+    ViChar options[]  = "Simulate=true, DriverSetup= Model=SA220P";
+
+    // Acquisition configuration parameters
+    ViReal64 const sampleRate = 2.0e9;
+    ViInt32 const streamingMode = AQMD3_VAL_STREAMING_MODE_CONTINUOUS;
+    ViInt32 const acquisitionMode = AQMD3_VAL_ACQUISITION_MODE_NORMAL;
+
+    // Channel configuration parameters
+    ViReal64 const range = 2.5;
+    ViReal64 const offset = 0.0;
+    ViInt32 const coupling = AQMD3_VAL_VERTICAL_COUPLING_DC;
+
+    /* Number of samples per min/max frame: the min/max stream bandwidth is 2/minMaxFrameSize of the raw one.
+       The first min/max stream of the session is used.*/
+    ViInt64 const minMaxFrameSize = 1024;
+
+    // Stream the raw samples alongside the envelope. NOTE: raw samples are fetched and counted only.
+    bool const streamRawSamples = false;
+    ViConstString rawStreamName = "StreamCh1";
+
+    // Chunk size (in elements) and number of chunk buffers of the min/max stream, and of the raw stream when enabled.
+    ViInt64 const minMaxChunkElements = 64 * 1024;
+    ViInt64 const rawChunkElements = 1024 * 1024;
+    size_t const nbrChunkBuffers = 8;
+
+    // Poll interval of the fetch threads while less than a chunk is available, and wait-time of the processing loop.
+    auto const pollInterval = microseconds(500);
+    auto const chunkWaitTime = milliseconds(500);
+
+    /* Overview store: number of levels, reduction factor between levels and points per level.
+       NOTE: level k keeps levelCapacity points of minMaxFrameSize*reductionFactor^k samples.*/
+    size_t const nbrOverviewLevels = 8;
+    size_t const overviewReductionFactor = 4;
+    size_t const overviewLevelCapacity = 1024 * 1024;
+
+    // Envelope report: period, span of signal, number of points queried and number of printed columns.
+    auto const reportInterval = seconds(5);
+    double const reportSpanSeconds = 10.0;
+    size_t const reportPoints = 1000;
+    size_t const reportColumns = 8;
+
+    // duration of the streaming session
+    auto const streamingDuration = seconds(600);
+}
+
+int main()
+{
+    cout << "MinMax Streaming \n\n";
+
+    // Initialize the driver. See driver help topic "Initializing the IVI-C Driver" for additional information.
+    ViSession session = VI_NULL;
+    ViBoolean const idQuery = VI_FALSE;
+    ViBoolean const reset   = VI_FALSE;
+
+    try
+    {
+        checkApiCall( AqMD3_InitWithOptions( resource, idQuery, reset, options, &session ) );
+
+        cout << "\nDriver session initialized\n";
+
+        // Read and output a few attributes.
+        ViChar str[128];
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_PREFIX,               sizeof( str ), str ) );
+        cout << "Driver prefix:      " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_REVISION,             sizeof( str ), str ) );
+        cout << "Driver revision:    " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_VENDOR,               sizeof( str ), str ) );
+        cout << "Driver vendor:      " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_DESCRIPTION,          sizeof( str ), str ) );
+        cout << "Driver description: " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_MODEL,                     sizeof( str ), str ) );
+        cout << "Instrument model:   " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_INFO_OPTIONS,              sizeof( str ), str ) );
+        cout << "Instrument options: " << str << '\n';
+        std::string const options(str);
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_FIRMWARE_REVISION,         sizeof( str ), str ) );
+        cout << "Firmware revision:  " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_INFO_SERIAL_NUMBER_STRING, sizeof( str ), str ) );
+        cout << "Serial number:      " << str << '\n';
+        cout << '\n';
+
+        // Abort execution if instrument is still in simulated mode.
+        ViBoolean simulate;
+        checkApiCall( AqMD3_GetAttributeViBoolean( session, "", AQMD3_ATTR_SIMULATE, &simulate ) );
+        if( simulate==VI_TRUE )
+        {
+            cout << "\nThe Streaming features are not supported in simulated mode.\n";
+            cout << "Please update the resource string (resource[]) to match your configuration,";
+            cout << " and update the init options string (options[]) to disable simulation.\n";
+
+            AqMD3_close( session );
+
+            return 1;
+        }
+
+        if (options.find("CST") == std::string::npos)
+        {
+            cout << "The required CST module option is missing from the instrument.\n";
+
+            AqMD3_close(session);
+
+            return 1;
+        }
+
+        // Configure the acquisition in continuous streaming mode.
+        cout << "Configuring Acquisition\n";
+        cout << "  Streaming mode:      Continuous\n";
+        cout << "  SampleRate:          " << sampleRate << '\n';
+        checkApiCall( AqMD3_SetAttributeViInt32( session, "", AQMD3_ATTR_STREAMING_MODE, streamingMode) );
+        checkApiCall( AqMD3_SetAttributeViReal64( session, "", AQMD3_ATTR_SAMPLE_RATE, sampleRate ) );
+        checkApiCall( AqMD3_SetAttributeViInt32( session, "", AQMD3_ATTR_ACQUISITION_MODE, acquisitionMode ) );
+
+        // Configure the channels.
+        cout << "Configuring Channel1\n";
+        cout << "  Range:              " << range << '\n';
+        cout << "  Offset:             " << offset << '\n';
+        cout << "  Coupling:           " << ( coupling?"DC":"AC" ) << '\n';
+        checkApiCall( AqMD3_ConfigureChannel( session, "Channel1", range, offset, coupling, VI_TRUE ) );
+
+        // Discover the streams of the session.
+        cout << "\nStreams of the session\n";
+        vector<MinMax::StreamInfo> const streams = MinMax::DiscoverStreams(session);
+        for (MinMax::StreamInfo const& stream : streams)
+            cout << "  " << stream.index << ": " << std::left << std::setw(20) << stream.name << std::right << MinMax::GetStreamTypeName(stream.type)
+                 << (stream.enabled ? " (enabled)" : "") << '\n';
+
+        vector<std::string> const minMaxStreams = MinMax::FindStreams(streams, AQMD3_VAL_STREAM_TYPE_MIN_MAX);
+        if (minMaxStreams.empty())
+        {
+            cout << "The instrument does not provide any min/max stream.\n";
+
+            AqMD3_close(session);
+
+            return 1;
+        }
+        std::string const minMaxStreamName = minMaxStreams.front();
+
+        // Enable the min/max stream, and the raw sample stream only if requested.
+        cout << "Configuring " << minMaxStreamName << '\n';
+        cout << "  Frame size:         " << minMaxFrameSize << " samples\n";
+        checkApiCall( AqMD3_SetAttributeViBoolean( session, minMaxStreamName.c_str(), AQMD3_ATTR_STREAM_ENABLED, VI_TRUE ) );
+        checkApiCall( AqMD3_SetAttributeViInt64( session, minMaxStreamName.c_str(), AQMD3_ATTR_STREAM_MINMAX_FRAME_SIZE, minMaxFrameSize ) );
+        checkApiCall( AqMD3_SetAttributeViBoolean( session, rawStreamName, AQMD3_ATTR_STREAM_ENABLED, streamRawSamples ? VI_TRUE : VI_FALSE ) );
+
+        // Calibrate the instrument.
+        cout << "\nApply setup and run self-calibration\n";
+        checkApiCall( AqMD3_ApplySetup( session ) );
+        checkApiCall( AqMD3_SelfCalibrate( session ) );
+
+        // Prepare the chunk readers: the min/max stream is read like a sample stream of (minimum, maximum) pairs.
+        ViInt64 minMaxStreamGrain = 0;
+        checkApiCall( AqMD3_GetAttributeViInt64( session, minMaxStreamName.c_str(), AQMD3_ATTR_STREAM_GRANULARITY_IN_BYTES, &minMaxStreamGrain) );
+        ContinuousStreaming::ChunkFetcher minMaxFetcher(AqMD3_StreamFetchDataInt32, session, minMaxStreamName, minMaxChunkElements, minMaxStreamGrain / ViInt64(sizeof(int32_t)));
+        ContinuousStreaming::ChunkReader minMaxReader(minMaxFetcher, nbrChunkBuffers, pollInterval);
+        cout << "  Min/max chunk:      " << minMaxFetcher.GetChunkElements() << " frames (" << double(minMaxFetcher.GetChunkElements() * minMaxFrameSize) / sampleRate * 1e3 << " ms)\n";
+
+        std::unique_ptr<ContinuousStreaming::ChunkFetcher> rawFetcher;
+        std::unique_ptr<ContinuousStreaming::ChunkReader> rawReader;
+        if (streamRawSamples)
+        {
+            ViInt64 rawStreamGrain = 0;
+            checkApiCall( AqMD3_GetAttributeViInt64( session, rawStreamName, AQMD3_ATTR_STREAM_GRANULARITY_IN_BYTES, &rawStreamGrain) );
+            rawFetcher.reset(new ContinuousStreaming::ChunkFetcher(AqMD3_StreamFetchDataInt32, session, rawStreamName, rawChunkElements, rawStreamGrain / ViInt64(sizeof(int32_t))));
+            rawReader.reset(new ContinuousStreaming::ChunkReader(*rawFetcher, nbrChunkBuffers, pollInterval));
+        }
+
+        MinMax::OverviewStore store(minMaxFrameSize, nbrOverviewLevels, overviewReductionFactor, overviewLevelCapacity);
+        cout << "  Overview store:     " << store.GetNbrLevels() << " levels, " << store.GetMemorySize() / (1024 * 1024) << " MBytes, coarsest level holds "
+             << double(overviewLevelCapacity) * double(store.GetSamplesPerPoint(store.GetNbrLevels() - 1)) / sampleRate << " s\n";
+
+        // Start the acquisition.
+        cout << "\nInitiating acquisition\n";
+        checkApiCall( AqMD3_InitiateAcquisition( session ) );
+        minMaxReader.Start();
+        if (rawReader)
+            rawReader->Start();
+        cout << "Acquisition is running\n\n";
+
+        uint64_t const reportSpanSamples = uint64_t(reportSpanSeconds * sampleRate);
+        MinMax::Span span;
+
+        auto const startTime = system_clock::now();
+        auto const endTime = startTime + streamingDuration;
+        auto nextReport = startTime + reportInterval;
+        while( system_clock::now() < endTime )
+        {
+            ContinuousStreaming::SampleChunk chunk;
+            if (minMaxReader.WaitNext(chunk, chunkWaitTime))
+            {
+                store.Append(chunk);
+                minMaxReader.Release();
+            }
+            else
+            {
+                cout << "waiting for data\n";
+            }
+
+            // drain the raw samples, if streamed alongside.
+            while (rawReader && rawReader->WaitNext(chunk, milliseconds(0)))
+                rawReader->Release();
+
+            if (system_clock::now() >= nextReport)
+            {
+                uint64_t const endSample = store.GetEndSampleIndex();
+                uint64_t const beginSample = endSample > reportSpanSamples ? endSample - reportSpanSamples : 0;
+                if (store.Query(beginSample, endSample, reportPoints, span) > 0)
+                    PrintEnvelope(span, sampleRate, reportColumns);
+                nextReport += reportInterval;
+            }
+        }
+
+        minMaxReader.Stop();
+        if (rawReader)
+            rawReader->Stop();
+
+        double const elapsedSeconds = std::chrono::duration<double>(system_clock::now() - startTime).count();
+        ContinuousStreaming::FetchStatistics const& statistics = minMaxFetcher.GetStatistics();
+        uint64_t const nbrFrames = statistics.nbrSamples / 2;
+        ViInt64 const totalMinMaxData = ViInt64(nbrFrames * sizeof(int32_t));
+        cout << "\nMin/max frames read: " << nbrFrames << " (" << double(nbrFrames * minMaxFrameSize) / sampleRate << " s of signal)\n";
+        cout << "  Peak queued chunks: " << minMaxReader.GetPeakQueuedChunks() << " of " << nbrChunkBuffers << '\n';
+        cout << "Total min/max data read: " << (totalMinMaxData/(1024*1024)) << " MBytes.\n";
+        cout << "Duration: " << elapsedSeconds << " seconds.\n";
+        cout << "Min/max data rate: " << double(totalMinMaxData)/(1024*1024)/elapsedSeconds << " MB/s (raw samples would be "
+             << sampleRate * sizeof(int16_t) / (1024*1024) << " MB/s).\n";
+        if (rawFetcher)
+        {
+            ViInt64 const totalSampleData = ViInt64(rawFetcher->GetStatistics().nbrSamples * sizeof(int16_t));
+            cout << "Total raw sample data read: " << (totalSampleData/(1024*1024)) << " MBytes.\n";
+        }
+
+        // Stop the acquisition.
+        cout << "\nStopping acquisition\n";
+        checkApiCall( AqMD3_Abort( session ) );
+
+        // Close the session.
+        checkApiCall( AqMD3_close( session ) );
+        cout << "\nDriver session closed\n";
+        return 0;
+    }
+    catch (ContinuousStreaming::StreamGapError const& exc)
+    {
+        std::cerr << "Gap in the continuous capture: " << exc.what() << std::endl;
+        std::cerr << "Processing did not keep up with the stream: use larger chunks, more chunk buffers or a larger min/max frame size.\n";
+
+        if (session != VI_NULL)
+        {
+            AqMD3_Abort( session );
+            AqMD3_close( session );
+        }
+        return(1);
+    }
+    catch (std::exception const& exc)
+    {
+        std::cerr << "Unexpected error: " << exc.what() << std::endl;
+
+        if (session != VI_NULL)
+        {
+            // Abort any ongoing acquisition
+            ViInt32 acqStatus = AQMD3_VAL_ACQUISITION_STATUS_RESULT_TRUE;
+            if ( VI_SUCCESS != AqMD3_IsIdle( session, &acqStatus ) )
+                cerr << "Failed to read acquisition status\n";
+            else if (acqStatus != AQMD3_VAL_ACQUISITION_STATUS_RESULT_TRUE)
+            {
+                if ( VI_SUCCESS != AqMD3_Abort( session ) )
+                    cerr << "Failed to abort the acquisition\n";
+            }
+
+            // close the instrument
+            if ( VI_SUCCESS != AqMD3_close( session ) )
+                cerr << "Failed to close the instrument\n";
+        }
+
+        cout << "\nException handling complete.\n";
+
+        return(1);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Definition of local functions
+//
+
+// Utility function to check status error during driver API call.
+void testApiCall( ViStatus status, char const * functionName )
+{
+    ViInt32 ErrorCode;
+    ViChar ErrorMessage[512];
+
+    if( status>0 ) // Warning occurred.
+    {
+        AqMD3_GetError( VI_NULL, &ErrorCode, sizeof( ErrorMessage ), ErrorMessage );
+        cerr << "** Warning during " << functionName << ": 0x" << hex << ErrorCode << ", " << ErrorMessage << '\n';
+    }
+    else if( status<0 ) // Error occurred.
+    {
+        AqMD3_GetError( VI_NULL, &ErrorCode, sizeof( ErrorMessage ), ErrorMessage );
+        cerr << "** ERROR during " << functionName << ": 0x" << hex << ErrorCode << ", " << ErrorMessage << '\n';
+        throw runtime_error( ErrorMessage );
+    }
+}
+
+void PrintEnvelope(MinMax::Span const& span, double sampleRate, size_t nbrColumns)
+{
+    size_t const nbrPoints = span.points.size();
+    size_t const pointsPerColumn = (nbrPoints + nbrColumns - 1) / nbrColumns;
+    double const firstTime = double(span.firstSampleIndex) / sampleRate;
+    double const duration = double(nbrPoints) * double(span.samplesPerPoint) / sampleRate;
+
+    cout << "Envelope " << std::fixed << std::setprecision(3) << firstTime << " s + " << duration << " s (level " << span.level << ", "
+         << nbrPoints << " points):" << std::defaultfloat;
+    for (size_t first = 0; first < nbrPoints; first += pointsPerColumn)
+    {
+        size_t const end = (std::min)(first + pointsPerColumn, nbrPoints);
+        int16_t minimum = span.points[first].minimum;
+        int16_t maximum = span.points[first].maximum;
+        for (size_t i = first + 1; i < end; ++i)
+        {
+            minimum = (std::min)(minimum, span.points[i].minimum);
+            maximum = (std::max)(maximum, span.points[i].maximum);
+        }
+        cout << " [" << minimum << "," << maximum << "]";
+    }
+    cout << '\n';
+}
@@ -12,6 +12,7 @@
 ///
 
 #include "../../include/LibTool.h"
+#include "../../include/StreamBatchReader.h"
 using LibTool::ToString;
 #include "AqMD3.h"
 
@@ -40,34 +41,9 @@ using std::this_thread::sleep_for;
 
 #define checkApiCall( f ) do { ViStatus s = f; testApiCall( s, #f ); } while( false )
 
-typedef std::vector<int32_t> FetchBuffer;
-
 //! Validate success status of the given functionName.
 void testApiCall( ViStatus status, char const * functionName );
 
-//! Fetch all elements available on module for stream streamName.
-/*! The resulting array segment might be empty if no data are available on module.
-     \param[in] session: session handle associated with the instrument to read from.
-     \param[in] streamName: the stream identifier to read from.
-     \param[in] maxElementsToFetch: the maximum number of elements to read.
-     \param[in] buffer: buffer used by fetch for read operation.
-     \return the array-segment delimiting actual valid data returned by the instrument. The segment might be empty if no data has been read.*/
-LibTool::ArraySegment<int32_t> FetchAvailableElements(ViSession session, ViConstString streamName, ViInt64 maxElementsToFetch, FetchBuffer& buffer);
-
-//! Perform a fetch of exact 'nbrElementsToFetch' elements into the given fetch "buffer".
-/*! This is a wrapper for low-level function #AqMD3_StreamFetchDataInt32 which adds the following:
-      - Return an array-segment to delimit the fetched elements in user-provided buffer.
-      - Handle the case where the user request to fetch 0 elements from the stream by returning an empty array-segment. This might be useful when
-        all the samples of a record are suppressed (i.e. nothing to read from sample stream).
-      - Check the consistency of returned
-    \param[in] session: session handle associated with the instrument to read from.
-    \param[in] streamName: the stream identifier to read from.
-    \param[in] nbrElementsToFetch: the number of elements to read.
-    \param[in] buffer: buffer used by fetch for read operation.
-    \return the array-segment delimiting actual valid data returned by the instrument. The segment might be empty if no data has been read.
-    \throw #std::runtime_error when the buffer size is too small for the requested fetch, or the number fetched elements is different than requested.*/
-LibTool::ArraySegment<int32_t> FetchElements(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, FetchBuffer& buffer);
-
 //! Save waveform information into output stream
 void SaveRecord(LibTool::TriggerMarker const& triggerMarker, ViInt64 nbrRecordElements, LibTool::ArraySegment<int32_t> const& elementBuffer, double timestampInterval, std::ostream& output);
 
@@ -223,23 +199,19 @@ int main()
         checkApiCall( AqMD3_ApplySetup( session ) );
         checkApiCall( AqMD3_SelfCalibrate( session ) );
 
-        // Prepare readout buffer
-        ViInt64 sampleStreamGrain = 0;
-        ViInt64 markerStreamGrain = 0;
-        checkApiCall( AqMD3_GetAttributeViInt64( session, sampleStreamName , AQMD3_ATTR_STREAM_GRANULARITY_IN_BYTES, &sampleStreamGrain) );
-        checkApiCall( AqMD3_GetAttributeViInt64( session, markerStreamName , AQMD3_ATTR_STREAM_GRANULARITY_IN_BYTES, &markerStreamGrain) );
-        ViInt64 const sampleStreamGrainElements = sampleStreamGrain / sizeof(int32_t);
-        ViInt64 const markerStreamGrainElements = markerStreamGrain / sizeof(int32_t);
-
-        ViInt64 const sampleStreamBufferSize = maxAcquisitionElements           // required elements
-                                             + maxAcquisitionElements/2         // unfolding overhead (only in single channel mode)
-                                             + sampleStreamGrainElements - 1;// alignment overhead
+        // Prepare the stream readers, they own the readout buffers.
+        LibTool::StreamReading::Parameters sampleReaderParams;
+        sampleReaderParams.grainElements = LibTool::StreamReading::GetGrainElements(session, sampleStreamName);
+        sampleReaderParams.overheadElements = maxAcquisitionElements/2;   // unfolding overhead (only in single channel mode)
+        sampleReaderParams.maxAttempts = nbrWaitForSamplesAttempts;
+        sampleReaderParams.initialRetryWait = milliseconds(recordDurationInMs);
+        sampleReaderParams.verbose = true;
+        LibTool::StreamReading::StreamBatchReader<> sampleReader(AqMD3_StreamFetchDataInt32, session, sampleStreamName, maxAcquisitionElements, sampleReaderParams, testApiCall);
 
-        ViInt64 const markerStreamBufferSize = maxMarkerElements                // required elements
-                                             + markerStreamGrainElements - 1;// alignment overhead
-
-        FetchBuffer sampleStreamBuffer(static_cast<size_t>(sampleStreamBufferSize));
-        FetchBuffer markerStreamBuffer(static_cast<size_t>(markerStreamBufferSize));
+        LibTool::StreamReading::Parameters markerReaderParams;
+        markerReaderParams.grainElements = LibTool::StreamReading::GetGrainElements(session, markerStreamName);
+        markerReaderParams.verbose = true;
+        LibTool::StreamReading::StreamBatchReader<> markerReader(AqMD3_StreamFetchDataInt32, session, markerStreamName, maxMarkerElements, markerReaderParams, testApiCall);
 
         // Expected values and statistics
         double minXtime = 0.0; // InitialXTime is the time of the very first sample in the record.
@@ -260,7 +232,7 @@ int main()
         while( system_clock::now() < endTime )
         {
             // Fetch markers of requested records
-            LibTool::ArraySegment<int32_t> markerArraySegment = FetchAvailableElements(session, markerStreamName, maxMarkerElements, markerStreamBuffer);
+            LibTool::ArraySegment<int32_t> markerArraySegment = markerReader.FetchAvailable();
             totalMarkerElements += markerArraySegment.Size();
 
             // If the fetch fails to read data, then wait before a new attempt.
@@ -274,7 +246,7 @@ int main()
             int64_t const numAvailableRecords = int64_t(markerArraySegment.Size() / LibTool::StandardStreaming::NbrTriggerMarkerElements);
 
             // Fetch all samples of requested records
-            LibTool::ArraySegment<int32_t> sampleArraySegment = FetchElements(session, sampleStreamName, numAvailableRecords*nbrRecordElements, sampleStreamBuffer);
+            LibTool::ArraySegment<int32_t> sampleArraySegment = sampleReader.FetchExact(numAvailableRecords*nbrRecordElements);
             totalSampleElements += sampleArraySegment.Size();
 
             // Process acquired records
@@ -376,89 +348,6 @@ void testApiCall( ViStatus status, char const * functionName )
     }
 }
 
-LibTool::ArraySegment<int32_t> FetchAvailableElements(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, FetchBuffer& buffer)
-{
-    int32_t* bufferData = buffer.data();
-    ViInt64 const bufferSize = buffer.size();
-
-    if (bufferSize < nbrElementsToFetch)
-        throw std::invalid_argument("Buffer size is smaller than the requested elements to fetch");
-
-    ViInt64 firstValidElement = 0;
-    ViInt64 actualElements = 0;
-    ViInt64 remainingElements = 0;
-
-    // Try to fetch the requested volume of elements.
-    checkApiCall(AqMD3_StreamFetchDataInt32(session, streamName, nbrElementsToFetch, bufferSize, (ViInt32*)bufferData, &remainingElements, &actualElements, &firstValidElement));
-
-    if ((actualElements == 0) && (remainingElements > 0))
-    {
-        /* Fetch failed to read data because the number of available elements is smaller than the requested volume.*/
-
-        // Check that the number of available elements is smaller than requested
-        if(nbrElementsToFetch <= remainingElements)
-            throw std::logic_error("First fetch failed to read "+ToString(nbrElementsToFetch)+" elements when it reports "+ToString(remainingElements)+" available elements.");
-
-        // Read available elements
-        checkApiCall(AqMD3_StreamFetchDataInt32(session, streamName, remainingElements, bufferSize, (ViInt32*)bufferData, &remainingElements, &actualElements, &firstValidElement));
-    }
-
-    if (actualElements > 0)
-    {
-        std::cout << "Fetched " << actualElements << " elements from " << streamName << " stream. Remaining elements: " << remainingElements << "\n";
-    }
-
-    // this buffer might be empty if fetch failed to read actual data.
-    return LibTool::ArraySegment<int32_t>(buffer, (size_t)firstValidElement, (size_t)actualElements);
-}
-
-LibTool::ArraySegment<int32_t> FetchElements(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, FetchBuffer& buffer)
-{
-    // Handle the special case there is no need to fetch elements (this might happen when all samples are suppressed) by returning an empty array segment
-    if (nbrElementsToFetch == 0)
-        return LibTool::ArraySegment<int32_t>(buffer, 0, 0);
-
-    int32_t* bufferData = buffer.data();
-    ViInt64 const bufferSize = buffer.size();
-
-    if (bufferSize < nbrElementsToFetch)
-        throw std::invalid_argument("Buffer size is smaller than the requested elements to fetch");
-
-    for (int nbrAttempts = 0; nbrAttempts < nbrWaitForSamplesAttempts; ++nbrAttempts)
-    {
-        ViInt64 firstElement = 0;
-        ViInt64 actualElements = 0;
-        ViInt64 remainingElements = 0;
-
-        // Try to fetch the requested volume of elements.
-        checkApiCall(AqMD3_StreamFetchDataInt32(session, streamName, nbrElementsToFetch, bufferSize, (ViInt32*)bufferData, &remainingElements, &actualElements, &firstElement));
-
-        if (nbrElementsToFetch == actualElements)
-        {
-            // Requested volume has been successfully  fetched.
-            std::cout << "Fetched " << actualElements << " elements from " << streamName << " stream. Remaining elements: " << remainingElements << "\n";
-            return LibTool::ArraySegment<int32_t>(buffer, size_t(firstElement), size_t(actualElements));
-        }
-        else
-        {
-            if ((actualElements == 0) && (remainingElements < nbrElementsToFetch))
-            {
-                /* Sometimes, the fetch fail because data might not be ready for fetch immediately.
-                   Make another attempt after a short wait. */
-                std::cout << "Wait for record samples to be ready for fetch\n";
-                std::this_thread::sleep_for(std::chrono::milliseconds(recordDurationInMs));
-                continue;
-            }
-
-            /* The following error might occurs in case of stream overflow error where sample storage in memory is interrupted
-               at overflow event. The very last record is incomplete in this case.*/
-            throw std::runtime_error("Number of fetched elements is different than requested. Requested=" + ToString(nbrElementsToFetch) + " , fetched=" + ToString(actualElements) + ".");
-        }
-    }
-
-    throw std::runtime_error("Failed to fetch requested data from "+ToString(streamName)+" after " +ToString(nbrWaitForSamplesAttempts)+ " attempts");
-}
-
 
 void SaveRecord(LibTool::TriggerMarker const& triggerMarker, ViInt64 nbrRecordElements, LibTool::ArraySegment<int32_t> const& elementBuffer, double timestampInterval, std::ostream& output)
 {
@@ -11,6 +11,7 @@
 ///
 
 #include "../../include/LibTool.h"
+#include "../../include/StreamBatchReader.h"
 using namespace LibTool::ZeroSuppress;
 using LibTool::ToString;
 #include "AqMD3.h"
@@ -35,8 +36,6 @@ using std::this_thread::sleep_for;
 #include <algorithm>
 
 
-typedef std::vector<int32_t> FetchBuffer;
-
 #define checkApiCall( f ) do { ViStatus s = f; testApiCall( s, #f ); } while( false )
 void testApiCall( ViStatus status, char const * functionName);
 
@@ -46,29 +45,6 @@ ViInt16 GetSample(LibTool::ArraySegment<int32_t> const& sampleBuffer, int64_t in
 //! Unpack the gates of a record described by descriptor 'recordDesc' into 'output'.
 void UnpackRecord(RecordDescriptor const& recordDesc, LibTool::ArraySegment<int32_t> const& sampleBuffer, ProcessingParameters const& processingParams, std::ostream& output);
 
-//! Fetch all elements available on module for stream streamName.
-/*! The resulting array segment might be empty if no data are available on module.
-     \param[in] session: session handle associated with the instrument to read from.
-     \param[in] streamName: the stream identifier to read from.
-     \param[in] maxElementsToFetch: the maximum number of elements to read.
-     \param[in] buffer: buffer used by fetch for read operation.
-     \return the array-segment delimiting actual valid data returned by the instrument. The segment might be empty if no data has been read.*/
-LibTool::ArraySegment<int32_t> FetchAvailableElements(ViSession session, ViConstString streamName, ViInt64 maxElementsToFetch, FetchBuffer& buffer);
-
-//! Perform a fetch of exact 'nbrElementsToFetch' elements into the given fetch "buffer".
-/*! This is a wrapper for low-level function #AqMD3_StreamFetchDataInt32 which adds the following:
-      - Return an array-segment to delimit the fetched elements in user-provided buffer.
-      - Handle the case where the user request to fetch 0 elements from the stream by returning an empty array-segment. This might be useful when
-        all the samples of a record are suppressed (i.e. nothing to read from sample stream).
-      - Check the consistency of returned
-    \param[in] session: session handle associated with the instrument to read from.
-    \param[in] streamName: the stream identifier to read from.
-    \param[in] nbrElementsToFetch: the number of elements to read.
-    \param[in] buffer: buffer used by fetch for read operation.
-    \return the array-segment delimiting actual valid data returned by the instrument. The segment might be empty if no data has been read.
-    \throw #std::runtime_error when the buffer size is too small for the requested fetch, or the number fetched elements is different than requested.*/
-LibTool::ArraySegment<int32_t> FetchElements(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, FetchBuffer& buffer);
-
 //! Return the processing parameters for the given instrument model.
 ProcessingParameters GetProcessingParametersForModel(std::string const& instrumentModel);
 
@@ -239,23 +215,17 @@ int main()
         cout << "Firmware revision:  " << str << '\n';
         checkApiCall( AqMD3_SelfCalibrate(session) );
 
-        // Prepare readout buffers
-        ViInt64 sampleStreamGrain = 0;
-        ViInt64 markerStreamGrain = 0;
-        checkApiCall( AqMD3_GetAttributeViInt64( session, sampleStreamName , AQMD3_ATTR_STREAM_GRANULARITY_IN_BYTES, &sampleStreamGrain) );
-        checkApiCall( AqMD3_GetAttributeViInt64( session, markerStreamName , AQMD3_ATTR_STREAM_GRANULARITY_IN_BYTES, &markerStreamGrain) );
-
-        ViInt64 const markerStreamGrainElements = markerStreamGrain / sizeof(ViInt32);
-        ViInt64 const sampleStreamGrainElements = sampleStreamGrain / sizeof(ViInt32);
-        ViInt64 const markerBufferSize = nbrMarkerElementsToFetch        /*buffer size*/ 
-                                       + (markerStreamGrainElements - 1) /* alignment overhead */;
-
-        ViInt64 const sampleBufferSize = nbrAcquisitionElements          /* useful buffer size */
-                                       + nbrAcquisitionElements / 2      /* unfolding overhead */
-                                       + (sampleStreamGrainElements - 1) /* alignment overhead */;
+        // Prepare the stream readers, they own the readout buffers.
+        LibTool::StreamReading::Parameters markerReaderParams;
+        markerReaderParams.grainElements = LibTool::StreamReading::GetGrainElements(session, markerStreamName);
+        markerReaderParams.verbose = true;
+        LibTool::StreamReading::StreamBatchReader<> markerReader(AqMD3_StreamFetchDataInt32, session, markerStreamName, nbrMarkerElementsToFetch, markerReaderParams, testApiCall);
 
-        FetchBuffer markerStreamBuffer((size_t)markerBufferSize);
-        FetchBuffer sampleStreamBuffer((size_t)sampleBufferSize);
+        LibTool::StreamReading::Parameters sampleReaderParams;
+        sampleReaderParams.grainElements = LibTool::StreamReading::GetGrainElements(session, sampleStreamName);
+        sampleReaderParams.overheadElements = nbrAcquisitionElements / 2;  // unfolding overhead
+        sampleReaderParams.verbose = true;
+        LibTool::StreamReading::StreamBatchReader<> sampleReader(AqMD3_StreamFetchDataInt32, session, sampleStreamName, nbrAcquisitionElements, sampleReaderParams, testApiCall);
 
         // processing parameters
         ProcessingParameters const processingParams = GetProcessingParametersForModel(instrumentModel);
@@ -291,7 +261,7 @@ int main()
             while((system_clock::now() < endTime) && (markerStreamDecoder.GetAvailableRecordCount() == 0))
             {
                 // process all the available data without waiting again.
-                LibTool::ArraySegment<int32_t> markerArraySegment = FetchAvailableElements(session, markerStreamName, nbrMarkerElementsToFetch, markerStreamBuffer);
+                LibTool::ArraySegment<int32_t> markerArraySegment = markerReader.FetchAvailable();
                 totalMarkerElements += markerArraySegment.Size();
 
                 // If the fetch fails to read data, then wait before a new attempt.
@@ -321,7 +291,7 @@ int main()
             int64_t const totalSampleElementCount = storedSampleCount / nbrSamplesPerElement;
 
             // fetch samples associated with all records at once
-            LibTool::ArraySegment<int32_t> sampleArraySegment = FetchElements(session, sampleStreamName, totalSampleElementCount, sampleStreamBuffer);
+            LibTool::ArraySegment<int32_t> sampleArraySegment = sampleReader.FetchExact(totalSampleElementCount);
             totalSampleElements += sampleArraySegment.Size();
 
             // iterate over record descriptors, check consistency of markers and save data into file.
@@ -481,73 +451,6 @@ void UnpackRecord(
     output << "actual record size: " << actualRecordSize << "\n\n";
 }
 
-LibTool::ArraySegment<int32_t> FetchAvailableElements(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, FetchBuffer& buffer)
-{
-    int32_t* bufferData = buffer.data();
-    ViInt64 const bufferSize = buffer.size();
-
-    if (bufferSize < nbrElementsToFetch)
-        throw std::invalid_argument("Buffer size is smaller than the requested elements to fetch");
-
-    ViInt64 firstValidElement = 0;
-    ViInt64 actualElements = 0;
-    ViInt64 remainingElements = 0;
-
-    // Try to fetch the requested volume of elements.
-    checkApiCall(AqMD3_StreamFetchDataInt32(session, streamName, nbrElementsToFetch, bufferSize, (ViInt32*)bufferData, &remainingElements, &actualElements, &firstValidElement));
-
-    if ((actualElements == 0) && (remainingElements > 0))
-    {
-        /* Fetch failed to read data because the number of available elements is smaller than the requested volume.*/
-
-        // Check that the number of available elements is smaller than requested
-        if (nbrElementsToFetch <= remainingElements)
-            throw std::logic_error("First fetch failed to read " + ToString(nbrElementsToFetch) + " elements when it reports " + ToString(remainingElements) + " available elements.");
-
-        // Read available elements
-        checkApiCall(AqMD3_StreamFetchDataInt32(session, streamName, remainingElements, bufferSize, (ViInt32*)bufferData, &remainingElements, &actualElements, &firstValidElement));
-    }
-
-    if (actualElements > 0)
-    {
-        std::cout << "\nFetched " << actualElements << " elements from " << streamName << " stream. Remaining elements: " << remainingElements << "\n";
-    }
-
-    // this buffer might be empty if fetch failed to read actual data.
-    return LibTool::ArraySegment<int32_t>(buffer, (size_t)firstValidElement, (size_t)actualElements);
-}
-
-LibTool::ArraySegment<int32_t> FetchElements(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, FetchBuffer& buffer)
-{
-    // Handle the special case there is no need to fetch elements (this might happen when all samples are suppressed) by returning an empty array segment
-    if (nbrElementsToFetch == 0)
-        return LibTool::ArraySegment<int32_t>(buffer, 0, 0);
-
-    int32_t* bufferData = buffer.data();
-    ViInt64 const bufferSize = buffer.size();
-
-    if (bufferSize < nbrElementsToFetch)
-        throw std::invalid_argument("Buffer size is smaller than the requested elements to fetch");
-
-    ViInt64 firstElement = 0;
-    ViInt64 actualElements = 0;
-    ViInt64 remainingElements = 0;
-
-    // Try to fetch the requested volume of elements.
-    checkApiCall(AqMD3_StreamFetchDataInt32(session, streamName, nbrElementsToFetch, bufferSize, (ViInt32*)bufferData, &remainingElements, &actualElements, &firstElement));
-
-    // if fetched data volume is equal to the requested, there is no thing else to do.
-    if (nbrElementsToFetch != actualElements)
-    {
-        throw std::runtime_error("Number of fetched elements is different than requested. Requested=" + ToString(nbrElementsToFetch) + " , fetched=" + ToString(actualElements) + ".");
-    }
-    else
-    {
-        std::cout << "\nFetched " << actualElements << " elements from " << streamName << " stream. Remaining elements: " << remainingElements << "\n";
-        return LibTool::ArraySegment<int32_t>(buffer, size_t(firstElement), size_t(actualElements));
-    }
-}
-
 ProcessingParameters GetProcessingParametersForModel(std::string const& model)
 {
     if (model == "SA220P" || model == "SA220E")
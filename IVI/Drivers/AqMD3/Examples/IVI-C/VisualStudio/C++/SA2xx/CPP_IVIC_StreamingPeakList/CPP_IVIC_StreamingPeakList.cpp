@@ -12,6 +12,7 @@
 ///
 
 #include "../../include/LibTool.h"
+#include "../../include/StreamBatchReader.h"
 using namespace LibTool;
 #include "AqMD3.h"
 
@@ -34,21 +35,9 @@ using std::this_thread::sleep_for;
 
 #define checkApiCall( f ) do { ViStatus s = f; testApiCall( s, #f ); } while( false )
 
-typedef std::vector<int32_t> FetchBuffer;
-
 //! Validate success status of the given functionName.
 void testApiCall( ViStatus status, char const * functionName );
 
-//! Attempt to fetch "FetchAvailableElements" elements from the "streamName", or the available number of elements if less than.
-/*! The resulting array segment might be empty if the fetch fails to read data from the stream.
-     \param[in] session: session handle associated with the instrument to read from.
-     \param[in] streamName: the stream identifier to read from.
-     \param[in] nbrElementsToFetch: the maximum number of elements to read.
-     \param[in] buffer: buffer used by fetch for read operation.
-     \param[out] nbrRemainingElements: the number of remaining elements on the stream after fetch operation.
-     \return the array-segment delimiting actual valid data returned by the instrument. The segment might be empty if no data has been read.*/
-ArraySegment<int32_t> FetchAvailableElements(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, FetchBuffer& buffer, ViInt64& nbrRemainingElements);
-
 //! Decode 256-bit format markers from #peaksArraySegment and print them into the #output stream.
 void PrintExtendedMarkers(ArraySegment<int32_t>& peaksArraySegment, std::ostream& output);
 //! Decode 128-bit format markers from #peaksArraySegment and print them into the #output stream.
@@ -224,15 +213,10 @@ int main()
         checkApiCall( AqMD3_ApplySetup( session ) );
         checkApiCall( AqMD3_SelfCalibrate( session ) );
 
-        // Prepare readout buffer
-        ViInt64 peakStreamGrain = 0;
-        checkApiCall( AqMD3_GetAttributeViInt64( session, peakStreamName , AQMD3_ATTR_STREAM_GRANULARITY_IN_BYTES, &peakStreamGrain) );
-        ViInt64 const peakStreamGrainElements = peakStreamGrain / sizeof(ViInt32);
-
-        ViInt64 const peaksBufferSize = nbrOfElementsToFetchAtOnce    // required elements
-                                       + peakStreamGrainElements - 1; // alignment overhead
-
-        FetchBuffer peaksBuffer((size_t)peaksBufferSize);
+        // Prepare the peak stream reader, it owns the readout buffer.
+        StreamReading::Parameters peakReaderParams;
+        peakReaderParams.grainElements = StreamReading::GetGrainElements(session, peakStreamName);
+        StreamReading::StreamBatchReader<> peakReader(AqMD3_StreamFetchDataInt32, session, peakStreamName, nbrOfElementsToFetchAtOnce, peakReaderParams, testApiCall);
 
         // Count the total volume of fetched markers and elements.
         ViInt64 totalMarkerElements = 0;
@@ -247,21 +231,20 @@ int main()
 
         auto const endTime = system_clock::now() + streamingDuration;
 
-        ViInt64 remainingElements = 0;
         bool veryFirstFetch=true;
         while( system_clock::now() < endTime )
         {
-            if (remainingElements < nbrOfElementsToFetchAtOnce)
+            if (peakReader.GetRemainingElements() < nbrOfElementsToFetchAtOnce)
             {
                 std::cout << "wait for data\n";
                 sleep_for(dataWaitTime);
             }
 
-            ArraySegment<int32_t> peaksArraySegment = FetchAvailableElements(session, peakStreamName, nbrOfElementsToFetchAtOnce, peaksBuffer, remainingElements);
+            ArraySegment<int32_t> peaksArraySegment = peakReader.FetchAvailable();
             totalMarkerElements += peaksArraySegment.Size();
 
             if(peaksArraySegment.Size() > 0)
-                cout << "Fetched " << peaksArraySegment.Size() << " elements from " << peakStreamName << " stream. Remaining elements: " << remainingElements << "\n";
+                cout << "Fetched " << peaksArraySegment.Size() << " elements from " << peakStreamName << " stream. Remaining elements: " << peakReader.GetRemainingElements() << "\n";
             else
                 continue;
 
@@ -339,55 +322,19 @@ void testApiCall( ViStatus status, char const * functionName )
     }
 }
 
-ArraySegment<int32_t> FetchAvailableElements(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, FetchBuffer& buffer, ViInt64& remainingElements)
-{
-    int32_t* bufferData = buffer.data();
-    ViInt64 const bufferSize = buffer.size();
-
-    if (bufferSize < nbrElementsToFetch)
-        throw std::invalid_argument("Buffer size is smaller than the requested elements to fetch");
-
-    ViInt64 firstValidElement = 0;
-    ViInt64 actualElements = 0;
-    remainingElements = 0;
-
-    // Try to fetch the requested volume of elements.
-    checkApiCall(AqMD3_StreamFetchDataInt32(session, streamName, nbrElementsToFetch, bufferSize, (ViInt32*)bufferData, &remainingElements, &actualElements, &firstValidElement));
-
-    if ((actualElements == 0) && (remainingElements > 0))
-    {
-        /* Fetch failed to read data because the number of available elements is smaller than the requested volume.*/
-
-        // Check that the number of available elements is smaller than requested
-        if (nbrElementsToFetch <= remainingElements)
-            throw std::logic_error("First fetch failed to read " + ToString(nbrElementsToFetch) + " elements when it reports " + ToString(remainingElements) + " available elements.");
-
-        // Read available elements
-        checkApiCall(AqMD3_StreamFetchDataInt32(session, streamName, remainingElements, bufferSize, (ViInt32*)bufferData, &remainingElements, &actualElements, &firstValidElement));
-    }
-
-    // this buffer might be empty if fetch failed to read actual data.
-    return ArraySegment<int32_t>(buffer, (size_t)firstValidElement, (size_t)actualElements);
-}
-
 //! Expect a 256-bit trigger marker on #stream, decode it and print its content into the #output stream.
 void PrintExtendedTriggerMarker(ArraySegment<int32_t>& stream, std::ostream& output)
 {
-    uint32_t const header = stream[0];
-    int const tag = header & 0xff;
+    typedef BitLayout::Layouts::ExtendedTrigger Layout;
+    int32_t const* const marker = stream.GetData();
 
+    int const tag = int(Layout::Tag::Extract(marker));
     if (tag != 0x11)
         throw std::runtime_error("Expected trigger marker tag, got " + ToString(tag));
 
-    uint32_t const low = stream[1];
-    uint32_t const high = stream[2];
-
-    uint32_t recordIndex = (header >> 8) & 0x00ffffff;
-
-    double triggerSubsamplePosition = -(double(low & 0x000000ff) / 256.0);
-    uint64_t const trigSampleLow = (low >> 8) & 0x0000000000ffffffL;
-    uint64_t const trigSampleHigh = uint64_t(high) << 24;
-    uint64_t triggerSampleIndex = trigSampleHigh | trigSampleLow;
+    uint32_t const recordIndex = uint32_t(Layout::RecordIndex::Extract(marker));
+    double const triggerSubsamplePosition = Layout::TriggerSubsample::ExtractScaled(marker);
+    uint64_t const triggerSampleIndex = Layout::Timestamp::Extract(marker);
 
     output << "\nTrigger marker: record #" <<  recordIndex << ", trigger sample index = " << triggerSampleIndex << ", subsample = " << triggerSubsamplePosition;
 }
@@ -395,74 +342,28 @@ void PrintExtendedTriggerMarker(ArraySegment<int32_t>& stream, std::ostream& out
 //! Expect a 256-bit pulse marker on #stream, decode it and print its content into the #output stream.
 void PrintExtendedPulseMarker(ArraySegment<int32_t>& stream, std::ostream& output)
 {
-    int32_t const header = stream[0];
-    int const tag = header & 0xff;
+    /* The fields of the marker, and the fixed-point layouts of the peak & center of mass coordinates, are described by
+       LibTool::BitLayout::Layouts::ExtendedPulse. Please refer to the User Manual (section "Real-time peak-listing mode (PKL option)")
+       for more details.*/
+    typedef BitLayout::Layouts::ExtendedPulse Layout;
+    int32_t const* const marker = stream.GetData();
 
+    int const tag = int(Layout::Tag::Extract(marker));
     if (tag != 0x14)
         throw std::runtime_error("Expected pulse marker tag, got " + ToString(tag));
 
-    //1. record index
-    uint32_t const recordIndex = (uint32_t)((header >> 8) & 0x00ffffff);
-
-    //2. timestamp
-    int32_t const item1 = stream[1];
-    int32_t const item2 = stream[2];
-
-    int64_t const tsLow = int64_t(item1)  & 0x00000000ffffffffL;
-    int64_t const tsHigh = int64_t(item2) & 0x000000000000ffffL;
-    int64_t const unsignedTimestamp = tsLow | (tsHigh << 32);
+    uint32_t const recordIndex = uint32_t(Layout::RecordIndex::Extract(marker));
 
     // timestamp is signed and might be negative when pulse is detected before the trigger
-    int64_t const timestamp = ExpandSign(unsignedTimestamp, 48);
-
-    // 3. width
-    int32_t const width = (item2 >> 16) & 0x00007fff;
-
-    //4. overflow
-    bool const overflow = (((item2 >> 31) & 0x01) != 0);
-
-    //5. number of overrange samples
-    int32_t const item3 = stream[3];
-    int32_t const nbrOverrangeSamples = item3 & 0x00007fff;
-
-    //6. sum of squares
-    int64_t const soSLow = (int64_t(item3) >> 16) & 0x000000000000ffffL;
-    int32_t const item4 = stream[4];
-    int64_t const soSHigh = int64_t(item4) & 0x00000000ffffffffL;
-
-    int64_t const sumOfSquares = (soSHigh << 16) | soSLow;
+    int64_t const timestamp = Layout::Timestamp::Extract(marker);
+    int32_t const width = int32_t(Layout::Width::Extract(marker));
+    int32_t const nbrOverrangeSamples = int32_t(Layout::OverrangeSamples::Extract(marker));
+    int64_t const sumOfSquares = int64_t(Layout::SumOfSquares::Extract(marker));
 
-    //7. peak position
-    int32_t const item5 = stream[5];
-    int32_t const item6 = stream[6];
-
-    int const peakXRaw = item5 & 0x00ffffff;
-    int const peakYRaw = ((item5 >> 24) & 0x000000ff) | ((item6 & 0x0000ffff) << 8);
-
-    //8. center of mass position
-    int32_t const item7 = stream[7];
-    int const comXRaw = ((item6 >> 16) & (0x0000ffff)) | ((item7 & 0x000000ff) << 16);
-    int const comYRaw = (item7 >> 8) & 0x00ffffff;
-
-    /*9. Scale fixed-point representations (peak & center of mass coordinates) into float-point values.
-         Please refer to the User Manual (section "Real-time peak-listing mode (PKL option)") for more
-         details on the layout of fixed-point representations associated with the following fields:
-         Peak timestamp, peak value, center-of-mass timestamp and center-of-mass value.*/
-    static int const peakX_nbrIntegerBits = 14;
-    static int const peakX_nbrFractionalBits = 8;
-    static int const peakY_nbrIntegerBits = 17;
-    static int const peakY_nbrFractionalBits = 3;
-
-    static int const comX_nbrIntegerBits = 16;
-    static int const comX_nbrFractionalBits = 8;
-    static int const comY_nbrIntegerBits = 16;
-    static int const comY_nbrFractionalBits = 1;
-
-    double const peakX = ScaleSigned(peakXRaw, peakX_nbrIntegerBits, peakX_nbrFractionalBits);
-    double const peakY = ScaleSigned(peakYRaw, peakY_nbrIntegerBits, peakY_nbrFractionalBits);
-
-    double const comX = ScaleSigned(comXRaw, comX_nbrIntegerBits, comX_nbrFractionalBits);
-    double const comY = ScaleSigned(comYRaw, comY_nbrIntegerBits, comY_nbrFractionalBits);
+    double const peakX = Layout::PeakX::ExtractScaled(marker);
+    double const peakY = Layout::PeakY::ExtractScaled(marker);
+    double const comX = Layout::ComX::ExtractScaled(marker);
+    double const comY = Layout::ComY::ExtractScaled(marker);
 
     // print the content of the marker into output stream.
     output << "\n     - Pulse descriptor:";
@@ -513,21 +414,16 @@ void PrintExtendedMarkers(ArraySegment<int32_t>& peaksArraySegment, std::ostream
 //! Expect a 128-bit trigger marker on #stream, decode it and print its content into the #output stream.
 void PrintCompactTriggerMarker(ArraySegment<int32_t>& stream, std::ostream& output)
 {
-    uint32_t const header = stream[0];
-    int const tag = header & 0x0f;
+    typedef BitLayout::Layouts::CompactTrigger Layout;
+    int32_t const* const marker = stream.GetData();
 
+    int const tag = int(Layout::Tag::Extract(marker));
     if (tag != 0x01)
         throw std::runtime_error("Expected compact trigger marker tag, got " + ToString(tag));
 
-    uint32_t const low = stream[1];
-    uint32_t const high = stream[2];
-
-    uint32_t recordIndex = (header >> 4) & 0x000fffff;
-
-    double triggerSubsamplePosition = -(double(low & 0x000000ff) / 256.0);
-    uint64_t const trigSampleLow = (low >> 8) & 0x0000000000ffffffL;
-    uint64_t const trigSampleHigh = uint64_t(high) << 24;
-    uint64_t triggerSampleIndex = trigSampleHigh | trigSampleLow;
+    uint32_t const recordIndex = uint32_t(Layout::RecordIndex::Extract(marker));
+    double const triggerSubsamplePosition = Layout::TriggerSubsample::ExtractScaled(marker);
+    uint64_t const triggerSampleIndex = Layout::Timestamp::Extract(marker);
 
     output << "\nTrigger marker: record #" << recordIndex << ", trigger sample index = " << triggerSampleIndex << ", subsample = " << triggerSubsamplePosition;
 }
@@ -535,34 +431,19 @@ void PrintCompactTriggerMarker(ArraySegment<int32_t>& stream, std::ostream& outp
 //! Expect a 128-bit pulse marker on #stream, decode it and print its content into the #output stream.
 void PrintCompactPulseMarker(ArraySegment<int32_t>& stream, std::ostream& output)
 {
-    int32_t const header = stream[0];
-    int const tag = header & 0x0f;
+    typedef BitLayout::Layouts::CompactPulse Layout;
+    int32_t const* const marker = stream.GetData();
 
+    int const tag = int(Layout::Tag::Extract(marker));
     if ((tag != 0x04) && (tag != 0x05) && (tag != 0x06))
         throw std::runtime_error("Unexpected compact pulse marker tag: " + ToString(tag));
 
-    //1. record index
-    uint32_t const recordIndex = (uint32_t)((header >> 4) & 0x000fffff);
-
-    //2. timestamp
-    int32_t const item1 = stream[1];
+    uint32_t const recordIndex = uint32_t(Layout::RecordIndex::Extract(marker));
 
-    int32_t const tsLow = (header >> 24) & 0x0000000ff;
-    int32_t const tsHigh = item1         & 0x00fffffff;
     // timestamp is signed and might be negative when pulse is detected before the trigger
-    int32_t const timestamp = tsLow | (tsHigh << 8);
-
-    // 3. width
-    int32_t const item2 = stream[2];
-    int32_t const wLow = (item1 >> 24) & 0x000000ff;
-    int32_t const wHigh = item2        & 0x00000007;
-    int32_t const width = wLow | (wHigh << 8);
-
-    //4. overflow
-    bool const overflow = (((item2 >> 3) & 0x01) != 0);
-
-    //5. number of overrange samples
-    int32_t const nbrOverrangeSamples = (item2 >> 4) & 0x000007ff;
+    int64_t const timestamp = Layout::Timestamp::Extract(marker);
+    int32_t const width = int32_t(Layout::Width::Extract(marker));
+    int32_t const nbrOverrangeSamples = int32_t(Layout::OverrangeSamples::Extract(marker));
 
     // print the content of the marker into output stream.
     output << "\n     - Pulse descriptor: " << tag;
@@ -573,56 +454,19 @@ void PrintCompactPulseMarker(ArraySegment<int32_t>& stream, std::ostream& output
     output << "\n            - Width (in samples)                                : " << width;
     output << "\n            - Overrange samples                                 : " << nbrOverrangeSamples;
 
-    int32_t const item3 = stream[3];
-
     if (tag == 0x04) // Peak
     {
-        static int const peakX_nbrIntegerBits = 14;
-        static int const peakX_nbrFractionalBits = 8;
-        static int const peakY_nbrIntegerBits = 17;
-        static int const peakY_nbrFractionalBits = 3;
-
-        //7. peak position
-        //int32_t const item6 = stream[6];
-
-        int const peakXL = (item2 >> 16) & 0x0000ffff;
-        int const peakXH = (item3      ) & 0x000000ff;
-        int const peakXRaw = peakXL | (peakXH << 16);
-
-        int const peakYRaw = ((item3 >> 8) & 0x00ffffff);
-
-        double const peakX = ScaleSigned(peakXRaw, peakX_nbrIntegerBits, peakX_nbrFractionalBits);
-        double const peakY = ScaleSigned(peakYRaw, peakY_nbrIntegerBits, peakY_nbrFractionalBits);
-
-        output << "\n            - Peak timestamp (rel. to the 1st pulse sample)     : " << peakX;
-        output << "\n            - Peak value (16-bit ADC code)                      : " << peakY;
+        output << "\n            - Peak timestamp (rel. to the 1st pulse sample)     : " << Layout::PeakX::ExtractScaled(marker);
+        output << "\n            - Peak value (16-bit ADC code)                      : " << Layout::PeakY::ExtractScaled(marker);
     }
     else if (tag == 0x05) // Center of Mass
     {
-        static int const comX_nbrIntegerBits = 16;
-        static int const comX_nbrFractionalBits = 8;
-        static int const comY_nbrIntegerBits = 16;
-        static int const comY_nbrFractionalBits = 1;
-
-        int const comXL = (item2 >> 16) & 0x0000ffff;
-        int const comXH = (item3)       & 0x000000ff;
-        int const comXRaw = comXL | (comXH << 16);
-
-        int const comYRaw = ((item3 >> 8) & 0x00ffffff);
-
-        double const comX = ScaleSigned(comXRaw, comX_nbrIntegerBits, comX_nbrFractionalBits);
-        double const comY = ScaleSigned(comYRaw, comY_nbrIntegerBits, comY_nbrFractionalBits);
-
-        output << "\n            - Center of mass (rel. to the 1st pulse sample)     : " << comX;
-        output << "\n            - Center of mass value (rel. to baseline, ADC code) : " << comY;
+        output << "\n            - Center of mass (rel. to the 1st pulse sample)     : " << Layout::ComX::ExtractScaled(marker);
+        output << "\n            - Center of mass value (rel. to baseline, ADC code) : " << Layout::ComY::ExtractScaled(marker);
     }
     else if (tag == 0x06) // Peak Area
     {
-        uint32_t const paLow = (int64_t(item2) >> 16) & 0x0000ffff;
-        uint32_t const paHigh = int64_t(item3)        & 0x0000ffff;
-        int64_t const peakArea = (paHigh << 16) | paLow;
-
-        output << "\n            - Peak Area                                         : " << peakArea;
+        output << "\n            - Peak Area                                         : " << int64_t(Layout::Area::Extract(marker));
     }
     else
     {
@@ -630,7 +474,6 @@ void PrintCompactPulseMarker(ArraySegment<int32_t>& stream, std::ostream& output
     }
 }
 
-
 void PrintCompactMarkers(ArraySegment<int32_t>& peaksArraySegment, std::ostream& output)
 {
     while (peaksArraySegment.Size() > 0)
@@ -0,0 +1,393 @@
+///
+/// Acqiris IVI-C Driver Example Program
+///
+/// Initializes the driver, reads a few Identity interface properties, and performs a
+/// streaming acquisition in PeakList mode with signal storage.
+///
+/// For additional information on programming with IVI drivers in various IDEs, please see
+/// http://www.ivifoundation.org/resources/
+///
+/// The Example requires a real instrument having CST and input signal on "Channel1". It
+/// also requires PKL option to enable PeakList acquisition mode.
+///
+/// Along with the pulse descriptors, the instrument stores the raw, filtered or filtered
+/// derivative signal of every record (AQMD3_ATTR_CHANNEL_PEAK_LIST_DATA_STORAGE_MODE). Records
+/// are associated with their trigger and pulse descriptors, and only the windows of signal
+/// around the detected pulses are saved: this is the signal needed to tune the smoothing lengths
+/// and derivative thresholds of the pulse detection.
+///
+
+#include "../../include/LibTool.h"
+#include "../../include/PeakListStream.h"
+#include "../../include/StreamBatchReader.h"
+using LibTool::ToString;
+using LibTool::ArraySegment;
+namespace PeakList = LibTool::PeakList;
+namespace StreamReading = LibTool::StreamReading;
+#include "AqMD3.h"
+
+#include <iostream>
+using std::cout;
+using std::cerr;
+using std::hex;
+#include <vector>
+#include <stdexcept>
+#include <chrono>
+using std::chrono::seconds;
+using std::chrono::milliseconds;
+using std::chrono::system_clock;
+#include <thread>
+using std::this_thread::sleep_for;
+#include <fstream>
+#include <algorithm>
+
+#define checkApiCall( f ) do { ViStatus s = f; testApiCall( s, #f ); } while( false )
+
+//! Validate success status of the given functionName.
+void testApiCall( ViStatus status, char const * functionName );
+
+//! Save the windows of #extractor into #output: for every window, record index, first sample and number of samples (int64) followed by its samples (int16).
+void SaveWindows(PeakList::WindowExtractor const& extractor, std::ostream& output);
+
+//! Return a printable name of a PeakList data storage mode.
+char const* GetStorageModeName(ViInt32 mode);
+
+// name-space gathering all user-configurable parameters
+namespace
+{
+    // Edit resource and options as needed. Resource is ignored if option has Simulate=true.
+    // An input signal is necessary if the example is run in non simulated mode, otherwise
+    // the acquisition will time out.
+    ViChar resource[] = "PXI40::0::0::INSTR";
+    ViChar options[]  = "Simulate=true, DriverSetup= Model=SA248P";
+
+    // Acquisition configuration parameters
+    ViReal64 const sampleRate = 8.0e9;
+    ViReal64 const sampleInterval = 1.0 / sampleRate;
+    ViInt64 const recordSize = 16*1024;
+    ViInt32 const streamingMode = AQMD3_VAL_STREAMING_MODE_TRIGGERED;
+    ViInt32 const acquisitionMode = AQMD3_VAL_ACQUISITION_MODE_PEAK_LIST;
+
+    // Channel configuration parameters
+    ViReal64 const range = 1.0;
+    ViReal64 const offset = 0.0;
+    ViInt32 const coupling = AQMD3_VAL_VERTICAL_COUPLING_DC;
+
+    // Pulse Analysis parameters
+    ViInt32 const pklValueSmoothingLength = 3;
+    ViInt32 const pklDerivativeSmoothingLength = 7;
+    ViInt32 const pklPulseValueThreshold = 512;
+    ViInt32 const pklPulseDerivativeThresholdRising = 256;
+    ViInt32 const pklPulseDerivativeThresholdFalling = -256;
+    ViInt32 const pklPulseDerivativeHysteresis = 16;
+    ViInt32 const pklBaseline = 0;
+    ViInt32 const pklDescriptorFormat = AQMD3_VAL_PEAK_LIST_DESCRIPTOR_FORMAT_EXTENDED;
+
+    /* Signal stored with the descriptors: AQMD3_VAL_PEAK_LIST_DATA_STORAGE_MODE_RAW, _FILTERED (value smoothing) or
+       _FILTERED_DERIVATIVE (derivative smoothing, compared to the derivative thresholds).*/
+    ViInt32 const pklDataStorageMode = AQMD3_VAL_PEAK_LIST_DATA_STORAGE_MODE_FILTERED_DERIVATIVE;
+
+    // Samples kept before the first sample and after the last sample of every pulse.
+    int64_t const windowPreSamples = 32;
+    int64_t const windowPostSamples = 64;
+
+    // Trigger configuration parameters
+    ViConstString triggerSource = "Internal1";
+    ViReal64 const triggerLevel = 0.0;
+    ViInt32 const triggerSlope = AQMD3_VAL_TRIGGER_SLOPE_POSITIVE;
+
+    // Fetch parameters
+    ViConstString peakStreamName = "PeaksCh1";
+    ViConstString sampleStreamName = "StreamCh1";
+    /* Number of 32-bit elements of the peak stream to fetch at once.
+       NOTE: Please tune according to your system input. Knowing that:
+        - 1 trigger generates 8 elements.
+        - 1 peak generates 8 elements.*/
+    ViInt64 const nbrOfElementsToFetchAtOnce = 1024*1024;
+    // Maximum number of records whose samples are fetched at once.
+    ViInt64 const maxRecordsToFetchAtOnce = 256;
+
+    int64_t const nbrSamplesPerElement = sizeof(int32_t) / sizeof(int16_t);
+    ViInt64 const nbrRecordElements = recordSize / nbrSamplesPerElement;
+
+    // duration of the streaming session
+    auto const streamingDuration = seconds(60);
+    /*wait-time before a new attempt of read operation.
+      NOTE: Please tune according to your system input (trigger rate & number of peaks)*/
+    auto const dataWaitTime = milliseconds(200);
+
+    /* Wait for samples to be ready for fetch*/
+    int64_t const recordDurationInMs = std::max(static_cast<int64_t>(recordSize * sampleInterval * 1000.0), int64_t(1));
+    int const nbrWaitForSamplesAttempts = 3;
+
+    // Output file of pulse windows (binary, native endianness)
+    std::string const outputFileName("StreamingPeakListData.bin");
+}
+
+int main()
+{
+    cout << "Triggered Streaming PeakList with signal storage \n\n";
+
+    // Initialize the driver. See driver help topic "Initializing the IVI-C Driver" for additional information.
+    ViSession session = VI_NULL;
+    ViBoolean const idQuery = VI_FALSE;
+    ViBoolean const reset   = VI_FALSE;
+
+    try
+    {
+        checkApiCall( AqMD3_InitWithOptions( resource, idQuery, reset, options, &session ) );
+
+        cout << "\nDriver session initialized\n";
+
+        // Read and output a few attributes.
+        ViChar str[128];
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_PREFIX,               sizeof( str ), str ) );
+        cout << "Driver prefix:      " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_REVISION,             sizeof( str ), str ) );
+        cout << "Driver revision:    " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_VENDOR,               sizeof( str ), str ) );
+        cout << "Driver vendor:      " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_DESCRIPTION,          sizeof( str ), str ) );
+        cout << "Driver description: " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_MODEL,                     sizeof( str ), str ) );
+        cout << "Instrument model:   " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_INFO_OPTIONS,              sizeof( str ), str ) );
+        cout << "Instrument options: " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_FIRMWARE_REVISION,         sizeof( str ), str ) );
+        cout << "Firmware revision:  " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_INFO_SERIAL_NUMBER_STRING, sizeof( str ), str ) );
+        cout << "Serial number:      " << str << '\n';
+        cout << '\n';
+
+        // Abort execution if instrument is still in simulated mode.
+        ViBoolean simulate;
+        checkApiCall( AqMD3_GetAttributeViBoolean( session, "", AQMD3_ATTR_SIMULATE, &simulate ) );
+        if( simulate==VI_TRUE )
+        {
+            cout << "\nThe Streaming features are not supported in simulated mode.\n";
+            cout << "Please update the resource string (resource[]) to match your configuration,";
+            cout << " and update the init options string (options[]) to disable simulation.\n";
+
+            AqMD3_close( session );
+
+            return 1;
+        }
+
+        // Configure the acquisition in triggered mode with PeakList enabled.
+        cout << "Configuring Acquisition\n";
+        cout << "  Record size :        " << recordSize << '\n';
+        cout << "  Streaming mode :     " << streamingMode << '\n';
+        cout << "  SampleRate:          " << sampleRate << '\n';
+        cout << "  Acquisition mode:    " << acquisitionMode << '\n';
+        checkApiCall( AqMD3_SetAttributeViInt32( session, "", AQMD3_ATTR_STREAMING_MODE, streamingMode) );
+        checkApiCall( AqMD3_SetAttributeViReal64( session, "", AQMD3_ATTR_SAMPLE_RATE, sampleRate ) );
+        checkApiCall( AqMD3_SetAttributeViInt32( session, "", AQMD3_ATTR_ACQUISITION_MODE, acquisitionMode) );
+        checkApiCall( AqMD3_SetAttributeViInt64( session, "", AQMD3_ATTR_RECORD_SIZE, recordSize) );
+
+        // Configure the channels.
+        cout << "Configuring Channel1\n";
+        cout << "  Range:              " << range << '\n';
+        cout << "  Offset:             " << offset << '\n';
+        cout << "  Coupling:           " << ( coupling?"DC":"AC" ) << '\n';
+        checkApiCall( AqMD3_ConfigureChannel( session, "Channel1", range, offset, coupling, VI_TRUE ) );
+
+        cout << "Configuring PeakList\n";
+        cout << "  Value smoothing length:             " << pklValueSmoothingLength << '\n';
+        cout << "  Derivative smoothing length:        " << pklDerivativeSmoothingLength << '\n';
+        cout << "  Pulse value threshold:              " << pklPulseValueThreshold << '\n';
+        cout << "  Pulse derivative threshold rising:  " << pklPulseDerivativeThresholdRising << '\n';
+        cout << "  Pulse derivative threshold falling: " << pklPulseDerivativeThresholdFalling << '\n';
+        cout << "  Pulse derivative hysteresis:        " << pklPulseDerivativeHysteresis << '\n';
+        cout << "  Baseline:                           " << pklBaseline << '\n';
+        cout << "  Descriptor Format:                  " << pklDescriptorFormat << '\n';
+        cout << "  Data storage mode:                  " << GetStorageModeName(pklDataStorageMode) << '\n';
+        checkApiCall(AqMD3_SetAttributeViInt32(session, "Channel1", AQMD3_ATTR_CHANNEL_PEAK_LIST_VALUE_SMOOTHING_LENGTH, pklValueSmoothingLength));
+        checkApiCall(AqMD3_SetAttributeViInt32(session, "Channel1", AQMD3_ATTR_CHANNEL_PEAK_LIST_DERIVATIVE_SMOOTHING_LENGTH, pklDerivativeSmoothingLength));
+        checkApiCall(AqMD3_SetAttributeViInt32(session, "Channel1", AQMD3_ATTR_CHANNEL_PEAK_LIST_PULSE_VALUE_THRESHOLD, pklPulseValueThreshold));
+        checkApiCall(AqMD3_SetAttributeViInt32(session, "Channel1", AQMD3_ATTR_CHANNEL_PEAK_LIST_PULSE_DERIVATIVE_THRESHOLD_RISING, pklPulseDerivativeThresholdRising));
+        checkApiCall(AqMD3_SetAttributeViInt32(session, "Channel1", AQMD3_ATTR_CHANNEL_PEAK_LIST_PULSE_DERIVATIVE_THRESHOLD_FALLING, pklPulseDerivativeThresholdFalling));
+        checkApiCall(AqMD3_SetAttributeViInt32(session, "Channel1", AQMD3_ATTR_CHANNEL_PEAK_LIST_PULSE_DERIVATIVE_HYSTERESIS, pklPulseDerivativeHysteresis));
+        checkApiCall(AqMD3_SetAttributeViInt32(session, "Channel1", AQMD3_ATTR_CHANNEL_PEAK_LIST_BASELINE, pklBaseline));
+        checkApiCall(AqMD3_SetAttributeViInt32(session, "Channel1", AQMD3_ATTR_CHANNEL_PEAK_LIST_DESCRIPTOR_FORMAT, pklDescriptorFormat));
+        checkApiCall(AqMD3_SetAttributeViInt32(session, "Channel1", AQMD3_ATTR_CHANNEL_PEAK_LIST_DATA_STORAGE_MODE, pklDataStorageMode));
+
+        // Configure the trigger.
+        cout << "Configuring Trigger\n";
+        cout << "  ActiveSource:       " << triggerSource << '\n';
+        cout << "  Level:              " << triggerLevel << "\n";
+        cout << "  Slope:              " << (triggerSlope ? "Positive" : "Negative") << "\n";
+        checkApiCall( AqMD3_SetAttributeViString( session, "", AQMD3_ATTR_ACTIVE_TRIGGER_SOURCE, triggerSource ) );
+        checkApiCall( AqMD3_SetAttributeViReal64( session, triggerSource, AQMD3_ATTR_TRIGGER_LEVEL, triggerLevel ) );
+        checkApiCall( AqMD3_SetAttributeViInt32( session, triggerSource, AQMD3_ATTR_TRIGGER_SLOPE, triggerSlope ) );
+
+        // Calibrate the instrument.
+        cout << "\nApply setup and run self-calibration\n";
+        checkApiCall( AqMD3_ApplySetup( session ) );
+        checkApiCall( AqMD3_SelfCalibrate( session ) );
+
+        // Prepare the stream readers, they own the readout buffers.
+        StreamReading::Parameters peakReaderParams;
+        peakReaderParams.grainElements = StreamReading::GetGrainElements(session, peakStreamName);
+        StreamReading::StreamBatchReader<> peakReader(AqMD3_StreamFetchDataInt32, session, peakStreamName, nbrOfElementsToFetchAtOnce, peakReaderParams, testApiCall);
+
+        StreamReading::Parameters sampleReaderParams;
+        sampleReaderParams.grainElements = StreamReading::GetGrainElements(session, sampleStreamName);
+        sampleReaderParams.maxAttempts = nbrWaitForSamplesAttempts;
+        sampleReaderParams.initialRetryWait = milliseconds(recordDurationInMs);
+        StreamReading::StreamBatchReader<> sampleReader(AqMD3_StreamFetchDataInt32, session, sampleStreamName, nbrRecordElements * maxRecordsToFetchAtOnce, sampleReaderParams, testApiCall);
+
+        PeakList::DescriptorFormat const descriptorFormat = (pklDescriptorFormat == AQMD3_VAL_PEAK_LIST_DESCRIPTOR_FORMAT_EXTENDED)
+            ? PeakList::DescriptorFormat::Extended : PeakList::DescriptorFormat::Compact;
+        PeakList::MarkerStreamDecoder decoder(descriptorFormat);
+        PeakList::WindowExtractor extractor(windowPreSamples, windowPostSamples);
+
+        // Count the total volume of fetched elements, records, pulses and saved samples.
+        ViInt64 totalPeakElements = 0;
+        ViInt64 totalSampleElements = 0;
+        int64_t nbrRecords = 0;
+        int64_t nbrPulses = 0;
+        int64_t nbrSavedSamples = 0;
+        int64_t expectedRecordIndex = 0;
+
+        std::ofstream outputFile(outputFileName, std::ios::binary);
+
+        // Start the acquisition.
+        cout << "\nInitiating acquisition\n";
+        checkApiCall( AqMD3_InitiateAcquisition( session ) );
+        cout << "Acquisition is running\n\n";
+
+        auto const endTime = system_clock::now() + streamingDuration;
+        while( system_clock::now() < endTime )
+        {
+            // 1. decode the available descriptors into records.
+            ArraySegment<int32_t> peaksArraySegment = peakReader.FetchAvailable();
+            totalPeakElements += peaksArraySegment.Size();
+            while (peaksArraySegment.Size() > 0)
+                decoder.DecodeNextMarker(peaksArraySegment);
+
+            if (decoder.GetAvailableRecordCount() == 0)
+            {
+                cout << "wait for data\n";
+                sleep_for(dataWaitTime);
+                continue;
+            }
+
+            // 2. fetch the samples of complete records, and keep the windows around their pulses.
+            while (decoder.GetAvailableRecordCount() > 0)
+            {
+                int const nbrRecordsToFetch = int((std::min)(ViInt64(decoder.GetAvailableRecordCount()), maxRecordsToFetchAtOnce));
+                PeakList::MarkerStreamDecoder::RecordDescriptorList const records = decoder.Take(nbrRecordsToFetch);
+
+                ArraySegment<int32_t> sampleArraySegment = sampleReader.FetchExact(nbrRecordsToFetch * nbrRecordElements);
+                totalSampleElements += sampleArraySegment.Size();
+
+                extractor.Clear();
+                for (PeakList::RecordDescriptor const& record : records)
+                {
+                    if ((expectedRecordIndex & LibTool::TriggerMarker::RecordIndexMask) != record.GetTrigger().recordIndex)
+                        throw std::runtime_error("Unexpected record index: expected=" + ToString(expectedRecordIndex) + ", got " + ToString(record.GetTrigger().recordIndex));
+
+                    extractor.Extract(record, reinterpret_cast<int16_t const*>(sampleArraySegment.GetData()), recordSize);
+                    sampleArraySegment.PopFront(size_t(nbrRecordElements));
+
+                    nbrPulses += int64_t(record.GetPulses().size());
+                    ++expectedRecordIndex;
+                }
+
+                SaveWindows(extractor, outputFile);
+                nbrRecords += nbrRecordsToFetch;
+                nbrSavedSamples += int64_t(extractor.GetSamples().size());
+            }
+        }
+        outputFile.close();
+
+        ViInt64 const totalData = (totalPeakElements + totalSampleElements) * sizeof(ViInt32);
+        cout << "\nRecords: " << nbrRecords << ", pulses: " << nbrPulses << '\n';
+        cout << "Saved samples: " << nbrSavedSamples << " of " << nbrRecords * recordSize << " stored "
+             << GetStorageModeName(pklDataStorageMode) << " samples, in " << outputFileName << '\n';
+        cout << "Total data read: " << (totalData/(1024*1024)) << " MBytes.\n";
+        cout << "Duration: " << (streamingDuration/seconds(1)) << " seconds.\n";
+        cout << "Data rate: " << (totalData)/(1024*1024)/(streamingDuration/seconds(1)) << " MB/s.\n";
+
+        // Stop the acquisition.
+        cout << "\nStopping acquisition\n";
+        checkApiCall( AqMD3_Abort( session ) );
+
+        // Close the session.
+        checkApiCall( AqMD3_close( session ) );
+        cout << "\nDriver session closed\n";
+        return 0;
+    }
+    catch (std::exception const& exc)
+    {
+        std::cerr << "Unexpected error: " << exc.what() << std::endl;
+
+        if (session != VI_NULL)
+        {
+            // Abort any ongoing acquisition
+            ViInt32 acqStatus = AQMD3_VAL_ACQUISITION_STATUS_RESULT_TRUE;
+            if ( VI_SUCCESS != AqMD3_IsIdle( session, &acqStatus ) )
+                cerr << "Failed to read acquisition status\n";
+            else if (acqStatus != AQMD3_VAL_ACQUISITION_STATUS_RESULT_TRUE)
+            {
+                if ( VI_SUCCESS != AqMD3_Abort( session ) )
+                    cerr << "Failed to abort the acquisition\n";
+            }
+
+            // close the instrument
+            if ( VI_SUCCESS != AqMD3_close( session ) )
+                cerr << "Failed to close the instrument\n";
+        }
+
+        cout << "\nException handling complete.\n";
+
+        return(1);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Definition of local functions
+//
+
+// Utility function to check status error during driver API call.
+void testApiCall( ViStatus status, char const * functionName )
+{
+    ViInt32 ErrorCode;
+    ViChar ErrorMessage[512];
+
+    if( status>0 ) // Warning occurred.
+    {
+        AqMD3_GetError( VI_NULL, &ErrorCode, sizeof( ErrorMessage ), ErrorMessage );
+        cerr << "** Warning during " << functionName << ": 0x" << hex << ErrorCode << ", " << ErrorMessage << '\n';
+    }
+    else if( status<0 ) // Error occurred.
+    {
+        AqMD3_GetError( VI_NULL, &ErrorCode, sizeof( ErrorMessage ), ErrorMessage );
+        cerr << "** ERROR during " << functionName << ": 0x" << hex << ErrorCode << ", " << ErrorMessage << '\n';
+        throw std::runtime_error( ErrorMessage );
+    }
+}
+
+void SaveWindows(PeakList::WindowExtractor const& extractor, std::ostream& output)
+{
+    int16_t const* const samples = extractor.GetSamples().data();
+    for (PeakList::PulseWindow const& window : extractor.GetWindows())
+    {
+        int64_t const header[3] = { int64_t(window.recordIndex), window.firstSample, window.nbrSamples };
+        output.write(reinterpret_cast<char const*>(header), sizeof(header));
+        output.write(reinterpret_cast<char const*>(samples + window.offset), std::streamsize(window.nbrSamples * sizeof(int16_t)));
+    }
+}
+
+char const* GetStorageModeName(ViInt32 mode)
+{
+    switch (mode)
+    {
+    case AQMD3_VAL_PEAK_LIST_DATA_STORAGE_MODE_NONE: return "none";
+    case AQMD3_VAL_PEAK_LIST_DATA_STORAGE_MODE_RAW: return "raw";
+    case AQMD3_VAL_PEAK_LIST_DATA_STORAGE_MODE_FILTERED: return "filtered";
+    case AQMD3_VAL_PEAK_LIST_DATA_STORAGE_MODE_FILTERED_DERIVATIVE: return "filtered derivative";
+    default: return "unknown";
+    }
+}
@@ -0,0 +1,404 @@
+///
+/// Acqiris IVI-C Driver Example Program
+///
+/// Initializes the driver, reads a few Identity interface properties, and performs a
+/// triggered streaming acquisition on two channels, served from a single thread: each
+/// channel is processed by a coroutine awaiting its marker and sample streams, and a
+/// stream reactor resumes the coroutines as their data become available. The records of the
+/// two channels are paired by record index, and the delay of Channel2 relative to Channel1 is
+/// estimated for every pair from the peak of their cross-correlation.
+///
+/// For additional information on programming with IVI drivers in various IDEs, please see
+/// http://www.ivifoundation.org/resources/
+///
+/// The Example requires a real instrument having CST and input signals on "Channel1" and
+/// "Channel2". It must be built as C++20 (coroutines).
+///
+
+#include "../../include/LibTool.h"
+#include "../../include/StreamReactor.h"
+#include "../../include/TimeDelay.h"
+using LibTool::ToString;
+#include "AqMD3.h"
+
+#include <iostream>
+using std::cout;
+using std::cerr;
+using std::hex;
+#include <vector>
+using std::vector;
+#include <stdexcept>
+using std::runtime_error;
+#include <chrono>
+using std::chrono::seconds;
+using std::chrono::milliseconds;
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+
+
+#define checkApiCall( f ) do { ViStatus s = f; testApiCall( s, #f ); } while( false )
+
+namespace Coroutines = LibTool::Coroutines;
+namespace TimeDelay = LibTool::TimeDelay;
+
+//! Processing statistics of a channel.
+struct ChannelStatistics
+{
+    int64_t nbrRecords = 0;
+    int64_t nbrMarkerElements = 0;
+    int64_t nbrSampleElements = 0;
+    int16_t minSample = INT16_MAX;
+    int16_t maxSample = INT16_MIN;
+};
+
+//! Delay estimation between the records of the two channels, shared by their coroutines (served by the same thread).
+struct DelayEstimation
+{
+    TimeDelay::RecordPairer pairer;
+    TimeDelay::Estimator estimator;
+    std::ofstream output;
+};
+
+//! Validate success status of the given functionName.
+void testApiCall( ViStatus status, char const * functionName );
+
+//! Process the records of a channel: await the markers available, then the samples of the records they describe.
+/*! Markers are validated (tag, incrementing record index, increasing xtime), samples are reduced to their minimum and maximum,
+    and records are paired with the records of the other channel for delay estimation.*/
+Coroutines::Task ProcessChannel(size_t channel, Coroutines::AsyncStream& markerStream, Coroutines::AsyncStream& sampleStream, double timestampPeriod, ChannelStatistics& statistics,
+                                DelayEstimation& delayEstimation);
+
+//! Return the timestamping period for model (expressed in seconds)
+double GetTimestampPeriodForModel(std::string const& model);
+
+// name-space gathering all user-configurable parameters
+namespace
+{
+    // Edit resource and options as needed. Resource is ignored if option has Simulate=true.
+    // An input signal is necessary if the example is run in non simulated mode, otherwise
+    // the acquisition will time out.
+    ViChar resource[] = "PXI40::0::0::INSTR";
+    ViChar options[]  = "Simulate=true, DriverSetup= Model=SA220P";
+
+    // Acquisition configuration parameters
+    ViReal64 const sampleRate = 1.0e9;
+    ViReal64 const sampleInterval = 1.0 / sampleRate;
+    ViInt64 const recordSize = 1024;
+    ViInt32 const streamingMode = AQMD3_VAL_STREAMING_MODE_TRIGGERED;
+    ViInt32 const acquisitionMode = AQMD3_VAL_ACQUISITION_MODE_NORMAL;
+
+    // Channel configuration parameters
+    ViConstString channels[] = { "Channel1", "Channel2" };
+    ViReal64 const range = 2.5;
+    ViReal64 const offset = 0.0;
+    ViInt32 const coupling = AQMD3_VAL_VERTICAL_COUPLING_DC;
+
+    // Trigger configuration parameters
+    ViConstString triggerSource = "Internal1";
+    ViReal64 const triggerLevel = 0.0;
+    ViInt32 const triggerSlope =  AQMD3_VAL_TRIGGER_SLOPE_POSITIVE;
+
+    // Fetch parameters, one marker and one sample stream per channel.
+    ViConstString sampleStreamNames[] = { "StreamCh1", "StreamCh2" };
+    ViConstString markerStreamNames[] = { "MarkersCh1", "MarkersCh2" };
+    ViInt64 const maxRecordsToFetchAtOnce = 4096;
+
+    int64_t const nbrSamplesPerElement = sizeof(int32_t) / sizeof(int16_t);
+    ViInt64 const nbrRecordElements = recordSize / nbrSamplesPerElement;
+    ViInt64 const maxAcquisitionElements = nbrRecordElements * maxRecordsToFetchAtOnce;
+    ViInt64 const maxMarkerElements = LibTool::StandardStreaming::NbrTriggerMarkerElements * maxRecordsToFetchAtOnce;
+
+    /* Reactor waits when no stream has data.
+       NOTE: Please tune according to your system input (trigger rate): the longest wait bounds the latency added to a batch.*/
+    Coroutines::Parameters const reactorParams = { std::chrono::microseconds(50), std::chrono::microseconds(2000) };
+
+    /* Delay estimation: largest delay searched (in samples) and peak interpolation. Records of a channel wait at most
+       maxPendingRecords records for their pair on the other channel.*/
+    TimeDelay::Parameters const delayParams = { 32, TimeDelay::Interpolation::Parabolic };
+    size_t const maxPendingRecords = 2 * maxRecordsToFetchAtOnce;
+
+    // Output file of the delays (CSV: record index, delay in samples, normalized correlation at the peak).
+    std::string const delayFileName("TimeDelays.csv");
+
+    // duration of the streaming session
+    auto const streamingDuration = seconds(60);
+}
+
+int main()
+{
+    cout << "Triggered Streaming on two channels with coroutines\n\n";
+
+    // Initialize the driver. See driver help topic "Initializing the IVI-C Driver" for additional information.
+    ViSession session = VI_NULL;
+    ViBoolean const idQuery = VI_FALSE;
+    ViBoolean const reset   = VI_FALSE;
+
+    try
+    {
+        checkApiCall( AqMD3_InitWithOptions( resource, idQuery, reset, options, &session ) );
+
+        cout << "\nDriver session initialized\n";
+
+        // Read and output a few attributes.
+        ViChar str[128];
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_PREFIX,               sizeof( str ), str ) );
+        cout << "Driver prefix:      " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_REVISION,             sizeof( str ), str ) );
+        cout << "Driver revision:    " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_VENDOR,               sizeof( str ), str ) );
+        cout << "Driver vendor:      " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_SPECIFIC_DRIVER_DESCRIPTION,          sizeof( str ), str ) );
+        cout << "Driver description: " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_MODEL,                     sizeof( str ), str ) );
+        cout << "Instrument model:   " << str << '\n';
+        std::string const instrumentModel(str);
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_INFO_OPTIONS,              sizeof( str ), str ) );
+        cout << "Instrument options: " << str << '\n';
+        std::string const options(str);
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_FIRMWARE_REVISION,         sizeof( str ), str ) );
+        cout << "Firmware revision:  " << str << '\n';
+        checkApiCall( AqMD3_GetAttributeViString( session, "", AQMD3_ATTR_INSTRUMENT_INFO_SERIAL_NUMBER_STRING, sizeof( str ), str ) );
+        cout << "Serial number:      " << str << '\n';
+        cout << '\n';
+
+        // Abort execution if instrument is still in simulated mode.
+        ViBoolean simulate;
+        checkApiCall( AqMD3_GetAttributeViBoolean( session, "", AQMD3_ATTR_SIMULATE, &simulate ) );
+        if( simulate==VI_TRUE )
+        {
+            cout << "\nThe Streaming features are not supported in simulated mode.\n";
+            cout << "Please update the resource string (resource[]) to match your configuration,";
+            cout << " and update the init options string (options[]) to disable simulation.\n";
+
+            AqMD3_close( session );
+
+            return 1;
+        }
+
+        if (options.find("CST") == std::string::npos)
+        {
+            cout << "The required CST module option is missing from the instrument.\n";
+
+            AqMD3_close(session);
+
+            return 1;
+        }
+
+        // Get timestamp period.
+        ViReal64 const timestampPeriod = GetTimestampPeriodForModel(instrumentModel);
+
+        // Configure the acquisition in triggered streaming mode.
+        cout << "Configuring Acquisition\n";
+        cout << "  Record size :        " << recordSize << '\n';
+        cout << "  SampleRate:          " << sampleRate << '\n';
+        checkApiCall( AqMD3_SetAttributeViInt32( session, "", AQMD3_ATTR_STREAMING_MODE, streamingMode) );
+        checkApiCall( AqMD3_SetAttributeViReal64( session, "", AQMD3_ATTR_SAMPLE_RATE, sampleRate ) );
+        checkApiCall( AqMD3_SetAttributeViInt32( session, "", AQMD3_ATTR_ACQUISITION_MODE, acquisitionMode ) );
+        checkApiCall( AqMD3_SetAttributeViInt64( session, "", AQMD3_ATTR_RECORD_SIZE, recordSize) );
+
+        // Configure the channels.
+        for (ViConstString channel : channels)
+        {
+            cout << "Configuring " << channel << "\n";
+            cout << "  Range:              " << range << '\n';
+            cout << "  Offset:             " << offset << '\n';
+            cout << "  Coupling:           " << ( coupling?"DC":"AC" ) << '\n';
+            checkApiCall( AqMD3_ConfigureChannel( session, channel, range, offset, coupling, VI_TRUE ) );
+        }
+
+        // Configure the trigger.
+        cout << "Configuring Trigger\n";
+        cout << "  ActiveSource:       " << triggerSource << '\n';
+        cout << "  Level:              " << triggerLevel << "\n";
+        cout << "  Slope:              " << (triggerSlope ? "Positive" : "Negative") << "\n";
+        checkApiCall( AqMD3_SetAttributeViString( session, "", AQMD3_ATTR_ACTIVE_TRIGGER_SOURCE, triggerSource ) );
+        checkApiCall( AqMD3_SetAttributeViReal64( session, triggerSource, AQMD3_ATTR_TRIGGER_LEVEL, triggerLevel ) );
+        checkApiCall( AqMD3_SetAttributeViInt32( session, triggerSource, AQMD3_ATTR_TRIGGER_SLOPE, triggerSlope ) );
+
+        // Calibrate the instrument.
+        cout << "\nApply setup and run self-calibration\n";
+        checkApiCall( AqMD3_ApplySetup( session ) );
+        checkApiCall( AqMD3_SelfCalibrate( session ) );
+
+        // Register the streams on the reactor, and spawn the processing of each channel. There is no unfolding overhead in dual channel mode.
+        Coroutines::StreamReactor reactor(reactorParams);
+        vector<ChannelStatistics> channelStatistics(2);
+        DelayEstimation delayEstimation = { TimeDelay::RecordPairer(recordSize, maxPendingRecords), TimeDelay::Estimator(delayParams), std::ofstream(delayFileName) };
+        delayEstimation.output << "record,delay,correlation\n";
+        for (size_t channel = 0; channel < 2; ++channel)
+        {
+            LibTool::StreamReading::Parameters sampleReaderParams;
+            sampleReaderParams.grainElements = LibTool::StreamReading::GetGrainElements(session, sampleStreamNames[channel]);
+            Coroutines::AsyncStream& sampleStream = reactor.AddStream(AqMD3_StreamFetchDataInt32, session, sampleStreamNames[channel], maxAcquisitionElements, sampleReaderParams, testApiCall);
+
+            LibTool::StreamReading::Parameters markerReaderParams;
+            markerReaderParams.grainElements = LibTool::StreamReading::GetGrainElements(session, markerStreamNames[channel]);
+            Coroutines::AsyncStream& markerStream = reactor.AddStream(AqMD3_StreamFetchDataInt32, session, markerStreamNames[channel], maxMarkerElements, markerReaderParams, testApiCall);
+
+            reactor.Spawn(ProcessChannel(channel, markerStream, sampleStream, timestampPeriod, channelStatistics[channel], delayEstimation));
+        }
+
+        // Start the acquisition.
+        cout << "\nInitiating acquisition\n";
+        checkApiCall( AqMD3_InitiateAcquisition( session ) );
+        cout << "Acquisition is running\n\n";
+
+        // Serve both channels from this thread for the duration of the session.
+        reactor.RunUntil(Coroutines::StreamReactor::Clock::now() + streamingDuration);
+
+        ViInt64 totalData = 0;
+        for (size_t channel = 0; channel < 2; ++channel)
+        {
+            ChannelStatistics const& statistics = channelStatistics[channel];
+            ViInt64 const channelData = (statistics.nbrSampleElements + statistics.nbrMarkerElements) * sizeof(ViInt32);
+            cout << "\n" << channels[channel] << '\n';
+            cout << "  Records:            " << statistics.nbrRecords << '\n';
+            cout << "  Data read:          " << (channelData/(1024*1024)) << " MBytes\n";
+            cout << "  Sample range:       [" << statistics.minSample << ", " << statistics.maxSample << "]\n";
+            totalData += channelData;
+        }
+        cout << "\nDuration: " << (streamingDuration/seconds(1)) << " seconds.\n";
+        cout << "Data rate: " << (totalData)/(1024*1024)/(streamingDuration/seconds(1)) << " MB/s.\n";
+        reactor.GetStatistics().Print(cout);
+
+        delayEstimation.output.close();
+        delayEstimation.estimator.GetStatistics().Print(cout, sampleRate);
+        cout << "  Unmatched records:  " << delayEstimation.pairer.GetNbrUnmatched() << " (peak " << delayEstimation.pairer.GetPeakPending() << " pending)\n";
+        cout << "  Delays saved to " << delayFileName << '\n';
+
+        // Stop the acquisition.
+        cout << "\nStopping acquisition\n";
+        checkApiCall( AqMD3_Abort( session ) );
+
+        // Close the session.
+        checkApiCall( AqMD3_close( session ) );
+        cout << "\nDriver session closed\n";
+        return 0;
+    }
+    catch (std::exception const& exc)
+    {
+        std::cerr << "Unexpected error: " << exc.what() << std::endl;
+
+        if (session != VI_NULL)
+        {
+            // Abort any ongoing acquisition
+            ViInt32 acqStatus = AQMD3_VAL_ACQUISITION_STATUS_RESULT_TRUE;
+            if ( VI_SUCCESS != AqMD3_IsIdle( session, &acqStatus ) )
+                cerr << "Failed to read acquisition status\n";
+            else if (acqStatus != AQMD3_VAL_ACQUISITION_STATUS_RESULT_TRUE)
+            {
+                if ( VI_SUCCESS != AqMD3_Abort( session ) )
+                    cerr << "Failed to abort the acquisition\n";
+            }
+
+            // close the instrument
+            if ( VI_SUCCESS != AqMD3_close( session ) )
+                cerr << "Failed to close the instrument\n";
+        }
+
+        cout << "\nException handling complete.\n";
+
+        return(1);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Definition of local functions
+//
+
+// Utility function to check status error during driver API call.
+void testApiCall( ViStatus status, char const * functionName )
+{
+    ViInt32 ErrorCode;
+    ViChar ErrorMessage[512];
+
+    if( status>0 ) // Warning occurred.
+    {
+        AqMD3_GetError( VI_NULL, &ErrorCode, sizeof( ErrorMessage ), ErrorMessage );
+        cerr << "** Warning during " << functionName << ": 0x" << hex << ErrorCode << ", " << ErrorMessage << '\n';
+    }
+    else if( status<0 ) // Error occurred.
+    {
+        AqMD3_GetError( VI_NULL, &ErrorCode, sizeof( ErrorMessage ), ErrorMessage );
+        cerr << "** ERROR during " << functionName << ": 0x" << hex << ErrorCode << ", " << ErrorMessage << '\n';
+        throw runtime_error( ErrorMessage );
+    }
+}
+
+Coroutines::Task ProcessChannel(size_t channel, Coroutines::AsyncStream& markerStream, Coroutines::AsyncStream& sampleStream, double timestampPeriod, ChannelStatistics& statistics,
+                                DelayEstimation& delayEstimation)
+{
+    double minXtime = 0.0; // InitialXTime is the time of the very first sample in the record.
+    ViInt64 expectedRecordIndex = 0;
+
+    for (;;)
+    {
+        // Await the markers of the records available, then all the samples of those records.
+        LibTool::ArraySegment<int32_t> markerArraySegment = co_await markerStream.NextBatch(LibTool::StandardStreaming::NbrTriggerMarkerElements, LibTool::StandardStreaming::NbrTriggerMarkerElements);
+        statistics.nbrMarkerElements += markerArraySegment.Size();
+
+        int64_t const numAvailableRecords = int64_t(markerArraySegment.Size() / LibTool::StandardStreaming::NbrTriggerMarkerElements);
+
+        LibTool::ArraySegment<int32_t> sampleArraySegment = co_await sampleStream.NextExact(numAvailableRecords*nbrRecordElements);
+        statistics.nbrSampleElements += sampleArraySegment.Size();
+
+        // Process acquired records
+        for (int64_t i = 0; i < numAvailableRecords; ++i)
+        {
+            // 1. decode trigger marker from marker stream
+            LibTool::TriggerMarker const nextTriggerMarker = LibTool::StandardStreaming::DecodeTriggerMarker(markerArraySegment);
+
+            // 2. Validate marker consistency: tag, incrementing record index, increasing xtime.
+            if (LibTool::MarkerTag::TriggerNormal != nextTriggerMarker.tag)
+                throw std::runtime_error("Unexpected trigger marker tag on " + markerStream.GetStreamName() + ": got " + ToString(int(nextTriggerMarker.tag)) + ", expected " + ToString(int(LibTool::MarkerTag::TriggerNormal)));
+
+            if ((expectedRecordIndex & LibTool::TriggerMarker::RecordIndexMask) != nextTriggerMarker.recordIndex)
+                throw std::runtime_error("Unexpected record index on " + markerStream.GetStreamName() + ": expected=" + ToString(expectedRecordIndex) + ", got " + ToString(nextTriggerMarker.recordIndex));
+
+            ViReal64 const xtime = nextTriggerMarker.GetInitialXTime(timestampPeriod);
+            if (xtime <= minXtime)
+                throw std::runtime_error("InitialXTime not increasing on " + markerStream.GetStreamName() + ": minimum expected=" + ToString(minXtime) + ", got " + ToString(xtime));
+
+            // 3. Reduce the samples of the record.
+            int16_t const* sampleArray = reinterpret_cast<int16_t const*>(sampleArraySegment.GetData());
+            for (int64_t j = 0; j < recordSize; ++j)
+            {
+                statistics.minSample = std::min(statistics.minSample, sampleArray[j]);
+                statistics.maxSample = std::max(statistics.maxSample, sampleArray[j]);
+            }
+
+            // 3.1 estimate the delay between the channels once the record of the other channel is there too.
+            delayEstimation.pairer.Add(channel, uint64_t(expectedRecordIndex), sampleArray, [&](uint64_t recordIndex, int16_t const* first, int16_t const* second)
+            {
+                TimeDelay::DelayEstimate const estimate = delayEstimation.estimator.Estimate(recordIndex, first, second, recordSize);
+                delayEstimation.output << recordIndex << ',' << estimate.delay << ',' << estimate.correlation << '\n';
+            });
+
+            // 3.2 remove record elements from the segment and advance to elements of the next record
+            sampleArraySegment.PopFront(nbrRecordElements);
+
+            ++statistics.nbrRecords;
+            ++expectedRecordIndex;
+            minXtime = xtime;
+        }
+    }
+}
+
+ViReal64 GetTimestampPeriodForModel(std::string const& model)
+{
+    if (model == "SA220P" || model == "SA220E")
+        return 500e-12;
+    else if (model == "SA230P" || model == "SA230E")
+        return 250e-12;
+    else if (model == "SA240P" || model == "SA240E")
+        return 250e-12;
+    else if (model == "SA217P" || model == "SA217E")
+        return 250e-12;
+    else if (model == "SA248P" || model == "SA248E")
+        return 125e-12;
+    else
+        throw std::invalid_argument("Cannot deduce timestamp period for instrument: " + model);
+}
@@ -11,7 +11,10 @@
 ///
 
 #include "../../include/LibTool.h"
+#include "../../include/StreamBatchReader.h"
+#include "../../include/ZeroSuppressTuning.h"
 using namespace LibTool::ZeroSuppress;
+namespace ZeroSuppressTuning = LibTool::ZeroSuppressTuning;
 using LibTool::ToString;
 #include "AqMD3.h"
 
@@ -35,8 +38,6 @@ using std::this_thread::sleep_for;
 #include <algorithm>
 
 
-typedef std::vector<int32_t> FetchBuffer;
-
 #define checkApiCall( f ) do { ViStatus s = f; testApiCall( s, #f ); } while( false )
 void testApiCall( ViStatus status, char const * functionName);
 
@@ -46,32 +47,12 @@ ViInt16 GetSample(LibTool::ArraySegment<int32_t> const& sampleBuffer, int64_t in
 //! Unpack the gates of a record described by descriptor 'recordDesc' into 'output'.
 void UnpackRecord(RecordDescriptor const& recordDesc, LibTool::ArraySegment<int32_t> const& sampleBuffer, ProcessingParameters const& processingParams, std::ostream& output);
 
-//! Fetch all elements available on module for stream streamName.
-/*! The resulting array segment might be empty if no data are available on module.
-     \param[in] session: session handle associated with the instrument to read from.
-     \param[in] streamName: the stream identifier to read from.
-     \param[in] maxElementsToFetch: the maximum number of elements to read.
-     \param[in] buffer: buffer used by fetch for read operation.
-     \return the array-segment delimiting actual valid data returned by the instrument. The segment might be empty if no data has been read.*/
-LibTool::ArraySegment<int32_t> FetchAvailableElements(ViSession session, ViConstString streamName, ViInt64 maxElementsToFetch, FetchBuffer& buffer);
-
-//! Perform a fetch of exact 'nbrElementsToFetch' elements into the given fetch "buffer".
-/*! This is a wrapper for low-level function #AqMD3_StreamFetchDataInt32 which adds the following:
-      - Return an array-segment to delimit the fetched elements in user-provided buffer.
-      - Handle the case where the user request to fetch 0 elements from the stream by returning an empty array-segment. This might be useful when
-        all the samples of a record are suppressed (i.e. nothing to read from sample stream).
-      - Check the consistency of returned
-    \param[in] session: session handle associated with the instrument to read from.
-    \param[in] streamName: the stream identifier to read from.
-    \param[in] nbrElementsToFetch: the number of elements to read.
-    \param[in] buffer: buffer used by fetch for read operation.
-    \return the array-segment delimiting actual valid data returned by the instrument. The segment might be empty if no data has been read.
-    \throw #std::runtime_error when the buffer size is too small for the requested fetch, or the number fetched elements is different than requested.*/
-LibTool::ArraySegment<int32_t> FetchElements(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, FetchBuffer& buffer);
-
 //! Return the processing parameters for the given instrument model.
 ProcessingParameters GetProcessingParametersForModel(std::string const& instrumentModel);
 
+//! Stream a calibration window without data reduction, and return the ZeroSuppress settings recommended for its noise.
+ZeroSuppressTuning::Recommendation CalibrateZeroSuppress(ViSession session, ProcessingParameters const& processingParams);
+
 // name-space gathering all user-configurable parameters
 namespace
 {
@@ -94,11 +75,25 @@ namespace
     ViReal64 const channelOffset = 0.0;
     ViInt32 const coupling = AQMD3_VAL_VERTICAL_COUPLING_DC;
 
-    // Channel ZeroSuppress configuration parameters
-    ViInt32 const zsThreshold = 0;
-    ViInt32 const zsHysteresis = 300;
-    ViInt32 const zsPreGateSamples = 0;
-    ViInt32 const zsPostGateSamples = 0;
+    // Channel ZeroSuppress configuration parameters (replaced by the calibration when applied)
+    ViInt32 zsThreshold = 0;
+    ViInt32 zsHysteresis = 300;
+    ViInt32 zsPreGateSamples = 0;
+    ViInt32 zsPostGateSamples = 0;
+
+    /* ZeroSuppress calibration (optional): a window is first streamed without data reduction to measure the baseline and noise of
+       the channel, and to recommend the settings opening zsTargetFalseGateRate gates per second on noise. The recommendation
+       replaces the settings above only if zsApplyRecommendation is set.
+       NOTE: the calibration window should hold no pulse (or very few), their edges are accounted as noise crossings.*/
+    bool const zsCalibrationEnabled = false;
+    bool const zsApplyRecommendation = false;
+    milliseconds const zsCalibrationDuration = milliseconds(500);
+    ViReal64 const zsTargetFalseGateRate = 10.0;        // gates opened by noise per second
+    ViReal64 const zsTargetStopSigmas = 2.0;            // gate closing level, in noise deviations above the baseline
+    ViInt32 const zsTargetPreGateSamples = 16;
+    ViInt32 const zsTargetPostGateSamples = 32;
+    ViReal64 const expectedPulseRate = 1.0e4;           // expected pulses per second, for the data rate prediction
+    ViReal64 const expectedPulseGateSamples = 32.0;     // expected samples of a pulse above the gate closing level
 
     // Trigger configuration
     ViConstString triggerSource = "Internal1";
@@ -239,20 +234,43 @@ int main()
         cout << "Firmware revision:  " << str << '\n';
         checkApiCall( AqMD3_SelfCalibrate(session) );
 
-        // Prepare readout buffers
-        ViInt64 sampleStreamGrain = 0;
-        ViInt64 markerStreamGrain = 0;
-        checkApiCall( AqMD3_GetAttributeViInt64( session, sampleStreamName , AQMD3_ATTR_STREAM_GRANULARITY_IN_BYTES, &sampleStreamGrain) );
-        checkApiCall( AqMD3_GetAttributeViInt64( session, markerStreamName , AQMD3_ATTR_STREAM_GRANULARITY_IN_BYTES, &markerStreamGrain) );
+        // Calibrate the ZeroSuppress settings on the noise of the channel, without data reduction.
+        if (zsCalibrationEnabled)
+        {
+            cout << "\nCalibrating ZeroSuppress for " << zsCalibrationDuration.count() << " ms\n";
+            checkApiCall( AqMD3_SetAttributeViInt32( session, "", AQMD3_ATTR_ACQUISITION_DATA_REDUCTION_MODE, AQMD3_VAL_ACQUISITION_DATA_REDUCTION_MODE_DISABLED) );
+            checkApiCall( AqMD3_ApplySetup( session ) );
+            ZeroSuppressTuning::Recommendation const recommendation = CalibrateZeroSuppress(session, GetProcessingParametersForModel(instrumentModel));
+            recommendation.Print(cout);
+
+            if (zsApplyRecommendation)
+            {
+                zsThreshold = recommendation.threshold;
+                zsHysteresis = recommendation.hysteresis;
+                zsPreGateSamples = recommendation.preGateSamples;
+                zsPostGateSamples = recommendation.postGateSamples;
+
+                cout << "Applying the recommended ZeroSuppress settings\n";
+                checkApiCall( AqMD3_SetAttributeViInt32( session, channel, AQMD3_ATTR_CHANNEL_ZERO_SUPPRESS_HYSTERESIS, zsHysteresis) );
+                checkApiCall( AqMD3_SetAttributeViInt32( session, channel, AQMD3_ATTR_CHANNEL_ZERO_SUPPRESS_THRESHOLD, zsThreshold) );
+                checkApiCall( AqMD3_SetAttributeViInt32( session, channel, AQMD3_ATTR_CHANNEL_ZERO_SUPPRESS_PRE_GATE_SAMPLES, zsPreGateSamples) );
+                checkApiCall( AqMD3_SetAttributeViInt32( session, channel, AQMD3_ATTR_CHANNEL_ZERO_SUPPRESS_POST_GATE_SAMPLES, zsPostGateSamples) );
+            }
+
+            checkApiCall( AqMD3_SetAttributeViInt32( session, "", AQMD3_ATTR_ACQUISITION_DATA_REDUCTION_MODE, dataReductionMode) );
+            checkApiCall( AqMD3_ApplySetup( session ) );
+        }
 
-        ViInt64 const markerStreamGrainElements = markerStreamGrain / sizeof(ViInt32);
-        ViInt64 const sampleStreamGrainElements = sampleStreamGrain / sizeof(ViInt32);
-        ViInt64 const markerBufferSize = nbrMarkerElementsToFetch /*buffer size*/ + (markerStreamGrainElements - 1) /* alignment overhead */;
-        ViInt64 const sampleBufferSize = nbrAcquisitionElements          /* useful buffer size */
-                                       + (sampleStreamGrainElements - 1) /* alignment overhead */;
+        // Prepare the stream readers, they own the readout buffers.
+        LibTool::StreamReading::Parameters markerReaderParams;
+        markerReaderParams.grainElements = LibTool::StreamReading::GetGrainElements(session, markerStreamName);
+        markerReaderParams.verbose = true;
+        LibTool::StreamReading::StreamBatchReader<> markerReader(AqMD3_StreamFetchDataInt32, session, markerStreamName, nbrMarkerElementsToFetch, markerReaderParams, testApiCall);
 
-        FetchBuffer markerStreamBuffer((size_t)markerBufferSize);
-        FetchBuffer sampleStreamBuffer((size_t)sampleBufferSize);
+        LibTool::StreamReading::Parameters sampleReaderParams;
+        sampleReaderParams.grainElements = LibTool::StreamReading::GetGrainElements(session, sampleStreamName);
+        sampleReaderParams.verbose = true;
+        LibTool::StreamReading::StreamBatchReader<> sampleReader(AqMD3_StreamFetchDataInt32, session, sampleStreamName, nbrAcquisitionElements, sampleReaderParams, testApiCall);
 
         // processing parameters
         ProcessingParameters const processingParams = GetProcessingParametersForModel(instrumentModel);
@@ -295,7 +313,7 @@ int main()
             while((system_clock::now() < endTime) && (markerStreamDecoder.GetAvailableRecordCount() == 0))
             {
                 // process all the available data without waiting again.
-                LibTool::ArraySegment<int32_t> markerArraySegment = FetchAvailableElements(session, markerStreamName, nbrMarkerElementsToFetch, markerStreamBuffer);
+                LibTool::ArraySegment<int32_t> markerArraySegment = markerReader.FetchAvailable();
                 totalMarkerElements += markerArraySegment.Size();
 
                 // If the fetch fails to read data, then wait before a new attempt.
@@ -330,7 +348,7 @@ int main()
             int64_t const totalSampleElementCount = storedSampleCount / nbrSamplesPerElement;
 
             // fetch samples associated with all records at once
-            LibTool::ArraySegment<int32_t> sampleArraySegment = FetchElements(session, sampleStreamName, totalSampleElementCount, sampleStreamBuffer);
+            LibTool::ArraySegment<int32_t> sampleArraySegment = sampleReader.FetchExact(totalSampleElementCount);
             totalSampleElements += sampleArraySegment.Size();
 
             // iterate over record descriptors, check consistency of markers and save data into file.
@@ -493,71 +511,72 @@ void UnpackRecord(
     output << "actual record size: " << actualRecordSize << "\n\n";
 }
 
-LibTool::ArraySegment<int32_t> FetchAvailableElements(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, FetchBuffer& buffer)
-{
-    int32_t* bufferData = buffer.data();
-    ViInt64 const bufferSize = buffer.size();
-
-    if (bufferSize < nbrElementsToFetch)
-        throw std::invalid_argument("Buffer size is smaller than the requested elements to fetch");
-
-    ViInt64 firstValidElement = 0;
-    ViInt64 actualElements = 0;
-    ViInt64 remainingElements = 0;
-
-    // Try to fetch the requested volume of elements.
-    checkApiCall(AqMD3_StreamFetchDataInt32(session, streamName, nbrElementsToFetch, bufferSize, (ViInt32*)bufferData, &remainingElements, &actualElements, &firstValidElement));
-
-    if ((actualElements == 0) && (remainingElements > 0))
-    {
-        /* Fetch failed to read data because the number of available elements is smaller than the requested volume.*/
-
-        // Check that the number of available elements is smaller than requested
-        if (nbrElementsToFetch <= remainingElements)
-            throw std::logic_error("First fetch failed to read " + ToString(nbrElementsToFetch) + " elements when it reports " + ToString(remainingElements) + " available elements.");
-
-        // Read available elements
-        checkApiCall(AqMD3_StreamFetchDataInt32(session, streamName, remainingElements, bufferSize, (ViInt32*)bufferData, &remainingElements, &actualElements, &firstValidElement));
-    }
-
-    if (actualElements > 0)
-    {
-        std::cout << "\nFetched " << actualElements << " elements from " << streamName << " stream. Remaining elements: " << remainingElements << "\n";
-    }
-
-    // this buffer might be empty if fetch failed to read actual data.
-    return LibTool::ArraySegment<int32_t>(buffer, (size_t)firstValidElement, (size_t)actualElements);
-}
-
-LibTool::ArraySegment<int32_t> FetchElements(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, FetchBuffer& buffer)
+ZeroSuppressTuning::Recommendation CalibrateZeroSuppress(ViSession session, ProcessingParameters const& processingParams)
 {
-    // Handle the special case there is no need to fetch elements (this might happen when all samples are suppressed) by returning an empty array segment
-    if (nbrElementsToFetch == 0)
-        return LibTool::ArraySegment<int32_t>(buffer, 0, 0);
-
-    int32_t* bufferData = buffer.data();
-    ViInt64 const bufferSize = buffer.size();
-
-    if (bufferSize < nbrElementsToFetch)
-        throw std::invalid_argument("Buffer size is smaller than the requested elements to fetch");
-
-    ViInt64 firstElement = 0;
-    ViInt64 actualElements = 0;
-    ViInt64 remainingElements = 0;
-
-    // Try to fetch the requested volume of elements.
-    checkApiCall(AqMD3_StreamFetchDataInt32(session, streamName, nbrElementsToFetch, bufferSize, (ViInt32*)bufferData, &remainingElements, &actualElements, &firstElement));
-
-    // if fetched data volume is equal to the requested, there is no thing else to do.
-    if (nbrElementsToFetch != actualElements)
-    {
-        throw std::runtime_error("Number of fetched elements is different than requested. Requested=" + ToString(nbrElementsToFetch) + " , fetched=" + ToString(actualElements) + ".");
-    }
-    else
+    // Without data reduction, every record is described by one trigger marker, and holds recordSize samples.
+    LibTool::StreamReading::Parameters markerReaderParams;
+    markerReaderParams.grainElements = LibTool::StreamReading::GetGrainElements(session, markerStreamName);
+    LibTool::StreamReading::StreamBatchReader<> markerReader(AqMD3_StreamFetchDataInt32, session, markerStreamName, maxRecordsToProcessAtOnce * 16, markerReaderParams, testApiCall);
+
+    LibTool::StreamReading::Parameters sampleReaderParams;
+    sampleReaderParams.grainElements = LibTool::StreamReading::GetGrainElements(session, sampleStreamName);
+    LibTool::StreamReading::StreamBatchReader<> sampleReader(AqMD3_StreamFetchDataInt32, session, sampleStreamName, nbrAcquisitionElements, sampleReaderParams, testApiCall);
+
+    MarkerStreamDecoder markerStreamDecoder(MarkerStreamDecoder::Mode::Normal);
+    ZeroSuppressTuning::NoiseHistogram histogram;
+    int64_t nbrRecords = 0;
+    LibTool::TriggerMarker firstTrigger;
+    LibTool::TriggerMarker lastTrigger;
+
+    checkApiCall( AqMD3_InitiateAcquisition( session ) );
+    auto const startTime = system_clock::now();
+    auto const endTime = startTime + zsCalibrationDuration;
+    while (system_clock::now() < endTime)
     {
-        std::cout << "\nFetched " << actualElements << " elements from " << streamName << " stream. Remaining elements: " << remainingElements << "\n";
-        return LibTool::ArraySegment<int32_t>(buffer, size_t(firstElement), size_t(actualElements));
+        LibTool::ArraySegment<int32_t> markerArraySegment = markerReader.FetchAvailable();
+        if (markerArraySegment.Size() == 0 && markerStreamDecoder.GetAvailableRecordCount() == 0)
+        {
+            sleep_for(milliseconds(10));
+            continue;
+        }
+        while (markerArraySegment.Size() > 0)
+            markerStreamDecoder.DecodeNextMarker(markerArraySegment);
+
+        ViInt64 const nbrRecordsToProcess = std::min(maxRecordsToProcessAtOnce, int64_t(markerStreamDecoder.GetAvailableRecordCount()));
+        if (nbrRecordsToProcess == 0)
+            continue;
+
+        std::vector<RecordDescriptor> const recordDescriptorList = markerStreamDecoder.Take(int(nbrRecordsToProcess));
+        if (nbrRecords == 0)
+            firstTrigger = recordDescriptorList.front().GetTriggerMarker();
+        lastTrigger = recordDescriptorList.back().GetTriggerMarker();
+
+        LibTool::ArraySegment<int32_t> const sampleArraySegment = sampleReader.FetchExact(nbrRecordsToProcess * recordSize / nbrSamplesPerElement);
+        int16_t const* const samples = reinterpret_cast<int16_t const*>(sampleArraySegment.GetData());
+        for (int64_t record = 0; record < nbrRecordsToProcess; ++record)
+            histogram.Add(samples + record * recordSize, size_t(recordSize));
+        nbrRecords += nbrRecordsToProcess;
     }
+    checkApiCall( AqMD3_Abort( session ) );
+
+    // The record rate of the acquisition, from the timestamps of the markers: the host may process the window slower than it is acquired.
+    uint32_t const recordIndexSpan = (lastTrigger.recordIndex - firstTrigger.recordIndex) & LibTool::TriggerMarker::RecordIndexMask;
+    double const acquisitionSeconds = lastTrigger.GetInitialXTime(processingParams.timestampPeriod) - firstTrigger.GetInitialXTime(processingParams.timestampPeriod);
+    if (recordIndexSpan == 0 || !(acquisitionSeconds > 0.0))
+        throw std::runtime_error("ZeroSuppress calibration window too short: " + ToString(nbrRecords) + " record(s) processed");
+    double const recordRate = double(recordIndexSpan) / acquisitionSeconds;
+
+    ZeroSuppressTuning::NoiseStatistics const noise = ZeroSuppressTuning::Analyze(histogram, sampleRate);
+    noise.Print(cout);
+
+    ZeroSuppressTuning::Target target;
+    target.falseGateRate = zsTargetFalseGateRate;
+    target.stopSigmas = zsTargetStopSigmas;
+    target.preGateSamples = zsTargetPreGateSamples;
+    target.postGateSamples = zsTargetPostGateSamples;
+    target.pulseRate = expectedPulseRate;
+    target.pulseGateSamples = expectedPulseGateSamples;
+    return ZeroSuppressTuning::Recommend(noise, histogram, target, processingParams, recordRate, recordSize);
 }
 
 ProcessingParameters GetProcessingParametersForModel(std::string const& model)
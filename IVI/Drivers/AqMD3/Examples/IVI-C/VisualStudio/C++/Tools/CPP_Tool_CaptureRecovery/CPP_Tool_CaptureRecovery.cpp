@@ -0,0 +1,99 @@
+///
+/// Acqiris IVI-C Driver Capture Recovery Tool
+///
+/// Recovers a segmented raw capture (as written by the streaming example with raw capture enabled)
+/// after a crash. The segments closed before the crash are listed in the manifest (prefix.manifest);
+/// the segment being written is not. The tool truncates the first segment missing from the manifest,
+/// its record index (".idx") and its journal (".jnl") to the last group commit whose data and records
+/// match the checksums of the journal, then appends the segment to the manifest with the record and
+/// timestamp ranges recovered. A capture closed cleanly is left untouched, and so is the manifest
+/// when no record is recovered (e.g. the segment prepared ahead of the one written at the crash).
+///
+/// Usage: CPP_Tool_CaptureRecovery [capture-prefix] [--no-verify]
+///
+/// With --no-verify, only the journal entries are checked, not the data they describe: recovery
+/// then takes seconds instead of a full read of the segment. The exit code is 2 when data were
+/// discarded.
+///
+
+#include "../../include/LibTool.h"
+#include "../../include/CaptureFile.h"
+#include "../../include/CaptureSegments.h"
+namespace Capture = LibTool::Capture;
+
+#include <iostream>
+using std::cout;
+using std::cerr;
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+// name-space gathering all user-configurable parameters
+namespace
+{
+    std::string capturePrefix("Streaming");
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        bool verifyData = true;
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string const argument(argv[i]);
+            if (argument == "--no-verify")
+                verifyData = false;
+            else
+                capturePrefix = argument;
+        }
+
+        std::string const manifestPath = capturePrefix + ".manifest";
+        cout << "Capture recovery (" << manifestPath << ")\n";
+        cout << "  Data verification:  " << (verifyData ? "on" : "off") << '\n';
+
+        // Segments are closed, and listed, in order: the first number not listed is the segment written at the time of the crash.
+        std::vector<Capture::SegmentInfo> const segments = Capture::SegmentedCapture::LoadManifest(manifestPath);
+        uint64_t number = 0;
+        while (std::any_of(segments.begin(), segments.end(), [number](Capture::SegmentInfo const& info) { return info.segment == number; }))
+            ++number;
+
+        std::string const segmentPath = Capture::SegmentedCapture::GetSegmentPath(capturePrefix, number);
+        cout << "  Listed segments:    " << segments.size() << '\n';
+        if (!std::ifstream(segmentPath))
+        {
+            cout << "\nNo segment missing from the manifest (" << segmentPath << " does not exist)\n";
+            return 0;
+        }
+
+        cout << "  Missing segment:    " << segmentPath << '\n';
+        Capture::RecoveryReport const report = Capture::Recover(segmentPath, verifyData);
+        report.Print(cout);
+
+        bool const dataDiscarded = report.nbrDiscardedEntries > 0 || report.nbrDiscardedRecords > 0;
+        if (report.nbrRecords == 0)
+        {
+            cout << "\nNo record recovered, " << manifestPath << " left unchanged\n";
+            return dataDiscarded ? 2 : 0;
+        }
+
+        Capture::SegmentInfo info;
+        info.segment = number;
+        info.path = segmentPath;
+        info.firstRecordIndex = report.firstRecordIndex;
+        info.nbrRecords = report.nbrRecords;
+        info.firstTimestamp = report.firstTimestamp;
+        info.lastTimestamp = report.lastTimestamp;
+        info.committedBytes = report.recordDataBytes;
+        Capture::SegmentedCapture::AppendManifest(manifestPath, info);
+        cout << "\nSegment " << number << " appended to " << manifestPath << '\n';
+        return dataDiscarded ? 2 : 0;
+    }
+    catch (std::exception const& exc)
+    {
+        cerr << "Unexpected error: " << exc.what() << std::endl;
+        return 1;
+    }
+}
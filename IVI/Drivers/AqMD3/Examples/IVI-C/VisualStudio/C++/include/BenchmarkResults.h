@@ -0,0 +1,490 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// BenchmarkResults: persistent benchmark results (JSON-lines) and statistical comparison.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_BENCHMARKRESULTS_H
+#define LIBTOOL_BENCHMARKRESULTS_H
+
+#include "LibTool.h"
+#include "Distributions.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace LibTool
+{
+    //! Benchmark results persistence and comparison.
+    /*! Each benchmark run appends one JSON object per line to a results file. Every line holds the format version, the benchmark
+        name, the environment (git revision, CPU model, compiler) and the measurements of all repetitions:
+
+            {"format":1,"benchmark":"decode.trigger","unit":"Mitems/s","better":"higher","revision":"1a2b3c4",
+             "cpu":"...","compiler":"...","timestamp":"2026-01-01T00:00:00Z","samples":[12.5,12.7,12.4]}
+
+        Lines with an unknown format version are ignored by the loader, so the file can be kept across versions.*/
+    namespace Benchmark
+    {
+        static int const ResultFormatVersion = 1;
+
+        //! Describe the environment a result was measured in.
+        struct Environment
+        {
+            std::string revision;   //!< git revision of the sources.
+            std::string cpu;        //!< CPU model name.
+            std::string compiler;   //!< compiler name and version.
+
+            //! Return the environment of the running executable.
+            static Environment Detect();
+
+            //! Return a key identifying the measurement platform (CPU and compiler), used to group comparable results.
+            std::string GetPlatformKey() const { return cpu + " | " + compiler; }
+        };
+
+        //! Represent the measurements of one benchmark.
+        struct Result
+        {
+            std::string benchmark;          //!< benchmark name, e.g. "decode.trigger".
+            std::string unit;               //!< unit of samples, e.g. "MB/s".
+            bool higherIsBetter = true;     //!< tell whether a higher value is an improvement.
+            Environment environment;        //!< environment the result was measured in.
+            std::string timestamp;          //!< UTC time of the measurement (ISO-8601).
+            std::vector<double> samples;    //!< one value per repetition.
+
+            //! Return the mean of samples.
+            double GetMean() const;
+            //! Return the (unbiased) standard deviation of samples.
+            double GetStdDev() const;
+
+            //! Serialize the result as a single JSON line (without end-of-line).
+            std::string ToJson() const;
+            //! Parse a line produced by #ToJson. Return false if the line is not a supported result.
+            static bool FromJson(std::string const& line, Result& result);
+        };
+
+        //! Append #result to the JSON-lines file at #path (created if missing).
+        void AppendResult(std::string const& path, Result const& result);
+
+        //! Load all supported results from the JSON-lines file at #path.
+        std::vector<Result> LoadResults(std::string const& path);
+
+        //! Outcome of the comparison of two results of the same benchmark.
+        struct Comparison
+        {
+            double relativeChange = 0.0;    //!< (candidate - baseline) / baseline, on means.
+            double lowerBound = 0.0;        //!< lower bound of the confidence interval of relative change.
+            double upperBound = 0.0;        //!< upper bound of the confidence interval of relative change.
+            bool isSignificant = false;     //!< confidence interval excludes zero.
+            bool isRegression = false;      //!< significant and worse than #threshold.
+        };
+
+        //! Compare #candidate against #baseline with Welch's t confidence interval on the difference of means.
+        /*! \param[in] confidence: the confidence level of the interval, e.g. 0.99.
+            \param[in] threshold: minimum relative slowdown to be reported as regression, e.g. 0.02 for 2%.*/
+        Comparison Compare(Result const& baseline, Result const& candidate, double confidence, double threshold);
+
+        //! Prevent the compiler from optimizing away a computed value.
+        template <typename T>
+        inline void DoNotOptimize(T const& value)
+        {
+            static char volatile sink = 0;
+            sink = static_cast<char>(sink + *reinterpret_cast<char const volatile*>(&value));
+        }
+
+        //! Run #body #repetitions times (plus one warm-up run) and return a result holding throughputs.
+        /*! \param[in] body: the measured function. It returns the number of items it processed.
+            \param[in] unitScale: items per second are divided by this value (e.g. 1e6 with unit "Mitems/s").*/
+        Result Run(std::string const& name, std::string const& unit, double unitScale, int repetitions, std::function<double()> const& body);
+
+
+        ///////////////////////////////////////////////////////////////////////////
+        //
+        // Environment member definitions
+        //
+
+        inline Environment Environment::Detect()
+        {
+            Environment env;
+
+#if defined(BENCHMARK_GIT_REVISION)
+            env.revision = BENCHMARK_GIT_REVISION;
+#else
+            // Ask git for the revision of the working directory, the executable is expected to run from the source tree.
+#if defined(_WIN32)
+            FILE* pipe = _popen("git describe --always --dirty 2>NUL", "r");
+#else
+            FILE* pipe = popen("git describe --always --dirty 2>/dev/null", "r");
+#endif
+            if (pipe != nullptr)
+            {
+                char buffer[128] = {};
+                if (fgets(buffer, sizeof(buffer), pipe) != nullptr)
+                    env.revision = buffer;
+#if defined(_WIN32)
+                _pclose(pipe);
+#else
+                pclose(pipe);
+#endif
+            }
+            while (!env.revision.empty() && (env.revision.back() == '\n' || env.revision.back() == '\r'))
+                env.revision.pop_back();
+#endif
+            if (env.revision.empty())
+                env.revision = "unknown";
+
+            // CPU brand string from extended cpuid leaves.
+            char brand[49] = {};
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+            int regs[4] = {};
+            __cpuid(regs, 0x80000000);
+            if (unsigned(regs[0]) >= 0x80000004u)
+            {
+                for (int leaf = 0; leaf < 3; ++leaf)
+                {
+                    __cpuid(regs, 0x80000002 + leaf);
+                    std::memcpy(brand + 16 * leaf, regs, sizeof(regs));
+                }
+            }
+#elif defined(__x86_64__) || defined(__i386__)
+            unsigned int regs[4] = {};
+            if (__get_cpuid(0x80000000, &regs[0], &regs[1], &regs[2], &regs[3]) && regs[0] >= 0x80000004u)
+            {
+                for (unsigned int leaf = 0; leaf < 3; ++leaf)
+                {
+                    __get_cpuid(0x80000002 + leaf, &regs[0], &regs[1], &regs[2], &regs[3]);
+                    std::memcpy(brand + 16 * leaf, regs, sizeof(regs));
+                }
+            }
+#endif
+            env.cpu = brand;
+            env.cpu.erase(0, env.cpu.find_first_not_of(' '));
+            if (env.cpu.empty())
+                env.cpu = "unknown";
+
+#if defined(__clang__)
+            env.compiler = std::string("clang ") + __clang_version__;
+#elif defined(_MSC_VER)
+            env.compiler = "MSVC " + ToString(_MSC_FULL_VER);
+#elif defined(__GNUC__)
+            env.compiler = std::string("gcc ") + __VERSION__;
+#else
+            env.compiler = "unknown";
+#endif
+            return env;
+        }
+
+        ///////////////////////////////////////////////////////////////////////////
+        //
+        // JSON helpers (restricted to the flat objects written by this file)
+        //
+
+        namespace Detail
+        {
+            inline std::string EscapeJson(std::string const& value)
+            {
+                std::string result;
+                for (char c : value)
+                {
+                    if (c == '"' || c == '\\')
+                        result += '\\';
+                    if (static_cast<unsigned char>(c) < 0x20)
+                        continue;
+                    result += c;
+                }
+                return result;
+            }
+
+            //! Minimal scanner of flat JSON objects with string, number and array-of-number values.
+            class JsonScanner
+            {
+            public:
+                explicit JsonScanner(std::string const& text) : m_text(text), m_pos(0) {}
+
+                bool Parse(std::map<std::string, std::string>& strings, std::map<std::string, std::vector<double>>& arrays)
+                {
+                    if (!Expect('{'))
+                        return false;
+                    if (Expect('}'))
+                        return true;
+                    for (;;)
+                    {
+                        std::string key;
+                        if (!ParseString(key) || !Expect(':'))
+                            return false;
+
+                        SkipSpaces();
+                        if (m_pos < m_text.size() && m_text[m_pos] == '"')
+                        {
+                            if (!ParseString(strings[key]))
+                                return false;
+                        }
+                        else if (m_pos < m_text.size() && m_text[m_pos] == '[')
+                        {
+                            ++m_pos;
+                            std::vector<double>& values = arrays[key];
+                            if (!Expect(']'))
+                            {
+                                for (;;)
+                                {
+                                    double value = 0.0;
+                                    if (!ParseNumber(value))
+                                        return false;
+                                    values.push_back(value);
+                                    if (Expect(']'))
+                                        break;
+                                    if (!Expect(','))
+                                        return false;
+                                }
+                            }
+                        }
+                        else
+                        {
+                            size_t const begin = m_pos;
+                            double value = 0.0;
+                            if (!ParseNumber(value))
+                                return false;
+                            strings[key] = m_text.substr(begin, m_pos - begin);
+                        }
+
+                        if (Expect('}'))
+                            return true;
+                        if (!Expect(','))
+                            return false;
+                    }
+                }
+
+            private:
+                void SkipSpaces()
+                {
+                    while (m_pos < m_text.size() && (m_text[m_pos] == ' ' || m_text[m_pos] == '\t' || m_text[m_pos] == '\r' || m_text[m_pos] == '\n'))
+                        ++m_pos;
+                }
+
+                bool Expect(char c)
+                {
+                    SkipSpaces();
+                    if (m_pos < m_text.size() && m_text[m_pos] == c)
+                    {
+                        ++m_pos;
+                        return true;
+                    }
+                    return false;
+                }
+
+                bool ParseString(std::string& value)
+                {
+                    if (!Expect('"'))
+                        return false;
+                    value.clear();
+                    while (m_pos < m_text.size() && m_text[m_pos] != '"')
+                    {
+                        if (m_text[m_pos] == '\\' && m_pos + 1 < m_text.size())
+                            ++m_pos;
+                        value += m_text[m_pos++];
+                    }
+                    return Expect('"');
+                }
+
+                bool ParseNumber(double& value)
+                {
+                    SkipSpaces();
+                    char const* begin = m_text.c_str() + m_pos;
+                    char* end = nullptr;
+                    value = std::strtod(begin, &end);
+                    if (end == begin)
+                        return false;
+                    m_pos += size_t(end - begin);
+                    return true;
+                }
+
+            private:
+                std::string const& m_text;
+                size_t m_pos;
+            };
+        }
+
+        ///////////////////////////////////////////////////////////////////////////
+        //
+        // Result member definitions
+        //
+
+        inline double Result::GetMean() const
+        {
+            if (samples.empty())
+                throw std::logic_error("Cannot compute the mean of benchmark " + benchmark + " without samples");
+            return std::accumulate(samples.begin(), samples.end(), 0.0) / double(samples.size());
+        }
+
+        inline double Result::GetStdDev() const
+        {
+            if (samples.size() < 2)
+                return 0.0;
+            double const mean = GetMean();
+            double sum = 0.0;
+            for (double value : samples)
+                sum += (value - mean) * (value - mean);
+            return std::sqrt(sum / double(samples.size() - 1));
+        }
+
+        inline std::string Result::ToJson() const
+        {
+            using Detail::EscapeJson;
+
+            std::ostringstream out;
+            out << std::setprecision(9);
+            out << "{\"format\":" << ResultFormatVersion
+                << ",\"benchmark\":\"" << EscapeJson(benchmark) << '"'
+                << ",\"unit\":\"" << EscapeJson(unit) << '"'
+                << ",\"better\":\"" << (higherIsBetter ? "higher" : "lower") << '"'
+                << ",\"revision\":\"" << EscapeJson(environment.revision) << '"'
+                << ",\"cpu\":\"" << EscapeJson(environment.cpu) << '"'
+                << ",\"compiler\":\"" << EscapeJson(environment.compiler) << '"'
+                << ",\"timestamp\":\"" << EscapeJson(timestamp) << '"'
+                << ",\"samples\":[";
+            for (size_t i = 0; i < samples.size(); ++i)
+                out << (i == 0 ? "" : ",") << samples[i];
+            out << "]}";
+            return out.str();
+        }
+
+        inline bool Result::FromJson(std::string const& line, Result& result)
+        {
+            std::map<std::string, std::string> strings;
+            std::map<std::string, std::vector<double>> arrays;
+
+            Detail::JsonScanner scanner(line);
+            if (!scanner.Parse(strings, arrays))
+                return false;
+
+            if (strings["format"] != ToString(ResultFormatVersion) || strings["benchmark"].empty())
+                return false;
+
+            result = Result();
+            result.benchmark = strings["benchmark"];
+            result.unit = strings["unit"];
+            result.higherIsBetter = strings["better"] != "lower";
+            result.environment.revision = strings["revision"];
+            result.environment.cpu = strings["cpu"];
+            result.environment.compiler = strings["compiler"];
+            result.timestamp = strings["timestamp"];
+            result.samples = arrays["samples"];
+            return !result.samples.empty();
+        }
+
+        ///////////////////////////////////////////////////////////////////////////
+        //
+        // Free function definitions
+        //
+
+        inline void AppendResult(std::string const& path, Result const& result)
+        {
+            std::ofstream output(path, std::ios::app);
+            if (!output)
+                throw std::runtime_error("Cannot open benchmark results file " + path);
+
+            output << result.ToJson() << '\n';
+        }
+
+        inline std::vector<Result> LoadResults(std::string const& path)
+        {
+            std::ifstream input(path);
+            if (!input)
+                throw std::runtime_error("Cannot open benchmark results file " + path);
+
+            std::vector<Result> results;
+            std::string line;
+            while (std::getline(input, line))
+            {
+                Result result;
+                if (Result::FromJson(line, result))
+                    results.push_back(result);
+            }
+            return results;
+        }
+
+        inline Comparison Compare(Result const& baseline, Result const& candidate, double confidence, double threshold)
+        {
+            if (baseline.samples.size() < 2 || candidate.samples.size() < 2)
+                throw std::invalid_argument("Comparison of " + candidate.benchmark + " requires at least 2 repetitions on both sides");
+
+            double const n1 = double(baseline.samples.size());
+            double const n2 = double(candidate.samples.size());
+            double const mean1 = baseline.GetMean();
+            double const mean2 = candidate.GetMean();
+            double const var1 = baseline.GetStdDev() * baseline.GetStdDev() / n1;
+            double const var2 = candidate.GetStdDev() * candidate.GetStdDev() / n2;
+
+            // Welch-Satterthwaite degrees of freedom.
+            double const varSum = var1 + var2;
+            double const dof = (varSum > 0.0)
+                             ? varSum * varSum / (var1 * var1 / (n1 - 1) + var2 * var2 / (n2 - 1))
+                             : n1 + n2 - 2;
+            double const halfWidth = Distributions::StudentQuantile(0.5 + confidence / 2, (std::max)(dof, 1.0)) * std::sqrt(varSum);
+
+            Comparison result;
+            double const difference = mean2 - mean1;
+            result.relativeChange = difference / mean1;
+            result.lowerBound = (difference - halfWidth) / mean1;
+            result.upperBound = (difference + halfWidth) / mean1;
+            result.isSignificant = (result.lowerBound > 0.0) || (result.upperBound < 0.0);
+
+            // express the worst bound as a slowdown in the direction of "better".
+            double const slowdown = candidate.higherIsBetter ? -result.upperBound : result.lowerBound;
+            result.isRegression = result.isSignificant && (slowdown > threshold);
+            return result;
+        }
+
+        inline Result Run(std::string const& name, std::string const& unit, double unitScale, int repetitions, std::function<double()> const& body)
+        {
+            if (repetitions < 1)
+                throw std::invalid_argument("Benchmark repetitions must be strict positive, got " + ToString(repetitions));
+
+            Result result;
+            result.benchmark = name;
+            result.unit = unit;
+            result.higherIsBetter = true;
+            result.environment = Environment::Detect();
+
+            std::time_t const now = std::time(nullptr);
+            char timestamp[32] = {};
+            std::tm utc = {};
+#if defined(_WIN32)
+            gmtime_s(&utc, &now);
+#else
+            gmtime_r(&now, &utc);
+#endif
+            std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", &utc);
+            result.timestamp = timestamp;
+
+            // warm-up run: page faults, caches and branch predictors.
+            body();
+
+            for (int i = 0; i < repetitions; ++i)
+            {
+                auto const start = std::chrono::steady_clock::now();
+                double const items = body();
+                std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
+                result.samples.push_back(items / elapsed.count() / unitScale);
+            }
+
+            return result;
+        }
+    }
+}
+
+#endif
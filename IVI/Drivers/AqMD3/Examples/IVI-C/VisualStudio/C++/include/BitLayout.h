@@ -0,0 +1,173 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// BitLayout: declarative description of the bit fields of stream markers, and the extractors
+// generated from it.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_BITLAYOUT_H
+#define LIBTOOL_BITLAYOUT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ratio>
+#include <type_traits>
+
+namespace LibTool
+{
+    //! Marker bit layouts.
+    /*! A field of a marker is described by a type: the index of its 32-bit word in the marker, its bit offset in that word, its
+        width, its signedness and the scale of its fixed-point representation. A field may run over the next word (offset+width
+        up to 64 bits):
+
+            typedef BitLayout::Field<1, 8, 56> Timestamp;                               // bits 8..63 of words 1-2
+            typedef BitLayout::Field<5, 0, 22, true, std::ratio<1, 256>> PeakX;         // signed fixed-point, 8 fraction bits
+
+            uint64_t const timestamp = Timestamp::Extract(marker);
+            double const peakX = PeakX::ExtractScaled(marker);
+
+        Everything is resolved at compile time, so the extractors inline to the shifts and masks one would write by hand. The
+        layouts of the marker formats of the firmware are gathered in #BitLayout::Layouts: a new format is a new table of fields.
+
+        The header does not depend on LibTool.h, which uses it.
+    */
+    namespace BitLayout
+    {
+        //! Field of Width bits at bit Offset of 32-bit word Word of a marker.
+        /*! \tparam Signed: the field is two's complement.
+            \tparam Scale: value of the least significant bit, for fixed-point fields (#ExtractScaled).*/
+        template <size_t Word, unsigned Offset, unsigned Width, bool Signed = false, class Scale = std::ratio<1>>
+        struct Field
+        {
+            static_assert(Offset < 32, "Field offset must be within its first word");
+            static_assert(0 < Width && Offset + Width <= 64, "Field must fit in two consecutive words");
+
+            typedef typename std::conditional<Signed, int64_t, uint64_t>::type ValueType;
+
+            static size_t const WordIndex = Word;
+            static size_t const NbrWords = (Offset + Width <= 32) ? 1 : 2;   //!< number of words the field runs over.
+
+            //! Return the raw bits of the field, right aligned.
+            static uint64_t ExtractBits(uint32_t const* marker)
+            {
+                uint64_t const words = (NbrWords == 1)
+                    ? uint64_t(marker[Word])
+                    : (uint64_t(marker[Word]) | (uint64_t(marker[Word + NbrWords - 1]) << 32));
+                return (words >> Offset) & Mask();
+            }
+
+            //! Return the value of the field (sign expanded if signed).
+            static ValueType Extract(uint32_t const* marker)
+            { return Convert(ExtractBits(marker)); }
+
+            static ValueType Extract(int32_t const* marker)
+            { return Extract(reinterpret_cast<uint32_t const*>(marker)); }
+
+            //! Return the value of the field multiplied by its scale.
+            static double ExtractScaled(uint32_t const* marker)
+            { return Scaled(Extract(marker)); }
+
+            static double ExtractScaled(int32_t const* marker)
+            { return ExtractScaled(reinterpret_cast<uint32_t const*>(marker)); }
+
+        private:
+            static uint64_t Mask()
+            { return (Width == 64) ? ~uint64_t(0) : ((uint64_t(1) << (Width % 64)) - 1); }
+
+            static ValueType Convert(uint64_t bits)
+            {
+                // Signed fields: move the sign bit to bit 63, then shift back arithmetically.
+                return Signed ? ValueType(int64_t(bits << (64 - Width)) >> (64 - Width)) : ValueType(bits);
+            }
+
+            static double Scaled(ValueType value)
+            { return double(value) * (double(Scale::num) / double(Scale::den)); }
+        };
+
+        //! Layouts of the marker formats.
+        namespace Layouts
+        {
+            //! 512-bit trigger marker of standard streaming, also used by ZeroSuppress (16 words).
+            struct TriggerMarker
+            {
+                static size_t const NbrElements = 16;
+
+                typedef Field<0, 0, 8> Tag;
+                typedef Field<0, 8, 24> RecordIndex;
+                typedef Field<1, 0, 8, false, std::ratio<-1, 256>> TriggerSubsample;   //!< trigger time in samples, in ]-1,0].
+                typedef Field<1, 8, 56> Timestamp;                                      //!< absolute index of the first sample.
+            };
+
+            //! 64-bit ZeroSuppress gate start, gate stop and record stop markers (2 words).
+            struct GateMarker
+            {
+                static size_t const NbrElements = 2;
+
+                typedef Field<0, 0, 8> Tag;
+                typedef Field<0, 24, 32> BlockIndex;
+                typedef Field<1, 24, 8> SampleIndex;    //!< start sample (gate start), or gate end index (stops) in the block.
+            };
+
+            //! 256-bit peak-list trigger descriptor (8 words).
+            struct ExtendedTrigger
+            {
+                static size_t const NbrElements = 8;
+
+                typedef Field<0, 0, 8> Tag;
+                typedef Field<0, 8, 24> RecordIndex;
+                typedef Field<1, 0, 8, false, std::ratio<-1, 256>> TriggerSubsample;
+                typedef Field<1, 8, 56> Timestamp;
+            };
+
+            //! 256-bit peak-list pulse descriptor (8 words).
+            /*! Fixed-point layouts, see the User Manual (section "Real-time peak-listing mode (PKL option)").*/
+            struct ExtendedPulse
+            {
+                static size_t const NbrElements = 8;
+
+                typedef Field<0, 0, 8> Tag;
+                typedef Field<0, 8, 24> RecordIndex;
+                typedef Field<1, 0, 48, true> Timestamp;                        //!< relative to the first sample of the record.
+                typedef Field<2, 16, 15> Width;
+                typedef Field<2, 31, 1> Overflow;
+                typedef Field<3, 0, 15> OverrangeSamples;
+                typedef Field<3, 16, 48> SumOfSquares;
+                typedef Field<5, 0, 22, true, std::ratio<1, 256>> PeakX;        //!< 14.8
+                typedef Field<5, 24, 20, true, std::ratio<1, 8>> PeakY;         //!< 17.3
+                typedef Field<6, 16, 24, true, std::ratio<1, 256>> ComX;        //!< 16.8
+                typedef Field<7, 8, 17, true, std::ratio<1, 2>> ComY;           //!< 16.1
+            };
+
+            //! 128-bit peak-list trigger descriptor (4 words).
+            struct CompactTrigger
+            {
+                static size_t const NbrElements = 4;
+
+                typedef Field<0, 0, 4> Tag;
+                typedef Field<0, 4, 20> RecordIndex;
+                typedef Field<1, 0, 8, false, std::ratio<-1, 256>> TriggerSubsample;
+                typedef Field<1, 8, 56> Timestamp;
+            };
+
+            //! 128-bit peak-list pulse descriptor (4 words): peak, center of mass or area, according to the tag.
+            struct CompactPulse
+            {
+                static size_t const NbrElements = 4;
+
+                typedef Field<0, 0, 4> Tag;
+                typedef Field<0, 4, 20> RecordIndex;
+                typedef Field<0, 24, 32, true> Timestamp;                       //!< relative to the first sample of the record.
+                typedef Field<1, 24, 11> Width;
+                typedef Field<2, 3, 1> Overflow;
+                typedef Field<2, 4, 11> OverrangeSamples;
+                typedef Field<2, 16, 32> Area;                                  //!< area descriptors.
+                typedef Field<2, 16, 22, true, std::ratio<1, 256>> PeakX;       //!< peak descriptors, 14.8
+                typedef Field<3, 8, 20, true, std::ratio<1, 8>> PeakY;          //!< peak descriptors, 17.3
+                typedef Field<2, 16, 24, true, std::ratio<1, 256>> ComX;        //!< center of mass descriptors, 16.8
+                typedef Field<3, 8, 17, true, std::ratio<1, 2>> ComY;           //!< center of mass descriptors, 16.1
+            };
+        }
+    }
+}
+
+#endif
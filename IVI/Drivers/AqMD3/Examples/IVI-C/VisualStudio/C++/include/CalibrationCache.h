@@ -0,0 +1,522 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// CalibrationCache: calibration profiles saved per instrument, acquisition configuration and
+// temperature band, loaded instead of running the self-calibration when switching configuration.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_CALIBRATIONCACHE_H
+#define LIBTOOL_CALIBRATIONCACHE_H
+
+#include "LibTool.h"
+#include <AqMD3.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace LibTool
+{
+    //! Calibration profile cache.
+    /*! AqMD3_SelfCalibrate takes seconds, AqMD3_CalibrationLoadFromFile milliseconds. #ProfileCache keeps one calibration file per
+        (instrument serial number, configuration hash, temperature band) in a directory, and calibrates the instrument from the
+        matching file when it exists and is recent enough, running (and saving) the self-calibration otherwise:
+
+            Calibration::ProfileCache cache(session, "CalibrationProfiles");
+            Calibration::Configuration configuration;
+            configuration.Set("SampleRate", sampleRate).Set("Channel1.Range", range);
+            ... configure the instrument ...
+            AqMD3_ApplySetup(session);
+            Calibration::SwitchResult const result = cache.Calibrate(configuration);
+
+        The configuration must list every setting the calibration depends on (sample rate, ranges, offsets, interleaving, ...).
+        A monitor thread (#StartMonitor) samples the board temperature: when it leaves the band of the active profile, a refresh
+        is pending. The self-calibration requires an idle instrument, so the refresh runs at the next idle point the application
+        signals with #RefreshIfPending (e.g. between two acquisitions).
+    */
+    namespace Calibration
+    {
+        //! Return the 64-bit FNV-1a hash of text, continuing from hash.
+        inline uint64_t HashFnv1a(std::string const& text, uint64_t hash = 0xcbf29ce484222325ull)
+        {
+            for (unsigned char const c : text)
+            {
+                hash ^= c;
+                hash *= 0x100000001b3ull;
+            }
+            return hash;
+        }
+
+        //! Return the temperature band of temperature (degrees Celsius): bands are bandWidth wide, band 0 starts at 0 degree.
+        inline int GetTemperatureBand(double temperature, double bandWidth)
+        { return int(std::floor(temperature / bandWidth)); }
+
+        //! Acquisition configuration relevant to the calibration, as a set of named settings.
+        class Configuration
+        {
+        public:
+            //! Set the setting name to value.
+            Configuration& Set(std::string const& name, std::string const& value)
+            {
+                m_settings[name] = value;
+                return *this;
+            }
+
+            //! Set the setting name to value, with all significant digits.
+            Configuration& Set(std::string const& name, double value)
+            {
+                std::ostringstream out;
+                out << std::setprecision(17) << value;
+                return Set(name, out.str());
+            }
+
+            Configuration& Set(std::string const& name, char const* value)
+            { return Set(name, std::string(value)); }
+
+            Configuration& Set(std::string const& name, bool value)
+            { return Set(name, std::string(value ? "true" : "false")); }
+
+            //! Set the setting name to the textual form of value (integers, enumerations).
+            template<class T>
+            Configuration& Set(std::string const& name, T const& value)
+            { return Set(name, ToString(value)); }
+
+            //! Return the settings as "name=value;" sorted by name: equal configurations have equal texts.
+            std::string GetCanonicalText() const
+            {
+                std::string text;
+                for (auto const& setting : m_settings)
+                    text += setting.first + "=" + setting.second + ";";
+                return text;
+            }
+
+            uint64_t GetHash() const
+            { return HashFnv1a(GetCanonicalText()); }
+
+        private:
+            std::map<std::string, std::string> m_settings;
+        };
+
+        //! Identify a calibration profile.
+        struct ProfileKey
+        {
+            std::string serialNumber;
+            uint64_t configurationHash = 0;
+            int temperatureBand = 0;
+
+            //! Return the name of the calibration file of the profile.
+            std::string GetFileName() const
+            {
+                std::ostringstream out;
+                out << serialNumber << '_' << std::hex << std::setw(16) << std::setfill('0') << configurationHash << std::dec << "_t" << temperatureBand << ".cal";
+                return out.str();
+            }
+
+            bool operator<(ProfileKey const& other) const
+            {
+                if (serialNumber != other.serialNumber)
+                    return serialNumber < other.serialNumber;
+                if (configurationHash != other.configurationHash)
+                    return configurationHash < other.configurationHash;
+                return temperatureBand < other.temperatureBand;
+            }
+        };
+
+        //! How the instrument has been calibrated by #ProfileCache::Calibrate.
+        enum class Action
+        {
+            Loaded,         //!< the matching profile has been loaded.
+            Calibrated,     //!< no usable profile: self-calibration run and saved.
+        };
+
+        //! Result of #ProfileCache::Calibrate.
+        struct SwitchResult
+        {
+            Action action = Action::Calibrated;
+            ProfileKey key;
+            double temperature = 0.0;   //!< board temperature (degrees Celsius).
+            double seconds = 0.0;       //!< duration of the calibration step.
+            std::string reason;         //!< why the self-calibration was run, empty when loaded.
+        };
+
+        //! Cache of calibration profiles of an instrument.
+        class ProfileCache
+        {
+        public:
+            //! Read the board temperature (degrees Celsius) into its argument, same status as the driver.
+            using TemperatureReader = std::function<ViStatus(ViReal64*)>;
+
+            //! Open the cache of directory (created if needed) for the instrument of session.
+            /*! Profiles older than maxAge are not loaded but replaced by a new self-calibration.*/
+            explicit ProfileCache(ViSession session, std::string const& directory, double temperatureBandWidth = 5.0,
+                std::chrono::hours maxAge = std::chrono::hours(24));
+
+            ~ProfileCache()
+            { StopMonitor(); }
+
+            ProfileCache(ProfileCache const&) = delete;
+            ProfileCache& operator=(ProfileCache const&) = delete;
+
+            //! Calibrate the instrument for configuration, which must be applied (AqMD3_ApplySetup) and idle.
+            /*! \throw #std::runtime_error if the self-calibration or the save of the profile fails.*/
+            SwitchResult Calibrate(Configuration const& configuration);
+
+            //! Read the board temperature with reader instead of the driver (e.g. through a session scheduler). Call before #StartMonitor.
+            void SetTemperatureReader(TemperatureReader reader)
+            { m_readTemperature = reader; }
+
+            //! Start sampling the board temperature every interval from a background thread.
+            void StartMonitor(std::chrono::milliseconds interval);
+
+            //! Stop the monitor thread.
+            void StopMonitor();
+
+            //! Tell whether the temperature has left the band of the active profile.
+            bool IsRefreshPending() const
+            { return m_refreshPending.load(); }
+
+            //! If a refresh is pending, self-calibrate the active configuration and save its profile. The instrument must be idle.
+            /*! \return true if the instrument has been recalibrated.*/
+            bool RefreshIfPending(SwitchResult* result = nullptr);
+
+            //! Return the last sampled board temperature (degrees Celsius).
+            double GetLastTemperature() const
+            { return m_lastTemperature.load(); }
+
+            //! Return the number of profiles of the instrument in the cache.
+            size_t GetProfileCount() const;
+
+        private:
+            //! Saved profile.
+            struct ProfileInfo
+            {
+                double temperature = 0.0;
+                int64_t savedTime = 0;      //!< seconds since the system clock epoch.
+            };
+
+            double ReadTemperature() const;
+
+            //! Run the self-calibration and save the profile of key.
+            void CalibrateAndSave(ProfileKey const& key, double temperature);
+
+            //! Return the path of file name in the directory.
+            std::string GetPath(std::string const& name) const
+            { return m_directory + '/' + name; }
+
+            //! Create directory and its missing parents.
+            static void CreateDirectories(std::string const& directory);
+
+            //! Load the index file of the directory.
+            void LoadIndex();
+
+            //! Write the index file of the directory (written aside, then renamed).
+            void SaveIndex() const;
+
+            //! Body of the monitor thread.
+            void MonitorMain(std::chrono::milliseconds interval);
+
+            ViSession const m_session;
+            std::string const m_directory;
+            double const m_temperatureBandWidth;
+            std::chrono::hours const m_maxAge;
+            std::string m_serialNumber;
+            TemperatureReader m_readTemperature;
+
+            mutable std::mutex m_mutex;
+            std::map<ProfileKey, ProfileInfo> m_profiles;
+            ProfileKey m_activeKey;
+            bool m_hasActiveKey;
+
+            std::atomic<double> m_lastTemperature;
+            std::atomic<bool> m_refreshPending;
+            std::condition_variable m_stopCondition;
+            bool m_stopRequested;
+            std::thread m_monitor;
+        };
+    }
+
+    ///////
+    // Calibration member definitions
+    //
+
+    inline Calibration::ProfileCache::ProfileCache(ViSession session, std::string const& directory, double temperatureBandWidth, std::chrono::hours maxAge)
+        : m_session(session)
+        , m_directory(directory)
+        , m_temperatureBandWidth(temperatureBandWidth)
+        , m_maxAge(maxAge)
+        , m_serialNumber()
+        , m_readTemperature([session](ViReal64* temperature) { return AqMD3_GetAttributeViReal64(session, "", AQMD3_ATTR_BOARD_TEMPERATURE, temperature); })
+        , m_mutex()
+        , m_profiles()
+        , m_activeKey()
+        , m_hasActiveKey(false)
+        , m_lastTemperature(0.0)
+        , m_refreshPending(false)
+        , m_stopCondition()
+        , m_stopRequested(false)
+        , m_monitor()
+    {
+        if (temperatureBandWidth <= 0.0)
+            throw std::invalid_argument("Invalid temperature band width: " + ToString(temperatureBandWidth));
+
+        ViChar serial[128];
+        ViStatus const status = AqMD3_GetAttributeViString(session, "", AQMD3_ATTR_INSTRUMENT_INFO_SERIAL_NUMBER_STRING, sizeof(serial), serial);
+        if (status < 0)
+            throw std::runtime_error("Failed to read the instrument serial number: status " + ToString(status));
+        m_serialNumber = serial;
+
+        CreateDirectories(m_directory);
+        LoadIndex();
+    }
+
+    inline Calibration::SwitchResult Calibration::ProfileCache::Calibrate(Configuration const& configuration)
+    {
+        auto const start = std::chrono::steady_clock::now();
+
+        SwitchResult result;
+        result.temperature = ReadTemperature();
+        result.key.serialNumber = m_serialNumber;
+        result.key.configurationHash = configuration.GetHash();
+        result.key.temperatureBand = GetTemperatureBand(result.temperature, m_temperatureBandWidth);
+
+        ProfileInfo info;
+        bool found = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto const it = m_profiles.find(result.key);
+            found = (it != m_profiles.end());
+            if (found)
+                info = it->second;
+        }
+
+        int64_t const now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        std::string const file = GetPath(result.key.GetFileName());
+
+        if (!found || !std::ifstream(file).good())
+            result.reason = "no profile";
+        else if (now - info.savedTime > std::chrono::duration_cast<std::chrono::seconds>(m_maxAge).count())
+            result.reason = "profile older than " + ToString(m_maxAge.count()) + " h";
+        else
+        {
+            ViStatus const status = AqMD3_CalibrationLoadFromFile(m_session, file.c_str());
+            ViBoolean required = VI_TRUE;
+            if (status >= 0 && AqMD3_GetAttributeViBoolean(m_session, "", AQMD3_ATTR_CALIBRATION_IS_REQUIRED, &required) >= 0 && required == VI_FALSE)
+                result.action = Action::Loaded;
+            else
+                result.reason = (status < 0) ? "load failed with status " + ToString(status) : "calibration still required after load";
+        }
+
+        if (result.action != Action::Loaded)
+            CalibrateAndSave(result.key, result.temperature);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_activeKey = result.key;
+            m_hasActiveKey = true;
+        }
+        m_lastTemperature = result.temperature;
+        m_refreshPending = false;
+
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+    inline void Calibration::ProfileCache::CalibrateAndSave(ProfileKey const& key, double temperature)
+    {
+        ViStatus status = AqMD3_SelfCalibrate(m_session);
+        if (status < 0)
+            throw std::runtime_error("Self-calibration failed: status " + ToString(status));
+
+        std::string const file = GetPath(key.GetFileName());
+        status = AqMD3_CalibrationSaveToFile(m_session, file.c_str());
+        if (status < 0)
+            throw std::runtime_error("Failed to save the calibration to " + file + ": status " + ToString(status));
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ProfileInfo& info = m_profiles[key];
+        info.temperature = temperature;
+        info.savedTime = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        SaveIndex();
+    }
+
+    inline bool Calibration::ProfileCache::RefreshIfPending(SwitchResult* result)
+    {
+        if (!m_refreshPending.load())
+            return false;
+
+        ProfileKey key;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_hasActiveKey)
+                return false;
+            key = m_activeKey;
+        }
+
+        auto const start = std::chrono::steady_clock::now();
+        double const temperature = ReadTemperature();
+        key.temperatureBand = GetTemperatureBand(temperature, m_temperatureBandWidth);
+        CalibrateAndSave(key, temperature);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_activeKey = key;
+        }
+        m_lastTemperature = temperature;
+        m_refreshPending = false;
+
+        if (result)
+        {
+            result->action = Action::Calibrated;
+            result->key = key;
+            result->temperature = temperature;
+            result->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            result->reason = "temperature drift";
+        }
+        return true;
+    }
+
+    inline void Calibration::ProfileCache::StartMonitor(std::chrono::milliseconds interval)
+    {
+        StopMonitor();
+        m_stopRequested = false;
+        m_monitor = std::thread(&ProfileCache::MonitorMain, this, interval);
+    }
+
+    inline void Calibration::ProfileCache::StopMonitor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopRequested = true;
+        }
+        m_stopCondition.notify_all();
+        if (m_monitor.joinable())
+            m_monitor.join();
+    }
+
+    inline void Calibration::ProfileCache::MonitorMain(std::chrono::milliseconds interval)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stopCondition.wait_for(lock, interval, [this] { return m_stopRequested; }))
+        {
+            if (!m_hasActiveKey)
+                continue;
+            int const activeBand = m_activeKey.temperatureBand;
+
+            // the driver call is made without holding the lock.
+            lock.unlock();
+            double temperature = 0.0;
+            bool const valid = (m_readTemperature(&temperature) >= 0);
+            lock.lock();
+
+            if (!valid)
+                continue;
+            m_lastTemperature = temperature;
+            if (GetTemperatureBand(temperature, m_temperatureBandWidth) != activeBand)
+                m_refreshPending = true;
+        }
+    }
+
+    inline double Calibration::ProfileCache::ReadTemperature() const
+    {
+        ViReal64 temperature = 0.0;
+        ViStatus const status = m_readTemperature(&temperature);
+        if (status < 0)
+            throw std::runtime_error("Failed to read the board temperature: status " + ToString(status));
+        return temperature;
+    }
+
+    inline size_t Calibration::ProfileCache::GetProfileCount() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t count = 0;
+        for (auto const& profile : m_profiles)
+        {
+            if (profile.first.serialNumber == m_serialNumber)
+                ++count;
+        }
+        return count;
+    }
+
+    inline void Calibration::ProfileCache::CreateDirectories(std::string const& directory)
+    {
+        // Create every prefix ending before a separator, then the directory itself. Existing directories fail silently.
+        for (size_t i = 1; i <= directory.size(); ++i)
+        {
+            if (i < directory.size() && directory[i] != '/' && directory[i] != '\\')
+                continue;
+            std::string const prefix = directory.substr(0, i);
+#if defined(_WIN32)
+            _mkdir(prefix.c_str());
+#else
+            mkdir(prefix.c_str(), 0777);
+#endif
+        }
+
+        // The directory must exist now: its index can be opened for writing.
+        std::string const probe = directory + "/profiles.idx";
+        bool const existed = std::ifstream(probe).good();
+        if (!std::ofstream(probe, std::ios::app))
+            throw std::runtime_error("Failed to create the calibration profile directory " + directory);
+        if (!existed)
+            std::remove(probe.c_str());
+    }
+
+    inline void Calibration::ProfileCache::LoadIndex()
+    {
+        // one profile per line: serial-number configuration-hash temperature-band temperature saved-time
+        std::ifstream input(GetPath("profiles.idx"));
+        std::string line;
+        while (std::getline(input, line))
+        {
+            std::istringstream fields(line);
+            ProfileKey key;
+            ProfileInfo info;
+            if (fields >> key.serialNumber >> std::hex >> key.configurationHash >> std::dec >> key.temperatureBand >> info.temperature >> info.savedTime)
+                m_profiles[key] = info;
+        }
+    }
+
+    inline void Calibration::ProfileCache::SaveIndex() const
+    {
+        std::string const path = GetPath("profiles.idx");
+        std::string const temporary = GetPath("profiles.idx.tmp");
+        {
+            std::ofstream output(temporary, std::ios::trunc);
+            for (auto const& profile : m_profiles)
+            {
+                output << profile.first.serialNumber << ' ' << std::hex << profile.first.configurationHash << std::dec << ' ' << profile.first.temperatureBand
+                       << ' ' << profile.second.temperature << ' ' << profile.second.savedTime << '\n';
+            }
+            if (!output)
+                throw std::runtime_error("Failed to write the calibration profile index " + temporary);
+        }
+
+        // std::rename does not replace an existing file on Windows.
+        if (std::rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            std::remove(path.c_str());
+            if (std::rename(temporary.c_str(), path.c_str()) != 0)
+                throw std::runtime_error("Failed to replace the calibration profile index " + path);
+        }
+    }
+}
+
+#endif
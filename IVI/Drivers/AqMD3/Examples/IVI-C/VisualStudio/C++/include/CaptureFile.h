@@ -0,0 +1,611 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// CaptureFile: preallocated, memory-mapped raw capture file that stream fetches write into
+// directly, with a separate index of record headers and a journal of group commits.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_CAPTUREFILE_H
+#define LIBTOOL_CAPTUREFILE_H
+
+#include "LibTool.h"
+#include "CaptureJournal.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace LibTool
+{
+    //! Raw capture utils.
+    /*! Recording raw samples usually costs a copy: fetch into a buffer, then write the buffer to the file. At several GB/s that
+        copy alone keeps a core busy moving memory. #CaptureFile maps a preallocated file in memory and hands out its free pages
+        as fetch destination, so the driver writes the samples straight into the file pages and the operating system writes them
+        back to disk:
+
+            Capture::CaptureFile captureFile("streaming.cap", captureSize);
+
+            Capture::Reservation const reservation = captureFile.Reserve(nbrElements + sampleReader.GetBufferOverhead());
+            ArraySegment<int32_t> const samples = sampleReader.FetchExactInto(nbrElements, reservation.data, reservation.capacity);
+            // ... validate the markers of the records, captureFile.Discard() on error ...
+            int64_t const offset = captureFile.Commit(samples);
+            captureFile.AddRecord(header);                                   // one header per record, with its offset
+
+        Only committed ranges are part of the capture: a discarded reservation is overwritten by the next one. Because of the
+        alignment of fetches, committed ranges are not contiguous; the record headers give the offset of the samples of every
+        record. They are written to the index file (path + ".idx"), the only data written separately.
+
+        Committed data and records are made durable by group commit, every #CommitPolicy::bytes committed bytes or
+        #CommitPolicy::interval, whichever comes first: the new pages and index records are synced to the drive, then one
+        #JournalEntry with their CRC32C is appended to the journal (path + ".jnl") and synced. A crash loses at most the last
+        commit interval, and no record is ever flushed on its own, so the capture runs at the speed of the drive.
+
+        After a crash the capture file still has its preallocated size and a torn tail. #Recover truncates the capture, index and
+        journal files to the last journal entry whose data and records match their checksums:
+
+            Capture::RecoveryReport const report = Capture::Recover("streaming.cap");
+
+        #CaptureFile::Close does a last group commit and truncates the file to the committed data. The #FileHeader at the start
+        of the file is updated at every group commit; after a crash, only the journal is authoritative.
+    */
+    namespace Capture
+    {
+        //! Size of the file header block, the data start right after it.
+        static int64_t const HeaderBytes = 4096;
+
+        //! Header at the start of capture files.
+        struct FileHeader
+        {
+            static uint32_t const CurrentVersion = 1;
+
+            char magic[8];              //!< "AQCAPTUR".
+            uint32_t version;           //!< format version.
+            uint32_t headerBytes;       //!< offset of the data in the file.
+            int64_t dataBytes;          //!< committed bytes following the header (gaps included).
+            int64_t nbrRecords;         //!< number of records in the index file.
+        };
+
+        //! Header of a record, written to the index file.
+        struct RecordHeader
+        {
+            uint64_t recordIndex;           //!< record index of the trigger marker.
+            uint64_t absoluteSampleIndex;   //!< timestamp of the first sample, in timestamp periods.
+            double triggerTimeSamples;      //!< trigger time in sample intervals, see #TriggerMarker.
+            int64_t dataOffset;             //!< offset of the first element of the record in the capture file, in bytes.
+            int64_t nbrElements;            //!< number of 32-bit elements of the record.
+        };
+
+        //! When committed data are made durable.
+        struct CommitPolicy
+        {
+            int64_t bytes = int64_t(64) << 20;                              //!< committed bytes between group commits, 0 for no limit.
+            std::chrono::milliseconds interval = std::chrono::milliseconds(200); //!< time between group commits, 0 for no limit.
+        };
+
+        //! Free elements of the file, handed out as fetch destination.
+        struct Reservation
+        {
+            int32_t* data;
+            int64_t capacity;
+        };
+
+        //! Capture statistics.
+        struct Statistics
+        {
+            uint64_t nbrCommits = 0;        //!< committed ranges.
+            uint64_t nbrDiscards = 0;       //!< discarded reservations.
+            int64_t nbrRecords = 0;         //!< record headers written.
+            int64_t committedBytes = 0;     //!< bytes of committed data.
+            int64_t gapBytes = 0;           //!< bytes skipped between committed ranges (fetch alignment).
+            uint64_t nbrGroupCommits = 0;   //!< journal entries written.
+            double commitSeconds = 0.0;     //!< time spent syncing and checksumming.
+
+            //! Add the counters of other, e.g. of another segment of the capture.
+            void Add(Statistics const& other);
+
+            void Print(std::ostream& output) const;
+        };
+
+        //! Outcome of #Recover.
+        struct RecoveryReport
+        {
+            uint64_t nbrJournalEntries = 0;     //!< consistent journal entries kept.
+            uint64_t nbrDiscardedEntries = 0;   //!< torn or inconsistent journal entries removed.
+            int64_t dataBytes = 0;              //!< committed bytes kept after the header (gaps included).
+            int64_t nbrRecords = 0;             //!< records kept.
+            int64_t nbrDiscardedRecords = 0;    //!< records of the index beyond the last consistent entry.
+            uint64_t firstRecordIndex = 0;      //!< record index of the first record kept.
+            uint64_t firstTimestamp = 0;        //!< absolute sample index of the first record kept.
+            uint64_t lastTimestamp = 0;         //!< absolute sample index of the last record kept.
+            int64_t recordDataBytes = 0;        //!< data bytes of the records kept (gaps excluded).
+            int64_t truncatedBytes = 0;         //!< bytes removed from the capture file.
+            bool wasClean = false;              //!< the files were already consistent (closed capture).
+
+            void Print(std::ostream& output) const;
+        };
+
+        //! Truncate the capture file path, its index and its journal to the last group commit matching its checksums.
+        /*! The data of every kept journal entry are checked unless verifyData is false (the journal itself is always checked).
+            \throw #std::runtime_error if the files cannot be opened or path is not a capture file.*/
+        RecoveryReport Recover(std::string const& path, bool verifyData = true);
+
+        //! Memory-mapped capture file of fixed capacity.
+        /*! One thread reserves, commits and adds records.*/
+        class CaptureFile
+        {
+        public:
+            //! Create (or truncate) path, its index and journal files, preallocate and map capacity bytes of data.
+            /*! \throw #std::runtime_error if the files cannot be created, preallocated or mapped.*/
+            explicit CaptureFile(std::string const& path, int64_t capacity, CommitPolicy const& policy = CommitPolicy());
+
+            //! Close the file, see #Close. Errors are ignored.
+            ~CaptureFile();
+
+            CaptureFile(CaptureFile const&) = delete;
+            CaptureFile& operator=(CaptureFile const&) = delete;
+
+            //! Return the free elements following the committed data, at least nbrElements.
+            /*! Runs a group commit first if one is due, see #FlushIfDue. The reservation is valid until the next #Commit or #Discard.
+                \throw #std::runtime_error if less than nbrElements are free.*/
+            Reservation Reserve(int64_t nbrElements);
+
+            //! Commit the elements of segment, which lies in the current reservation, and release the reservation.
+            /*! \return the offset of the segment in the file, in bytes.
+                \throw #std::logic_error if there is no reservation or if segment is out of it.*/
+            int64_t Commit(ArraySegment<int32_t> const& segment);
+
+            //! Release the current reservation without committing it.
+            void Discard();
+
+            //! Add header to the index, at the next group commit.
+            void AddRecord(RecordHeader const& header);
+
+            //! Group commit: sync the committed data and the new records, then journal them.
+            /*! \throw #std::runtime_error on I/O error.*/
+            void Flush();
+
+            //! Run a group commit if the commit policy says so, e.g. while the acquisition is idle.
+            /*! \return true if a group commit was run.*/
+            bool FlushIfDue();
+
+            //! Flush, unmap and truncate the file to the committed data. Further calls do nothing.
+            /*! Reservations must be committed and their records added first: a reservation still open is discarded.
+                \throw #std::runtime_error on I/O error.*/
+            void Close();
+
+            //! Return the number of free elements following the committed data.
+            int64_t GetFreeElements() const
+            { return (m_capacity - m_committedEnd) / int64_t(sizeof(int32_t)); }
+
+            CommitPolicy const& GetCommitPolicy() const
+            { return m_policy; }
+
+            std::string const& GetPath() const
+            { return m_path; }
+
+            Statistics const& GetStatistics() const
+            { return m_statistics; }
+
+        private:
+            typedef std::chrono::steady_clock Clock;
+
+            //! Write back [begin, end[ of the mapping. Asynchronous unless wait is set.
+            void FlushRange(int64_t begin, int64_t end, bool wait);
+
+            //! Fill and write the file header with the committed data.
+            void UpdateHeader();
+
+            //! Unmap the file and close the handles.
+            void Release();
+
+            std::string const m_path;
+            int64_t const m_capacity;       //!< size of the file, header included.
+            CommitPolicy const m_policy;
+            SyncedFile m_index;
+            CaptureJournal m_journal;
+            std::vector<RecordHeader> m_pendingRecords;     //!< records added since the last group commit.
+            char* m_base;                   //!< start of the mapping (the file header).
+            int64_t m_committedEnd;         //!< end of the committed data, in bytes from the start of the file.
+            int64_t m_durableEnd;           //!< end of the data of the last group commit.
+            Clock::time_point m_lastCommitTime;
+            bool m_reserved;
+            Statistics m_statistics;
+#if defined(_WIN32)
+            HANDLE m_handle;
+            HANDLE m_mapping;
+#else
+            int m_fd;
+#endif
+        };
+    }
+
+    ///////
+    // Capture member definitions
+    //
+
+    inline void Capture::Statistics::Add(Statistics const& other)
+    {
+        nbrCommits += other.nbrCommits;
+        nbrDiscards += other.nbrDiscards;
+        nbrRecords += other.nbrRecords;
+        committedBytes += other.committedBytes;
+        gapBytes += other.gapBytes;
+        nbrGroupCommits += other.nbrGroupCommits;
+        commitSeconds += other.commitSeconds;
+    }
+
+    inline void Capture::Statistics::Print(std::ostream& output) const
+    {
+        output << "\nRaw capture\n";
+        output << "  Committed:          " << (committedBytes >> 20) << " MBytes in " << nbrCommits << " ranges (" << nbrDiscards << " discarded)\n";
+        output << "  Records:            " << nbrRecords << '\n';
+        output << "  Alignment gaps:     " << gapBytes << " bytes\n";
+        output << "  Group commits:      " << nbrGroupCommits << " (" << commitSeconds << " s)\n";
+    }
+
+    inline void Capture::RecoveryReport::Print(std::ostream& output) const
+    {
+        output << "\nCapture recovery" << (wasClean ? " (capture was closed cleanly)" : "") << '\n';
+        output << "  Journal entries:    " << nbrJournalEntries << " kept, " << nbrDiscardedEntries << " discarded\n";
+        output << "  Data:               " << (dataBytes >> 20) << " MBytes kept, " << (truncatedBytes >> 20) << " MBytes truncated\n";
+        output << "  Records:            " << nbrRecords << " kept, " << nbrDiscardedRecords << " discarded\n";
+        if (nbrRecords > 0)
+            output << "  Record range:       #" << firstRecordIndex << ", timestamps [" << firstTimestamp << ", " << lastTimestamp << "]\n";
+    }
+
+    inline Capture::RecoveryReport Capture::Recover(std::string const& path, bool verifyData)
+    {
+        SyncedFile data(path, SyncedFile::Mode::Open);
+        SyncedFile index(path + ".idx", SyncedFile::Mode::Open);
+        SyncedFile journal(path + ".jnl", SyncedFile::Mode::Open);
+
+        FileHeader header;
+        if (data.Read(0, &header, sizeof(header)) != sizeof(header) || std::memcmp(header.magic, "AQCAPTUR", sizeof(header.magic)) != 0)
+            throw std::runtime_error(path + " is not a capture file");
+
+        // CRC32C of the bytes [begin, end[ of file, or of fewer bytes if the file is shorter.
+        std::vector<char> buffer(size_t(4) << 20);
+        auto const fileCrc = [&buffer](SyncedFile const& file, int64_t begin, int64_t end)
+        {
+            uint32_t crc = 0;
+            while (begin < end)
+            {
+                size_t const read = file.Read(begin, buffer.data(), size_t((std::min)(end - begin, int64_t(buffer.size()))));
+                if (read == 0)
+                    break;
+                crc = Crc32c(buffer.data(), read, crc);
+                begin += int64_t(read);
+            }
+            return crc;
+        };
+
+        // Keep the entries up to the first one describing data or records not on the drive.
+        std::vector<JournalEntry> const entries = CaptureJournal::Load(journal);
+        int64_t const recordBytes = int64_t(sizeof(RecordHeader));
+        int64_t dataEnd = HeaderBytes;
+        int64_t nbrRecords = 0;
+        uint64_t nbrConsistent = 0;
+        for (JournalEntry const& entry : entries)
+        {
+            if (entry.dataEnd < dataEnd || data.GetSize() < entry.dataEnd || index.GetSize() < entry.nbrRecords * recordBytes)
+                break;
+            if (verifyData && (fileCrc(data, dataEnd, entry.dataEnd) != entry.dataCrc || fileCrc(index, nbrRecords * recordBytes, entry.nbrRecords * recordBytes) != entry.indexCrc))
+                break;
+
+            dataEnd = entry.dataEnd;
+            nbrRecords = entry.nbrRecords;
+            ++nbrConsistent;
+        }
+
+        int64_t const entryBytes = int64_t(sizeof(JournalEntry));
+        RecoveryReport report;
+        report.nbrJournalEntries = nbrConsistent;
+        report.nbrDiscardedEntries = uint64_t((journal.GetSize() + entryBytes - 1) / entryBytes) - nbrConsistent;
+        report.dataBytes = dataEnd - HeaderBytes;
+        report.nbrRecords = nbrRecords;
+        report.nbrDiscardedRecords = (index.GetSize() + recordBytes - 1) / recordBytes - nbrRecords;
+        report.truncatedBytes = data.GetSize() - dataEnd;
+        report.wasClean = (report.nbrDiscardedEntries == 0 && report.nbrDiscardedRecords == 0 && report.truncatedBytes == 0);
+
+        // Ranges of the records kept, e.g. for the manifest of a segmented capture.
+        std::vector<RecordHeader> headers(buffer.size() / sizeof(RecordHeader));
+        for (int64_t first = 0; first < nbrRecords;)
+        {
+            size_t const count = size_t((std::min)(nbrRecords - first, int64_t(headers.size())));
+            if (index.Read(first * recordBytes, headers.data(), count * sizeof(RecordHeader)) != count * sizeof(RecordHeader))
+                throw std::runtime_error("Failed to read the records of " + path + ".idx");
+            if (first == 0)
+            {
+                report.firstRecordIndex = headers.front().recordIndex;
+                report.firstTimestamp = headers.front().absoluteSampleIndex;
+            }
+            report.lastTimestamp = headers[count - 1].absoluteSampleIndex;
+            for (size_t i = 0; i < count; ++i)
+                report.recordDataBytes += headers[i].nbrElements * int64_t(sizeof(int32_t));
+            first += int64_t(count);
+        }
+
+        if (report.wasClean && header.dataBytes == report.dataBytes && header.nbrRecords == nbrRecords)
+            return report;
+
+        data.Truncate(dataEnd);
+        header.dataBytes = dataEnd - HeaderBytes;
+        header.nbrRecords = nbrRecords;
+        data.Write(0, &header, sizeof(header));
+        data.Sync();
+        index.Truncate(nbrRecords * recordBytes);
+        index.Sync();
+        journal.Truncate(int64_t(nbrConsistent) * entryBytes);
+        journal.Sync();
+        return report;
+    }
+
+    inline Capture::CaptureFile::CaptureFile(std::string const& path, int64_t capacity, CommitPolicy const& policy)
+        : m_path(path)
+        , m_capacity(HeaderBytes + (capacity + HeaderBytes - 1) / HeaderBytes * HeaderBytes)
+        , m_policy(policy)
+        , m_index(path + ".idx", SyncedFile::Mode::Create)
+        , m_journal(path + ".jnl")
+        , m_pendingRecords()
+        , m_base(nullptr)
+        , m_committedEnd(HeaderBytes)
+        , m_durableEnd(HeaderBytes)
+        , m_lastCommitTime(Clock::now())
+        , m_reserved(false)
+        , m_statistics()
+#if defined(_WIN32)
+        , m_handle(INVALID_HANDLE_VALUE)
+        , m_mapping(nullptr)
+#else
+        , m_fd(-1)
+#endif
+    {
+        if (capacity <= 0 || policy.bytes < 0 || policy.interval.count() < 0)
+            throw std::invalid_argument("Invalid capture file configuration for " + path + ": capacity " + ToString(capacity) + ", commit every " + ToString(policy.bytes)
+                                        + " bytes or " + ToString(policy.interval.count()) + " ms");
+
+#if defined(_WIN32)
+        m_handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_handle == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Failed to create " + path + ": error " + ToString(GetLastError()));
+
+        // The mapping extends the file to its capacity.
+        m_mapping = CreateFileMappingA(m_handle, nullptr, PAGE_READWRITE, DWORD(uint64_t(m_capacity) >> 32), DWORD(uint64_t(m_capacity)), nullptr);
+        if (m_mapping != nullptr)
+            m_base = static_cast<char*>(MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, SIZE_T(m_capacity)));
+        if (m_base == nullptr)
+        {
+            DWORD const error = GetLastError();
+            Release();
+            throw std::runtime_error("Failed to map " + ToString(m_capacity) + " bytes of " + path + ": error " + ToString(error));
+        }
+#else
+        m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (m_fd < 0)
+            throw std::runtime_error("Failed to create " + path + ": " + std::strerror(errno));
+
+        // Allocate the blocks now: a write fault on a full file system would otherwise be a SIGBUS in the driver.
+        int const error = posix_fallocate(m_fd, 0, off_t(m_capacity));
+        if (error != 0)
+        {
+            Release();
+            throw std::runtime_error("Failed to preallocate " + ToString(m_capacity) + " bytes for " + path + ": " + std::strerror(error));
+        }
+
+        void* const base = ::mmap(nullptr, size_t(m_capacity), PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        if (base == MAP_FAILED)
+        {
+            int const mapError = errno;
+            Release();
+            throw std::runtime_error("Failed to map " + ToString(m_capacity) + " bytes of " + path + ": " + std::strerror(mapError));
+        }
+        m_base = static_cast<char*>(base);
+        ::madvise(m_base, size_t(m_capacity), MADV_SEQUENTIAL);
+#endif
+
+        UpdateHeader();
+    }
+
+    inline Capture::CaptureFile::~CaptureFile()
+    {
+        try
+        {
+            Close();
+        }
+        catch (std::exception const&)
+        {
+            Release();
+        }
+    }
+
+    inline Capture::Reservation Capture::CaptureFile::Reserve(int64_t nbrElements)
+    {
+        if (m_base == nullptr)
+            throw std::logic_error("Capture file " + m_path + " is closed");
+
+        FlushIfDue();
+        if (GetFreeElements() < nbrElements)
+            throw std::runtime_error("Capture file " + m_path + " is full: " + ToString(GetFreeElements()) + " free elements, " + ToString(nbrElements) + " requested");
+
+        m_reserved = true;
+        Reservation const reservation = { reinterpret_cast<int32_t*>(m_base + m_committedEnd), GetFreeElements() };
+        return reservation;
+    }
+
+    inline int64_t Capture::CaptureFile::Commit(ArraySegment<int32_t> const& segment)
+    {
+        if (!m_reserved)
+            throw std::logic_error("Commit without reservation in capture file " + m_path);
+
+        char const* const begin = reinterpret_cast<char const*>(segment.GetData());
+        int64_t const offset = begin - m_base;
+        int64_t const size = int64_t(segment.Size() * sizeof(int32_t));
+        if (offset < m_committedEnd || m_capacity < offset + size)
+            throw std::logic_error("Committed segment is out of the reservation of capture file " + m_path);
+
+        m_reserved = false;
+        m_statistics.gapBytes += offset - m_committedEnd;
+        m_statistics.committedBytes += size;
+        ++m_statistics.nbrCommits;
+        m_committedEnd = offset + size;
+        return offset;
+    }
+
+    inline void Capture::CaptureFile::Discard()
+    {
+        if (m_reserved)
+            ++m_statistics.nbrDiscards;
+        m_reserved = false;
+    }
+
+    inline void Capture::CaptureFile::AddRecord(RecordHeader const& header)
+    {
+        m_pendingRecords.push_back(header);
+        ++m_statistics.nbrRecords;
+    }
+
+    inline void Capture::CaptureFile::Flush()
+    {
+        if (m_base == nullptr)
+            return;
+
+        Clock::time_point const start = Clock::now();
+        m_lastCommitTime = start;
+        if (m_committedEnd == m_durableEnd && m_pendingRecords.empty())
+            return;
+
+        // Data and records first: the journal entry must only describe bytes already on the drive.
+        JournalEntry entry = {};
+        entry.dataEnd = m_committedEnd;
+        entry.nbrRecords = m_statistics.nbrRecords;
+        entry.dataCrc = Crc32c(m_base + m_durableEnd, size_t(m_committedEnd - m_durableEnd));
+        entry.indexCrc = Crc32c(m_pendingRecords.data(), m_pendingRecords.size() * sizeof(RecordHeader));
+        FlushRange(m_durableEnd, m_committedEnd, true);
+        m_index.Append(m_pendingRecords.data(), m_pendingRecords.size() * sizeof(RecordHeader));
+        m_index.Sync();
+        m_journal.Append(entry);
+
+        m_pendingRecords.clear();
+        m_durableEnd = m_committedEnd;
+        UpdateHeader();
+        ++m_statistics.nbrGroupCommits;
+        m_statistics.commitSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    inline bool Capture::CaptureFile::FlushIfDue()
+    {
+        bool const bytesDue = m_policy.bytes > 0 && m_committedEnd - m_durableEnd >= m_policy.bytes;
+        bool const timeDue = m_policy.interval.count() > 0 && Clock::now() - m_lastCommitTime >= m_policy.interval;
+        if (!bytesDue && !timeDue)
+            return false;
+
+        Flush();
+        return true;
+    }
+
+    inline void Capture::CaptureFile::Close()
+    {
+        if (m_base == nullptr)
+            return;
+
+        m_reserved = false;
+        Flush();
+        FlushRange(0, HeaderBytes, true);
+
+        // Unmap before truncating: the mapping covers the whole capacity.
+        int64_t const committedEnd = m_committedEnd;
+#if defined(_WIN32)
+        UnmapViewOfFile(m_base);
+        m_base = nullptr;
+        CloseHandle(m_mapping);
+        m_mapping = nullptr;
+
+        LARGE_INTEGER end;
+        end.QuadPart = committedEnd;
+        bool const truncated = SetFilePointerEx(m_handle, end, nullptr, FILE_BEGIN) && SetEndOfFile(m_handle);
+        DWORD const error = GetLastError();
+        Release();
+        if (!truncated)
+            throw std::runtime_error("Failed to truncate " + m_path + " to " + ToString(committedEnd) + " bytes: error " + ToString(error));
+#else
+        ::munmap(m_base, size_t(m_capacity));
+        m_base = nullptr;
+
+        bool const truncated = (::ftruncate(m_fd, off_t(committedEnd)) == 0);
+        int const error = errno;
+        Release();
+        if (!truncated)
+            throw std::runtime_error("Failed to truncate " + m_path + " to " + ToString(committedEnd) + " bytes: " + std::strerror(error));
+#endif
+    }
+
+    inline void Capture::CaptureFile::FlushRange(int64_t begin, int64_t end, bool wait)
+    {
+        // Flushes start on a page boundary.
+        static int64_t const PageBytes = 4096;
+        begin = begin / PageBytes * PageBytes;
+        if (end <= begin)
+            return;
+
+#if defined(_WIN32)
+        // FlushViewOfFile starts the write-back of the dirty pages, FlushFileBuffers waits for it.
+        if (!FlushViewOfFile(m_base + begin, SIZE_T(end - begin)) || (wait && !FlushFileBuffers(m_handle)))
+            throw std::runtime_error("Failed to flush " + m_path + ": error " + ToString(GetLastError()));
+#else
+        if (::msync(m_base + begin, size_t(end - begin), wait ? MS_SYNC : MS_ASYNC) != 0)
+            throw std::runtime_error("Failed to flush " + m_path + ": " + std::strerror(errno));
+#endif
+    }
+
+    inline void Capture::CaptureFile::UpdateHeader()
+    {
+        FileHeader header;
+        std::memcpy(header.magic, "AQCAPTUR", sizeof(header.magic));
+        header.version = FileHeader::CurrentVersion;
+        header.headerBytes = uint32_t(HeaderBytes);
+        header.dataBytes = m_committedEnd - HeaderBytes;
+        header.nbrRecords = m_statistics.nbrRecords;
+        std::memcpy(m_base, &header, sizeof(header));
+        FlushRange(0, HeaderBytes, false);
+    }
+
+    inline void Capture::CaptureFile::Release()
+    {
+#if defined(_WIN32)
+        if (m_base != nullptr)
+            UnmapViewOfFile(m_base);
+        if (m_mapping != nullptr)
+            CloseHandle(m_mapping);
+        if (m_handle != INVALID_HANDLE_VALUE)
+            CloseHandle(m_handle);
+        m_mapping = nullptr;
+        m_handle = INVALID_HANDLE_VALUE;
+#else
+        if (m_base != nullptr)
+            ::munmap(m_base, size_t(m_capacity));
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_fd = -1;
+#endif
+        m_base = nullptr;
+    }
+}
+
+#endif
@@ -0,0 +1,392 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// CaptureJournal: append-only journal of the committed ranges of a capture file and their CRC32C,
+// written with group commit, and the synced file it is written to.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_CAPTUREJOURNAL_H
+#define LIBTOOL_CAPTUREJOURNAL_H
+
+#include "LibTool.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__SSE4_2__) || defined(__AVX__)
+#include <nmmintrin.h>
+#endif
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace LibTool
+{
+    namespace Capture
+    {
+        //! Return the CRC32C (Castagnoli) of size bytes of data, following crc (the CRC of the preceding bytes).
+        /*! Uses the SSE4.2 crc32 instruction when the build targets it (-msse4.2, /arch:AVX), slicing-by-8 tables otherwise.*/
+        uint32_t Crc32c(void const* data, size_t size, uint32_t crc = 0);
+
+        //! Entry of the capture journal, written at every group commit.
+        /*! An entry is valid only if its magic and its own CRC match: a torn write at the tail of the journal is detected.*/
+        struct JournalEntry
+        {
+            static uint32_t const Magic = 0x4c4e4a41;   // "AJNL"
+
+            uint64_t sequence;          //!< index of the entry in the journal.
+            int64_t dataEnd;            //!< end of the committed data, in bytes from the start of the capture file.
+            int64_t nbrRecords;         //!< number of records in the index file.
+            uint32_t dataCrc;           //!< CRC32C of the capture file bytes from the previous dataEnd to dataEnd.
+            uint32_t indexCrc;          //!< CRC32C of the index records added since the previous entry.
+            uint32_t magic;
+            uint32_t entryCrc;          //!< CRC32C of the fields above.
+
+            //! Set magic and entryCrc.
+            void Seal();
+
+            //! Tell whether magic and entryCrc match the entry.
+            bool IsSealed() const;
+        };
+
+        //! File written by appending, synced to the drive on demand.
+        class SyncedFile
+        {
+        public:
+            enum class Mode
+            {
+                Create,     //!< create or truncate.
+                Open,       //!< open an existing file.
+            };
+
+            //! Open path for reading and writing.
+            /*! \throw #std::runtime_error if path cannot be opened.*/
+            explicit SyncedFile(std::string const& path, Mode mode);
+            ~SyncedFile();
+
+            SyncedFile(SyncedFile const&) = delete;
+            SyncedFile& operator=(SyncedFile const&) = delete;
+
+            //! Write size bytes of data at the end of the file.
+            void Append(void const* data, size_t size);
+
+            //! Write size bytes of data at offset.
+            void Write(int64_t offset, void const* data, size_t size);
+
+            //! Read up to size bytes at offset into data, and return the number of bytes read.
+            size_t Read(int64_t offset, void* data, size_t size) const;
+
+            //! Wait until the data written so far are on the drive.
+            void Sync();
+
+            //! Set the size of the file, and move the end of the file there.
+            void Truncate(int64_t size);
+
+            int64_t GetSize() const
+            { return m_size; }
+
+            std::string const& GetPath() const
+            { return m_path; }
+
+        private:
+            std::string const m_path;
+            int64_t m_size;
+#if defined(_WIN32)
+            HANDLE m_handle;
+#else
+            int m_fd;
+#endif
+        };
+
+        //! Append-only journal of the group commits of a capture file.
+        /*! Every #Append is one write and one sync of the journal: call it once per group commit, after syncing the data it
+            describes, so that an entry on the drive always describes data on the drive.*/
+        class CaptureJournal
+        {
+        public:
+            //! Create (or truncate) the journal path.
+            explicit CaptureJournal(std::string const& path);
+
+            //! Seal entry with the next sequence number, append it and sync the journal.
+            void Append(JournalEntry entry);
+
+            //! Return the number of entries written.
+            uint64_t GetNbrEntries() const
+            { return m_nbrEntries; }
+
+            //! Return the entries of the journal file up to the first invalid one (torn tail), see #JournalEntry::IsSealed.
+            static std::vector<JournalEntry> Load(SyncedFile const& file);
+
+        private:
+            SyncedFile m_file;
+            uint64_t m_nbrEntries;
+        };
+    }
+
+    ///////
+    // Capture journal member definitions
+    //
+
+    inline uint32_t Capture::Crc32c(void const* data, size_t size, uint32_t crc)
+    {
+        uint8_t const* bytes = static_cast<uint8_t const*>(data);
+        uint32_t value = ~crc;
+
+#if defined(__SSE4_2__) || defined(__AVX__)
+#if defined(_M_X64) || defined(__x86_64__)
+        uint64_t value64 = value;
+        for (; size >= 8; size -= 8, bytes += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, bytes, sizeof(word));
+            value64 = _mm_crc32_u64(value64, word);
+        }
+        value = uint32_t(value64);
+#endif
+        for (; size > 0; --size, ++bytes)
+            value = _mm_crc32_u8(value, *bytes);
+#else
+        // Slicing-by-8: 8 bytes per iteration through 8 tables of the reflected polynomial 0x82f63b78.
+        struct Tables
+        {
+            uint32_t values[8][256];
+
+            Tables()
+            {
+                for (uint32_t i = 0; i < 256; ++i)
+                {
+                    uint32_t entry = i;
+                    for (int bit = 0; bit < 8; ++bit)
+                        entry = (entry >> 1) ^ ((entry & 1u) ? 0x82f63b78u : 0u);
+                    values[0][i] = entry;
+                }
+                for (uint32_t i = 0; i < 256; ++i)
+                    for (int slice = 1; slice < 8; ++slice)
+                        values[slice][i] = (values[slice - 1][i] >> 8) ^ values[0][values[slice - 1][i] & 0xff];
+            }
+        };
+        static Tables const tables;
+        uint32_t const (*const t)[256] = tables.values;
+
+        for (; size >= 8; size -= 8, bytes += 8)
+        {
+            uint32_t const low = value ^ (uint32_t(bytes[0]) | uint32_t(bytes[1]) << 8 | uint32_t(bytes[2]) << 16 | uint32_t(bytes[3]) << 24);
+            value = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24]
+                  ^ t[3][bytes[4]] ^ t[2][bytes[5]] ^ t[1][bytes[6]] ^ t[0][bytes[7]];
+        }
+        for (; size > 0; --size, ++bytes)
+            value = (value >> 8) ^ t[0][(value ^ *bytes) & 0xff];
+#endif
+        return ~value;
+    }
+
+    inline void Capture::JournalEntry::Seal()
+    {
+        magic = Magic;
+        entryCrc = Crc32c(this, offsetof(JournalEntry, entryCrc));
+    }
+
+    inline bool Capture::JournalEntry::IsSealed() const
+    {
+        return magic == Magic && entryCrc == Crc32c(this, offsetof(JournalEntry, entryCrc));
+    }
+
+#if defined(_WIN32)
+
+    inline Capture::SyncedFile::SyncedFile(std::string const& path, Mode mode)
+        : m_path(path)
+        , m_size(0)
+        , m_handle(INVALID_HANDLE_VALUE)
+    {
+        DWORD const disposition = (mode == Mode::Create) ? CREATE_ALWAYS : OPEN_EXISTING;
+        m_handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, disposition, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_handle == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Failed to open " + path + ": error " + ToString(GetLastError()));
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_handle, &size))
+        {
+            DWORD const error = GetLastError();
+            CloseHandle(m_handle);
+            throw std::runtime_error("Failed to get the size of " + path + ": error " + ToString(error));
+        }
+        m_size = size.QuadPart;
+    }
+
+    inline Capture::SyncedFile::~SyncedFile()
+    {
+        CloseHandle(m_handle);
+    }
+
+    inline void Capture::SyncedFile::Write(int64_t offset, void const* data, size_t size)
+    {
+        char const* bytes = static_cast<char const*>(data);
+        while (size > 0)
+        {
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = DWORD(uint64_t(offset));
+            overlapped.OffsetHigh = DWORD(uint64_t(offset) >> 32);
+            DWORD const request = DWORD((std::min)(size, size_t(1) << 30));
+            DWORD written = 0;
+            if (!WriteFile(m_handle, bytes, request, &written, &overlapped) || written == 0)
+                throw std::runtime_error("Failed to write " + ToString(size) + " bytes at offset " + ToString(offset) + " of " + m_path + ": error " + ToString(GetLastError()));
+            bytes += written;
+            offset += written;
+            size -= written;
+            m_size = (std::max)(m_size, offset);
+        }
+    }
+
+    inline size_t Capture::SyncedFile::Read(int64_t offset, void* data, size_t size) const
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = DWORD(uint64_t(offset));
+        overlapped.OffsetHigh = DWORD(uint64_t(offset) >> 32);
+        DWORD read = 0;
+        if (!ReadFile(m_handle, data, DWORD((std::min)(size, size_t(1) << 30)), &read, &overlapped) && GetLastError() != ERROR_HANDLE_EOF)
+            throw std::runtime_error("Failed to read " + ToString(size) + " bytes at offset " + ToString(offset) + " of " + m_path + ": error " + ToString(GetLastError()));
+        return size_t(read);
+    }
+
+    inline void Capture::SyncedFile::Sync()
+    {
+        if (!FlushFileBuffers(m_handle))
+            throw std::runtime_error("Failed to sync " + m_path + ": error " + ToString(GetLastError()));
+    }
+
+    inline void Capture::SyncedFile::Truncate(int64_t size)
+    {
+        LARGE_INTEGER end;
+        end.QuadPart = size;
+        if (!SetFilePointerEx(m_handle, end, nullptr, FILE_BEGIN) || !SetEndOfFile(m_handle))
+            throw std::runtime_error("Failed to truncate " + m_path + " to " + ToString(size) + " bytes: error " + ToString(GetLastError()));
+        m_size = size;
+    }
+
+#else
+
+    inline Capture::SyncedFile::SyncedFile(std::string const& path, Mode mode)
+        : m_path(path)
+        , m_size(0)
+        , m_fd(-1)
+    {
+        int const flags = (mode == Mode::Create) ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR;
+        m_fd = ::open(path.c_str(), flags, 0644);
+        if (m_fd < 0)
+            throw std::runtime_error("Failed to open " + path + ": " + std::strerror(errno));
+
+        struct stat status;
+        if (::fstat(m_fd, &status) != 0)
+        {
+            int const error = errno;
+            ::close(m_fd);
+            throw std::runtime_error("Failed to get the size of " + path + ": " + std::strerror(error));
+        }
+        m_size = int64_t(status.st_size);
+    }
+
+    inline Capture::SyncedFile::~SyncedFile()
+    {
+        ::close(m_fd);
+    }
+
+    inline void Capture::SyncedFile::Write(int64_t offset, void const* data, size_t size)
+    {
+        char const* bytes = static_cast<char const*>(data);
+        while (size > 0)
+        {
+            ssize_t const written = ::pwrite(m_fd, bytes, size, off_t(offset));
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                throw std::runtime_error("Failed to write " + ToString(size) + " bytes at offset " + ToString(offset) + " of " + m_path + ": " + std::strerror(errno));
+            bytes += written;
+            offset += written;
+            size -= size_t(written);
+            m_size = (std::max)(m_size, offset);
+        }
+    }
+
+    inline size_t Capture::SyncedFile::Read(int64_t offset, void* data, size_t size) const
+    {
+        ssize_t read;
+        do
+        {
+            read = ::pread(m_fd, data, size, off_t(offset));
+        } while (read < 0 && errno == EINTR);
+
+        if (read < 0)
+            throw std::runtime_error("Failed to read " + ToString(size) + " bytes at offset " + ToString(offset) + " of " + m_path + ": " + std::strerror(errno));
+        return size_t(read);
+    }
+
+    inline void Capture::SyncedFile::Sync()
+    {
+#if defined(__linux__)
+        int const result = ::fdatasync(m_fd);
+#else
+        int const result = ::fsync(m_fd);
+#endif
+        if (result != 0)
+            throw std::runtime_error("Failed to sync " + m_path + ": " + std::strerror(errno));
+    }
+
+    inline void Capture::SyncedFile::Truncate(int64_t size)
+    {
+        if (::ftruncate(m_fd, off_t(size)) != 0)
+            throw std::runtime_error("Failed to truncate " + m_path + " to " + ToString(size) + " bytes: " + std::strerror(errno));
+        m_size = size;
+    }
+
+#endif
+
+    inline void Capture::SyncedFile::Append(void const* data, size_t size)
+    {
+        Write(m_size, data, size);
+    }
+
+    inline Capture::CaptureJournal::CaptureJournal(std::string const& path)
+        : m_file(path, SyncedFile::Mode::Create)
+        , m_nbrEntries(0)
+    {}
+
+    inline void Capture::CaptureJournal::Append(JournalEntry entry)
+    {
+        entry.sequence = m_nbrEntries;
+        entry.Seal();
+        m_file.Append(&entry, sizeof(entry));
+        m_file.Sync();
+        ++m_nbrEntries;
+    }
+
+    inline std::vector<Capture::JournalEntry> Capture::CaptureJournal::Load(SyncedFile const& file)
+    {
+        std::vector<JournalEntry> entries;
+        JournalEntry entry;
+        while (file.Read(int64_t(entries.size() * sizeof(entry)), &entry, sizeof(entry)) == sizeof(entry))
+        {
+            if (!entry.IsSealed() || entry.sequence != entries.size())
+                break;
+            if (!entries.empty() && (entry.dataEnd < entries.back().dataEnd || entry.nbrRecords < entries.back().nbrRecords))
+                break;
+            entries.push_back(entry);
+        }
+        return entries;
+    }
+}
+
+#endif
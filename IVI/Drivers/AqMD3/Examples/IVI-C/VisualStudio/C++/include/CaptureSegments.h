@@ -0,0 +1,472 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// CaptureSegments: raw capture split into numbered, preallocated segment files rolled over by size
+// or duration, with a manifest of the records and times of every segment.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_CAPTURESEGMENTS_H
+#define LIBTOOL_CAPTURESEGMENTS_H
+
+#include "LibTool.h"
+#include "CaptureFile.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace LibTool
+{
+    namespace Capture
+    {
+        //! Rollover policy of a segmented capture.
+        struct SegmentPolicy
+        {
+            int64_t segmentBytes = int64_t(4) << 30;                            //!< capacity of a segment file.
+            std::chrono::seconds segmentDuration = std::chrono::seconds(0);     //!< time covered by a segment, 0 for no limit.
+            CommitPolicy commit;                                                //!< group commit of every segment.
+        };
+
+        //! Records and times of a segment, as listed in the manifest.
+        struct SegmentInfo
+        {
+            uint64_t segment = 0;               //!< segment number.
+            std::string path;                   //!< path of the segment file.
+            uint64_t firstRecordIndex = 0;
+            int64_t nbrRecords = 0;
+            uint64_t firstTimestamp = 0;        //!< absolute sample index of the first record.
+            uint64_t lastTimestamp = 0;         //!< absolute sample index of the last record.
+            int64_t committedBytes = 0;         //!< sample bytes of the segment.
+
+            //! Tell whether recordIndex is in the segment.
+            bool HasRecord(uint64_t recordIndex) const
+            { return nbrRecords > 0 && firstRecordIndex <= recordIndex && recordIndex - firstRecordIndex < uint64_t(nbrRecords); }
+        };
+
+        //! Segmented capture statistics.
+        struct SegmentStatistics
+        {
+            uint64_t nbrSegments = 0;           //!< segments written, the current one included.
+            double rolloverWaitSeconds = 0.0;   //!< time the write path waited for the next segment.
+            double maxRolloverWaitSeconds = 0.0;
+            Statistics capture;                 //!< totals of the segment files.
+
+            void Print(std::ostream& output) const;
+        };
+
+        //! Raw capture written to a sequence of #CaptureFile segments.
+        /*! A single capture file for a multi-hour run is hard to handle, and growing one makes the file system allocate extents in
+            the write path. #SegmentedCapture writes numbered segments (prefix_00000.cap, prefix_00001.cap, ...) of
+            #SegmentPolicy::segmentBytes each, and rolls over to the next one when the current one is full or covers
+            #SegmentPolicy::segmentDuration:
+
+                Capture::SegmentedCapture capture("streaming", policy);
+
+                Capture::Reservation const reservation = capture.Reserve(nbrElements + sampleReader.GetBufferOverhead());
+                // ... fetch, Commit and AddRecord as with a #CaptureFile ...
+
+            The next segment is created and preallocated in the background while the current one is written, and the full one is
+            closed (last group commit, truncation) in the background too: rollover only swaps the mapping in the write path. The
+            manifest (prefix.manifest) gets one line per closed segment with its record and timestamp ranges; see #LoadManifest.
+            Every segment has its own index and journal, so that segments can be shipped, deleted or recovered independently.
+            After a crash, the segment being written is missing from the manifest: recover it with #Recover, then list it with
+            #AppendManifest (see CPP_Tool_CaptureRecovery).
+
+            Rollover happens in #Reserve only: the records of a batch always lie in the segment of their samples, and the
+            dataOffset of their headers is an offset in that segment. One thread reserves, commits and adds records.
+        */
+        class SegmentedCapture
+        {
+        public:
+            //! Create the first segment and the manifest, and start preparing the next segment.
+            /*! \throw #std::runtime_error if the files cannot be created.*/
+            explicit SegmentedCapture(std::string const& prefix, SegmentPolicy const& policy = SegmentPolicy());
+
+            //! Close the capture, see #Close. Errors are ignored.
+            ~SegmentedCapture();
+
+            SegmentedCapture(SegmentedCapture const&) = delete;
+            SegmentedCapture& operator=(SegmentedCapture const&) = delete;
+
+            //! Return at least nbrElements free elements of the current segment, after a rollover if needed.
+            /*! \throw #std::invalid_argument if nbrElements does not fit in a segment.
+                \throw #std::runtime_error if the next segment could not be created or the previous one closed.*/
+            Reservation Reserve(int64_t nbrElements);
+
+            //! Commit segment of the current reservation, see #CaptureFile::Commit.
+            /*! \return the offset of the segment in the current segment file, in bytes.*/
+            int64_t Commit(ArraySegment<int32_t> const& segment);
+
+            //! Release the current reservation without committing it.
+            void Discard();
+
+            //! Add header, whose dataOffset is in the current segment, to the index of the current segment.
+            void AddRecord(RecordHeader const& header);
+
+            //! Run a group commit of the current segment if due, see #CaptureFile::FlushIfDue.
+            bool FlushIfDue();
+
+            //! Close the current segment and wait for the background work, then delete the prepared segment. Further calls do nothing.
+            /*! \throw #std::runtime_error on I/O error.*/
+            void Close();
+
+            //! Return the number of the current segment.
+            uint64_t GetSegmentNumber() const
+            { return m_info.segment; }
+
+            std::string GetManifestPath() const
+            { return m_prefix + ".manifest"; }
+
+            //! Return the statistics of all segments.
+            SegmentStatistics GetStatistics() const;
+
+            //! Return the path of segment number of the capture prefix.
+            static std::string GetSegmentPath(std::string const& prefix, uint64_t number);
+
+            //! Return the segments listed in the manifest path.
+            /*! \throw #std::runtime_error if path cannot be read or is not a manifest.*/
+            static std::vector<SegmentInfo> LoadManifest(std::string const& path);
+
+            //! Append the line of info to the manifest path, e.g. for a segment recovered after a crash.
+            /*! \throw #std::runtime_error if path cannot be written.*/
+            static void AppendManifest(std::string const& path, SegmentInfo const& info);
+
+        private:
+            typedef std::chrono::steady_clock Clock;
+
+            //! Close the current segment in the background, and switch to the prepared one.
+            void Rollover();
+
+            //! Start creating and preallocating segment number in the background.
+            void Prepare(uint64_t number);
+
+            //! Return the prepared segment number, created now if its background preparation failed before.
+            /*! \throw #std::runtime_error if the segment cannot be created, the next call tries again.*/
+            std::unique_ptr<CaptureFile> TakeNext(uint64_t number);
+
+            //! Delete the prepared segment number, which is not used.
+            void DiscardNext(uint64_t number);
+
+            //! Wait for the segment being closed, and add its statistics.
+            void WaitClosing();
+
+            //! Append the line of info to the manifest.
+            void WriteManifest(SegmentInfo const& info);
+
+            //! Write the manifest line of info to output.
+            static void PrintManifestLine(std::ostream& output, SegmentInfo const& info);
+
+            //! Delete the files of a segment.
+            static void RemoveSegment(std::string const& path);
+
+            std::string const m_prefix;
+            SegmentPolicy const m_policy;
+            std::ofstream m_manifest;               //!< written by the closing task only, one at a time.
+            std::unique_ptr<CaptureFile> m_current;
+            SegmentInfo m_info;                     //!< of the current segment.
+            Clock::time_point m_segmentStart;
+            std::future<std::unique_ptr<CaptureFile>> m_next;
+            std::future<Statistics> m_closing;
+            Statistics m_closedStatistics;          //!< totals of the closed segments.
+            SegmentStatistics m_statistics;         //!< rollover counters (capture totals computed on demand).
+        };
+    }
+
+    ///////
+    // Segmented capture member definitions
+    //
+
+    inline void Capture::SegmentStatistics::Print(std::ostream& output) const
+    {
+        output << "\nSegmented capture\n";
+        output << "  Segments:           " << nbrSegments << '\n';
+        output << "  Rollover wait:      " << rolloverWaitSeconds << " s (max " << maxRolloverWaitSeconds * 1e3 << " ms)\n";
+        capture.Print(output);
+    }
+
+    inline Capture::SegmentedCapture::SegmentedCapture(std::string const& prefix, SegmentPolicy const& policy)
+        : m_prefix(prefix)
+        , m_policy(policy)
+        , m_manifest(prefix + ".manifest", std::ios::trunc)
+        , m_current()
+        , m_info()
+        , m_segmentStart(Clock::now())
+        , m_next()
+        , m_closing()
+        , m_closedStatistics()
+        , m_statistics()
+    {
+        if (policy.segmentBytes <= 0 || policy.segmentDuration.count() < 0)
+            throw std::invalid_argument("Invalid segment policy for " + prefix + ": " + ToString(policy.segmentBytes) + " bytes, " + ToString(policy.segmentDuration.count()) + " s");
+        if (!m_manifest)
+            throw std::runtime_error("Failed to create " + GetManifestPath());
+
+        m_manifest << "segment,path,firstRecordIndex,nbrRecords,firstTimestamp,lastTimestamp,committedBytes\n" << std::flush;
+
+        m_info.path = GetSegmentPath(prefix, 0);
+        m_current.reset(new CaptureFile(m_info.path, policy.segmentBytes, policy.commit));
+        m_statistics.nbrSegments = 1;
+        Prepare(1);
+    }
+
+    inline Capture::SegmentedCapture::~SegmentedCapture()
+    {
+        try
+        {
+            Close();
+        }
+        catch (std::exception const&)
+        {
+        }
+    }
+
+    inline Capture::Reservation Capture::SegmentedCapture::Reserve(int64_t nbrElements)
+    {
+        if (!m_current)
+            throw std::logic_error("Segmented capture " + m_prefix + " is closed");
+
+        if (nbrElements * int64_t(sizeof(int32_t)) > m_policy.segmentBytes)
+            throw std::invalid_argument("Reservation of " + ToString(nbrElements) + " elements exceeds the segments of " + m_prefix);
+
+        bool const isFull = m_current->GetFreeElements() < nbrElements;
+        bool const isOld = m_policy.segmentDuration.count() > 0 && m_info.nbrRecords > 0 && Clock::now() - m_segmentStart >= m_policy.segmentDuration;
+        if (isFull || isOld)
+            Rollover();
+
+        return m_current->Reserve(nbrElements);
+    }
+
+    inline int64_t Capture::SegmentedCapture::Commit(ArraySegment<int32_t> const& segment)
+    {
+        return m_current->Commit(segment);
+    }
+
+    inline void Capture::SegmentedCapture::Discard()
+    {
+        if (m_current)
+            m_current->Discard();
+    }
+
+    inline void Capture::SegmentedCapture::AddRecord(RecordHeader const& header)
+    {
+        m_current->AddRecord(header);
+
+        if (m_info.nbrRecords == 0)
+        {
+            m_info.firstRecordIndex = header.recordIndex;
+            m_info.firstTimestamp = header.absoluteSampleIndex;
+        }
+        m_info.lastTimestamp = header.absoluteSampleIndex;
+        ++m_info.nbrRecords;
+    }
+
+    inline bool Capture::SegmentedCapture::FlushIfDue()
+    {
+        return m_current && m_current->FlushIfDue();
+    }
+
+    inline void Capture::SegmentedCapture::Close()
+    {
+        if (!m_current)
+            return;
+
+        // The prepared segment is never used: delete it even if closing fails.
+        std::unique_ptr<CaptureFile> current = std::move(m_current);
+        try
+        {
+            WaitClosing();
+
+            current->Close();
+            m_info.committedBytes = current->GetStatistics().committedBytes;
+            WriteManifest(m_info);
+            m_closedStatistics.Add(current->GetStatistics());
+        }
+        catch (...)
+        {
+            DiscardNext(m_info.segment + 1);
+            throw;
+        }
+        DiscardNext(m_info.segment + 1);
+    }
+
+    inline Capture::SegmentStatistics Capture::SegmentedCapture::GetStatistics() const
+    {
+        SegmentStatistics statistics = m_statistics;
+        statistics.capture = m_closedStatistics;
+        if (m_current)
+            statistics.capture.Add(m_current->GetStatistics());
+        return statistics;
+    }
+
+    inline std::string Capture::SegmentedCapture::GetSegmentPath(std::string const& prefix, uint64_t number)
+    {
+        std::ostringstream path;
+        path << prefix << '_' << std::setw(5) << std::setfill('0') << number << ".cap";
+        return path.str();
+    }
+
+    inline std::vector<Capture::SegmentInfo> Capture::SegmentedCapture::LoadManifest(std::string const& path)
+    {
+        std::ifstream input(path);
+        std::string line;
+        if (!std::getline(input, line) || line.compare(0, 8, "segment,") != 0)
+            throw std::runtime_error(path + " is not a capture manifest");
+
+        std::vector<SegmentInfo> segments;
+        while (std::getline(input, line))
+        {
+            if (line.empty())
+                continue;
+
+            std::vector<std::string> fields;
+            std::istringstream input(line);
+            for (std::string field; std::getline(input, field, ',');)
+                fields.push_back(field);
+
+            SegmentInfo info;
+            try
+            {
+                if (fields.size() != 7)
+                    throw std::invalid_argument(line);
+                info.segment = std::stoull(fields[0]);
+                info.path = fields[1];
+                info.firstRecordIndex = std::stoull(fields[2]);
+                info.nbrRecords = std::stoll(fields[3]);
+                info.firstTimestamp = std::stoull(fields[4]);
+                info.lastTimestamp = std::stoull(fields[5]);
+                info.committedBytes = std::stoll(fields[6]);
+            }
+            catch (std::logic_error const&)
+            {
+                throw std::runtime_error("Invalid line in capture manifest " + path + ": " + line);
+            }
+            segments.push_back(info);
+        }
+        return segments;
+    }
+
+    inline void Capture::SegmentedCapture::AppendManifest(std::string const& path, SegmentInfo const& info)
+    {
+        std::ofstream output(path, std::ios::app);
+        PrintManifestLine(output, info);
+        output.flush();
+        if (!output)
+            throw std::runtime_error("Failed to write " + path);
+    }
+
+    inline void Capture::SegmentedCapture::Rollover()
+    {
+        // Usually ready long before: the wait is the time the drive took to preallocate beyond one segment of data.
+        Clock::time_point const start = Clock::now();
+        std::unique_ptr<CaptureFile> next = TakeNext(m_info.segment + 1);
+        WaitClosing();
+        double const waitSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+        m_statistics.rolloverWaitSeconds += waitSeconds;
+        m_statistics.maxRolloverWaitSeconds = (std::max)(m_statistics.maxRolloverWaitSeconds, waitSeconds);
+
+        // Hand the full segment over to the background, which adds it to the manifest once closed.
+        std::shared_ptr<CaptureFile> const full(std::move(m_current));
+        SegmentInfo info = m_info;
+        m_closing = std::async(std::launch::async, [this, full, info]() mutable
+        {
+            full->Close();
+            info.committedBytes = full->GetStatistics().committedBytes;
+            WriteManifest(info);
+            return full->GetStatistics();
+        });
+
+        m_current = std::move(next);
+        m_info = SegmentInfo();
+        m_info.segment = info.segment + 1;
+        m_info.path = m_current->GetPath();
+        m_segmentStart = Clock::now();
+        ++m_statistics.nbrSegments;
+        Prepare(m_info.segment + 1);
+    }
+
+    inline void Capture::SegmentedCapture::Prepare(uint64_t number)
+    {
+        std::string const path = GetSegmentPath(m_prefix, number);
+        int64_t const segmentBytes = m_policy.segmentBytes;
+        CommitPolicy const commit = m_policy.commit;
+        m_next = std::async(std::launch::async, [path, segmentBytes, commit]()
+        {
+            return std::unique_ptr<CaptureFile>(new CaptureFile(path, segmentBytes, commit));
+        });
+    }
+
+    inline std::unique_ptr<Capture::CaptureFile> Capture::SegmentedCapture::TakeNext(uint64_t number)
+    {
+        // A failed preparation was reported by the previous call: try again, synchronously.
+        if (!m_next.valid())
+            Prepare(number);
+
+        try
+        {
+            return m_next.get();
+        }
+        catch (...)
+        {
+            RemoveSegment(GetSegmentPath(m_prefix, number));
+            throw;
+        }
+    }
+
+    inline void Capture::SegmentedCapture::DiscardNext(uint64_t number)
+    {
+        if (m_next.valid())
+        {
+            try
+            {
+                std::unique_ptr<CaptureFile> next = m_next.get();
+                next->Close();
+            }
+            catch (std::exception const&)
+            {
+                // the segment is deleted anyway.
+            }
+        }
+        RemoveSegment(GetSegmentPath(m_prefix, number));
+    }
+
+    inline void Capture::SegmentedCapture::WaitClosing()
+    {
+        if (!m_closing.valid())
+            return;
+
+        m_closedStatistics.Add(m_closing.get());
+    }
+
+    inline void Capture::SegmentedCapture::WriteManifest(SegmentInfo const& info)
+    {
+        PrintManifestLine(m_manifest, info);
+        m_manifest.flush();
+        if (!m_manifest)
+            throw std::runtime_error("Failed to write " + GetManifestPath());
+    }
+
+    inline void Capture::SegmentedCapture::PrintManifestLine(std::ostream& output, SegmentInfo const& info)
+    {
+        output << info.segment << ',' << info.path << ',' << info.firstRecordIndex << ',' << info.nbrRecords << ','
+               << info.firstTimestamp << ',' << info.lastTimestamp << ',' << info.committedBytes << '\n';
+    }
+
+    inline void Capture::SegmentedCapture::RemoveSegment(std::string const& path)
+    {
+        std::remove(path.c_str());
+        std::remove((path + ".idx").c_str());
+        std::remove((path + ".jnl").c_str());
+    }
+}
+
+#endif
@@ -0,0 +1,538 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// ClockCorrelation: host/device clock correlation (offset and drift) and trigger-to-result
+// latency percentiles for the streaming pipelines of the AqMD3 IVI-C examples.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_CLOCKCORRELATION_H
+#define LIBTOOL_CLOCKCORRELATION_H
+
+#include "LibTool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <iomanip>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace LibTool
+{
+    //! Correlation of the device timestamps with the host clock.
+    /*! Device time is the absolute sample index of markers multiplied by the timestamp period of the model. The host observes
+        the device clock each time a fetch returns: the newest device time available at that moment, read against the host
+        clock. Every observation is late by the transfer and polling delays, never early, so the host/device relation is the
+        lower envelope of the observations. #Correlator fits a line (offset and drift) to that envelope over a sliding
+        window, and #LatencyMonitor uses the fit to convert trigger timestamps of records into host time:
+
+            ClockCorrelation::LatencyMonitor latency;
+            ...
+            markers = Fetch(...);
+            latency.ObserveDeviceTime(newestMarker.GetInitialXTime(timestampPeriod) + recordDuration, fetchReturnTime);
+            ...
+            Process(record);
+            latency.RecordResult(marker.GetInitialXTime(timestampPeriod) + marker.GetInitialXOffset(sampleInterval));
+            ...
+            latency.Report(std::cout);
+
+        NOTE: the minimum delay between the moment data is complete on the device and the moment a fetch can return it cannot
+        be told apart from the clock offset without a shared time reference. It is part of the envelope, so measured latencies
+        exclude it. Use #LatencyMonitor::SetTransportDelay to add a known value.
+    */
+    namespace ClockCorrelation
+    {
+        typedef std::chrono::steady_clock HostClock;
+
+        //! One observation of the device clock: the newest device time known to the host at host time.
+        struct Observation
+        {
+            double deviceTime; //!< device time in seconds.
+            double hostTime;   //!< host time in seconds since the correlator epoch.
+
+            //! Return the apparent delay of the observation (host time minus device time).
+            double GetDelay() const
+            { return hostTime - deviceTime; }
+        };
+
+        //! Linear relation between device time and host time: host = device + offset + drift * (device - reference).
+        struct ClockFit
+        {
+            bool valid = false;              //!< false until the first observation.
+            double offset = 0.0;             //!< host minus device time at #referenceDeviceTime, in seconds.
+            double drift = 0.0;              //!< relative rate difference of the clocks (s/s).
+            double referenceDeviceTime = 0.0; //!< device time at which #offset applies.
+
+            //! Return the host time (seconds since the correlator epoch) corresponding to deviceTime.
+            double ToHostTime(double deviceTime) const
+            { return deviceTime + offset + drift * (deviceTime - referenceDeviceTime); }
+
+            //! Return the drift in parts per million.
+            double GetDriftPpm() const
+            { return drift * 1e6; }
+        };
+
+        //! Fit of the lower envelope of host/device clock observations.
+        /*! Observations are reduced to one per sampling interval (the one with the smallest delay), kept in a sliding window
+            of #windowSize points. The fit is the line supporting the lower convex hull of the window at its mean device time:
+            among lines below all observations, it minimizes the sum of residuals. Drift is estimated only once the window
+            spans #minDriftSpan seconds of device time.*/
+        class Correlator
+        {
+        public:
+            explicit Correlator(HostClock::duration samplingInterval = std::chrono::milliseconds(100), size_t windowSize = 256, double minDriftSpan = 1.0)
+                : m_epoch(HostClock::now())
+                , m_samplingInterval(samplingInterval)
+                , m_windowSize((std::max)(windowSize, size_t(2)))
+                , m_minDriftSpan(minDriftSpan)
+                , m_hasPending(false)
+                , m_pending()
+                , m_pendingStart()
+                , m_window()
+                , m_fit()
+                , m_jitter(0.0)
+                , m_nbrObservations(0)
+            {}
+
+            //! Return the host time origin of the correlator.
+            HostClock::time_point GetEpoch() const
+            { return m_epoch; }
+
+            //! Return hostTime in seconds since the correlator epoch.
+            double ToSeconds(HostClock::time_point hostTime) const
+            { return std::chrono::duration<double>(hostTime - m_epoch).count(); }
+
+            //! Feed an observation: deviceTime (seconds) is the newest device time known at hostTime.
+            void Observe(double deviceTime, HostClock::time_point hostTime);
+
+            //! Return the current fit.
+            ClockFit const& GetFit() const
+            { return m_fit; }
+
+            //! Return the median distance of the window observations above the fit (seconds).
+            double GetJitter() const
+            { return m_jitter; }
+
+            //! Return the number of observations fed to the correlator.
+            uint64_t GetObservationCount() const
+            { return m_nbrObservations; }
+
+            //! Return the number of points of the fitting window.
+            size_t GetWindowCount() const
+            { return m_window.size(); }
+
+        private:
+            //! Append the pending observation to the window and refit.
+            void CommitPending();
+
+            //! Fit the lower envelope of the window.
+            void Refit();
+
+            HostClock::time_point const m_epoch;
+            HostClock::duration const m_samplingInterval;
+            size_t const m_windowSize;
+            double const m_minDriftSpan;
+
+            bool m_hasPending;
+            Observation m_pending;
+            HostClock::time_point m_pendingStart;
+            std::deque<Observation> m_window;
+
+            ClockFit m_fit;
+            double m_jitter;
+            uint64_t m_nbrObservations;
+        };
+
+        //! Histogram of latencies with log-linear buckets, for percentiles at constant relative precision.
+        /*! Every octave above #minLatency is divided in #subBuckets linear buckets: the relative error of percentiles is
+            below 1/subBuckets. Values below #minLatency (including negative ones, which only occur when the clock fit is
+            off) fall in the first bucket; values above #maxLatency in the last one. Min, max and mean are exact.*/
+        class LatencyHistogram
+        {
+        public:
+            explicit LatencyHistogram(double minLatency = 1e-6, double maxLatency = 1000.0, int subBuckets = 32);
+
+            //! Account one latency, in seconds.
+            void Record(double latency);
+
+            //! Return the latency (seconds) below which percent of recorded latencies fall. Return 0 if the histogram is empty.
+            double GetPercentile(double percent) const;
+
+            //! Return the number of recorded latencies.
+            uint64_t GetCount() const
+            { return m_count; }
+
+            //! Return the number of recorded latencies which were negative.
+            uint64_t GetNegativeCount() const
+            { return m_nbrNegative; }
+
+            double GetMin() const
+            { return m_count ? m_min : 0.0; }
+
+            double GetMax() const
+            { return m_count ? m_max : 0.0; }
+
+            double GetMean() const
+            { return m_count ? m_sum / double(m_count) : 0.0; }
+
+            //! Clear all recorded latencies.
+            void Reset();
+
+        private:
+            //! Return the bucket index of latency.
+            size_t GetBucketIndex(double latency) const;
+
+            //! Return the lower bound of the bucket at index.
+            double GetBucketLowerBound(size_t index) const;
+
+            double const m_minLatency;
+            int const m_subBuckets;
+            int const m_nbrOctaves;
+            std::vector<uint64_t> m_buckets;
+            uint64_t m_count;
+            uint64_t m_nbrNegative;
+            double m_min;
+            double m_max;
+            double m_sum;
+        };
+
+        //! Trigger-to-result latency of records, measured in host time through the clock correlation.
+        class LatencyMonitor
+        {
+        public:
+            explicit LatencyMonitor(HostClock::duration samplingInterval = std::chrono::milliseconds(100), size_t windowSize = 256)
+                : m_correlator(samplingInterval, windowSize)
+                , m_histogram()
+                , m_transportDelay(0.0)
+                , m_nbrUnmeasured(0)
+            {}
+
+            //! Sample the host clock against the newest device time (seconds), preferably right after the fetch which returned it.
+            void ObserveDeviceTime(double deviceTime, HostClock::time_point hostTime = HostClock::now())
+            { m_correlator.Observe(deviceTime, hostTime); }
+
+            //! Account the result of a record whose trigger occurred at triggerDeviceTime (seconds), produced at hostTime.
+            /*! Records produced before the first observation cannot be converted to host time: they are only counted.*/
+            void RecordResult(double triggerDeviceTime, HostClock::time_point hostTime = HostClock::now());
+
+            //! Set the known minimum delay (seconds) between data completion on the device and its availability to fetch.
+            void SetTransportDelay(double delay)
+            { m_transportDelay = delay; }
+
+            Correlator const& GetCorrelator() const
+            { return m_correlator; }
+
+            LatencyHistogram const& GetHistogram() const
+            { return m_histogram; }
+
+            //! Return the number of records produced before the clock fit was available.
+            uint64_t GetUnmeasuredCount() const
+            { return m_nbrUnmeasured; }
+
+            //! Return a one-line summary of latency percentiles.
+            std::string FormatPercentiles() const;
+
+            //! Print the clock fit and the latency distribution.
+            void Report(std::ostream& output) const;
+
+        private:
+            Correlator m_correlator;
+            LatencyHistogram m_histogram;
+            double m_transportDelay;
+            uint64_t m_nbrUnmeasured;
+        };
+
+        //! Return latency (seconds) formatted with a suitable unit.
+        std::string FormatLatency(double latency);
+    }
+
+    ///////
+    // Correlator member definitions
+    //
+
+    inline void ClockCorrelation::Correlator::Observe(double deviceTime, HostClock::time_point hostTime)
+    {
+        Observation const observation = { deviceTime, ToSeconds(hostTime) };
+        ++m_nbrObservations;
+
+        if (!m_hasPending)
+        {
+            m_pending = observation;
+            m_pendingStart = hostTime;
+            m_hasPending = true;
+        }
+        else if (hostTime - m_pendingStart < m_samplingInterval)
+        {
+            // keep the least delayed observation of the sampling interval.
+            if (observation.GetDelay() < m_pending.GetDelay())
+                m_pending = observation;
+        }
+        else
+        {
+            CommitPending();
+            m_pending = observation;
+            m_pendingStart = hostTime;
+        }
+
+        // Until the window holds a point, an offset-only fit on the pending observation gives a usable estimate.
+        if (m_window.empty())
+        {
+            m_fit.valid = true;
+            m_fit.offset = m_pending.GetDelay();
+            m_fit.drift = 0.0;
+            m_fit.referenceDeviceTime = m_pending.deviceTime;
+        }
+    }
+
+    inline void ClockCorrelation::Correlator::CommitPending()
+    {
+        // Device time must increase through the window: a device reset restarts the correlation.
+        if (!m_window.empty() && m_pending.deviceTime <= m_window.back().deviceTime)
+            m_window.clear();
+
+        m_window.push_back(m_pending);
+        if (m_window.size() > m_windowSize)
+            m_window.pop_front();
+
+        Refit();
+    }
+
+    inline void ClockCorrelation::Correlator::Refit()
+    {
+        double const reference = m_window.front().deviceTime;
+        double const span = m_window.back().deviceTime - reference;
+
+        // Lower convex hull of (device time, delay) by monotone chain: points are already sorted by device time.
+        std::vector<Observation const*> hull;
+        hull.reserve(m_window.size());
+        double sumX = 0.0;
+        for (Observation const& point : m_window)
+        {
+            sumX += point.deviceTime - reference;
+            while (hull.size() >= 2)
+            {
+                Observation const& a = *hull[hull.size() - 2];
+                Observation const& b = *hull[hull.size() - 1];
+                double const cross = (b.deviceTime - a.deviceTime) * (point.GetDelay() - a.GetDelay()) - (b.GetDelay() - a.GetDelay()) * (point.deviceTime - a.deviceTime);
+                if (cross > 0.0)
+                    break;
+                hull.pop_back();
+            }
+            hull.push_back(&point);
+        }
+
+        double offset = 0.0;
+        double drift = 0.0;
+        if (hull.size() < 2 || span < m_minDriftSpan)
+        {
+            // Not enough device time to estimate drift: keep the previous drift and support the lowest point.
+            drift = m_fit.valid ? m_fit.drift : 0.0;
+            offset = std::numeric_limits<double>::infinity();
+            for (Observation const& point : m_window)
+                offset = (std::min)(offset, point.GetDelay() - drift * (point.deviceTime - reference));
+        }
+        else
+        {
+            // The edge of the hull spanning the mean device time supports the envelope with the minimum sum of residuals.
+            double const meanX = reference + sumX / double(m_window.size());
+            size_t edge = 0;
+            while (edge + 2 < hull.size() && hull[edge + 1]->deviceTime < meanX)
+                ++edge;
+
+            Observation const& a = *hull[edge];
+            Observation const& b = *hull[edge + 1];
+            drift = (b.GetDelay() - a.GetDelay()) / (b.deviceTime - a.deviceTime);
+            offset = a.GetDelay() + drift * (reference - a.deviceTime);
+        }
+
+        m_fit.valid = true;
+        m_fit.offset = offset;
+        m_fit.drift = drift;
+        m_fit.referenceDeviceTime = reference;
+
+        std::vector<double> residuals;
+        residuals.reserve(m_window.size());
+        for (Observation const& point : m_window)
+            residuals.push_back(point.hostTime - m_fit.ToHostTime(point.deviceTime));
+        std::nth_element(residuals.begin(), residuals.begin() + residuals.size() / 2, residuals.end());
+        m_jitter = residuals[residuals.size() / 2];
+    }
+
+    ///////
+    // LatencyHistogram member definitions
+    //
+
+    inline ClockCorrelation::LatencyHistogram::LatencyHistogram(double minLatency, double maxLatency, int subBuckets)
+        : m_minLatency(minLatency)
+        , m_subBuckets(subBuckets)
+        , m_nbrOctaves(int(std::ceil(std::log2(maxLatency / minLatency))))
+        , m_buckets()
+        , m_count(0)
+        , m_nbrNegative(0)
+        , m_min(0.0)
+        , m_max(0.0)
+        , m_sum(0.0)
+    {
+        if (minLatency <= 0.0 || maxLatency <= minLatency || subBuckets < 1)
+            throw std::invalid_argument("Invalid latency histogram range: min=" + ToString(minLatency) + ", max=" + ToString(maxLatency) + ", sub-buckets=" + ToString(subBuckets));
+
+        // bucket 0 holds latencies below the minimum.
+        m_buckets.assign(size_t(1 + m_nbrOctaves * m_subBuckets), 0);
+    }
+
+    inline size_t ClockCorrelation::LatencyHistogram::GetBucketIndex(double latency) const
+    {
+        if (!(latency >= m_minLatency))
+            return 0;
+
+        // latency/min = mantissa * 2^exponent with mantissa in [0.5, 1[: octave exponent-1, linear position 2*mantissa-1 in it.
+        int exponent = 0;
+        double const mantissa = std::frexp(latency / m_minLatency, &exponent);
+        int const octave = exponent - 1;
+        if (octave >= m_nbrOctaves)
+            return m_buckets.size() - 1;
+
+        int const subBucket = (std::min)(int((2.0 * mantissa - 1.0) * m_subBuckets), m_subBuckets - 1);
+        return size_t(1 + octave * m_subBuckets + subBucket);
+    }
+
+    inline double ClockCorrelation::LatencyHistogram::GetBucketLowerBound(size_t index) const
+    {
+        if (index == 0)
+            return 0.0;
+
+        int const octave = int(index - 1) / m_subBuckets;
+        int const subBucket = int(index - 1) % m_subBuckets;
+        return std::ldexp(m_minLatency, octave) * (1.0 + double(subBucket) / m_subBuckets);
+    }
+
+    inline void ClockCorrelation::LatencyHistogram::Record(double latency)
+    {
+        if (latency < 0.0)
+            ++m_nbrNegative;
+
+        ++m_buckets[GetBucketIndex(latency)];
+        m_min = m_count ? (std::min)(m_min, latency) : latency;
+        m_max = m_count ? (std::max)(m_max, latency) : latency;
+        m_sum += latency;
+        ++m_count;
+    }
+
+    inline double ClockCorrelation::LatencyHistogram::GetPercentile(double percent) const
+    {
+        if (m_count == 0)
+            return 0.0;
+
+        uint64_t const rank = (std::max)(uint64_t(1), uint64_t(std::ceil(percent / 100.0 * double(m_count))));
+        uint64_t cumulated = 0;
+        for (size_t index = 0; index < m_buckets.size(); ++index)
+        {
+            cumulated += m_buckets[index];
+            if (cumulated < rank)
+                continue;
+
+            // report the middle of the bucket, bounded by the exact extremes.
+            double const lower = GetBucketLowerBound(index);
+            double const upper = (index + 1 < m_buckets.size()) ? GetBucketLowerBound(index + 1) : m_max;
+            return (std::min)((std::max)(0.5 * (lower + upper), m_min), m_max);
+        }
+        return m_max;
+    }
+
+    inline void ClockCorrelation::LatencyHistogram::Reset()
+    {
+        std::fill(m_buckets.begin(), m_buckets.end(), uint64_t(0));
+        m_count = 0;
+        m_nbrNegative = 0;
+        m_min = 0.0;
+        m_max = 0.0;
+        m_sum = 0.0;
+    }
+
+    ///////
+    // LatencyMonitor member definitions
+    //
+
+    inline void ClockCorrelation::LatencyMonitor::RecordResult(double triggerDeviceTime, HostClock::time_point hostTime)
+    {
+        ClockFit const& fit = m_correlator.GetFit();
+        if (!fit.valid)
+        {
+            ++m_nbrUnmeasured;
+            return;
+        }
+
+        m_histogram.Record(m_correlator.ToSeconds(hostTime) - fit.ToHostTime(triggerDeviceTime) + m_transportDelay);
+    }
+
+    inline std::string ClockCorrelation::LatencyMonitor::FormatPercentiles() const
+    {
+        std::ostringstream out;
+        out << "latency p50=" << FormatLatency(m_histogram.GetPercentile(50.0))
+            << " p90=" << FormatLatency(m_histogram.GetPercentile(90.0))
+            << " p99=" << FormatLatency(m_histogram.GetPercentile(99.0))
+            << " max=" << FormatLatency(m_histogram.GetMax())
+            << " (" << m_histogram.GetCount() << " records)";
+        return out.str();
+    }
+
+    inline void ClockCorrelation::LatencyMonitor::Report(std::ostream& output) const
+    {
+        ClockFit const& fit = m_correlator.GetFit();
+
+        output << "\nClock correlation\n";
+        if (!fit.valid)
+        {
+            output << "  no observation\n";
+            return;
+        }
+        output << "  Observations:       " << m_correlator.GetObservationCount() << " (" << m_correlator.GetWindowCount() << " in window)\n";
+        output << "  Offset:             " << std::fixed << std::setprecision(6) << fit.offset << " s at device time " << fit.referenceDeviceTime << " s\n";
+        output << "  Drift:              " << std::setprecision(3) << fit.GetDriftPpm() << " ppm\n";
+        output << "  Envelope jitter:    " << FormatLatency(m_correlator.GetJitter()) << '\n';
+        if (m_transportDelay != 0.0)
+            output << "  Transport delay:    " << FormatLatency(m_transportDelay) << '\n';
+
+        output << "\nTrigger-to-result latency (" << m_histogram.GetCount() << " records";
+        if (m_nbrUnmeasured > 0)
+            output << ", " << m_nbrUnmeasured << " unmeasured";
+        output << ")\n";
+        if (m_histogram.GetCount() == 0)
+        {
+            output << std::defaultfloat;
+            return;
+        }
+
+        output << "  min " << FormatLatency(m_histogram.GetMin()) << ", mean " << FormatLatency(m_histogram.GetMean()) << ", max " << FormatLatency(m_histogram.GetMax()) << '\n';
+        double const percents[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+        for (double const percent : percents)
+            output << "  p" << std::left << std::setw(8) << std::defaultfloat << std::setprecision(6) << percent << std::right << FormatLatency(m_histogram.GetPercentile(percent)) << '\n';
+        if (m_histogram.GetNegativeCount() > 0)
+            output << "  " << m_histogram.GetNegativeCount() << " negative latencies: the clock fit is off, check observations are taken right after fetch\n";
+        output << std::defaultfloat;
+    }
+
+    inline std::string ClockCorrelation::FormatLatency(double latency)
+    {
+        char const* const units[] = { "s", "ms", "us", "ns" };
+        int unit = 0;
+        double value = latency;
+        while (unit < 3 && std::fabs(value) < 1.0 && value != 0.0)
+        {
+            value *= 1000.0;
+            ++unit;
+        }
+
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(std::fabs(value) < 10.0 ? 2 : 1) << value << ' ' << units[unit];
+        return out.str();
+    }
+}
+
+#endif
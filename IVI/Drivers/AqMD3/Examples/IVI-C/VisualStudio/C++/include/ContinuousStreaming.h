@@ -0,0 +1,596 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// ContinuousStreaming: gapless acquisition of the sample stream in continuous streaming mode, as
+// an unbounded sequence of chunks, and chunk-oriented processing stages handling overlap.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_CONTINUOUSSTREAMING_H
+#define LIBTOOL_CONTINUOUSSTREAMING_H
+
+#include "LibTool.h"
+#include <AqMD3.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace LibTool
+{
+    //! Continuous streaming utils.
+    /*! In continuous streaming mode (AQMD3_VAL_STREAMING_MODE_CONTINUOUS) there is no record and no marker: the sample stream is
+        an unbounded sequence of samples. It is fetched in large chunks aligned on the stream granularity, every chunk being
+        stamped with the running index of its first sample since the acquisition start. Chunks are processed by stages which keep
+        the samples they need across chunk boundaries (filter history, overlapping blocks). Typical use:
+
+            ContinuousStreaming::ChunkFetcher fetcher(AqMD3_StreamFetchDataInt32, session, "StreamCh1", chunkElements, grainElements);
+            ContinuousStreaming::ChunkReader reader(fetcher, 4, pollInterval);
+            ContinuousStreaming::FirFilter filter(ContinuousStreaming::FirFilter::DesignLowPass(63, 0.1), 4);
+
+            reader.Start();
+            while (running)
+            {
+                ContinuousStreaming::SampleChunk chunk;
+                if (!reader.WaitNext(chunk, timeout))
+                    continue;
+                filter.Process(chunk, output);
+                reader.Release();
+            }
+            reader.Stop();
+
+        The reader fetches from a dedicated thread, so that the device memory is drained while chunks are processed. A stream
+        overflow (the host did not keep up) is a gap in the capture: it is reported as #StreamGapError.
+    */
+    namespace ContinuousStreaming
+    {
+        typedef std::vector<int32_t> ChunkBuffer;
+
+        //! Raised when the continuity of the sample stream is lost (stream overflow on the device, or chunks processed out of order).
+        class StreamGapError : public std::runtime_error
+        {
+        public:
+            explicit StreamGapError(std::string const& message)
+                : std::runtime_error(message)
+            {}
+        };
+
+        //! A chunk of the unbounded sample stream.
+        struct SampleChunk
+        {
+            uint64_t firstSampleIndex = 0; //!< running index of the first sample since the acquisition start.
+            int16_t const* samples = nullptr;
+            size_t nbrSamples = 0;
+
+            //! Return the running index following the last sample of the chunk.
+            uint64_t GetEndSampleIndex() const
+            { return firstSampleIndex + nbrSamples; }
+        };
+
+        //! Return desiredElements rounded down to a multiple of grainElements (at least one grain).
+        inline int64_t AlignChunkElements(int64_t desiredElements, int64_t grainElements)
+        {
+            if (grainElements <= 0)
+                throw std::invalid_argument("Invalid stream granularity: " + ToString(grainElements) + " elements");
+            return (std::max)(desiredElements / grainElements, int64_t(1)) * grainElements;
+        }
+
+        //! Fetch statistics of the continuous stream.
+        struct FetchStatistics
+        {
+            uint64_t nbrChunks = 0;              //!< number of fetched chunks.
+            uint64_t nbrSamples = 0;             //!< number of fetched samples.
+            uint64_t nbrNotReady = 0;            //!< number of fetch attempts which found less than a chunk available.
+            int64_t peakBacklogElements = 0;     //!< maximum number of elements left on the device after a fetch.
+            double consumerStallSeconds = 0.0;   //!< time the fetch thread waited for a free chunk buffer.
+
+            //! Print statistics, sample rate is used to express volumes in seconds of signal.
+            void Print(std::ostream& output, double sampleRate) const;
+        };
+
+        //! Fetch granularity-aligned chunks of a sample stream, and stamp them with the running sample index.
+        class ChunkFetcher
+        {
+        public:
+            using FetchFunction = std::function<ViStatus(ViSession, ViConstString, ViInt64, ViInt64, ViInt32*, ViInt64*, ViInt64*, ViInt64*)>;
+
+            static int64_t const NbrSamplesPerElement = sizeof(int32_t) / sizeof(int16_t);
+
+            explicit ChunkFetcher(FetchFunction fetch, ViSession session, std::string const& streamName, int64_t chunkElements, int64_t grainElements)
+                : m_fetch(fetch)
+                , m_session(session)
+                , m_streamName(streamName)
+                , m_chunkElements(AlignChunkElements(chunkElements, grainElements))
+                , m_grainElements(grainElements)
+                , m_nextSampleIndex(0)
+                , m_statistics()
+            {}
+
+            //! Return the number of elements of a chunk.
+            int64_t GetChunkElements() const
+            { return m_chunkElements; }
+
+            //! Return the number of samples of a chunk.
+            int64_t GetChunkSamples() const
+            { return m_chunkElements * NbrSamplesPerElement; }
+
+            //! Return the buffer size (in elements) required by #FetchNext.
+            int64_t GetBufferElements() const
+            {
+                return m_chunkElements        // required elements
+                    + m_chunkElements / 2     // unfolding overhead (only in single channel mode)
+                    + m_grainElements - 1;    // alignment overhead
+            }
+
+            //! Return the running index of the first sample of the next chunk.
+            uint64_t GetNextSampleIndex() const
+            { return m_nextSampleIndex; }
+
+            FetchStatistics const& GetStatistics() const
+            { return m_statistics; }
+
+            FetchStatistics& GetStatistics()
+            { return m_statistics; }
+
+            //! Fetch the next chunk into buffer if it is entirely available on the device.
+            /*! \return false if less than a chunk is available: nothing has been read.
+                \throw #StreamGapError on stream overflow, #std::runtime_error on any other fetch error.*/
+            bool FetchNext(ChunkBuffer& buffer, SampleChunk& chunk);
+
+        private:
+            FetchFunction m_fetch;
+            ViSession const m_session;
+            std::string const m_streamName;
+            int64_t const m_chunkElements;
+            int64_t const m_grainElements;
+            uint64_t m_nextSampleIndex;
+            FetchStatistics m_statistics;
+        };
+
+        //! Fetch chunks from a dedicated thread into a pool of buffers, and deliver them in order to the processing thread.
+        /*! The fetch thread polls the device every #pollInterval while less than a chunk is available. When all buffers hold chunks
+            not yet released by the consumer, the fetch thread waits: the device memory absorbs the backlog until it overflows.*/
+        class ChunkReader
+        {
+        public:
+            explicit ChunkReader(ChunkFetcher& fetcher, size_t nbrBuffers, std::chrono::microseconds pollInterval);
+
+            ~ChunkReader()
+            { Stop(); }
+
+            ChunkReader(ChunkReader const&) = delete;
+            ChunkReader& operator=(ChunkReader const&) = delete;
+
+            //! Start the fetch thread.
+            void Start();
+
+            //! Stop the fetch thread. Chunks not yet delivered are discarded and their buffers reused after a new #Start.
+            /*! Chunks already delivered remain valid until #Release.*/
+            void Stop();
+
+            //! Wait up to timeout for the next chunk.
+            /*! The chunk samples remain valid until #Release. Chunks must be released in the order they are delivered.
+                \return false on timeout.
+                \throw the error raised by the fetch thread, if any.*/
+            bool WaitNext(SampleChunk& chunk, std::chrono::milliseconds timeout);
+
+            //! Release the oldest delivered chunk: its buffer is reused for a future fetch.
+            void Release();
+
+            //! Return the maximum number of fetched chunks waiting for the consumer.
+            size_t GetPeakQueuedChunks() const
+            { return m_peakQueued; }
+
+        private:
+            //! Body of the fetch thread.
+            void Run();
+
+            ChunkFetcher& m_fetcher;
+            std::chrono::microseconds const m_pollInterval;
+            std::vector<ChunkBuffer> m_buffers;
+
+            std::mutex m_mutex;
+            std::condition_variable m_condition;
+            std::deque<size_t> m_freeBuffers;                      //!< buffers available for fetch.
+            std::deque<std::pair<size_t, SampleChunk>> m_ready;     //!< fetched chunks not yet delivered.
+            std::deque<size_t> m_delivered;                        //!< buffers of delivered chunks not yet released.
+            size_t m_peakQueued;
+            bool m_stopRequested;
+            std::exception_ptr m_error;
+            std::thread m_thread;
+        };
+
+        //! Finite impulse response filter over the unbounded stream, with optional decimation.
+        /*! The last (nbrTaps-1) input samples are kept across chunks, so the output is the same as filtering the whole stream at
+            once. Output sample k corresponds to input sample k*decimation; the filter delay is #GetDelaySamples input samples.*/
+        class FirFilter
+        {
+        public:
+            explicit FirFilter(std::vector<float> const& taps, int decimation = 1);
+
+            //! Filter chunk and append the output samples to output.
+            /*! \return the running index (in output samples) of the first appended sample.
+                \throw #StreamGapError if chunk does not follow the previous one.*/
+            uint64_t Process(SampleChunk const& chunk, std::vector<float>& output);
+
+            //! Return the delay of the filter, in input samples (linear phase filters).
+            double GetDelaySamples() const
+            { return 0.5 * double(m_nbrTaps - 1); }
+
+            int GetDecimation() const
+            { return m_decimation; }
+
+            //! Return the taps of a low-pass filter of cutoff frequency (fraction of the sample rate, in ]0, 0.5[) by the windowed-sinc method (Hamming window).
+            static std::vector<float> DesignLowPass(size_t nbrTaps, double cutoff);
+
+        private:
+            size_t const m_nbrTaps;
+            int const m_decimation;
+            std::vector<float> m_reversedTaps;
+            std::vector<float> m_work;      //!< (nbrTaps-1) history samples followed by the samples of the current chunk.
+            uint64_t m_nextInputIndex;      //!< running index of the next expected input sample.
+            uint64_t m_nextOutputIndex;     //!< running index (in input samples) of the next output sample.
+        };
+
+        //! Slice the unbounded stream into blocks of #blockSize samples every #hopSize samples (e.g. overlapping FFT frames).
+        /*! Samples are kept across chunks until every block they belong to has been delivered.*/
+        class BlockSlicer
+        {
+        public:
+            explicit BlockSlicer(size_t blockSize, size_t hopSize);
+
+            //! Feed chunk, and call callback(firstSampleIndex, float const* block) for every completed block.
+            /*! \throw #StreamGapError if chunk does not follow the previous one.*/
+            template <typename Callback>
+            void Process(SampleChunk const& chunk, Callback&& callback);
+
+            size_t GetBlockSize() const
+            { return m_blockSize; }
+
+            size_t GetHopSize() const
+            { return m_hopSize; }
+
+        private:
+            size_t const m_blockSize;
+            size_t const m_hopSize;
+            std::vector<float> m_pending;   //!< samples not yet consumed by all their blocks.
+            uint64_t m_pendingIndex;        //!< running index of the first pending sample.
+            uint64_t m_nextBlockIndex;      //!< running index of the first sample of the next block.
+            uint64_t m_nextInputIndex;      //!< running index of the next expected input sample.
+        };
+    }
+
+    ///////
+    // ContinuousStreaming member definitions
+    //
+
+    inline void ContinuousStreaming::FetchStatistics::Print(std::ostream& output, double sampleRate) const
+    {
+        output << "\nContinuous stream\n";
+        output << "  Chunks:             " << nbrChunks << '\n';
+        output << "  Samples:            " << nbrSamples << " (" << double(nbrSamples) / sampleRate << " s of signal)\n";
+        output << "  Not ready polls:    " << nbrNotReady << '\n';
+        output << "  Peak backlog:       " << peakBacklogElements * ChunkFetcher::NbrSamplesPerElement << " samples ("
+               << double(peakBacklogElements * ChunkFetcher::NbrSamplesPerElement) / sampleRate << " s of signal)\n";
+        output << "  Consumer stalls:    " << consumerStallSeconds << " s\n";
+    }
+
+    inline bool ContinuousStreaming::ChunkFetcher::FetchNext(ChunkBuffer& buffer, SampleChunk& chunk)
+    {
+        ViInt64 const bufferSize = ViInt64(buffer.size());
+        if (bufferSize < GetBufferElements())
+            throw std::invalid_argument("Chunk buffer size " + ToString(bufferSize) + " is smaller than required " + ToString(GetBufferElements()) + " elements");
+
+        ViInt64 firstElement = 0;
+        ViInt64 actualElements = 0;
+        ViInt64 remainingElements = 0;
+        ViStatus const status = m_fetch(m_session, m_streamName.c_str(), m_chunkElements, bufferSize, (ViInt32*)buffer.data(), &remainingElements, &actualElements, &firstElement);
+
+        if (status == AQMD3_ERROR_STREAM_OVERFLOW)
+            throw StreamGapError("Stream overflow on " + m_streamName + ": continuous capture interrupted after sample " + ToString(m_nextSampleIndex));
+        if (status < 0)
+            throw std::runtime_error("Failed to fetch " + ToString(m_chunkElements) + " elements from " + m_streamName + ": status " + ToString(status));
+
+        if (actualElements == 0)
+        {
+            ++m_statistics.nbrNotReady;
+            return false;
+        }
+
+        if (actualElements != m_chunkElements)
+            throw StreamGapError("Number of fetched elements is different than requested on " + m_streamName + ". Requested=" + ToString(m_chunkElements) + ", fetched=" + ToString(actualElements) + ".");
+
+        chunk.firstSampleIndex = m_nextSampleIndex;
+        chunk.samples = reinterpret_cast<int16_t const*>(buffer.data() + firstElement);
+        chunk.nbrSamples = size_t(actualElements * NbrSamplesPerElement);
+
+        m_nextSampleIndex += chunk.nbrSamples;
+        ++m_statistics.nbrChunks;
+        m_statistics.nbrSamples += chunk.nbrSamples;
+        m_statistics.peakBacklogElements = (std::max)(m_statistics.peakBacklogElements, int64_t(remainingElements));
+        return true;
+    }
+
+    inline ContinuousStreaming::ChunkReader::ChunkReader(ChunkFetcher& fetcher, size_t nbrBuffers, std::chrono::microseconds pollInterval)
+        : m_fetcher(fetcher)
+        , m_pollInterval(pollInterval)
+        , m_buffers()
+        , m_mutex()
+        , m_condition()
+        , m_freeBuffers()
+        , m_ready()
+        , m_delivered()
+        , m_peakQueued(0)
+        , m_stopRequested(false)
+        , m_error()
+        , m_thread()
+    {
+        if (nbrBuffers < 2)
+            throw std::invalid_argument("Chunk reader requires at least 2 buffers, got " + ToString(nbrBuffers));
+
+        m_buffers.resize(nbrBuffers);
+        for (size_t i = 0; i < nbrBuffers; ++i)
+        {
+            m_buffers[i].resize(size_t(fetcher.GetBufferElements()));
+            m_freeBuffers.push_back(i);
+        }
+    }
+
+    inline void ContinuousStreaming::ChunkReader::Start()
+    {
+        if (m_thread.joinable())
+            throw std::logic_error("Chunk reader already started");
+
+        m_stopRequested = false;
+        m_error = nullptr;
+        m_thread = std::thread(&ChunkReader::Run, this);
+    }
+
+    inline void ContinuousStreaming::ChunkReader::Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopRequested = true;
+        }
+        m_condition.notify_all();
+
+        if (m_thread.joinable())
+            m_thread.join();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto const& ready : m_ready)
+            m_freeBuffers.push_back(ready.first);
+        m_ready.clear();
+    }
+
+    inline bool ContinuousStreaming::ChunkReader::WaitNext(SampleChunk& chunk, std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait_for(lock, timeout, [this]() { return !m_ready.empty() || m_error; });
+
+        if (m_ready.empty())
+        {
+            if (m_error)
+                std::rethrow_exception(m_error);
+            return false;
+        }
+
+        m_delivered.push_back(m_ready.front().first);
+        chunk = m_ready.front().second;
+        m_ready.pop_front();
+        return true;
+    }
+
+    inline void ContinuousStreaming::ChunkReader::Release()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_delivered.empty())
+                throw std::logic_error("No delivered chunk to release");
+
+            m_freeBuffers.push_back(m_delivered.front());
+            m_delivered.pop_front();
+        }
+        m_condition.notify_all();
+    }
+
+    inline void ContinuousStreaming::ChunkReader::Run()
+    {
+        try
+        {
+            for (;;)
+            {
+                size_t bufferIndex = 0;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    if (m_freeBuffers.empty())
+                    {
+                        // All buffers are held by the consumer: the device memory absorbs the stream meanwhile.
+                        auto const stallStart = std::chrono::steady_clock::now();
+                        m_condition.wait(lock, [this]() { return !m_freeBuffers.empty() || m_stopRequested; });
+                        m_fetcher.GetStatistics().consumerStallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - stallStart).count();
+                    }
+                    if (m_stopRequested)
+                        return;
+
+                    bufferIndex = m_freeBuffers.front();
+                    m_freeBuffers.pop_front();
+                }
+
+                SampleChunk chunk;
+                while (!m_fetcher.FetchNext(m_buffers[bufferIndex], chunk))
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    if (m_condition.wait_for(lock, m_pollInterval, [this]() { return m_stopRequested; }))
+                    {
+                        m_freeBuffers.push_back(bufferIndex);
+                        return;
+                    }
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_ready.emplace_back(bufferIndex, chunk);
+                    m_peakQueued = (std::max)(m_peakQueued, m_ready.size());
+                }
+                m_condition.notify_all();
+            }
+        }
+        catch (...)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_error = std::current_exception();
+            }
+            m_condition.notify_all();
+        }
+    }
+
+    inline ContinuousStreaming::FirFilter::FirFilter(std::vector<float> const& taps, int decimation)
+        : m_nbrTaps(taps.size())
+        , m_decimation(decimation)
+        , m_reversedTaps(taps.rbegin(), taps.rend())
+        , m_work(taps.empty() ? 0 : taps.size() - 1, 0.0f)
+        , m_nextInputIndex(0)
+        , m_nextOutputIndex(0)
+    {
+        if (taps.empty())
+            throw std::invalid_argument("FIR filter requires at least one tap");
+        if (decimation < 1)
+            throw std::invalid_argument("Invalid FIR decimation factor: " + ToString(decimation));
+    }
+
+    inline uint64_t ContinuousStreaming::FirFilter::Process(SampleChunk const& chunk, std::vector<float>& output)
+    {
+        if (chunk.firstSampleIndex != m_nextInputIndex)
+            throw StreamGapError("FIR filter expects sample " + ToString(m_nextInputIndex) + ", got chunk starting at " + ToString(chunk.firstSampleIndex));
+
+        // Convert the chunk behind the history: window of output n is m_work[n-firstIndex, n-firstIndex+nbrTaps[.
+        size_t const history = m_nbrTaps - 1;
+        m_work.resize(history + chunk.nbrSamples);
+        float* const work = m_work.data();
+        for (size_t i = 0; i < chunk.nbrSamples; ++i)
+            work[history + i] = float(chunk.samples[i]);
+
+        uint64_t const firstOutputIndex = m_nextOutputIndex / uint64_t(m_decimation);
+        size_t const firstPosition = size_t(m_nextOutputIndex - chunk.firstSampleIndex);
+        size_t const nbrOutputs = (firstPosition < chunk.nbrSamples) ? (chunk.nbrSamples - firstPosition + size_t(m_decimation) - 1) / size_t(m_decimation) : 0;
+        size_t const outputOffset = output.size();
+        output.resize(outputOffset + nbrOutputs, 0.0f);
+
+        // Accumulate tap by tap over tiles of outputs: the inner loop has no reduction, so it vectorizes without fast-math.
+        size_t const tileSize = 1024;
+        size_t const decimation = size_t(m_decimation);
+        for (size_t tileStart = 0; tileStart < nbrOutputs; tileStart += tileSize)
+        {
+            size_t const tileCount = (std::min)(tileSize, nbrOutputs - tileStart);
+            float* const accumulator = output.data() + outputOffset + tileStart;
+            float const* const window = work + firstPosition + tileStart * decimation;
+            for (size_t k = 0; k < m_nbrTaps; ++k)
+            {
+                float const tap = m_reversedTaps[k];
+                float const* const input = window + k;
+                if (decimation == 1)
+                {
+                    for (size_t n = 0; n < tileCount; ++n)
+                        accumulator[n] += tap * input[n];
+                }
+                else
+                {
+                    for (size_t n = 0; n < tileCount; ++n)
+                        accumulator[n] += tap * input[n * decimation];
+                }
+            }
+        }
+        size_t const position = firstPosition + nbrOutputs * decimation;
+
+        m_nextOutputIndex = chunk.firstSampleIndex + position;
+        m_nextInputIndex = chunk.GetEndSampleIndex();
+
+        // keep the last (nbrTaps-1) samples as history of the next chunk.
+        if (history > 0)
+            std::memmove(work, work + chunk.nbrSamples, history * sizeof(float));
+        m_work.resize(history);
+
+        return firstOutputIndex;
+    }
+
+    inline std::vector<float> ContinuousStreaming::FirFilter::DesignLowPass(size_t nbrTaps, double cutoff)
+    {
+        if (nbrTaps == 0 || !(cutoff > 0.0 && cutoff < 0.5))
+            throw std::invalid_argument("Invalid low-pass design: taps=" + ToString(nbrTaps) + ", cutoff=" + ToString(cutoff));
+
+        double const pi = 3.14159265358979323846;
+        double const center = 0.5 * double(nbrTaps - 1);
+        std::vector<double> taps(nbrTaps);
+        double sum = 0.0;
+        for (size_t i = 0; i < nbrTaps; ++i)
+        {
+            double const x = double(i) - center;
+            double const sinc = (x == 0.0) ? 2.0 * cutoff : std::sin(2.0 * pi * cutoff * x) / (pi * x);
+            double const window = (nbrTaps > 1) ? 0.54 - 0.46 * std::cos(2.0 * pi * double(i) / double(nbrTaps - 1)) : 1.0;
+            taps[i] = sinc * window;
+            sum += taps[i];
+        }
+
+        // unity gain at DC.
+        std::vector<float> result(nbrTaps);
+        for (size_t i = 0; i < nbrTaps; ++i)
+            result[i] = float(taps[i] / sum);
+        return result;
+    }
+
+    inline ContinuousStreaming::BlockSlicer::BlockSlicer(size_t blockSize, size_t hopSize)
+        : m_blockSize(blockSize)
+        , m_hopSize(hopSize)
+        , m_pending()
+        , m_pendingIndex(0)
+        , m_nextBlockIndex(0)
+        , m_nextInputIndex(0)
+    {
+        if (blockSize == 0 || hopSize == 0)
+            throw std::invalid_argument("Invalid block slicing: block=" + ToString(blockSize) + ", hop=" + ToString(hopSize));
+
+        m_pending.reserve(blockSize);
+    }
+
+    template <typename Callback>
+    void ContinuousStreaming::BlockSlicer::Process(SampleChunk const& chunk, Callback&& callback)
+    {
+        if (chunk.firstSampleIndex != m_nextInputIndex)
+            throw StreamGapError("Block slicer expects sample " + ToString(m_nextInputIndex) + ", got chunk starting at " + ToString(chunk.firstSampleIndex));
+        m_nextInputIndex = chunk.GetEndSampleIndex();
+
+        // Samples before the next block (hop larger than block) are never needed.
+        size_t const skip = (m_nextBlockIndex > chunk.firstSampleIndex) ? size_t((std::min)(m_nextBlockIndex - chunk.firstSampleIndex, uint64_t(chunk.nbrSamples))) : 0;
+        if (m_pending.empty())
+            m_pendingIndex = chunk.firstSampleIndex + skip;
+
+        size_t const pendingSize = m_pending.size();
+        m_pending.resize(pendingSize + chunk.nbrSamples - skip);
+        for (size_t i = skip; i < chunk.nbrSamples; ++i)
+            m_pending[pendingSize + i - skip] = float(chunk.samples[i]);
+
+        uint64_t const pendingEnd = m_pendingIndex + m_pending.size();
+        for (; m_nextBlockIndex + m_blockSize <= pendingEnd; m_nextBlockIndex += m_hopSize)
+            callback(m_nextBlockIndex, m_pending.data() + size_t(m_nextBlockIndex - m_pendingIndex));
+
+        // drop the samples preceding the next block.
+        size_t const consumed = size_t((std::min)(m_nextBlockIndex, pendingEnd) - m_pendingIndex);
+        m_pending.erase(m_pending.begin(), m_pending.begin() + consumed);
+        m_pendingIndex += consumed;
+    }
+}
+
+#endif
@@ -0,0 +1,334 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// DirectFile: preallocated scratch file accessed with unbuffered (direct) positional I/O, and
+// sector-aligned buffers to go with it.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_DIRECTFILE_H
+#define LIBTOOL_DIRECTFILE_H
+
+#include "LibTool.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace LibTool
+{
+    //! Direct I/O utils.
+    /*! Streaming several GB/s to disk through the file system cache competes with the application for memory bandwidth, and the
+        cache flushes at unpredictable times. #DirectFile bypasses the cache (FILE_FLAG_NO_BUFFERING on Windows, O_DIRECT on
+        Linux): every transfer goes straight between the user buffer and the drive. In return, file offsets, transfer sizes and
+        buffer addresses must be multiples of the sector size (#Alignment covers the 512 B and 4 KiB sector drives), which
+        #AlignedBuffer and #AlignUp take care of.
+
+        The file is preallocated at creation, so that sequential writes never extend it. On Windows the first pass of writes
+        still advances the valid data length of the file, which is why the file is best written sequentially from its start.
+    */
+    namespace DirectIo
+    {
+        //! Alignment of offsets, sizes and addresses of direct transfers.
+        static size_t const Alignment = 4096;
+
+        //! Return size rounded up to a multiple of alignment.
+        inline size_t AlignUp(size_t size, size_t alignment = Alignment)
+        { return (size + alignment - 1) / alignment * alignment; }
+
+        //! Heap buffer aligned on #Alignment, with a size multiple of #Alignment.
+        class AlignedBuffer
+        {
+        public:
+            explicit AlignedBuffer(size_t size = 0)
+                : m_data(nullptr)
+                , m_size(0)
+            { Resize(size); }
+
+            ~AlignedBuffer()
+            { Free(m_data); }
+
+            AlignedBuffer(AlignedBuffer const&) = delete;
+            AlignedBuffer& operator=(AlignedBuffer const&) = delete;
+
+            //! Reallocate the buffer to hold at least size bytes. Content is not preserved.
+            void Resize(size_t size);
+
+            char* Data()
+            { return m_data; }
+
+            char const* Data() const
+            { return m_data; }
+
+            size_t Size() const
+            { return m_size; }
+
+        private:
+            static void Free(char* data);
+
+            char* m_data;
+            size_t m_size;
+        };
+
+        //! Scratch file of fixed size, accessed with unbuffered positional reads and writes.
+        /*! Concurrent #Read and #Write on distinct ranges are allowed (one writer thread and one reader thread).*/
+        class DirectFile
+        {
+        public:
+            //! Create (or truncate) the file path and preallocate size bytes (rounded up to #Alignment).
+            /*! If the file system refuses unbuffered I/O (e.g. tmpfs on Linux), the file falls back to buffered I/O: see #IsUnbuffered.
+                \param[in] deleteOnClose: remove the file when it is closed.
+                \throw #std::runtime_error if the file cannot be created or preallocated.*/
+            explicit DirectFile(std::string const& path, int64_t size, bool deleteOnClose = true);
+
+            ~DirectFile();
+
+            DirectFile(DirectFile const&) = delete;
+            DirectFile& operator=(DirectFile const&) = delete;
+
+            //! Write size bytes of data at offset. offset, size and data must be aligned on #Alignment.
+            /*! \throw #std::invalid_argument on misaligned or out of range transfer, #std::runtime_error on I/O error.*/
+            void Write(int64_t offset, void const* data, size_t size);
+
+            //! Read size bytes at offset into data. offset, size and data must be aligned on #Alignment.
+            /*! \throw #std::invalid_argument on misaligned or out of range transfer, #std::runtime_error on I/O error.*/
+            void Read(int64_t offset, void* data, size_t size);
+
+            std::string const& GetPath() const
+            { return m_path; }
+
+            int64_t GetSize() const
+            { return m_size; }
+
+            //! Tell whether transfers bypass the file system cache.
+            bool IsUnbuffered() const
+            { return m_unbuffered; }
+
+        private:
+            //! Check the alignment and range of a transfer.
+            void CheckTransfer(int64_t offset, void const* data, size_t size) const;
+
+            std::string const m_path;
+            int64_t const m_size;
+            bool m_unbuffered;
+#if defined(_WIN32)
+            HANDLE m_handle;
+#else
+            int m_fd;
+#endif
+        };
+    }
+
+    ///////
+    // DirectIo member definitions
+    //
+
+    inline void DirectIo::AlignedBuffer::Resize(size_t size)
+    {
+        size_t const alignedSize = AlignUp(size);
+        if (alignedSize <= m_size)
+            return;
+
+        Free(m_data);
+        m_data = nullptr;
+        m_size = 0;
+
+#if defined(_WIN32)
+        void* data = _aligned_malloc(alignedSize, Alignment);
+#else
+        void* data = nullptr;
+        if (posix_memalign(&data, Alignment, alignedSize) != 0)
+            data = nullptr;
+#endif
+        if (data == nullptr)
+            throw std::bad_alloc();
+
+        m_data = static_cast<char*>(data);
+        m_size = alignedSize;
+    }
+
+    inline void DirectIo::AlignedBuffer::Free(char* data)
+    {
+#if defined(_WIN32)
+        _aligned_free(data);
+#else
+        std::free(data);
+#endif
+    }
+
+#if defined(_WIN32)
+
+    inline DirectIo::DirectFile::DirectFile(std::string const& path, int64_t size, bool deleteOnClose)
+        : m_path(path)
+        , m_size(int64_t(AlignUp(size_t(size))))
+        , m_unbuffered(true)
+        , m_handle(INVALID_HANDLE_VALUE)
+    {
+        DWORD const flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH | (deleteOnClose ? FILE_FLAG_DELETE_ON_CLOSE : 0);
+        m_handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, flags, nullptr);
+        if (m_handle == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Failed to create " + path + ": error " + ToString(GetLastError()));
+
+        FILE_ALLOCATION_INFO allocation;
+        allocation.AllocationSize.QuadPart = m_size;
+        FILE_END_OF_FILE_INFO endOfFile;
+        endOfFile.EndOfFile.QuadPart = m_size;
+        if (!SetFileInformationByHandle(m_handle, FileAllocationInfo, &allocation, sizeof(allocation))
+            || !SetFileInformationByHandle(m_handle, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile)))
+        {
+            DWORD const error = GetLastError();
+            CloseHandle(m_handle);
+            throw std::runtime_error("Failed to preallocate " + ToString(m_size) + " bytes for " + path + ": error " + ToString(error));
+        }
+    }
+
+    inline DirectIo::DirectFile::~DirectFile()
+    {
+        CloseHandle(m_handle);
+    }
+
+    inline void DirectIo::DirectFile::Write(int64_t offset, void const* data, size_t size)
+    {
+        CheckTransfer(offset, data, size);
+
+        char const* bytes = static_cast<char const*>(data);
+        while (size > 0)
+        {
+            DWORD const transferSize = DWORD((std::min)(size, size_t(1) << 30));
+            OVERLAPPED position = {};
+            position.Offset = DWORD(uint64_t(offset));
+            position.OffsetHigh = DWORD(uint64_t(offset) >> 32);
+
+            DWORD written = 0;
+            if (!WriteFile(m_handle, bytes, transferSize, &written, &position) || written != transferSize)
+                throw std::runtime_error("Failed to write " + ToString(transferSize) + " bytes at " + ToString(offset) + " in " + m_path + ": error " + ToString(GetLastError()));
+
+            bytes += written;
+            offset += written;
+            size -= written;
+        }
+    }
+
+    inline void DirectIo::DirectFile::Read(int64_t offset, void* data, size_t size)
+    {
+        CheckTransfer(offset, data, size);
+
+        char* bytes = static_cast<char*>(data);
+        while (size > 0)
+        {
+            DWORD const transferSize = DWORD((std::min)(size, size_t(1) << 30));
+            OVERLAPPED position = {};
+            position.Offset = DWORD(uint64_t(offset));
+            position.OffsetHigh = DWORD(uint64_t(offset) >> 32);
+
+            DWORD read = 0;
+            if (!ReadFile(m_handle, bytes, transferSize, &read, &position) || read != transferSize)
+                throw std::runtime_error("Failed to read " + ToString(transferSize) + " bytes at " + ToString(offset) + " in " + m_path + ": error " + ToString(GetLastError()));
+
+            bytes += read;
+            offset += read;
+            size -= read;
+        }
+    }
+
+#else
+
+    inline DirectIo::DirectFile::DirectFile(std::string const& path, int64_t size, bool deleteOnClose)
+        : m_path(path)
+        , m_size(int64_t(AlignUp(size_t(size))))
+        , m_unbuffered(false)
+        , m_fd(-1)
+    {
+#if defined(O_DIRECT)
+        m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        m_unbuffered = (m_fd >= 0);
+#endif
+        if (m_fd < 0)
+            m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (m_fd < 0)
+            throw std::runtime_error("Failed to create " + path + ": " + std::strerror(errno));
+
+        int const error = posix_fallocate(m_fd, 0, off_t(m_size));
+        if (error != 0)
+        {
+            ::close(m_fd);
+            throw std::runtime_error("Failed to preallocate " + ToString(m_size) + " bytes for " + path + ": " + std::strerror(error));
+        }
+
+        // The directory entry goes away now, the storage when the file is closed.
+        if (deleteOnClose)
+            ::unlink(path.c_str());
+    }
+
+    inline DirectIo::DirectFile::~DirectFile()
+    {
+        ::close(m_fd);
+    }
+
+    inline void DirectIo::DirectFile::Write(int64_t offset, void const* data, size_t size)
+    {
+        CheckTransfer(offset, data, size);
+
+        char const* bytes = static_cast<char const*>(data);
+        while (size > 0)
+        {
+            ssize_t const written = ::pwrite(m_fd, bytes, size, off_t(offset));
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                throw std::runtime_error("Failed to write " + ToString(size) + " bytes at " + ToString(offset) + " in " + m_path + ": " + std::strerror(errno));
+
+            bytes += written;
+            offset += written;
+            size -= size_t(written);
+        }
+    }
+
+    inline void DirectIo::DirectFile::Read(int64_t offset, void* data, size_t size)
+    {
+        CheckTransfer(offset, data, size);
+
+        char* bytes = static_cast<char*>(data);
+        while (size > 0)
+        {
+            ssize_t const read = ::pread(m_fd, bytes, size, off_t(offset));
+            if (read < 0 && errno == EINTR)
+                continue;
+            if (read <= 0)
+                throw std::runtime_error("Failed to read " + ToString(size) + " bytes at " + ToString(offset) + " in " + m_path + ": " + (read < 0 ? std::strerror(errno) : "end of file"));
+
+            bytes += read;
+            offset += read;
+            size -= size_t(read);
+        }
+    }
+
+#endif
+
+    inline void DirectIo::DirectFile::CheckTransfer(int64_t offset, void const* data, size_t size) const
+    {
+        if (offset % int64_t(Alignment) != 0 || size % Alignment != 0 || reinterpret_cast<uintptr_t>(data) % Alignment != 0)
+            throw std::invalid_argument("Misaligned direct transfer of " + ToString(size) + " bytes at " + ToString(offset) + " in " + m_path);
+
+        if (offset < 0 || offset + int64_t(size) > m_size)
+            throw std::invalid_argument("Direct transfer of " + ToString(size) + " bytes at " + ToString(offset) + " is out of " + m_path + " (" + ToString(m_size) + " bytes)");
+    }
+}
+
+#endif
@@ -0,0 +1,161 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// Distributions: quantiles and cumulative distributions of the normal and Student's t
+// distributions, shared by the benchmark comparison and the synthetic waveform generator.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_DISTRIBUTIONS_H
+#define LIBTOOL_DISTRIBUTIONS_H
+
+#include "LibTool.h"
+
+#include <cmath>
+#include <stdexcept>
+
+namespace LibTool
+{
+    //! Probability distributions.
+    /*! Double precision approximations, intended for set-up code (tables, confidence intervals) rather than per-sample use.*/
+    namespace Distributions
+    {
+        //! Return the quantile #p of the standard normal distribution.
+        double NormalQuantile(double p);
+        //! Return the regularized incomplete beta function I_x(a, b).
+        double IncompleteBeta(double x, double a, double b);
+        //! Return the cumulative distribution of Student's t distribution with #dof degrees of freedom at #t.
+        double StudentCdf(double t, double dof);
+        //! Return the quantile #p of Student's t distribution with #dof degrees of freedom.
+        double StudentQuantile(double p, double dof);
+
+        ///////////////////////////////////////////////////////////////////////////
+        //
+        // Distributions definitions
+        //
+
+        inline double NormalQuantile(double p)
+        {
+            if (p <= 0.0 || p >= 1.0)
+                throw std::invalid_argument("Quantile probability must be in ]0,1[, got " + ToString(p));
+
+            // Acklam's rational approximation (relative error below 1.2e-9).
+            static double const a[] = { -3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02, 1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00 };
+            static double const b[] = { -5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02, 6.680131188771972e+01, -1.328068155288572e+01 };
+            static double const c[] = { -7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00, -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00 };
+            static double const d[] = { 7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00, 3.754408661907416e+00 };
+
+            double const pLow = 0.02425;
+            if (p < pLow)
+            {
+                double const q = std::sqrt(-2 * std::log(p));
+                return (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+            }
+            if (p > 1 - pLow)
+                return -NormalQuantile(1 - p);
+
+            double const q = p - 0.5;
+            double const r = q * q;
+            return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q / (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+        }
+
+        inline double IncompleteBeta(double x, double a, double b)
+        {
+            if (x < 0.0 || x > 1.0)
+                throw std::invalid_argument("Incomplete beta argument must be in [0,1], got " + ToString(x));
+            if (x == 0.0 || x == 1.0)
+                return x;
+
+            // The continued fraction converges quickly below the mean of the distribution only; use I_x(a, b) = 1 - I_1-x(b, a) above.
+            if (x > (a + 1) / (a + b + 2))
+                return 1 - IncompleteBeta(1 - x, b, a);
+
+            // Continued fraction evaluated with the modified Lentz's method.
+            double const tiny = 1e-300;
+            double c = 1.0;
+            double d = 1 - (a + b) * x / (a + 1);
+            d = 1 / ((std::abs(d) < tiny) ? tiny : d);
+            double fraction = d;
+            for (int m = 1; m <= 300; ++m)
+            {
+                double const evenTerm = m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m));
+                d = 1 + evenTerm * d;
+                d = 1 / ((std::abs(d) < tiny) ? tiny : d);
+                c = 1 + evenTerm / c;
+                c = (std::abs(c) < tiny) ? tiny : c;
+                fraction *= c * d;
+
+                double const oddTerm = -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+                d = 1 + oddTerm * d;
+                d = 1 / ((std::abs(d) < tiny) ? tiny : d);
+                c = 1 + oddTerm / c;
+                c = (std::abs(c) < tiny) ? tiny : c;
+                fraction *= c * d;
+                if (std::abs(c * d - 1) < 1e-15)
+                    break;
+            }
+
+            double const logFront = std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b) + a * std::log(x) + b * std::log1p(-x);
+            return std::exp(logFront) * fraction / a;
+        }
+
+        inline double StudentCdf(double t, double dof)
+        {
+            if (dof <= 0.0)
+                throw std::invalid_argument("Degrees of freedom must be strict positive, got " + ToString(dof));
+
+            // P(|T| > |t|) = I_x(dof/2, 1/2) with x = dof/(dof+t^2).
+            double const tail = IncompleteBeta(dof / (dof + t * t), dof / 2, 0.5) / 2;
+            return (t > 0) ? 1 - tail : tail;
+        }
+
+        inline double StudentQuantile(double p, double dof)
+        {
+            if (dof <= 0.0)
+                throw std::invalid_argument("Degrees of freedom must be strict positive, got " + ToString(dof));
+            if (p <= 0.0 || p >= 1.0)
+                throw std::invalid_argument("Quantile probability must be in ]0,1[, got " + ToString(p));
+
+            // Closed forms for 1 (Cauchy distribution) and 2 degrees of freedom.
+            double const pi = 3.14159265358979323846;
+            if (dof == 1.0)
+                return std::tan(pi * (p - 0.5));
+            if (dof == 2.0)
+                return (2 * p - 1) / std::sqrt(2 * p * (1 - p));
+
+            if (dof >= 30.0)
+            {
+                // Cornish-Fisher expansion of the t quantile around the normal quantile; accurate to ~1e-5 for dof >= 30.
+                double const z = NormalQuantile(p);
+                double const z2 = z * z;
+                double const g1 = (z2 + 1) * z / 4;
+                double const g2 = ((5 * z2 + 16) * z2 + 3) * z / 96;
+                double const g3 = (((3 * z2 + 19) * z2 + 17) * z2 - 15) * z / 384;
+                double const g4 = ((((79 * z2 + 776) * z2 + 1482) * z2 - 1920) * z2 - 945) * z / 92160;
+                return z + g1 / dof + g2 / (dof * dof) + g3 / (dof * dof * dof) + g4 / (dof * dof * dof * dof);
+            }
+
+            // Otherwise the expansion diverges in the tails (Welch's degrees of freedom are not integer): invert the
+            // distribution by bisection on the upper half, the quantile being symmetric around 0.
+            double const upper = (std::max)(p, 1 - p);
+            double low = 0.0;
+            double high = 1.0;
+            while (StudentCdf(high, dof) < upper)
+            {
+                low = high;
+                high *= 2;
+            }
+            for (int i = 0; i < 200 && high - low > 1e-12 * high; ++i)
+            {
+                double const middle = (low + high) / 2;
+                if (StudentCdf(middle, dof) < upper)
+                    low = middle;
+                else
+                    high = middle;
+            }
+            double const t = (low + high) / 2;
+            return (p < 0.5) ? -t : t;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,426 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// FaultInjection: interposition layer around AqMD3_StreamFetchDataInt32 injecting stream faults
+// according to a seeded schedule.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_FAULTINJECTION_H
+#define LIBTOOL_FAULTINJECTION_H
+
+#include "LibTool.h"
+#include <AqMD3.h>
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <ostream>
+
+namespace LibTool
+{
+    //! Fault injection utils used to exercise the recovery paths of the streaming loops.
+    /*! The interposer is placed between the application and the fetch backend (the driver or any simulated stream). Typical use:
+
+            FaultInjection::Schedule schedule(seed, rates);
+            FaultInjection::StreamFetchInterposer fetch(AqMD3_StreamFetchDataInt32, schedule);
+            fetch.AddMarkerStream("MarkersCh1", 16);
+
+            // use "fetch.StreamFetchDataInt32(...)" in place of "AqMD3_StreamFetchDataInt32(...)"
+    */
+    namespace FaultInjection
+    {
+        //! Kind of faults the interposer can inject into a fetch call.
+        enum class FaultKind : int
+        {
+            None = 0,               //!< the call is forwarded to the backend untouched.
+            ShortRead,              //!< the backend is not called, fewer elements than requested are reported available (no data loss).
+            DelayedAvailability,    //!< the backend is not called, no element reported available.
+            OverflowTruncation,     //!< the tail of fetched data is dropped, then the stream reports overflow.
+            CorruptedTag,           //!< the tag of the first fetched marker is corrupted (marker streams only).
+            RecordIndexGap,         //!< the record index of the first fetched marker jumps forward (marker streams only).
+            ErrorStatus,            //!< the backend is not called, an error status is returned.
+            Count
+        };
+
+        //! Return a printable name for the given fault kind.
+        inline char const* ToString(FaultKind kind)
+        {
+            switch (kind)
+            {
+            case FaultKind::None:                return "None";
+            case FaultKind::ShortRead:           return "ShortRead";
+            case FaultKind::DelayedAvailability: return "DelayedAvailability";
+            case FaultKind::OverflowTruncation:  return "OverflowTruncation";
+            case FaultKind::CorruptedTag:        return "CorruptedTag";
+            case FaultKind::RecordIndexGap:      return "RecordIndexGap";
+            case FaultKind::ErrorStatus:         return "ErrorStatus";
+            default:                             return "Unknown";
+            }
+        }
+
+        //! Per-call probabilities of each fault kind. The sum must not exceed 1.
+        struct FaultRates
+        {
+            double shortRead = 0.0;
+            double delayedAvailability = 0.0;
+            double overflowTruncation = 0.0;
+            double corruptedTag = 0.0;
+            double recordIndexGap = 0.0;
+            double errorStatus = 0.0;
+
+            //! Return the sum of all probabilities.
+            double GetTotal() const
+            { return shortRead + delayedAvailability + overflowTruncation + corruptedTag + recordIndexGap + errorStatus; }
+        };
+
+        //! Small and fast deterministic generator (SplitMix64) used to draw the schedule.
+        class SplitMix64
+        {
+        public:
+            explicit SplitMix64(uint64_t seed) : m_state(seed) {}
+
+            //! Return the next 64-bit pseudo-random value.
+            uint64_t Next()
+            {
+                uint64_t z = (m_state += 0x9e3779b97f4a7c15ull);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+                return z ^ (z >> 31);
+            }
+
+            //! Return a pseudo-random value uniformly distributed in [0,1[.
+            double NextUniform() { return double(Next() >> 11) * (1.0 / 9007199254740992.0); }
+
+            //! Return a pseudo-random value uniformly distributed in [low, high].
+            int64_t NextInRange(int64_t low, int64_t high)
+            {
+                if (high <= low)
+                    return low;
+                return low + int64_t(Next() % uint64_t(high - low + 1));
+            }
+
+        private:
+            uint64_t m_state;
+        };
+
+        //! Seeded schedule of faults.
+        /*! The schedule draws one fault kind per fetch call from #FaultRates. Faults can also be scripted at a given call index; scripted
+            faults take precedence over random ones. Two schedules built with the same seed, rates and script produce the same sequence.*/
+        class Schedule
+        {
+        public:
+            //! Build a disabled schedule: every call is forwarded untouched.
+            explicit Schedule() : Schedule(0, FaultRates()) {}
+
+            //! Build a schedule drawing faults with #rates from a generator seeded with #seed.
+            /*! \param[in] warmupCalls: number of leading calls which are never faulted (e.g. to let the acquisition settle).*/
+            explicit Schedule(uint64_t seed, FaultRates const& rates, uint64_t warmupCalls = 0);
+
+            //! Inject #kind at the call with index #callIndex (0-based, counted over all streams).
+            void AddScripted(uint64_t callIndex, FaultKind kind) { m_scripted[callIndex] = kind; }
+
+            //! Tell whether the schedule may inject any fault.
+            bool IsEnabled() const { return m_rates.GetTotal() > 0.0 || !m_scripted.empty(); }
+
+            //! Draw the fault associated with the next call.
+            FaultKind Next();
+
+            //! Return the generator used to draw fault parameters (truncation length, gap size...).
+            SplitMix64& GetGenerator() { return m_generator; }
+
+        private:
+            SplitMix64 m_generator;
+            FaultRates m_rates;
+            uint64_t m_warmupCalls;
+            uint64_t m_callIndex;
+            std::map<uint64_t, FaultKind> m_scripted;
+        };
+
+        //! Tuning of injected faults.
+        struct Parameters
+        {
+            ViStatus errorStatus = AQMD3_ERROR_IO_TIMEOUT;  //!< status returned by #FaultKind::ErrorStatus.
+            bool latchOverflow = true;                      //!< once truncated, the stream keeps returning AQMD3_ERROR_STREAM_OVERFLOW.
+            int64_t maxRecordIndexGap = 4;                  //!< maximum record index jump of #FaultKind::RecordIndexGap.
+            int64_t shortReadGrainElements = 1;             //!< default grain of the availability reported by short reads, see #StreamFetchInterposer::SetGrainElements.
+        };
+
+        //! Counters collected by the interposer.
+        struct Statistics
+        {
+            uint64_t calls = 0;                 //!< total number of fetch calls.
+            uint64_t elementsRequested = 0;     //!< total number of elements requested by the application.
+            uint64_t elementsDelivered = 0;     //!< total number of elements returned to the application.
+            uint64_t elementsLost = 0;          //!< total number of elements fetched from backend and not delivered.
+            uint64_t faults[int(FaultKind::Count)] = {};
+
+            //! Return the number of injected faults of the given kind.
+            uint64_t GetFaultCount(FaultKind kind) const { return faults[int(kind)]; }
+
+            //! Print the counters in human readable format.
+            void Print(std::ostream& output) const;
+        };
+
+        //! Interposer around AqMD3_StreamFetchDataInt32.
+        /*! The interposer has exactly the same calling convention as the driver function, so any fetch helper written against the
+            driver can be pointed at it. It forwards calls to the given backend (the driver, or any simulated stream with the same
+            contract) and alters the results according to the schedule.*/
+        class StreamFetchInterposer
+        {
+        public:
+            using FetchFunction = std::function<ViStatus(ViSession, ViConstString, ViInt64, ViInt64, ViInt32*, ViInt64*, ViInt64*, ViInt64*)>;
+
+            explicit StreamFetchInterposer(FetchFunction backend, Schedule const& schedule, Parameters const& params = Parameters());
+
+            //! Declare #streamName as a marker stream of markers of #markerElements elements. Tag and record-index faults are only applied on marker streams.
+            void AddMarkerStream(std::string const& streamName, int64_t markerElements)
+            {
+                m_markerStreams.insert(streamName);
+                SetGrainElements(streamName, markerElements);
+            }
+
+            //! Round the availability reported by short reads on #streamName down to #grainElements (e.g. whole markers, whole records).
+            void SetGrainElements(std::string const& streamName, int64_t grainElements);
+
+            //! Same contract as AqMD3_StreamFetchDataInt32.
+            ViStatus StreamFetchDataInt32(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, ViInt64 arrayBufferSize,
+                                          ViInt32 array[], ViInt64* availableElements, ViInt64* actualElements, ViInt64* firstValidElement);
+
+            //! Return the collected counters.
+            Statistics const& GetStatistics() const { return m_statistics; }
+
+        private:
+            //! Forward the call to backend and update delivery counters.
+            ViStatus Forward(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, ViInt64 arrayBufferSize,
+                             ViInt32 array[], ViInt64* availableElements, ViInt64* actualElements, ViInt64* firstValidElement);
+
+            bool IsMarkerStream(ViConstString streamName) const { return m_markerStreams.count(streamName) != 0; }
+
+            int64_t GetGrainElements(ViConstString streamName) const
+            {
+                auto const grain = m_grainElements.find(streamName);
+                return (grain != m_grainElements.end()) ? grain->second : m_params.shortReadGrainElements;
+            }
+
+        private:
+            FetchFunction m_backend;
+            Schedule m_schedule;
+            Parameters m_params;
+            std::set<std::string> m_markerStreams;
+            std::map<std::string, int64_t> m_grainElements;
+            std::set<std::string> m_overflowedStreams;
+            Statistics m_statistics;
+        };
+
+
+        ///////////////////////////////////////////////////////////////////////////
+        //
+        // Schedule member definitions
+        //
+
+        inline Schedule::Schedule(uint64_t seed, FaultRates const& rates, uint64_t warmupCalls)
+            : m_generator(seed)
+            , m_rates(rates)
+            , m_warmupCalls(warmupCalls)
+            , m_callIndex(0)
+            , m_scripted()
+        {
+            if (rates.GetTotal() > 1.0)
+                throw std::invalid_argument("Sum of fault rates must not exceed 1, got " + LibTool::ToString(rates.GetTotal()));
+        }
+
+        inline FaultKind Schedule::Next()
+        {
+            uint64_t const callIndex = m_callIndex++;
+
+            auto const scripted = m_scripted.find(callIndex);
+            if (scripted != m_scripted.end())
+                return scripted->second;
+
+            if (callIndex < m_warmupCalls || m_rates.GetTotal() <= 0.0)
+                return FaultKind::None;
+
+            double threshold = m_generator.NextUniform();
+            std::pair<double, FaultKind> const table[] =
+            {
+                { m_rates.shortRead,           FaultKind::ShortRead },
+                { m_rates.delayedAvailability, FaultKind::DelayedAvailability },
+                { m_rates.overflowTruncation,  FaultKind::OverflowTruncation },
+                { m_rates.corruptedTag,        FaultKind::CorruptedTag },
+                { m_rates.recordIndexGap,      FaultKind::RecordIndexGap },
+                { m_rates.errorStatus,         FaultKind::ErrorStatus },
+            };
+
+            for (auto const& entry : table)
+            {
+                if (threshold < entry.first)
+                    return entry.second;
+                threshold -= entry.first;
+            }
+
+            return FaultKind::None;
+        }
+
+        ///////////////////////////////////////////////////////////////////////////
+        //
+        // Statistics member definitions
+        //
+
+        inline void Statistics::Print(std::ostream& output) const
+        {
+            output << "Fault injection statistics:\n";
+            output << "  Fetch calls:          " << calls << '\n';
+            output << "  Elements requested:   " << elementsRequested << '\n';
+            output << "  Elements delivered:   " << elementsDelivered << '\n';
+            output << "  Elements lost:        " << elementsLost << '\n';
+            for (int kind = int(FaultKind::None) + 1; kind < int(FaultKind::Count); ++kind)
+                output << "  " << std::left << std::setw(22) << (std::string(FaultInjection::ToString(FaultKind(kind))) + ":") << std::right << faults[kind] << '\n';
+        }
+
+        ///////////////////////////////////////////////////////////////////////////
+        //
+        // StreamFetchInterposer member definitions
+        //
+
+        inline StreamFetchInterposer::StreamFetchInterposer(FetchFunction backend, Schedule const& schedule, Parameters const& params)
+            : m_backend(backend)
+            , m_schedule(schedule)
+            , m_params(params)
+            , m_markerStreams()
+            , m_grainElements()
+            , m_overflowedStreams()
+            , m_statistics()
+        {
+            if (!m_backend)
+                throw std::invalid_argument("Fault injection requires a valid fetch backend");
+
+            if (m_params.shortReadGrainElements <= 0)
+                throw std::invalid_argument("Short read grain must be strict positive, got " + LibTool::ToString(m_params.shortReadGrainElements));
+        }
+
+        inline void StreamFetchInterposer::SetGrainElements(std::string const& streamName, int64_t grainElements)
+        {
+            if (grainElements <= 0)
+                throw std::invalid_argument("Short read grain must be strict positive, got " + LibTool::ToString(grainElements) + " for " + streamName);
+
+            m_grainElements[streamName] = grainElements;
+        }
+
+        inline ViStatus StreamFetchInterposer::Forward(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, ViInt64 arrayBufferSize,
+                                                       ViInt32 array[], ViInt64* availableElements, ViInt64* actualElements, ViInt64* firstValidElement)
+        {
+            ViStatus const status = m_backend(session, streamName, nbrElementsToFetch, arrayBufferSize, array, availableElements, actualElements, firstValidElement);
+            if (status >= 0)
+                m_statistics.elementsDelivered += uint64_t(*actualElements);
+            return status;
+        }
+
+        inline ViStatus StreamFetchInterposer::StreamFetchDataInt32(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, ViInt64 arrayBufferSize,
+                                                                    ViInt32 array[], ViInt64* availableElements, ViInt64* actualElements, ViInt64* firstValidElement)
+        {
+            ++m_statistics.calls;
+            m_statistics.elementsRequested += uint64_t(nbrElementsToFetch);
+
+            // A truncated stream keeps reporting the overflow, as the instrument does until the acquisition is restarted.
+            if (m_overflowedStreams.count(streamName) != 0)
+            {
+                *availableElements = 0;
+                *actualElements = 0;
+                *firstValidElement = 0;
+                return AQMD3_ERROR_STREAM_OVERFLOW;
+            }
+
+            FaultKind kind = m_schedule.Next();
+            if ((kind == FaultKind::CorruptedTag || kind == FaultKind::RecordIndexGap) && !IsMarkerStream(streamName))
+                kind = FaultKind::None;
+
+            SplitMix64& generator = m_schedule.GetGenerator();
+
+            switch (kind)
+            {
+            case FaultKind::None:
+                return Forward(session, streamName, nbrElementsToFetch, arrayBufferSize, array, availableElements, actualElements, firstValidElement);
+
+            case FaultKind::ShortRead:
+            {
+                /* The driver fetches all the requested elements or none of them. Fetch nothing and report fewer (grain-aligned) elements
+                   available than requested, as when the data are not ready yet: the stream is untouched, the caller retries or fetches
+                   the reported volume.*/
+                if (nbrElementsToFetch <= 0)
+                    return Forward(session, streamName, nbrElementsToFetch, arrayBufferSize, array, availableElements, actualElements, firstValidElement);
+
+                ViInt64 const grain = GetGrainElements(streamName);
+                ++m_statistics.faults[int(kind)];
+                *availableElements = (generator.NextInRange(0, nbrElementsToFetch - 1) / grain) * grain;
+                *actualElements = 0;
+                *firstValidElement = 0;
+                return VI_SUCCESS;
+            }
+
+            case FaultKind::DelayedAvailability:
+                ++m_statistics.faults[int(kind)];
+                *availableElements = 0;
+                *actualElements = 0;
+                *firstValidElement = 0;
+                return VI_SUCCESS;
+
+            case FaultKind::ErrorStatus:
+                ++m_statistics.faults[int(kind)];
+                *availableElements = 0;
+                *actualElements = 0;
+                *firstValidElement = 0;
+                return m_params.errorStatus;
+
+            case FaultKind::OverflowTruncation:
+            {
+                ViStatus const status = m_backend(session, streamName, nbrElementsToFetch, arrayBufferSize, array, availableElements, actualElements, firstValidElement);
+                if (status < 0 || *actualElements == 0)
+                    return status;
+
+                // Deliver a random head of the fetched data, the tail is lost as if storage had been interrupted by an overflow.
+                ++m_statistics.faults[int(kind)];
+                ViInt64 const delivered = generator.NextInRange(0, *actualElements - 1);
+                m_statistics.elementsLost += uint64_t(*actualElements - delivered);
+                m_statistics.elementsDelivered += uint64_t(delivered);
+                *actualElements = delivered;
+                *availableElements = 0;
+
+                if (m_params.latchOverflow)
+                    m_overflowedStreams.insert(streamName);
+                return status;
+            }
+
+            case FaultKind::CorruptedTag:
+            case FaultKind::RecordIndexGap:
+            {
+                ViStatus const status = Forward(session, streamName, nbrElementsToFetch, arrayBufferSize, array, availableElements, actualElements, firstValidElement);
+                if (status < 0 || *actualElements == 0)
+                    return status;
+
+                ++m_statistics.faults[int(kind)];
+                uint32_t& header = reinterpret_cast<uint32_t&>(array[*firstValidElement]);
+                if (kind == FaultKind::CorruptedTag)
+                {
+                    // flip at least one bit of the 8-bit tag.
+                    header ^= uint32_t(generator.NextInRange(1, 0xff));
+                }
+                else
+                {
+                    // keep the tag, jump the 24-bit record index forward.
+                    uint32_t const gap = uint32_t(generator.NextInRange(1, (std::max)(m_params.maxRecordIndexGap, int64_t(1))));
+                    uint32_t const recordIndex = ((header >> 8) + gap) & TriggerMarker::RecordIndexMask;
+                    header = (header & 0xff) | (recordIndex << 8);
+                }
+                return status;
+            }
+
+            default:
+                throw std::logic_error("Unexpected fault kind: " + LibTool::ToString(int(kind)));
+            }
+        }
+    }
+}
+
+#endif
@@ -17,6 +17,8 @@
 #include <list>
 #include <algorithm>
 
+#include "BitLayout.h"
+
 namespace LibTool
 {
     //! Convert a value to a string.
@@ -91,19 +93,25 @@ namespace LibTool
     }
 
     //! Represents a subsegment of a read-only array.
-    /*! The class receives a const reference to a read-only instance of 'std::vector'. The class does not own this given instance, and the
-        later must not be resized and/or destroyed until the destruction of all associated 'ArraySegment' instances.*/
+    /*! The class receives a read-only contiguous container (e.g. 'std::vector' with any allocator) or a raw array. The class does not own
+        the given data, and the later must not be resized and/or destroyed until the destruction of all associated 'ArraySegment' instances.*/
     template <typename T> class ArraySegment
     {
     private:
         using value_type = T;
         using pointer = T*;
-        using container_type = std::vector<T>;
 
     public:
         //! Build a segment of 'count' elements starting at 'offset' from 'data' container.
-        /*! 'data' must not be resized and/or destroyed during the life-cycle of all ArraySegment objects referencing it.*/
-        explicit ArraySegment(container_type const& data, size_t offset, size_t count);
+        /*! 'data' is any contiguous container providing 'data()' and 'size()'. It must not be resized and/or destroyed during the life-cycle
+            of all ArraySegment objects referencing it.*/
+        template <typename Container>
+        explicit ArraySegment(Container const& data, size_t offset, size_t count)
+            : ArraySegment(data.data(), data.size(), offset, count)
+        {}
+
+        //! Build a segment of 'count' elements starting at 'offset' from the raw array 'data' of 'capacity' elements.
+        explicit ArraySegment(T const* data, size_t capacity, size_t offset, size_t count);
 
         //! Return the size of the segment.
         size_t Size() const { return m_size; }
@@ -115,13 +123,14 @@ namespace LibTool
         }
 
         //! Return a pointer of the first element in the segment.
-        pointer GetData() const { return pointer(&m_data[m_offset]); }
+        pointer GetData() const { return const_cast<pointer>(m_data + m_offset); }
 
         //! Skip the first 'nbrElements' elements from the array segment. Size is reduced accordingly, elements are not destroyed.
         void PopFront(size_t nbrElements);
 
     private:
-        container_type const& m_data;   //!< Const reference to the underlaying data container
+        T const* m_data;                //!< Pointer to the first element of the underlaying data array
+        size_t m_capacity;              //!< number of elements of the underlaying data array
         size_t m_offset;                //!< offset in 'm_data' of the very first item of the segment.
         size_t m_size;                  //!< size of the segment
     };
@@ -471,17 +480,18 @@ namespace LibTool
     //
 
     template <typename T>
-    inline ArraySegment<T>::ArraySegment(container_type const& data, size_t offset, size_t count)
+    inline ArraySegment<T>::ArraySegment(T const* data, size_t capacity, size_t offset, size_t count)
         : m_data(data)
+        , m_capacity(capacity)
         , m_offset(offset)
         , m_size(count)
     {
-        if (data.size() < offset + count)
+        if (capacity < offset + count)
         {
             throw std::logic_error("Array segment definition exceeds array size: "
                 "offset=" + ToString(offset) +
                 ", count=" + ToString(count) +
-                ", array size=" + ToString(m_data.size())
+                ", array size=" + ToString(m_capacity)
             );
         }
     }
@@ -504,26 +514,22 @@ namespace LibTool
 
     inline TriggerMarker StandardStreaming::DecodeTriggerMarker(MarkerStream& stream)
     {
-        uint32_t const header = stream[0];
-        MarkerTag const tag = ExtractTag(header);
+        typedef BitLayout::Layouts::TriggerMarker Layout;
+
+        int32_t const* const marker = stream.GetData();
+        MarkerTag const tag = MarkerTag(Layout::Tag::Extract(marker));
 
         if (!IsTriggerMarkerTag(tag))
             throw std::runtime_error("Expected trigger marker, got " + ToString(int(tag)));
 
-        uint32_t const low = stream[1];
-        uint32_t const high = stream[2];
-
         TriggerMarker result;
 
         result.tag = tag;
-        result.recordIndex = (header >> 8) & TriggerMarker::RecordIndexMask;
-
-        result.triggerTimeSamples = -(double(low & 0x000000ff) / 256.0);
-        uint64_t const timestampLow = (low >> 8) & 0x0000000000ffffffL;
-        uint64_t const timestampHigh = uint64_t(high) << 24;
-        result.absoluteSampleIndex = timestampHigh | timestampLow;
+        result.recordIndex = uint32_t(Layout::RecordIndex::Extract(marker));
+        result.triggerTimeSamples = Layout::TriggerSubsample::ExtractScaled(marker);
+        result.absoluteSampleIndex = Layout::Timestamp::Extract(marker);
 
-        stream.PopFront(16);
+        stream.PopFront(Layout::NbrElements);
 
         return result;
     }
@@ -553,8 +559,9 @@ namespace LibTool
             throw std::invalid_argument(oss.str());
         }
 
+        int32_t const marker[] = { element0, element1 };
         m_blockIndex = blockIndex;
-        m_startSampleIndex = (element1 >> 24) & 0xff;
+        m_startSampleIndex = int32_t(BitLayout::Layouts::GateMarker::SampleIndex::Extract(marker));
     }
 
     ///////////////////////////////////////////////////////////////////////////
@@ -583,8 +590,9 @@ namespace LibTool
             throw std::invalid_argument(oss.str());
         }
 
+        int32_t const marker[] = { element0, element1 };
         m_blockIndex = blockIndex;
-        m_gateEndIndex = (element1 >> 24) & 0xff;
+        m_gateEndIndex = int32_t(BitLayout::Layouts::GateMarker::SampleIndex::Extract(marker));
         m_tag = tag;
     }
 
@@ -601,9 +609,8 @@ namespace LibTool
 
     inline int64_t ZeroSuppress::GateMarker::ExtractPosition(int32_t element0, int32_t element1)
     {
-        int64_t const low = (element0 >> 24) & 0xff;
-        int64_t const high = int64_t(element1 & 0xffffff) << 8;
-        return high | low;
+        int32_t const marker[] = { element0, element1 };
+        return int64_t(BitLayout::Layouts::GateMarker::BlockIndex::Extract(marker));
     }
 
     inline ZeroSuppress::GateMarker::GateMarker(GateStartMarker const& startMarker, GateStopMarker const& stopMarker)
@@ -716,28 +723,8 @@ namespace LibTool
 
     inline TriggerMarker ZeroSuppress::MarkerStreamDecoder::DecodeTriggerMarker(MarkerStream& stream)
     {
-        uint32_t const header = stream[0];
-        MarkerTag const tag = ExtractTag(header);
-
-        if (!IsTriggerMarkerTag(tag))
-            throw std::runtime_error("Expected trigger marker, got " + ToString(int(tag)));
-
-        uint32_t const low = stream[1];
-        uint32_t const high = stream[2];
-
-        TriggerMarker result;
-
-        result.tag = tag;
-        result.recordIndex = (header >> 8) & TriggerMarker::RecordIndexMask;
-
-        result.triggerTimeSamples = -(double(low & 0x000000ff) / 256.0);
-        uint64_t const timestampLow = (low >> 8) & 0x0000000000ffffffL;
-        uint64_t const timestampHigh = uint64_t(high) << 24;
-        result.absoluteSampleIndex = timestampHigh | timestampLow;
-
-        stream.PopFront(16);
-
-        return result;
+        // ZeroSuppress records start with the trigger marker of standard streaming.
+        return StandardStreaming::DecodeTriggerMarker(stream);
     }
 
     inline void ZeroSuppress::MarkerStreamDecoder::DecodeNextMarker(MarkerStream& stream)
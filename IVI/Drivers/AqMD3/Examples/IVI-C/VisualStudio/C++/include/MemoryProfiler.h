@@ -0,0 +1,468 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// MemoryProfiler: per-component memory accounting, stage throughput counters and footprint cap
+// for the streaming pipelines of the AqMD3 IVI-C examples.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_MEMORYPROFILER_H
+#define LIBTOOL_MEMORYPROFILER_H
+
+#include "LibTool.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef PSAPI_VERSION
+#define PSAPI_VERSION 2 // GetProcessMemoryInfo resolves to K32GetProcessMemoryInfo in kernel32 (no Psapi.lib).
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <cstdio>
+#include <unistd.h>
+#endif
+
+namespace LibTool
+{
+    //! Memory instrumentation of the streaming pipelines.
+    /*! Containers of the pipeline (fetch buffers, record pools, decoder and writer queues) use #TrackingAllocator bound to a named
+        #Component of the #Registry. The registry keeps current and peak allocations per component, enforces an optional footprint
+        cap, and counts bytes moved by every pipeline stage. Typical use:
+
+            auto& registry = MemoryProfiler::Registry::Instance();
+            registry.SetFootprintCap(512 * 1024 * 1024);
+
+            MemoryProfiler::TrackedVector<int32_t> buffer(size, MemoryProfiler::TrackingAllocator<int32_t>(registry.GetComponent("fetch.samples")));
+            ...
+            registry.GetStage("fetch.samples").AddBytes(nbrBytes);
+            ...
+            registry.Report(std::cout);
+    */
+    namespace MemoryProfiler
+    {
+        //! Raised when an allocation or the process resident memory exceeds the configured footprint cap.
+        class FootprintLimitError : public std::runtime_error
+        {
+        public:
+            explicit FootprintLimitError(std::string const& message)
+                : std::runtime_error(message)
+            {}
+        };
+
+        //! Return the resident memory of the current process in bytes (0 if not available on the platform).
+        int64_t GetProcessResidentBytes();
+
+        //! Return the peak resident memory of the current process in bytes (0 if not available on the platform).
+        int64_t GetProcessPeakResidentBytes();
+
+        class Registry;
+
+        //! Memory accounting of one component of the pipeline.
+        /*! Counters are atomic: a component can be shared by containers used from different threads.*/
+        class Component
+        {
+        public:
+            explicit Component(std::string const& name, Registry& registry)
+                : m_name(name)
+                , m_registry(registry)
+                , m_currentBytes(0)
+                , m_peakBytes(0)
+                , m_nbrAllocations(0)
+            {}
+
+            Component(Component const&) = delete;
+            Component& operator=(Component const&) = delete;
+
+            //! Account for the allocation of #nbrBytes.
+            /*! \throw FootprintLimitError if the allocation makes the tracked total exceed the footprint cap. Nothing is accounted in this case.*/
+            void Allocate(int64_t nbrBytes);
+
+            //! Account for the release of #nbrBytes.
+            void Release(int64_t nbrBytes);
+
+            std::string const& GetName() const { return m_name; }
+            int64_t GetCurrentBytes() const { return m_currentBytes.load(std::memory_order_relaxed); }
+            int64_t GetPeakBytes() const { return m_peakBytes.load(std::memory_order_relaxed); }
+            int64_t GetAllocationCount() const { return m_nbrAllocations.load(std::memory_order_relaxed); }
+
+        private:
+            std::string const m_name;
+            Registry& m_registry;
+            std::atomic<int64_t> m_currentBytes;
+            std::atomic<int64_t> m_peakBytes;
+            std::atomic<int64_t> m_nbrAllocations;
+        };
+
+        //! Count of bytes moved by one stage of the pipeline (fetch, unpack, write, ...).
+        class StageCounter
+        {
+        public:
+            explicit StageCounter(std::string const& name)
+                : m_name(name)
+                , m_bytes(0)
+            {}
+
+            StageCounter(StageCounter const&) = delete;
+            StageCounter& operator=(StageCounter const&) = delete;
+
+            //! Account for #nbrBytes moved by the stage.
+            void AddBytes(int64_t nbrBytes) { m_bytes.fetch_add(nbrBytes, std::memory_order_relaxed); }
+
+            //! Clear the count of bytes.
+            void Reset() { m_bytes.store(0, std::memory_order_relaxed); }
+
+            std::string const& GetName() const { return m_name; }
+            int64_t GetBytes() const { return m_bytes.load(std::memory_order_relaxed); }
+
+        private:
+            std::string const m_name;
+            std::atomic<int64_t> m_bytes;
+        };
+
+        //! Process-wide registry of components and stages.
+        /*! Components and stages are created on first use and live as long as the registry, references to them stay valid.*/
+        class Registry
+        {
+        public:
+            using Clock = std::chrono::steady_clock;
+
+            //! Return the process-wide registry.
+            static Registry& Instance()
+            {
+                static Registry registry;
+                return registry;
+            }
+
+            explicit Registry()
+                : m_mutex()
+                , m_components()
+                , m_stages()
+                , m_footprintCap(0)
+                , m_currentBytes(0)
+                , m_peakBytes(0)
+                , m_startTime(Clock::now())
+            {}
+
+            Registry(Registry const&) = delete;
+            Registry& operator=(Registry const&) = delete;
+
+            //! Return the component named #name, created on first call.
+            Component& GetComponent(std::string const& name);
+
+            //! Return the stage counter named #name, created on first call.
+            StageCounter& GetStage(std::string const& name);
+
+            //! Set the maximum footprint in bytes (0 means no limit).
+            /*! The cap applies to the sum of tracked allocations (checked at allocation time) and to the resident memory of the process
+                (checked by #CheckFootprint).*/
+            void SetFootprintCap(int64_t nbrBytes) { m_footprintCap.store(nbrBytes, std::memory_order_relaxed); }
+            int64_t GetFootprintCap() const { return m_footprintCap.load(std::memory_order_relaxed); }
+
+            //! Return the sum of current allocations of all components.
+            int64_t GetCurrentBytes() const { return m_currentBytes.load(std::memory_order_relaxed); }
+
+            //! Return the peak of the sum of allocations of all components.
+            int64_t GetPeakBytes() const { return m_peakBytes.load(std::memory_order_relaxed); }
+
+            //! Check the resident memory of the process against the footprint cap.
+            /*! \throw FootprintLimitError if the cap is set and exceeded.*/
+            void CheckFootprint() const;
+
+            //! Restart the time base of stage throughput and clear stage counters (references to stages stay valid).
+            void ResetStages();
+
+            //! Print per-component allocations, per-stage throughput and process resident memory.
+            void Report(std::ostream& output) const;
+
+        private:
+            friend class Component;
+
+            //! Account for a change of #deltaBytes of the tracked total, enforcing the footprint cap for positive changes.
+            void Account(int64_t deltaBytes, std::string const& componentName);
+
+            mutable std::mutex m_mutex;
+            std::map<std::string, std::unique_ptr<Component>> m_components;
+            std::map<std::string, std::unique_ptr<StageCounter>> m_stages;
+            std::atomic<int64_t> m_footprintCap;
+            std::atomic<int64_t> m_currentBytes;
+            std::atomic<int64_t> m_peakBytes;
+            Clock::time_point m_startTime;
+        };
+
+        //! Standard allocator accounting its allocations in a #Component.
+        /*! Allocators bound to the same component compare equal. Rebound allocators (e.g. list nodes) keep the component. An
+            allocator bound to no component accounts nothing.*/
+        template <typename T>
+        class TrackingAllocator
+        {
+        public:
+            using value_type = T;
+
+            explicit TrackingAllocator(Component& component) noexcept
+                : m_component(&component)
+            {}
+
+            //! Build an allocator accounting its allocations in component, or nowhere if it is null.
+            explicit TrackingAllocator(Component* component) noexcept
+                : m_component(component)
+            {}
+
+            template <typename U>
+            TrackingAllocator(TrackingAllocator<U> const& other) noexcept
+                : m_component(other.GetComponent())
+            {}
+
+            T* allocate(size_t n)
+            {
+                if (n > (std::numeric_limits<size_t>::max)() / sizeof(T))
+                    throw std::bad_alloc();
+
+                if (m_component == nullptr)
+                    return static_cast<T*>(::operator new(n * sizeof(T)));
+
+                int64_t const nbrBytes = int64_t(n * sizeof(T));
+                m_component->Allocate(nbrBytes);
+                try
+                {
+                    return static_cast<T*>(::operator new(n * sizeof(T)));
+                }
+                catch (...)
+                {
+                    m_component->Release(nbrBytes);
+                    throw;
+                }
+            }
+
+            void deallocate(T* p, size_t n) noexcept
+            {
+                ::operator delete(p);
+                if (m_component != nullptr)
+                    m_component->Release(int64_t(n * sizeof(T)));
+            }
+
+            //! Return the component of the allocator, null if it is not tracked.
+            Component* GetComponent() const { return m_component; }
+
+        private:
+            Component* m_component;
+        };
+
+        template <typename T, typename U>
+        inline bool operator==(TrackingAllocator<T> const& lhs, TrackingAllocator<U> const& rhs)
+        { return lhs.GetComponent() == rhs.GetComponent(); }
+
+        template <typename T, typename U>
+        inline bool operator!=(TrackingAllocator<T> const& lhs, TrackingAllocator<U> const& rhs)
+        { return !(lhs == rhs); }
+
+        //! Vector accounting its storage in a component.
+        template <typename T>
+        using TrackedVector = std::vector<T, TrackingAllocator<T>>;
+
+        //! Return an allocator bound to the component #name of the process-wide registry, or an untracked allocator if not #tracked.
+        /*! Looking the component up takes the lock of the registry: make allocators once, outside of processing loops.*/
+        template <typename T>
+        inline TrackingAllocator<T> MakeAllocator(std::string const& name, bool tracked = true)
+        {
+            return TrackingAllocator<T>(tracked ? &Registry::Instance().GetComponent(name) : nullptr);
+        }
+
+        //! Format #nbrBytes with a binary unit (B, KiB, MiB, GiB).
+        inline std::string FormatBytes(double nbrBytes)
+        {
+            static char const* const units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+            int unit = 0;
+            while (nbrBytes >= 1024.0 && unit < 4)
+            {
+                nbrBytes /= 1024.0;
+                ++unit;
+            }
+
+            std::ostringstream strm;
+            strm << std::fixed << std::setprecision(unit == 0 ? 0 : 2) << nbrBytes << ' ' << units[unit];
+            return strm.str();
+        }
+    }
+
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    // MemoryProfiler member definitions
+    //
+
+    inline int64_t MemoryProfiler::GetProcessResidentBytes()
+    {
+#if defined(_WIN32)
+        PROCESS_MEMORY_COUNTERS counters;
+        if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            return 0;
+        return int64_t(counters.WorkingSetSize);
+#else
+        std::FILE* file = std::fopen("/proc/self/statm", "r");
+        if (file == nullptr)
+            return 0;
+
+        long long nbrPages = 0;
+        long long nbrResidentPages = 0;
+        int const nbrFields = std::fscanf(file, "%lld %lld", &nbrPages, &nbrResidentPages);
+        std::fclose(file);
+
+        if (nbrFields != 2)
+            return 0;
+        return int64_t(nbrResidentPages) * int64_t(sysconf(_SC_PAGESIZE));
+#endif
+    }
+
+    inline int64_t MemoryProfiler::GetProcessPeakResidentBytes()
+    {
+#if defined(_WIN32)
+        PROCESS_MEMORY_COUNTERS counters;
+        if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            return 0;
+        return int64_t(counters.PeakWorkingSetSize);
+#else
+        std::FILE* file = std::fopen("/proc/self/status", "r");
+        if (file == nullptr)
+            return 0;
+
+        char line[256];
+        long long peakKiB = 0;
+        while (std::fgets(line, sizeof(line), file) != nullptr)
+        {
+            if (std::sscanf(line, "VmHWM: %lld kB", &peakKiB) == 1)
+                break;
+        }
+        std::fclose(file);
+        return int64_t(peakKiB) * 1024;
+#endif
+    }
+
+    inline void MemoryProfiler::Component::Allocate(int64_t nbrBytes)
+    {
+        m_registry.Account(nbrBytes, m_name);
+
+        int64_t const current = m_currentBytes.fetch_add(nbrBytes, std::memory_order_relaxed) + nbrBytes;
+        int64_t peak = m_peakBytes.load(std::memory_order_relaxed);
+        while (current > peak && !m_peakBytes.compare_exchange_weak(peak, current, std::memory_order_relaxed))
+        {
+        }
+        m_nbrAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void MemoryProfiler::Component::Release(int64_t nbrBytes)
+    {
+        m_currentBytes.fetch_sub(nbrBytes, std::memory_order_relaxed);
+        m_registry.Account(-nbrBytes, m_name);
+    }
+
+    inline MemoryProfiler::Component& MemoryProfiler::Registry::GetComponent(std::string const& name)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto& component = m_components[name];
+        if (!component)
+            component.reset(new Component(name, *this));
+        return *component;
+    }
+
+    inline MemoryProfiler::StageCounter& MemoryProfiler::Registry::GetStage(std::string const& name)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto& stage = m_stages[name];
+        if (!stage)
+            stage.reset(new StageCounter(name));
+        return *stage;
+    }
+
+    inline void MemoryProfiler::Registry::Account(int64_t deltaBytes, std::string const& componentName)
+    {
+        int64_t const current = m_currentBytes.fetch_add(deltaBytes, std::memory_order_relaxed) + deltaBytes;
+        if (deltaBytes <= 0)
+            return;
+
+        int64_t const cap = GetFootprintCap();
+        if (cap > 0 && current > cap)
+        {
+            m_currentBytes.fetch_sub(deltaBytes, std::memory_order_relaxed);
+            throw FootprintLimitError("Allocation of " + FormatBytes(double(deltaBytes)) + " for component '" + componentName
+                + "' exceeds the footprint cap: tracked=" + FormatBytes(double(current - deltaBytes)) + ", cap=" + FormatBytes(double(cap)));
+        }
+
+        int64_t peak = m_peakBytes.load(std::memory_order_relaxed);
+        while (current > peak && !m_peakBytes.compare_exchange_weak(peak, current, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    inline void MemoryProfiler::Registry::CheckFootprint() const
+    {
+        int64_t const cap = GetFootprintCap();
+        if (cap <= 0)
+            return;
+
+        int64_t const resident = GetProcessResidentBytes();
+        if (resident > cap)
+            throw FootprintLimitError("Process resident memory exceeds the footprint cap: resident=" + FormatBytes(double(resident)) + ", cap=" + FormatBytes(double(cap)));
+    }
+
+    inline void MemoryProfiler::Registry::ResetStages()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& entry : m_stages)
+            entry.second->Reset();
+        m_startTime = Clock::now();
+    }
+
+    inline void MemoryProfiler::Registry::Report(std::ostream& output) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        double const elapsedSeconds = std::chrono::duration<double>(Clock::now() - m_startTime).count();
+
+        output << "\nMemory footprint\n";
+        output << "  " << std::left << std::setw(24) << "Component" << std::right << std::setw(14) << "Current" << std::setw(14) << "Peak" << std::setw(14) << "Allocations" << '\n';
+        for (auto const& entry : m_components)
+        {
+            Component const& component = *entry.second;
+            output << "  " << std::left << std::setw(24) << component.GetName() << std::right
+                   << std::setw(14) << FormatBytes(double(component.GetCurrentBytes()))
+                   << std::setw(14) << FormatBytes(double(component.GetPeakBytes()))
+                   << std::setw(14) << component.GetAllocationCount() << '\n';
+        }
+        output << "  " << std::left << std::setw(24) << "Total tracked" << std::right
+               << std::setw(14) << FormatBytes(double(GetCurrentBytes()))
+               << std::setw(14) << FormatBytes(double(GetPeakBytes())) << '\n';
+        output << "  " << std::left << std::setw(24) << "Process resident" << std::right
+               << std::setw(14) << FormatBytes(double(GetProcessResidentBytes()))
+               << std::setw(14) << FormatBytes(double(GetProcessPeakResidentBytes())) << '\n';
+        if (GetFootprintCap() > 0)
+            output << "  Footprint cap: " << FormatBytes(double(GetFootprintCap())) << '\n';
+
+        if (m_stages.empty())
+            return;
+
+        output << "\nStage throughput over " << std::fixed << std::setprecision(1) << elapsedSeconds << " s\n";
+        for (auto const& entry : m_stages)
+        {
+            StageCounter const& stage = *entry.second;
+            double const rate = (elapsedSeconds > 0.0) ? double(stage.GetBytes()) / elapsedSeconds : 0.0;
+            output << "  " << std::left << std::setw(24) << stage.GetName() << std::right
+                   << std::setw(14) << FormatBytes(double(stage.GetBytes()))
+                   << std::setw(14) << FormatBytes(rate) << "/s\n";
+        }
+        output << std::defaultfloat;
+    }
+}
+
+#endif
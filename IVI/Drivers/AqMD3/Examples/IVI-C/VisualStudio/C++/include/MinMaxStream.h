@@ -0,0 +1,346 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// MinMaxStream: discovery of the streams of a session, decoding of min/max streams and
+// multi-resolution overview of the min/max envelope of long acquisitions.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_MINMAXSTREAM_H
+#define LIBTOOL_MINMAXSTREAM_H
+
+#include "LibTool.h"
+#include "ContinuousStreaming.h"
+#include <AqMD3.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace LibTool
+{
+    //! Min/max stream utils.
+    /*! A min/max stream (AQMD3_VAL_STREAM_TYPE_MIN_MAX) delivers, for every frame of AQMD3_ATTR_STREAM_MINMAX_FRAME_SIZE samples,
+        the minimum and maximum sample of the frame: the envelope of the signal at a fraction 2/frameSize of the raw bandwidth.
+        Every 32-bit element of the stream holds one frame. The layout assumed here, minimum in the low 16 bits and maximum in the
+        high 16 bits, has not been checked against the user manual of the instrument: check it there, and swap the two halves in
+        #DecodeFrames if the firmware packs them the other way round.
+
+        In continuous streaming mode the stream is fetched with #ContinuousStreaming::ChunkReader like a sample stream: a chunk
+        then holds (minimum, maximum) pairs, and its running sample index is twice the index of its first frame. Frames are
+        accumulated in an #OverviewStore, which keeps the envelope at several resolutions for long-duration monitoring:
+
+            ContinuousStreaming::ChunkFetcher fetcher(AqMD3_StreamFetchDataInt32, session, minMaxStreamName, chunkElements, grainElements);
+            MinMax::OverviewStore store(frameSize, 8, 4, 1024 * 1024);
+            ...
+            store.Append(chunk);
+            store.Query(beginSample, endSample, 1000, span);
+    */
+    namespace MinMax
+    {
+        //! Stream of a session, as reported by the driver.
+        struct StreamInfo
+        {
+            ViInt32 index = 0;          //!< one-based index of the stream.
+            std::string name;
+            ViInt32 type = 0;           //!< AQMD3_VAL_STREAM_TYPE_XXX.
+            bool enabled = false;
+        };
+
+        //! Return the description of all streams of session, in driver order.
+        /*! \throw #std::runtime_error if the driver fails to report a stream.*/
+        std::vector<StreamInfo> DiscoverStreams(ViSession session);
+
+        //! Return the names of the streams of type AQMD3_VAL_STREAM_TYPE_XXX.
+        std::vector<std::string> FindStreams(std::vector<StreamInfo> const& streams, ViInt32 type);
+
+        //! Return a printable name of a stream type.
+        std::string GetStreamTypeName(ViInt32 type);
+
+        //! Split nbrFrames stream elements into their minimum and maximum (assumed layout: minimum in the low 16 bits).
+        void DecodeFrames(int32_t const* elements, size_t nbrFrames, int16_t* minima, int16_t* maxima);
+
+        //! Point of the envelope: extreme samples over a span of the signal.
+        struct Point
+        {
+            int16_t minimum = 0;
+            int16_t maximum = 0;
+        };
+
+        //! Contiguous points of the envelope at one resolution.
+        struct Span
+        {
+            uint64_t firstSampleIndex = 0;  //!< running index of the first sample covered by the first point.
+            int64_t samplesPerPoint = 0;
+            size_t level = 0;
+            std::vector<Point> points;
+        };
+
+        //! Envelope of the signal at nbrLevels resolutions.
+        /*! Level 0 holds the frames as received, every point of level k+1 merges reductionFactor points of level k. Every level
+            keeps the levelCapacity most recent points: coarse levels retain reductionFactor times more history than the finer
+            ones, for the same memory.*/
+        class OverviewStore
+        {
+        public:
+            explicit OverviewStore(int64_t frameSize, size_t nbrLevels, size_t reductionFactor, size_t levelCapacity);
+
+            //! Append nbrFrames consecutive frames.
+            void Append(int16_t const* minima, int16_t const* maxima, size_t nbrFrames);
+
+            //! Append the frames of a chunk of the min/max stream (pairs of minimum and maximum).
+            /*! \throw #ContinuousStreaming::StreamGapError if chunk does not follow the previous one.*/
+            void Append(ContinuousStreaming::SampleChunk const& chunk);
+
+            //! Return in span the points covering [beginSample, endSample[ at the finest level giving at most maxPoints points.
+            /*! Levels which no longer hold beginSample are skipped, the range is clipped to the points stored at the chosen level.
+                \return the number of points of span.*/
+            size_t Query(uint64_t beginSample, uint64_t endSample, size_t maxPoints, Span& span) const;
+
+            //! Return the running index following the last sample covered by level 0.
+            uint64_t GetEndSampleIndex() const
+            { return m_levels[0].nbrPoints * uint64_t(m_frameSize); }
+
+            //! Return the number of samples covered by a point of level.
+            int64_t GetSamplesPerPoint(size_t level) const
+            { return m_levels[level].samplesPerPoint; }
+
+            size_t GetNbrLevels() const
+            { return m_levels.size(); }
+
+            //! Return the memory used by the stored points, in bytes.
+            size_t GetMemorySize() const
+            { return m_levels.size() * m_levelCapacity * sizeof(Point); }
+
+        private:
+            struct Level
+            {
+                int64_t samplesPerPoint = 0;
+                uint64_t nbrPoints = 0;             //!< number of points written since the start.
+                std::vector<Point> points;          //!< ring of the last levelCapacity points.
+                Point partial;                      //!< merge of the points of the level below not yet forming a point.
+                size_t nbrPartial = 0;
+                std::vector<int16_t> reducedMin;    //!< points for the level above, built during #Append.
+                std::vector<int16_t> reducedMax;
+            };
+
+            //! Store points in level and propagate them to the coarser levels.
+            void AppendLevel(size_t level, int16_t const* minima, int16_t const* maxima, size_t nbrPoints);
+
+            int64_t const m_frameSize;
+            size_t const m_reductionFactor;
+            size_t const m_levelCapacity;
+            std::vector<Level> m_levels;
+            std::vector<int16_t> m_decodedMin;
+            std::vector<int16_t> m_decodedMax;
+        };
+    }
+
+    ///////
+    // MinMax member definitions
+    //
+
+    inline std::vector<MinMax::StreamInfo> MinMax::DiscoverStreams(ViSession session)
+    {
+        ViInt32 nbrStreams = 0;
+        ViStatus status = AqMD3_GetAttributeViInt32(session, "", AQMD3_ATTR_STREAM_COUNT, &nbrStreams);
+        if (status < 0)
+            throw std::runtime_error("Failed to read the stream count: status " + ToString(status));
+
+        std::vector<StreamInfo> streams;
+        for (ViInt32 index = 1; index <= nbrStreams; ++index)
+        {
+            StreamInfo info;
+            info.index = index;
+
+            ViChar name[128];
+            status = AqMD3_GetStreamName(session, index, sizeof(name), name);
+            if (status < 0)
+                throw std::runtime_error("Failed to read the name of stream " + ToString(index) + ": status " + ToString(status));
+            info.name = name;
+
+            status = AqMD3_GetAttributeViInt32(session, name, AQMD3_ATTR_STREAM_TYPE, &info.type);
+            if (status < 0)
+                throw std::runtime_error("Failed to read the type of stream " + info.name + ": status " + ToString(status));
+
+            ViBoolean enabled = VI_FALSE;
+            status = AqMD3_GetAttributeViBoolean(session, name, AQMD3_ATTR_STREAM_ENABLED, &enabled);
+            if (status < 0)
+                throw std::runtime_error("Failed to read the state of stream " + info.name + ": status " + ToString(status));
+            info.enabled = (enabled == VI_TRUE);
+
+            streams.push_back(info);
+        }
+        return streams;
+    }
+
+    inline std::vector<std::string> MinMax::FindStreams(std::vector<StreamInfo> const& streams, ViInt32 type)
+    {
+        std::vector<std::string> names;
+        for (StreamInfo const& info : streams)
+        {
+            if (info.type == type)
+                names.push_back(info.name);
+        }
+        return names;
+    }
+
+    inline std::string MinMax::GetStreamTypeName(ViInt32 type)
+    {
+        switch (type)
+        {
+        case AQMD3_VAL_STREAM_TYPE_MARKERS: return "Markers";
+        case AQMD3_VAL_STREAM_TYPE_MIN_MAX: return "MinMax";
+        case AQMD3_VAL_STREAM_TYPE_SAMPLES: return "Samples";
+        default: return "Unknown(" + ToString(type) + ")";
+        }
+    }
+
+    inline void MinMax::DecodeFrames(int32_t const* elements, size_t nbrFrames, int16_t* minima, int16_t* maxima)
+    {
+        for (size_t i = 0; i < nbrFrames; ++i)
+        {
+            uint32_t const element = uint32_t(elements[i]);
+            minima[i] = int16_t(element & 0xFFFF);
+            maxima[i] = int16_t(element >> 16);
+        }
+    }
+
+    inline MinMax::OverviewStore::OverviewStore(int64_t frameSize, size_t nbrLevels, size_t reductionFactor, size_t levelCapacity)
+        : m_frameSize(frameSize)
+        , m_reductionFactor(reductionFactor)
+        , m_levelCapacity(levelCapacity)
+        , m_levels(nbrLevels)
+        , m_decodedMin()
+        , m_decodedMax()
+    {
+        if (frameSize <= 0)
+            throw std::invalid_argument("Invalid min/max frame size: " + ToString(frameSize));
+        if (nbrLevels == 0 || reductionFactor < 2 || levelCapacity == 0)
+            throw std::invalid_argument("Invalid overview store geometry: levels=" + ToString(nbrLevels) + ", reduction=" + ToString(reductionFactor)
+                + ", capacity=" + ToString(levelCapacity));
+
+        int64_t samplesPerPoint = frameSize;
+        for (Level& level : m_levels)
+        {
+            level.samplesPerPoint = samplesPerPoint;
+            level.points.resize(levelCapacity);
+            samplesPerPoint *= int64_t(reductionFactor);
+        }
+    }
+
+    inline void MinMax::OverviewStore::Append(int16_t const* minima, int16_t const* maxima, size_t nbrFrames)
+    {
+        AppendLevel(0, minima, maxima, nbrFrames);
+    }
+
+    inline void MinMax::OverviewStore::Append(ContinuousStreaming::SampleChunk const& chunk)
+    {
+        uint64_t const firstFrame = chunk.firstSampleIndex / 2;
+        if (firstFrame != m_levels[0].nbrPoints)
+            throw ContinuousStreaming::StreamGapError("Min/max chunk starts at frame " + ToString(firstFrame) + ", expected " + ToString(m_levels[0].nbrPoints));
+
+        size_t const nbrFrames = chunk.nbrSamples / 2;
+        m_decodedMin.resize(nbrFrames);
+        m_decodedMax.resize(nbrFrames);
+        DecodeFrames(reinterpret_cast<int32_t const*>(chunk.samples), nbrFrames, m_decodedMin.data(), m_decodedMax.data());
+        AppendLevel(0, m_decodedMin.data(), m_decodedMax.data(), nbrFrames);
+    }
+
+    inline void MinMax::OverviewStore::AppendLevel(size_t levelIndex, int16_t const* minima, int16_t const* maxima, size_t nbrPoints)
+    {
+        Level& level = m_levels[levelIndex];
+
+        // store the most recent points only: older ones would be overwritten in the same call.
+        size_t const nbrSkipped = nbrPoints > m_levelCapacity ? nbrPoints - m_levelCapacity : 0;
+        for (size_t i = nbrSkipped; i < nbrPoints; ++i)
+        {
+            Point& point = level.points[size_t((level.nbrPoints + i) % m_levelCapacity)];
+            point.minimum = minima[i];
+            point.maximum = maxima[i];
+        }
+        level.nbrPoints += nbrPoints;
+
+        if (levelIndex + 1 == m_levels.size())
+            return;
+
+        // merge groups of reductionFactor points, the first one completing the partial point of the previous call.
+        level.reducedMin.clear();
+        level.reducedMax.clear();
+
+        size_t i = 0;
+        if (level.nbrPartial > 0)
+        {
+            for (; i < nbrPoints && level.nbrPartial < m_reductionFactor; ++i, ++level.nbrPartial)
+            {
+                level.partial.minimum = (std::min)(level.partial.minimum, minima[i]);
+                level.partial.maximum = (std::max)(level.partial.maximum, maxima[i]);
+            }
+            if (level.nbrPartial < m_reductionFactor)
+                return;
+            level.reducedMin.push_back(level.partial.minimum);
+            level.reducedMax.push_back(level.partial.maximum);
+            level.nbrPartial = 0;
+        }
+
+        for (; i + m_reductionFactor <= nbrPoints; i += m_reductionFactor)
+        {
+            int16_t minimum = minima[i];
+            int16_t maximum = maxima[i];
+            for (size_t j = 1; j < m_reductionFactor; ++j)
+            {
+                minimum = (std::min)(minimum, minima[i + j]);
+                maximum = (std::max)(maximum, maxima[i + j]);
+            }
+            level.reducedMin.push_back(minimum);
+            level.reducedMax.push_back(maximum);
+        }
+
+        if (i < nbrPoints)
+        {
+            level.partial.minimum = minima[i];
+            level.partial.maximum = maxima[i];
+            for (level.nbrPartial = 1, ++i; i < nbrPoints; ++i, ++level.nbrPartial)
+            {
+                level.partial.minimum = (std::min)(level.partial.minimum, minima[i]);
+                level.partial.maximum = (std::max)(level.partial.maximum, maxima[i]);
+            }
+        }
+
+        if (!level.reducedMin.empty())
+            AppendLevel(levelIndex + 1, level.reducedMin.data(), level.reducedMax.data(), level.reducedMin.size());
+    }
+
+    inline size_t MinMax::OverviewStore::Query(uint64_t beginSample, uint64_t endSample, size_t maxPoints, Span& span) const
+    {
+        span.points.clear();
+        if (endSample <= beginSample || maxPoints == 0)
+            return 0;
+
+        for (size_t levelIndex = 0; levelIndex < m_levels.size(); ++levelIndex)
+        {
+            Level const& level = m_levels[levelIndex];
+            uint64_t const samplesPerPoint = uint64_t(level.samplesPerPoint);
+            uint64_t const oldestPoint = level.nbrPoints > m_levelCapacity ? level.nbrPoints - m_levelCapacity : 0;
+
+            uint64_t const firstPoint = beginSample / samplesPerPoint;
+            uint64_t const endPoint = (std::min)((endSample + samplesPerPoint - 1) / samplesPerPoint, level.nbrPoints);
+            bool const isLast = (levelIndex + 1 == m_levels.size());
+            if (!isLast && (endPoint - (std::min)(firstPoint, endPoint) > maxPoints || firstPoint < oldestPoint))
+                continue;
+
+            uint64_t const first = (std::max)(firstPoint, oldestPoint);
+            uint64_t const end = (std::min)(endPoint, first + maxPoints);
+            span.firstSampleIndex = first * samplesPerPoint;
+            span.samplesPerPoint = level.samplesPerPoint;
+            span.level = levelIndex;
+            for (uint64_t point = first; point < end; ++point)
+                span.points.push_back(level.points[size_t(point % m_levelCapacity)]);
+            break;
+        }
+        return span.points.size();
+    }
+}
+
+#endif
@@ -0,0 +1,261 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// OutlierDetector: distance of every record to a running template of the records, and flagging of
+// the records unusually far from it.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_OUTLIERDETECTOR_H
+#define LIBTOOL_OUTLIERDETECTOR_H
+
+#include "LibTool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+namespace LibTool
+{
+    //! Outlier record utils.
+    /*! When most records look alike, only the unusual ones are worth storing. #Detector keeps a template of the records, the
+        exponentially weighted average of the records which are not outliers, and measures the distance of every record to it:
+
+            Outliers::Detector detector(parameters, recordSize);
+
+            Outliers::Result const result = detector.Process(recordIndex, samples, trigger.triggerTimeSamples);
+            if (result.isOutlier)
+                SaveRecord(samples, recordSize);
+
+        A record is an outlier when its distance exceeds the mean distance of the usual records by #Parameters::thresholdSigmas
+        standard deviations (both also exponentially weighted, so the threshold follows slow drifts of the signal). The first
+        #Parameters::warmupRecords records build the template and the distance statistics, none of them is an outlier.
+
+        Records are sampled at a random phase relative to their trigger: with #Parameters::alignPhase, every record is first
+        interpolated at whole sample intervals after its trigger (from TriggerMarker::triggerTimeSamples), and the last sample is
+        dropped. Distances are computed on integers against a rounded copy of the template, so that the reductions vectorize.
+    */
+    namespace Outliers
+    {
+        //! Return value rounded to the nearest integer (half away from zero), without a library call so that loops vectorize.
+        inline int16_t RoundToInt16(float value)
+        { return int16_t(int32_t(value + (value < 0.0f ? -0.5f : 0.5f))); }
+
+        //! Distance between a record and the template.
+        enum class Metric
+        {
+            Rms,            //!< root mean square of the deviations (L2 distance normalized by the number of samples).
+            MaxAbs,         //!< largest absolute deviation.
+        };
+
+        //! Detection parameters.
+        struct Parameters
+        {
+            Metric metric = Metric::Rms;
+            double templateWeight = 1.0 / 64;   //!< weight of a new record in the template.
+            double statisticsWeight = 1.0 / 256;//!< weight of a new distance in the distance mean and variance.
+            double thresholdSigmas = 6.0;       //!< outlier threshold, in standard deviations above the mean distance.
+            double minThreshold = 4.0;          //!< lowest threshold, in ADC codes (noise-free signals have a null variance).
+            uint32_t warmupRecords = 64;        //!< records averaged into the template before detecting outliers.
+            bool alignPhase = true;             //!< align records on their trigger before comparing them.
+
+            //! \throw #std::invalid_argument if the parameters are inconsistent.
+            void Validate() const;
+        };
+
+        //! Outcome of a record.
+        struct Result
+        {
+            uint64_t recordIndex;
+            double distance;            //!< distance to the template, in ADC codes.
+            double threshold;           //!< threshold the distance was compared to.
+            bool isOutlier;
+        };
+
+        //! Detection statistics, the summary of the records which are not retained.
+        struct Statistics
+        {
+            uint64_t nbrRecords = 0;
+            uint64_t nbrOutliers = 0;
+            double distanceMean = 0.0;          //!< weighted mean distance of the usual records.
+            double distanceVariance = 0.0;      //!< weighted variance of the distances of the usual records.
+            double maxUsualDistance = 0.0;      //!< largest distance of a record which was not an outlier (after warm-up).
+            double maxDistance = 0.0;
+            double seconds = 0.0;               //!< processing time.
+
+            //! Return the ratio of the outliers to the records.
+            double GetOutlierRate() const
+            { return nbrRecords > 0 ? double(nbrOutliers) / double(nbrRecords) : 0.0; }
+
+            void Print(std::ostream& output) const;
+        };
+
+        //! Running template and outlier detector of records of a given size.
+        class Detector
+        {
+        public:
+            //! \throw #std::invalid_argument if parameters are inconsistent, or recordSize is too small.
+            explicit Detector(Parameters const& parameters, int64_t recordSize);
+
+            //! Compare the record of recordSize samples to the template, and update the template with it unless it is an outlier.
+            /*! \param triggerTimeSamples the delay between the trigger and the first sample of the record, in [0, 1[ sample interval.*/
+            Result Process(uint64_t recordIndex, int16_t const* samples, double triggerTimeSamples = 0.0);
+
+            //! Return the template (recordSize samples, or recordSize-1 when phases are aligned).
+            std::vector<float> const& GetTemplate() const
+            { return m_template; }
+
+            //! Write the template as float values (native endianness).
+            void SaveTemplate(std::ostream& output) const;
+
+            Parameters const& GetParameters() const
+            { return m_parameters; }
+
+            Statistics const& GetStatistics() const
+            { return m_statistics; }
+
+        private:
+            Parameters const m_parameters;
+            size_t const m_nbrSamples;          //!< samples compared, one less than the record when phases are aligned.
+            std::vector<int16_t> m_record;      //!< record aligned on its trigger.
+            std::vector<float> m_template;
+            std::vector<int16_t> m_reference;   //!< template rounded to integers.
+            Statistics m_statistics;
+        };
+    }
+
+    ///////
+    // Outliers member definitions
+    //
+
+    inline void Outliers::Parameters::Validate() const
+    {
+        if (!(templateWeight > 0.0 && templateWeight <= 1.0) || !(statisticsWeight > 0.0 && statisticsWeight <= 1.0) || !(thresholdSigmas > 0.0) || minThreshold < 0.0)
+            throw std::invalid_argument("Invalid outlier detection: template weight " + ToString(templateWeight) + ", statistics weight " + ToString(statisticsWeight)
+                                        + ", threshold " + ToString(thresholdSigmas) + " sigmas (at least " + ToString(minThreshold) + ")");
+    }
+
+    inline void Outliers::Statistics::Print(std::ostream& output) const
+    {
+        output << "\nOutlier detection\n";
+        output << "  Records:            " << nbrRecords << '\n';
+        output << "  Outliers:           " << nbrOutliers << " (" << GetOutlierRate() * 100.0 << " %)\n";
+        output << "  Usual distance:     " << distanceMean << " +/- " << std::sqrt(distanceVariance) << " (max " << maxUsualDistance << ")\n";
+        output << "  Max distance:       " << maxDistance << '\n';
+        output << "  Processing:         " << seconds << " s";
+        if (nbrRecords > 0)
+            output << " (" << seconds / double(nbrRecords) * 1e6 << " us per record)";
+        output << '\n';
+    }
+
+    inline Outliers::Detector::Detector(Parameters const& parameters, int64_t recordSize)
+        : m_parameters(parameters)
+        , m_nbrSamples(size_t((std::max)(recordSize, int64_t(2)) - (parameters.alignPhase ? 1 : 0)))
+        , m_record(m_nbrSamples, 0)
+        , m_template(m_nbrSamples, 0.0f)
+        , m_reference(m_nbrSamples, 0)
+        , m_statistics()
+    {
+        parameters.Validate();
+        if (recordSize < 2)
+            throw std::invalid_argument("Invalid record size for outlier detection: " + ToString(recordSize));
+    }
+
+    inline Outliers::Result Outliers::Detector::Process(uint64_t recordIndex, int16_t const* samples, double triggerTimeSamples)
+    {
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point const start = Clock::now();
+        size_t const n = m_nbrSamples;
+
+        // Interpolate at (trigger + 1 + i) sample intervals, which falls between samples i and i+1.
+        int16_t const* record = samples;
+        if (m_parameters.alignPhase)
+        {
+            float const weight = float(1.0 - triggerTimeSamples);
+            int16_t* const aligned = m_record.data();
+            for (size_t i = 0; i < n; ++i)
+            {
+                float const value = float(samples[i]) + weight * float(samples[i + 1] - samples[i]);
+                aligned[i] = RoundToInt16(value);
+            }
+            record = aligned;
+        }
+
+        // Distance to the rounded template: integer reductions.
+        int16_t const* const reference = m_reference.data();
+        double distance = 0.0;
+        if (m_parameters.metric == Metric::Rms)
+        {
+            int64_t sum = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                int64_t const deviation = int64_t(record[i]) - int64_t(reference[i]);
+                sum += deviation * deviation;
+            }
+            distance = std::sqrt(double(sum) / double(n));
+        }
+        else
+        {
+            int32_t maxDeviation = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                int32_t const deviation = std::abs(int32_t(record[i]) - int32_t(reference[i]));
+                maxDeviation = (std::max)(maxDeviation, deviation);
+            }
+            distance = double(maxDeviation);
+        }
+
+        // Compare to the adaptive threshold, once the template is built.
+        Statistics& statistics = m_statistics;
+        bool const warmingUp = statistics.nbrRecords < m_parameters.warmupRecords;
+        Result result;
+        result.recordIndex = recordIndex;
+        result.distance = distance;
+        result.threshold = (std::max)(statistics.distanceMean + m_parameters.thresholdSigmas * std::sqrt(statistics.distanceVariance), m_parameters.minThreshold);
+        // A non-finite distance must neither pass for usual nor reach the template and the distance statistics.
+        bool const isFinite = std::isfinite(distance);
+        result.isOutlier = !isFinite || (!warmingUp && distance > result.threshold);
+
+        ++statistics.nbrRecords;
+        if (isFinite)
+            statistics.maxDistance = (std::max)(statistics.maxDistance, distance);
+        if (result.isOutlier)
+            ++statistics.nbrOutliers;
+        else
+        {
+            // Cumulative averages while warming up (the first distances, to an incomplete template, are not accounted), weighted ones afterwards.
+            if (!warmingUp)
+                statistics.maxUsualDistance = (std::max)(statistics.maxUsualDistance, distance);
+            if (statistics.nbrRecords > 1)
+            {
+                double const weight = warmingUp ? 1.0 / double(statistics.nbrRecords - 1) : m_parameters.statisticsWeight;
+                double const deviation = distance - statistics.distanceMean;
+                statistics.distanceMean += weight * deviation;
+                statistics.distanceVariance = (1.0 - weight) * (statistics.distanceVariance + weight * deviation * deviation);
+            }
+
+            float const weight = float(warmingUp ? 1.0 / double(statistics.nbrRecords) : m_parameters.templateWeight);
+            float* const average = m_template.data();
+            int16_t* const rounded = m_reference.data();
+            for (size_t i = 0; i < n; ++i)
+            {
+                average[i] += weight * (float(record[i]) - average[i]);
+                rounded[i] = RoundToInt16(average[i]);
+            }
+        }
+
+        statistics.seconds += std::chrono::duration<double>(Clock::now() - start).count();
+        return result;
+    }
+
+    inline void Outliers::Detector::SaveTemplate(std::ostream& output) const
+    {
+        output.write(reinterpret_cast<char const*>(m_template.data()), std::streamsize(m_template.size() * sizeof(float)));
+    }
+}
+
+#endif
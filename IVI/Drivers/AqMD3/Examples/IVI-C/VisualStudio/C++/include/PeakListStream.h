@@ -0,0 +1,429 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// PeakListStream: decoding of PeakList descriptor streams into records of pulse descriptors, and
+// extraction of the stored signal (raw, filtered or filtered derivative) around detected pulses.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_PEAKLISTSTREAM_H
+#define LIBTOOL_PEAKLISTSTREAM_H
+
+#include "LibTool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace LibTool
+{
+    //! PeakList related utils.
+    /*! In PeakList acquisition mode the peak stream carries, for every record, a trigger descriptor followed by the descriptors of
+        the pulses detected in the record. When AQMD3_ATTR_CHANNEL_PEAK_LIST_DATA_STORAGE_MODE is not NONE, the sample stream also
+        carries the record samples (raw, filtered or filtered derivative signal). #MarkerStreamDecoder groups descriptors into
+        #RecordDescriptor objects, with the same interface as #ZeroSuppress::MarkerStreamDecoder, and #WindowExtractor keeps only
+        the samples around the pulses of a record:
+
+            PeakList::MarkerStreamDecoder decoder(PeakList::DescriptorFormat::Extended);
+            PeakList::WindowExtractor extractor(preSamples, postSamples);
+
+            while (peakStream.Size() > 0)
+                decoder.DecodeNextMarker(peakStream);
+            for (auto const& record : decoder.Take(int(decoder.GetAvailableRecordCount())))
+            {
+                extractor.Extract(record, recordSamples, recordSize);
+                recordSamples += recordSize;
+            }
+
+        A record is complete when the trigger descriptor of the next record is decoded: the last record of a fetch is delivered
+        with the next fetch (or by #MarkerStreamDecoder::Flush).
+    */
+    namespace PeakList
+    {
+        //! Format of the descriptors (AQMD3_ATTR_CHANNEL_PEAK_LIST_DESCRIPTOR_FORMAT).
+        enum class DescriptorFormat
+        {
+            Extended,   //!< 256-bit descriptors (AQMD3_VAL_PEAK_LIST_DESCRIPTOR_FORMAT_EXTENDED).
+            Compact,    //!< 128-bit descriptors (PEAK, CENTER_OF_MASS and PEAK_AREA formats).
+        };
+
+        //! Return the number of 32-bit elements of a descriptor.
+        inline size_t GetDescriptorElements(DescriptorFormat format)
+        { return format == DescriptorFormat::Extended ? 8 : 4; }
+
+        //! Descriptor tags.
+        enum class DescriptorTag : uint8_t
+        {
+            ExtendedTrigger     = 0x11,
+            ExtendedPulse       = 0x14,
+            ExtendedAlignment   = 0x1f,
+            CompactTrigger      = 0x01,
+            CompactPeak         = 0x04,
+            CompactCenterOfMass = 0x05,
+            CompactArea         = 0x06,
+            CompactAlignment    = 0x0f,
+        };
+
+        //! Content of a pulse descriptor. Fields not carried by the descriptor format are left to zero.
+        struct PulseDescriptor
+        {
+            DescriptorTag tag = DescriptorTag::ExtendedPulse;
+            uint32_t recordIndex = 0;
+            int64_t timestamp = 0;          //!< index of the first pulse sample, relative to the first sample of the record (negative before).
+            int32_t width = 0;              //!< number of samples of the pulse.
+            bool overflow = false;          //!< width exceeds the descriptor field.
+            int32_t nbrOverrangeSamples = 0;
+            int64_t sumOfSquares = 0;       //!< extended format only.
+            int64_t area = 0;               //!< compact area format only.
+            double peakX = 0.0;             //!< peak position relative to the first pulse sample.
+            double peakY = 0.0;             //!< peak value (ADC code).
+            double comX = 0.0;              //!< center of mass position relative to the first pulse sample.
+            double comY = 0.0;              //!< center of mass value relative to baseline (ADC code).
+        };
+
+        //! Represent a record: its trigger and the pulses detected in it.
+        class RecordDescriptor
+        {
+        public:
+            using PulseList = std::vector<PulseDescriptor>;
+
+            //! Set the trigger marker
+            void SetTrigger(TriggerMarker const& trigger) { m_trigger = trigger; }
+            //! Return a const reference to trigger marker.
+            TriggerMarker const& GetTrigger() const { return m_trigger; }
+            //! Add a pulse descriptor to the pulse list.
+            void AddPulse(PulseDescriptor const& pulse) { m_pulses.push_back(pulse); }
+            //! Return a const reference to the list of pulse descriptors.
+            PulseList const& GetPulses() const { return m_pulses; }
+
+        private:
+            TriggerMarker m_trigger;    //!< trigger marker.
+            PulseList m_pulses;         //!< pulses of the record, in stream order.
+        };
+
+        //! Decoder class for PeakList descriptor streams.
+        class MarkerStreamDecoder
+        {
+        public:
+            using MarkerStream = ArraySegment<int32_t>;
+            using RecordDescriptorList = std::vector<RecordDescriptor>;
+
+            explicit MarkerStreamDecoder(DescriptorFormat format)
+                : m_recordQueue()
+                , m_currentRecord()
+                , m_hasCurrentRecord(false)
+                , m_format(format)
+            {}
+
+            //! Decode the next descriptor from the given input stream
+            /*! Decoded descriptors are removed from the input stream. */
+            void DecodeNextMarker(MarkerStream& stream);
+
+            //! Deliver the record being decoded, if any (e.g. at the end of the acquisition).
+            void Flush();
+
+            //! Pop the next record descriptor out from the queue.
+            RecordDescriptor Pop();
+
+            //! Take the next "count" record descriptors from the queue and return them as result.
+            RecordDescriptorList Take(int count);
+
+            //! Return the number of record descriptors in the queue.
+            size_t GetAvailableRecordCount() const { return m_recordQueue.size(); }
+
+            //! Expect a 256-bit trigger descriptor on stream and decode it.
+            static TriggerMarker DecodeExtendedTrigger(MarkerStream const& stream);
+            //! Expect a 256-bit pulse descriptor on stream and decode it.
+            static PulseDescriptor DecodeExtendedPulse(MarkerStream const& stream);
+            //! Expect a 128-bit trigger descriptor on stream and decode it.
+            static TriggerMarker DecodeCompactTrigger(MarkerStream const& stream);
+            //! Expect a 128-bit pulse descriptor (peak, center of mass or area) on stream and decode it.
+            static PulseDescriptor DecodeCompactPulse(MarkerStream const& stream);
+
+        private:
+            //! Close the current record and start a new one with trigger.
+            void StartRecord(TriggerMarker const& trigger);
+
+            std::list<RecordDescriptor> m_recordQueue;
+            RecordDescriptor m_currentRecord;
+            bool m_hasCurrentRecord;
+            DescriptorFormat const m_format;
+        };
+
+        //! Samples of a record around one or several overlapping pulses.
+        struct PulseWindow
+        {
+            uint32_t recordIndex = 0;
+            int64_t firstSample = 0;        //!< index of the first sample of the window, relative to the first sample of the record.
+            int64_t nbrSamples = 0;
+            size_t offset = 0;              //!< offset of the first sample of the window in #WindowExtractor::GetSamples.
+            size_t firstPulse = 0;          //!< index in the record pulse list of the first pulse of the window.
+            size_t nbrPulses = 0;
+        };
+
+        //! Extract the samples of records around their pulses, pre-trigger and post-trigger margins included.
+        /*! Windows of overlapping pulses are merged, windows are clipped to the record. Samples are appended to a single store until
+            #Clear, so that only the signal of interest is kept (and saved) out of the record samples.*/
+        class WindowExtractor
+        {
+        public:
+            explicit WindowExtractor(int64_t preSamples, int64_t postSamples)
+                : m_preSamples(preSamples)
+                , m_postSamples(postSamples)
+                , m_windows()
+                , m_samples()
+            {
+                if (preSamples < 0 || postSamples < 0)
+                    throw std::invalid_argument("Invalid pulse window margins: pre=" + ToString(preSamples) + ", post=" + ToString(postSamples));
+            }
+
+            //! Extract the windows of record from its recordSize samples. Return the number of windows extracted.
+            size_t Extract(RecordDescriptor const& record, int16_t const* samples, int64_t recordSize);
+
+            //! Forget extracted windows and samples (the capacity of the store is kept).
+            void Clear()
+            {
+                m_windows.clear();
+                m_samples.clear();
+            }
+
+            std::vector<PulseWindow> const& GetWindows() const
+            { return m_windows; }
+
+            std::vector<int16_t> const& GetSamples() const
+            { return m_samples; }
+
+        private:
+            int64_t const m_preSamples;
+            int64_t const m_postSamples;
+            std::vector<PulseWindow> m_windows;
+            std::vector<int16_t> m_samples;
+        };
+    }
+
+    ///////
+    // PeakList member definitions
+    //
+
+    inline void PeakList::MarkerStreamDecoder::DecodeNextMarker(MarkerStream& stream)
+    {
+        size_t const descriptorElements = GetDescriptorElements(m_format);
+        if (stream.Size() < descriptorElements)
+            throw std::runtime_error("Truncated PeakList descriptor: " + ToString(stream.Size()) + " elements left, expected " + ToString(descriptorElements));
+
+        if (m_format == DescriptorFormat::Extended)
+        {
+            DescriptorTag const tag = DescriptorTag(stream[0] & 0xff);
+            switch (tag)
+            {
+            case DescriptorTag::ExtendedTrigger:
+                StartRecord(DecodeExtendedTrigger(stream));
+                break;
+            case DescriptorTag::ExtendedPulse:
+                if (!m_hasCurrentRecord)
+                    throw std::runtime_error("Pulse descriptor before the first trigger descriptor");
+                m_currentRecord.AddPulse(DecodeExtendedPulse(stream));
+                break;
+            case DescriptorTag::ExtendedAlignment:
+                break;
+            default:
+                throw std::runtime_error("Unexpected tag " + ToString(int(tag)));
+            }
+        }
+        else
+        {
+            DescriptorTag const tag = DescriptorTag(stream[0] & 0x0f);
+            switch (tag)
+            {
+            case DescriptorTag::CompactTrigger:
+                StartRecord(DecodeCompactTrigger(stream));
+                break;
+            case DescriptorTag::CompactPeak:
+            case DescriptorTag::CompactCenterOfMass:
+            case DescriptorTag::CompactArea:
+                if (!m_hasCurrentRecord)
+                    throw std::runtime_error("Pulse descriptor before the first trigger descriptor");
+                m_currentRecord.AddPulse(DecodeCompactPulse(stream));
+                break;
+            case DescriptorTag::CompactAlignment:
+                break;
+            default:
+                throw std::runtime_error("Unexpected tag " + ToString(int(tag)));
+            }
+        }
+
+        stream.PopFront(descriptorElements);
+    }
+
+    inline void PeakList::MarkerStreamDecoder::StartRecord(TriggerMarker const& trigger)
+    {
+        Flush();
+        m_currentRecord = RecordDescriptor();
+        m_currentRecord.SetTrigger(trigger);
+        m_hasCurrentRecord = true;
+    }
+
+    inline void PeakList::MarkerStreamDecoder::Flush()
+    {
+        if (!m_hasCurrentRecord)
+            return;
+        m_recordQueue.push_back(std::move(m_currentRecord));
+        m_currentRecord = RecordDescriptor();
+        m_hasCurrentRecord = false;
+    }
+
+    inline PeakList::RecordDescriptor PeakList::MarkerStreamDecoder::Pop()
+    {
+        if (m_recordQueue.empty())
+            throw std::runtime_error("Cannot pop a record descriptor from an empty queue");
+
+        RecordDescriptor result = std::move(m_recordQueue.front());
+        m_recordQueue.pop_front();
+        return result;
+    }
+
+    inline PeakList::MarkerStreamDecoder::RecordDescriptorList PeakList::MarkerStreamDecoder::Take(int count)
+    {
+        if (size_t(count) > m_recordQueue.size())
+            throw std::runtime_error("Cannot take " + ToString(count) + " record descriptors, only " + ToString(m_recordQueue.size()) + " available");
+
+        RecordDescriptorList result;
+        result.reserve(size_t(count));
+        for (int i = 0; i < count; ++i)
+            result.push_back(Pop());
+        return result;
+    }
+
+    inline TriggerMarker PeakList::MarkerStreamDecoder::DecodeExtendedTrigger(MarkerStream const& stream)
+    {
+        typedef BitLayout::Layouts::ExtendedTrigger Layout;
+
+        int32_t const* const marker = stream.GetData();
+        uint64_t const tag = Layout::Tag::Extract(marker);
+        if (tag != uint64_t(DescriptorTag::ExtendedTrigger))
+            throw std::runtime_error("Expected trigger descriptor tag, got " + ToString(tag));
+
+        TriggerMarker trigger;
+        trigger.tag = MarkerTag::TriggerNormal;
+        trigger.recordIndex = uint32_t(Layout::RecordIndex::Extract(marker));
+        trigger.triggerTimeSamples = Layout::TriggerSubsample::ExtractScaled(marker);
+        trigger.absoluteSampleIndex = Layout::Timestamp::Extract(marker);
+        return trigger;
+    }
+
+    inline PeakList::PulseDescriptor PeakList::MarkerStreamDecoder::DecodeExtendedPulse(MarkerStream const& stream)
+    {
+        typedef BitLayout::Layouts::ExtendedPulse Layout;
+
+        int32_t const* const marker = stream.GetData();
+        uint64_t const tag = Layout::Tag::Extract(marker);
+        if (tag != uint64_t(DescriptorTag::ExtendedPulse))
+            throw std::runtime_error("Expected pulse descriptor tag, got " + ToString(tag));
+
+        PulseDescriptor pulse;
+        pulse.tag = DescriptorTag::ExtendedPulse;
+        pulse.recordIndex = uint32_t(Layout::RecordIndex::Extract(marker));
+        pulse.timestamp = Layout::Timestamp::Extract(marker);
+        pulse.width = int32_t(Layout::Width::Extract(marker));
+        pulse.overflow = (Layout::Overflow::Extract(marker) != 0);
+        pulse.nbrOverrangeSamples = int32_t(Layout::OverrangeSamples::Extract(marker));
+        pulse.sumOfSquares = int64_t(Layout::SumOfSquares::Extract(marker));
+        pulse.peakX = Layout::PeakX::ExtractScaled(marker);
+        pulse.peakY = Layout::PeakY::ExtractScaled(marker);
+        pulse.comX = Layout::ComX::ExtractScaled(marker);
+        pulse.comY = Layout::ComY::ExtractScaled(marker);
+        return pulse;
+    }
+
+    inline TriggerMarker PeakList::MarkerStreamDecoder::DecodeCompactTrigger(MarkerStream const& stream)
+    {
+        typedef BitLayout::Layouts::CompactTrigger Layout;
+
+        int32_t const* const marker = stream.GetData();
+        uint64_t const tag = Layout::Tag::Extract(marker);
+        if (tag != uint64_t(DescriptorTag::CompactTrigger))
+            throw std::runtime_error("Expected compact trigger descriptor tag, got " + ToString(tag));
+
+        TriggerMarker trigger;
+        trigger.tag = MarkerTag::TriggerNormal;
+        trigger.recordIndex = uint32_t(Layout::RecordIndex::Extract(marker));
+        trigger.triggerTimeSamples = Layout::TriggerSubsample::ExtractScaled(marker);
+        trigger.absoluteSampleIndex = Layout::Timestamp::Extract(marker);
+        return trigger;
+    }
+
+    inline PeakList::PulseDescriptor PeakList::MarkerStreamDecoder::DecodeCompactPulse(MarkerStream const& stream)
+    {
+        typedef BitLayout::Layouts::CompactPulse Layout;
+
+        int32_t const* const marker = stream.GetData();
+        DescriptorTag const tag = DescriptorTag(Layout::Tag::Extract(marker));
+        if (tag != DescriptorTag::CompactPeak && tag != DescriptorTag::CompactCenterOfMass && tag != DescriptorTag::CompactArea)
+            throw std::runtime_error("Unexpected compact pulse descriptor tag: " + ToString(int(tag)));
+
+        PulseDescriptor pulse;
+        pulse.tag = tag;
+        pulse.recordIndex = uint32_t(Layout::RecordIndex::Extract(marker));
+        pulse.timestamp = Layout::Timestamp::Extract(marker);
+        pulse.width = int32_t(Layout::Width::Extract(marker));
+        pulse.overflow = (Layout::Overflow::Extract(marker) != 0);
+        pulse.nbrOverrangeSamples = int32_t(Layout::OverrangeSamples::Extract(marker));
+
+        if (tag == DescriptorTag::CompactArea)
+        {
+            pulse.area = int64_t(Layout::Area::Extract(marker));
+        }
+        else if (tag == DescriptorTag::CompactPeak)
+        {
+            pulse.peakX = Layout::PeakX::ExtractScaled(marker);
+            pulse.peakY = Layout::PeakY::ExtractScaled(marker);
+        }
+        else
+        {
+            pulse.comX = Layout::ComX::ExtractScaled(marker);
+            pulse.comY = Layout::ComY::ExtractScaled(marker);
+        }
+        return pulse;
+    }
+
+    inline size_t PeakList::WindowExtractor::Extract(RecordDescriptor const& record, int16_t const* samples, int64_t recordSize)
+    {
+        RecordDescriptor::PulseList const& pulses = record.GetPulses();
+        size_t const nbrWindowsBefore = m_windows.size();
+
+        size_t i = 0;
+        while (i < pulses.size())
+        {
+            // merge the windows of the following pulses as long as they overlap.
+            int64_t first = pulses[i].timestamp - m_preSamples;
+            int64_t end = pulses[i].timestamp + pulses[i].width + m_postSamples;
+            size_t const firstPulse = i;
+            for (++i; i < pulses.size() && pulses[i].timestamp - m_preSamples <= end; ++i)
+                end = (std::max)(end, pulses[i].timestamp + pulses[i].width + m_postSamples);
+
+            first = (std::max)(first, int64_t(0));
+            end = (std::min)(end, recordSize);
+            if (end <= first)
+                continue;
+
+            PulseWindow window;
+            window.recordIndex = record.GetTrigger().recordIndex;
+            window.firstSample = first;
+            window.nbrSamples = end - first;
+            window.offset = m_samples.size();
+            window.firstPulse = firstPulse;
+            window.nbrPulses = i - firstPulse;
+
+            // a single block copy per window.
+            m_samples.resize(window.offset + size_t(window.nbrSamples));
+            std::memcpy(m_samples.data() + window.offset, samples + first, size_t(window.nbrSamples) * sizeof(int16_t));
+            m_windows.push_back(window);
+        }
+        return m_windows.size() - nbrWindowsBefore;
+    }
+}
+
+#endif
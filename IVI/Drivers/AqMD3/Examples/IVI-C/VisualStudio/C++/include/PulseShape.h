@@ -0,0 +1,410 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// PulseShape: online pulse-shape discrimination (tail-to-total charge ratio) of the pulses of
+// records or ZeroSuppress gates, with a 2-D histogram of ratio versus charge.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_PULSESHAPE_H
+#define LIBTOOL_PULSESHAPE_H
+
+#include "LibTool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+namespace LibTool
+{
+    //! Pulse-shape discrimination utils.
+    /*! Scintillators tell particles apart by the decay of their pulses: the fraction of the charge in the tail of a pulse is higher
+        for neutrons than for gammas. #Discriminator locates the pulses of a record (or of a ZeroSuppress gate) with a threshold,
+        then integrates every pulse over a prompt window and a total window starting #Parameters::preSamples before the
+        threshold crossing, after subtracting the baseline averaged over the #Parameters::baselineSamples preceding the windows:
+
+                        baseline          prompt
+                   |<-------------->|<---------->|
+                                    |<----------------------------------->|
+                                                     total
+                                    ^ crossing - preSamples
+
+        Each pulse gives a #PulseEvent (time, total charge, ratio of the tail (total - prompt) charge to the total charge), and
+        #Histogram2D accumulates the ratio versus the charge online. Keeping the raw samples of the records holding an event of
+        interest only (#Selection) reduces waveform storage to the selected events:
+
+            PulseShape::Discriminator discriminator(parameters);
+            PulseShape::Histogram2D histogram(1024, maxCharge, 256);
+
+            events.clear();
+            discriminator.Process(recordSamples, recordSize, recordIndex, events);
+            histogram.Fill(events);
+            if (std::any_of(events.begin(), events.end(), [&](PulseShape::PulseEvent const& e) { return selection.IsSelected(e); }))
+                SaveRecord(recordSamples, recordSize);
+
+        Integrals cost O(1) per pulse from the prefix sums of the record, computed in one pass. The threshold search scans blocks
+        of samples with branch-free loops the compiler vectorizes, and only looks for the crossing inside a block that has one.
+    */
+    namespace PulseShape
+    {
+        //! Polarity of the pulses.
+        enum class Polarity
+        {
+            Positive,
+            Negative,
+        };
+
+        //! Pulse detection and integration windows, in samples.
+        struct Parameters
+        {
+            Polarity polarity = Polarity::Negative;
+            int32_t threshold = 200;            //!< detection level above the baseline (below for negative pulses), in ADC codes.
+            int32_t baselineSamples = 32;       //!< samples averaged into the baseline, just before the windows.
+            int32_t preSamples = 8;             //!< start of the windows before the threshold crossing.
+            int32_t promptSamples = 24;         //!< length of the prompt window.
+            int32_t totalSamples = 200;         //!< length of the total window, which includes the prompt window.
+
+            //! \throw #std::invalid_argument if the windows are inconsistent.
+            void Validate() const;
+        };
+
+        //! Pulse found by #Discriminator.
+        struct PulseEvent
+        {
+            uint64_t recordIndex;
+            double time;                //!< threshold crossing in samples from the first sample of the record, interpolated.
+            double totalCharge;         //!< baseline-subtracted integral over the total window, in ADC codes x samples (positive).
+            float ratio;                //!< tail (total - prompt) charge over total charge.
+            float baseline;             //!< baseline subtracted from the samples, in ADC codes.
+        };
+
+        //! Events of interest, e.g. the neutron band of a scintillator.
+        struct Selection
+        {
+            double minCharge = 0.0;
+            double maxCharge = 1e300;
+            double minRatio = 0.0;
+            double maxRatio = 1.0;
+
+            bool IsSelected(PulseEvent const& event) const
+            {
+                return minCharge <= event.totalCharge && event.totalCharge < maxCharge && minRatio <= event.ratio && event.ratio < maxRatio;
+            }
+        };
+
+        //! Discrimination statistics.
+        struct Statistics
+        {
+            uint64_t nbrSegments = 0;           //!< records or gates processed.
+            uint64_t nbrSamples = 0;
+            uint64_t nbrPulses = 0;             //!< events emitted.
+            uint64_t nbrTruncated = 0;          //!< pulses whose windows exceed the record or gate.
+            uint64_t nbrRejected = 0;           //!< pulses with a non-positive total charge.
+            double seconds = 0.0;               //!< processing time.
+
+            void Print(std::ostream& output) const;
+        };
+
+        //! Histogram of the tail-to-total ratio versus the total charge.
+        class Histogram2D
+        {
+        public:
+            //! Cover charges [0, maxCharge[ with nbrChargeBins bins, and ratios [minRatio, maxRatio[ with nbrRatioBins bins.
+            explicit Histogram2D(size_t nbrChargeBins, double maxCharge, size_t nbrRatioBins, double minRatio = 0.0, double maxRatio = 1.0);
+
+            //! Count event, or count it out of range.
+            void Fill(PulseEvent const& event);
+
+            //! Count all events.
+            void Fill(std::vector<PulseEvent> const& events)
+            {
+                for (PulseEvent const& event : events)
+                    Fill(event);
+            }
+
+            //! Return the count of (chargeBin, ratioBin).
+            uint64_t GetCount(size_t chargeBin, size_t ratioBin) const
+            { return m_counts[chargeBin * m_nbrRatioBins + ratioBin]; }
+
+            size_t GetNbrChargeBins() const
+            { return m_nbrChargeBins; }
+
+            size_t GetNbrRatioBins() const
+            { return m_nbrRatioBins; }
+
+            uint64_t GetNbrEntries() const
+            { return m_nbrEntries; }
+
+            uint64_t GetNbrOutOfRange() const
+            { return m_nbrOutOfRange; }
+
+            //! Write the counts as nbrChargeBins rows of nbrRatioBins uint64 values (native endianness).
+            void Save(std::ostream& output) const;
+
+            void Clear();
+
+        private:
+            size_t const m_nbrChargeBins;
+            size_t const m_nbrRatioBins;
+            double const m_chargeScale;         //!< bins per charge unit.
+            double const m_minRatio;
+            double const m_ratioScale;          //!< bins per ratio unit.
+            std::vector<uint64_t> m_counts;
+            uint64_t m_nbrEntries;
+            uint64_t m_nbrOutOfRange;
+        };
+
+        //! Pulse finder and integrator.
+        class Discriminator
+        {
+        public:
+            //! \throw #std::invalid_argument if parameters are inconsistent.
+            explicit Discriminator(Parameters const& parameters);
+
+            //! Append the events of the nbrSamples samples of a record (or of a segment of it starting at firstSampleIndex).
+            /*! The threshold level follows the baseline of the last pulse, starting from the baseline of the first samples.
+                \return the number of events appended.*/
+            size_t Process(int16_t const* samples, int64_t nbrSamples, uint64_t recordIndex, std::vector<PulseEvent>& events, int64_t firstSampleIndex = 0);
+
+            //! Append the events of the gates of a ZeroSuppress record, whose stored samples start at samples.
+            /*! Every gate is processed on its pre-gate, gate and post-gate samples: set the pre-gate length to at least
+                baselineSamples + preSamples to have a baseline before the first pulse of a gate.
+                \return the number of events appended.*/
+            size_t ProcessGates(ZeroSuppress::RecordDescriptor const& record, ZeroSuppress::ProcessingParameters const& params, int64_t recordSize,
+                                int16_t const* samples, std::vector<PulseEvent>& events);
+
+            Parameters const& GetParameters() const
+            { return m_parameters; }
+
+            Statistics const& GetStatistics() const
+            { return m_statistics; }
+
+        private:
+            //! Return the index of the first sample in [begin, end[ at or above level (at or below if !above), end if none.
+            static int64_t FindCrossing(int16_t const* samples, int64_t begin, int64_t end, int32_t level, bool above);
+
+            Parameters const m_parameters;
+            std::vector<int64_t> m_prefix;      //!< prefix sums of the current segment.
+            Statistics m_statistics;
+        };
+    }
+
+    ///////
+    // PulseShape member definitions
+    //
+
+    inline void PulseShape::Parameters::Validate() const
+    {
+        if (threshold <= 0 || baselineSamples <= 0 || preSamples < 0 || promptSamples <= 0 || totalSamples <= promptSamples)
+            throw std::invalid_argument("Invalid pulse-shape windows: threshold " + ToString(threshold) + ", baseline " + ToString(baselineSamples) + ", pre " + ToString(preSamples)
+                                        + ", prompt " + ToString(promptSamples) + ", total " + ToString(totalSamples));
+    }
+
+    inline void PulseShape::Statistics::Print(std::ostream& output) const
+    {
+        output << "\nPulse-shape discrimination\n";
+        output << "  Segments:           " << nbrSegments << " (" << (nbrSamples >> 20) << " MSamples)\n";
+        output << "  Pulses:             " << nbrPulses << " (" << nbrTruncated << " truncated, " << nbrRejected << " rejected)\n";
+        output << "  Processing:         " << seconds << " s";
+        if (seconds > 0.0)
+            output << " (" << double(nbrSamples) / seconds / 1e6 << " MSamples/s)";
+        output << '\n';
+    }
+
+    inline PulseShape::Histogram2D::Histogram2D(size_t nbrChargeBins, double maxCharge, size_t nbrRatioBins, double minRatio, double maxRatio)
+        : m_nbrChargeBins(nbrChargeBins)
+        , m_nbrRatioBins(nbrRatioBins)
+        , m_chargeScale(double(nbrChargeBins) / maxCharge)
+        , m_minRatio(minRatio)
+        , m_ratioScale(double(nbrRatioBins) / (maxRatio - minRatio))
+        , m_counts(nbrChargeBins * nbrRatioBins, 0)
+        , m_nbrEntries(0)
+        , m_nbrOutOfRange(0)
+    {
+        if (nbrChargeBins == 0 || nbrRatioBins == 0 || !(maxCharge > 0.0) || !(maxRatio > minRatio))
+            throw std::invalid_argument("Invalid histogram: " + ToString(nbrChargeBins) + " charge bins up to " + ToString(maxCharge) + ", " + ToString(nbrRatioBins)
+                                        + " ratio bins in [" + ToString(minRatio) + ", " + ToString(maxRatio) + "[");
+    }
+
+    inline void PulseShape::Histogram2D::Fill(PulseEvent const& event)
+    {
+        ++m_nbrEntries;
+        double const chargeBin = event.totalCharge * m_chargeScale;
+        double const ratioBin = (double(event.ratio) - m_minRatio) * m_ratioScale;
+        if (chargeBin < 0.0 || chargeBin >= double(m_nbrChargeBins) || ratioBin < 0.0 || ratioBin >= double(m_nbrRatioBins))
+        {
+            ++m_nbrOutOfRange;
+            return;
+        }
+        ++m_counts[size_t(chargeBin) * m_nbrRatioBins + size_t(ratioBin)];
+    }
+
+    inline void PulseShape::Histogram2D::Save(std::ostream& output) const
+    {
+        output.write(reinterpret_cast<char const*>(m_counts.data()), std::streamsize(m_counts.size() * sizeof(uint64_t)));
+    }
+
+    inline void PulseShape::Histogram2D::Clear()
+    {
+        std::fill(m_counts.begin(), m_counts.end(), uint64_t(0));
+        m_nbrEntries = 0;
+        m_nbrOutOfRange = 0;
+    }
+
+    inline PulseShape::Discriminator::Discriminator(Parameters const& parameters)
+        : m_parameters(parameters)
+        , m_prefix()
+        , m_statistics()
+    {
+        parameters.Validate();
+    }
+
+    inline size_t PulseShape::Discriminator::Process(int16_t const* samples, int64_t nbrSamples, uint64_t recordIndex, std::vector<PulseEvent>& events, int64_t firstSampleIndex)
+    {
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point const start = Clock::now();
+        size_t const firstEvent = events.size();
+        ++m_statistics.nbrSegments;
+        m_statistics.nbrSamples += uint64_t((std::max)(nbrSamples, int64_t(0)));
+
+        int64_t const B = m_parameters.baselineSamples;
+        int64_t const pre = m_parameters.preSamples;
+        int64_t const prompt = m_parameters.promptSamples;
+        int64_t const total = m_parameters.totalSamples;
+        if (nbrSamples < B)
+            return 0;
+
+        // Prefix sums: the integral of [a, b[ is m_prefix[b] - m_prefix[a].
+        m_prefix.resize(size_t(nbrSamples) + 1);
+        int64_t* const prefix = m_prefix.data();
+        prefix[0] = 0;
+        for (int64_t i = 0; i < nbrSamples; ++i)
+            prefix[i + 1] = prefix[i] + samples[i];
+
+        bool const positive = (m_parameters.polarity == Polarity::Positive);
+        double const sign = positive ? 1.0 : -1.0;
+        double baseline = double(prefix[B]) / double(B);
+        int64_t windowEnd = 0;                  // end of the windows of the previous pulse.
+        int64_t position = B;
+
+        for (;;)
+        {
+            int32_t const level = int32_t(baseline + sign * m_parameters.threshold + (positive ? 0.5 : -0.5));
+            int64_t const crossing = FindCrossing(samples, position, nbrSamples, level, positive);
+            if (crossing >= nbrSamples)
+                break;
+
+            int64_t const first = crossing - pre;
+            int64_t const last = first + total;
+            if (first < 0 || last > nbrSamples)
+            {
+                ++m_statistics.nbrTruncated;
+                if (last > nbrSamples)
+                    break;
+            }
+            else
+            {
+                // Baseline just before the windows, unless the tail of the previous pulse is in there: keep the previous one.
+                if (first - B >= windowEnd)
+                    baseline = double(prefix[first] - prefix[first - B]) / double(B);
+
+                double const totalCharge = sign * (double(prefix[last] - prefix[first]) - baseline * double(total));
+                double const promptCharge = sign * (double(prefix[first + prompt] - prefix[first]) - baseline * double(prompt));
+                if (totalCharge <= 0.0)
+                    ++m_statistics.nbrRejected;
+                else
+                {
+                    // Linear interpolation of the crossing between the previous sample and the crossing sample.
+                    double time = double(crossing);
+                    if (crossing > 0 && samples[crossing] != samples[crossing - 1])
+                        time -= double(samples[crossing] - level) / double(samples[crossing] - samples[crossing - 1]);
+
+                    PulseEvent event;
+                    event.recordIndex = recordIndex;
+                    event.time = double(firstSampleIndex) + time;
+                    event.totalCharge = totalCharge;
+                    event.ratio = float((totalCharge - promptCharge) / totalCharge);
+                    event.baseline = float(baseline);
+                    events.push_back(event);
+                }
+            }
+
+            // Re-arm once the signal is back across the level after the windows.
+            windowEnd = (std::max)(last, crossing + 1);
+            position = FindCrossing(samples, (std::min)(windowEnd, nbrSamples), nbrSamples, level + (positive ? -1 : 1), !positive);
+        }
+
+        size_t const nbrEvents = events.size() - firstEvent;
+        m_statistics.nbrPulses += nbrEvents;
+        m_statistics.seconds += std::chrono::duration<double>(Clock::now() - start).count();
+        return nbrEvents;
+    }
+
+    inline size_t PulseShape::Discriminator::ProcessGates(ZeroSuppress::RecordDescriptor const& record, ZeroSuppress::ProcessingParameters const& params, int64_t recordSize,
+                                                          int16_t const* samples, std::vector<PulseEvent>& events)
+    {
+        uint64_t const recordIndex = record.GetTriggerMarker().recordIndex;
+        int64_t actualRecordSize = recordSize;
+        int64_t nextGateOffsetInMemory = 0;
+        size_t nbrEvents = 0;
+        for (ZeroSuppress::GateMarker const& gate : record.GetGateList())
+        {
+            int64_t const gateStartIndex = gate.GetStartMarker().GetStartSampleIndex(params);
+            int64_t const gateStopIndex = gate.GetStopMarker().GetStopSampleIndex(params);
+
+            // Same layout as the gates of the ZeroSuppress example: pre-gate samples acquired before the record are invalid.
+            int64_t leadingSamplesToSkip = gate.GetStartMarker().GetSuppressedSampleCount(params);
+            if (gateStartIndex < params.preGateSamples)
+            {
+                int32_t const preRecordSamples = params.preGateSamples - int32_t(gateStartIndex);
+                int32_t const invalidStoredSamples = AlignUp(preRecordSamples, params.processingBlockSamples);
+                actualRecordSize = (std::max)(int64_t(0), recordSize - invalidStoredSamples);
+                leadingSamplesToSkip = invalidStoredSamples;
+            }
+
+            int64_t const dataStartIndex = (std::max)(int64_t(0), gateStartIndex - params.preGateSamples);
+            int64_t const dataStopIndex = (std::min)(gateStopIndex + params.postGateSamples, actualRecordSize);
+            int64_t const dataStartIndexInMemory = nextGateOffsetInMemory + leadingSamplesToSkip;
+            if (dataStopIndex > dataStartIndex)
+                nbrEvents += Process(samples + dataStartIndexInMemory, dataStopIndex - dataStartIndex, recordIndex, events, dataStartIndex);
+
+            nextGateOffsetInMemory += gate.GetStoredSampleCount(params, record.GetRecordStopMarker());
+        }
+        return nbrEvents;
+    }
+
+    inline int64_t PulseShape::Discriminator::FindCrossing(int16_t const* samples, int64_t begin, int64_t end, int32_t level, bool above)
+    {
+        // Blocks of 64 samples are tested at once without branches, the crossing is then located inside the block.
+        static int64_t const BlockSamples = 64;
+        int16_t const clamped = int16_t((std::min)((std::max)(level, int32_t(INT16_MIN)), int32_t(INT16_MAX)));
+        int64_t i = begin;
+        for (; i + BlockSamples <= end; i += BlockSamples)
+        {
+            int found = 0;
+            if (above)
+            {
+                for (int64_t j = 0; j < BlockSamples; ++j)
+                    found |= (samples[i + j] >= clamped);
+            }
+            else
+            {
+                for (int64_t j = 0; j < BlockSamples; ++j)
+                    found |= (samples[i + j] <= clamped);
+            }
+            if (found)
+                break;
+        }
+
+        for (; i < end; ++i)
+        {
+            if (above ? samples[i] >= clamped : samples[i] <= clamped)
+                return i;
+        }
+        return end;
+    }
+}
+
+#endif
@@ -0,0 +1,438 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// SessionScheduler: thread-safe access to a driver session shared by fetch, control and
+// monitoring threads, with strict priority of stream fetches over the other driver calls.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_SESSIONSCHEDULER_H
+#define LIBTOOL_SESSIONSCHEDULER_H
+
+#include "LibTool.h"
+#include <AqMD3.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+
+namespace LibTool
+{
+    //! Session scheduling utils.
+    /*! When several threads share a session, a slow attribute read issued by a monitoring thread right before a fetch delays the
+        fetch, and the device memory fills meanwhile. #Scheduler serializes all driver calls of the application and grants the
+        session to the pending call of highest priority:
+          - #Priority::Fetch: stream fetches, always served first.
+          - #Priority::Control: configuration and acquisition control.
+          - #Priority::Monitoring: attribute reads for monitoring, additionally spaced by a minimum interval, and cached so that
+            threads reading the same attribute share one driver call (#GetAttributeViReal64 and siblings).
+
+            SessionScheduling::Scheduler scheduler(AqMD3_StreamFetchDataInt32);
+            ... fetch thread:
+            scheduler.StreamFetchDataInt32(session, "StreamCh1", ...);
+            ... monitoring thread:
+            ViReal64 temperature = 0.0;
+            scheduler.GetAttributeViReal64(session, "", AQMD3_ATTR_BOARD_TEMPERATURE, &temperature, std::chrono::seconds(1));
+            ... any other call:
+            scheduler.Call(session, SessionScheduling::Priority::Control, [&]() { return AqMD3_Abort(session); });
+
+        A call in progress is never interrupted: the worst delay of a fetch is the longest non-fetch call, reported with the time
+        every priority spent waiting for the session (#Statistics). The scheduler only coordinates the calls made through it; with
+        #Parameters::useDriverLock the driver session lock is also held during each call, to coordinate with code calling the
+        driver directly under AqMD3_LockSession.
+    */
+    namespace SessionScheduling
+    {
+        //! Priority of a driver call, from highest to lowest.
+        enum class Priority
+        {
+            Fetch,
+            Control,
+            Monitoring,
+            Count,
+        };
+
+        //! Return the name of priority.
+        inline char const* ToString(Priority priority)
+        {
+            switch (priority)
+            {
+            case Priority::Fetch:       return "Fetch";
+            case Priority::Control:     return "Control";
+            case Priority::Monitoring:  return "Monitoring";
+            default:                    return "Unknown";
+            }
+        }
+
+        //! Scheduler parameters.
+        struct Parameters
+        {
+            bool useDriverLock = false;                          //!< hold AqMD3_LockSession during each call.
+            std::chrono::microseconds monitoringInterval{ 1000 }; //!< minimum delay between two monitoring calls.
+        };
+
+        //! Access counters of a priority.
+        struct PriorityStatistics
+        {
+            uint64_t calls = 0;              //!< number of calls.
+            double waitSeconds = 0.0;        //!< total time waiting for the session.
+            double maxWaitSeconds = 0.0;     //!< longest wait for the session.
+            double holdSeconds = 0.0;        //!< total time holding the session.
+            double maxHoldSeconds = 0.0;     //!< longest call.
+        };
+
+        //! Counters collected by the scheduler.
+        struct Statistics
+        {
+            PriorityStatistics priorities[int(Priority::Count)];
+            uint64_t cacheHits = 0;          //!< monitoring reads served from a recent value.
+            uint64_t coalescedReads = 0;     //!< monitoring reads served by the driver call of another thread.
+
+            //! Return the counters of priority.
+            PriorityStatistics const& Get(Priority priority) const
+            { return priorities[int(priority)]; }
+
+            //! Print the counters in human readable format.
+            void Print(std::ostream& output) const;
+        };
+
+        //! Serialize the driver calls of several threads on shared sessions, by priority.
+        class Scheduler
+        {
+        public:
+            using FetchFunction = std::function<ViStatus(ViSession, ViConstString, ViInt64, ViInt64, ViInt32*, ViInt64*, ViInt64*, ViInt64*)>;
+
+            explicit Scheduler(FetchFunction fetch, Parameters const& params = Parameters());
+
+            Scheduler(Scheduler const&) = delete;
+            Scheduler& operator=(Scheduler const&) = delete;
+
+            //! Call function() with exclusive access to the driver, granted by priority, and return its status.
+            /*! With #Parameters::useDriverLock, function() is not called if AqMD3_LockSession fails and its error is returned instead.
+                An error of AqMD3_UnlockSession is returned if function() succeeded.*/
+            template<class Function>
+            ViStatus Call(ViSession session, Priority priority, Function&& function)
+            {
+                Access access(*this, session, priority);
+                if (access.GetLockStatus() < 0)
+                    return access.GetLockStatus();
+
+                ViStatus const status = function();
+                ViStatus const unlockStatus = access.Unlock();
+                return (status < 0 || unlockStatus >= 0) ? status : unlockStatus;
+            }
+
+            //! Same contract as AqMD3_StreamFetchDataInt32, called with #Priority::Fetch.
+            ViStatus StreamFetchDataInt32(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, ViInt64 arrayBufferSize,
+                                          ViInt32 array[], ViInt64* availableElements, ViInt64* actualElements, ViInt64* firstValidElement)
+            {
+                return Call(session, Priority::Fetch, [&]()
+                {
+                    return m_fetch(session, streamName, nbrElementsToFetch, arrayBufferSize, array, availableElements, actualElements, firstValidElement);
+                });
+            }
+
+            //! Return a fetch function with the contract of AqMD3_StreamFetchDataInt32 calling #StreamFetchDataInt32.
+            FetchFunction GetFetchFunction()
+            {
+                return [this](ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, ViInt64 arrayBufferSize,
+                              ViInt32* array, ViInt64* availableElements, ViInt64* actualElements, ViInt64* firstValidElement)
+                {
+                    return StreamFetchDataInt32(session, streamName, nbrElementsToFetch, arrayBufferSize, array, availableElements, actualElements, firstValidElement);
+                };
+            }
+
+            //! Read attribute of repCap with #Priority::Monitoring, unless a value read less than maxAge ago is available.
+            /*! Concurrent reads of the same attribute wait for the driver call in progress and share its result.*/
+            ViStatus GetAttributeViReal64(ViSession session, ViConstString repCap, ViAttr attribute, ViReal64* value, std::chrono::milliseconds maxAge)
+            { return ReadCached(m_real64Cache, AqMD3_GetAttributeViReal64, session, repCap, attribute, value, maxAge); }
+
+            ViStatus GetAttributeViInt64(ViSession session, ViConstString repCap, ViAttr attribute, ViInt64* value, std::chrono::milliseconds maxAge)
+            { return ReadCached(m_int64Cache, AqMD3_GetAttributeViInt64, session, repCap, attribute, value, maxAge); }
+
+            ViStatus GetAttributeViInt32(ViSession session, ViConstString repCap, ViAttr attribute, ViInt32* value, std::chrono::milliseconds maxAge)
+            { return ReadCached(m_int32Cache, AqMD3_GetAttributeViInt32, session, repCap, attribute, value, maxAge); }
+
+            ViStatus GetAttributeViBoolean(ViSession session, ViConstString repCap, ViAttr attribute, ViBoolean* value, std::chrono::milliseconds maxAge)
+            { return ReadCached(m_booleanCache, AqMD3_GetAttributeViBoolean, session, repCap, attribute, value, maxAge); }
+
+            //! Return a copy of the collected counters.
+            Statistics GetStatistics() const;
+
+        private:
+            typedef std::chrono::steady_clock Clock;
+            typedef std::tuple<ViSession, std::string, ViAttr> AttributeKey;
+
+            //! Last value read of an attribute.
+            template<class T>
+            struct CachedValue
+            {
+                T value = T();
+                ViStatus status = 0;
+                Clock::time_point time;
+                bool valid = false;
+                bool inFlight = false;   //!< a driver call is reading the attribute.
+            };
+
+            //! Exclusive access to the driver for the lifetime of the object, under the driver session lock with #Parameters::useDriverLock.
+            class Access
+            {
+            public:
+                Access(Scheduler& scheduler, ViSession session, Priority priority)
+                    : m_scheduler(scheduler)
+                    , m_session(session)
+                    , m_priority(priority)
+                    , m_start(scheduler.Acquire(priority))
+                    , m_lockStatus(VI_SUCCESS)
+                    , m_locked(false)
+                {
+                    if (scheduler.m_params.useDriverLock)
+                    {
+                        m_lockStatus = AqMD3_LockSession(session, VI_NULL);
+                        m_locked = (m_lockStatus >= 0);
+                    }
+                }
+
+                //! Release the driver session lock if the call threw an exception, in which case the status is lost.
+                ~Access()
+                {
+                    if (m_locked)
+                        AqMD3_UnlockSession(m_session, VI_NULL);
+                    m_scheduler.Release(m_priority, m_start);
+                }
+
+                Access(Access const&) = delete;
+                Access& operator=(Access const&) = delete;
+
+                //! Return the status of AqMD3_LockSession, VI_SUCCESS without #Parameters::useDriverLock.
+                ViStatus GetLockStatus() const { return m_lockStatus; }
+
+                //! Release the driver session lock and return the status of AqMD3_UnlockSession, VI_SUCCESS if it was not held.
+                ViStatus Unlock()
+                {
+                    if (!m_locked)
+                        return VI_SUCCESS;
+
+                    m_locked = false;
+                    return AqMD3_UnlockSession(m_session, VI_NULL);
+                }
+
+            private:
+                Scheduler& m_scheduler;
+                ViSession const m_session;
+                Priority const m_priority;
+                Clock::time_point const m_start;
+                ViStatus m_lockStatus;
+                bool m_locked;
+            };
+
+            //! Wait until no call is in progress and no call of higher priority is pending, then take the session.
+            /*! \return the time the access has been granted.*/
+            Clock::time_point Acquire(Priority priority);
+
+            //! Give the session back, granted at start.
+            void Release(Priority priority, Clock::time_point start);
+
+            //! Return true if a call of higher priority than priority is pending.
+            bool IsPreempted(Priority priority) const;
+
+            template<class T, class ReadFunction>
+            ViStatus ReadCached(std::map<AttributeKey, CachedValue<T>>& cache, ReadFunction read, ViSession session, ViConstString repCap, ViAttr attribute,
+                                T* value, std::chrono::milliseconds maxAge);
+
+            FetchFunction m_fetch;
+            Parameters const m_params;
+
+            mutable std::mutex m_mutex;
+            std::condition_variable m_condition;
+            bool m_busy;
+            size_t m_pending[int(Priority::Count)];
+            Clock::time_point m_nextMonitoringTime;
+            Statistics m_statistics;
+
+            std::condition_variable m_cacheCondition;
+            std::map<AttributeKey, CachedValue<ViReal64>> m_real64Cache;
+            std::map<AttributeKey, CachedValue<ViInt64>> m_int64Cache;
+            std::map<AttributeKey, CachedValue<ViInt32>> m_int32Cache;
+            std::map<AttributeKey, CachedValue<ViBoolean>> m_booleanCache;
+        };
+    }
+
+    ///////
+    // SessionScheduling member definitions
+    //
+
+    inline void SessionScheduling::Statistics::Print(std::ostream& output) const
+    {
+        std::ios::fmtflags const flags = output.flags();
+        std::streamsize const precision = output.precision();
+
+        output << "Session scheduling statistics:\n";
+        output << "  Priority      Calls     Wait total(s)  Wait max(ms)  Hold total(s)  Hold max(ms)\n";
+        for (int priority = 0; priority < int(Priority::Count); ++priority)
+        {
+            PriorityStatistics const& stats = priorities[priority];
+            output << "  " << std::left << std::setw(12) << SessionScheduling::ToString(Priority(priority)) << std::right
+                   << std::setw(7) << stats.calls
+                   << std::fixed << std::setprecision(3)
+                   << std::setw(18) << stats.waitSeconds
+                   << std::setw(14) << stats.maxWaitSeconds * 1e3
+                   << std::setw(15) << stats.holdSeconds
+                   << std::setw(14) << stats.maxHoldSeconds * 1e3 << '\n';
+        }
+        output.flags(flags);
+        output.precision(precision);
+        output << "  Cached reads:       " << cacheHits << '\n';
+        output << "  Coalesced reads:    " << coalescedReads << '\n';
+    }
+
+    inline SessionScheduling::Scheduler::Scheduler(FetchFunction fetch, Parameters const& params)
+        : m_fetch(fetch)
+        , m_params(params)
+        , m_mutex()
+        , m_condition()
+        , m_busy(false)
+        , m_pending()
+        , m_nextMonitoringTime()
+        , m_statistics()
+        , m_cacheCondition()
+        , m_real64Cache()
+        , m_int64Cache()
+        , m_int32Cache()
+        , m_booleanCache()
+    {
+        if (!m_fetch)
+            throw std::invalid_argument("Session scheduler requires a valid fetch function");
+    }
+
+    inline SessionScheduling::Statistics SessionScheduling::Scheduler::GetStatistics() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_statistics;
+    }
+
+    inline bool SessionScheduling::Scheduler::IsPreempted(Priority priority) const
+    {
+        for (int higher = 0; higher < int(priority); ++higher)
+        {
+            if (m_pending[higher] != 0)
+                return true;
+        }
+        return false;
+    }
+
+    inline SessionScheduling::Scheduler::Clock::time_point SessionScheduling::Scheduler::Acquire(Priority priority)
+    {
+        auto const requestTime = Clock::now();
+        Clock::time_point start;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            ++m_pending[int(priority)];
+            for (;;)
+            {
+                if (m_busy || IsPreempted(priority))
+                {
+                    m_condition.wait(lock);
+                    continue;
+                }
+
+                // Monitoring calls are spaced, the session remains available to the other priorities meanwhile.
+                if (priority == Priority::Monitoring && Clock::now() < m_nextMonitoringTime)
+                {
+                    m_condition.wait_until(lock, m_nextMonitoringTime);
+                    continue;
+                }
+                break;
+            }
+            --m_pending[int(priority)];
+            m_busy = true;
+
+            start = Clock::now();
+            if (priority == Priority::Monitoring)
+                m_nextMonitoringTime = start + m_params.monitoringInterval;
+
+            double const waitSeconds = std::chrono::duration<double>(start - requestTime).count();
+            PriorityStatistics& stats = m_statistics.priorities[int(priority)];
+            ++stats.calls;
+            stats.waitSeconds += waitSeconds;
+            stats.maxWaitSeconds = (std::max)(stats.maxWaitSeconds, waitSeconds);
+        }
+        return start;
+    }
+
+    inline void SessionScheduling::Scheduler::Release(Priority priority, Clock::time_point start)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_busy = false;
+
+            double const holdSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+            PriorityStatistics& stats = m_statistics.priorities[int(priority)];
+            stats.holdSeconds += holdSeconds;
+            stats.maxHoldSeconds = (std::max)(stats.maxHoldSeconds, holdSeconds);
+        }
+        m_condition.notify_all();
+    }
+
+    template<class T, class ReadFunction>
+    inline ViStatus SessionScheduling::Scheduler::ReadCached(std::map<AttributeKey, CachedValue<T>>& cache, ReadFunction read, ViSession session, ViConstString repCap,
+                                                             ViAttr attribute, T* value, std::chrono::milliseconds maxAge)
+    {
+        auto const requestTime = Clock::now();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        CachedValue<T>& entry = cache[AttributeKey(session, repCap, attribute)];
+
+        bool waited = false;
+        for (;;)
+        {
+            // A value read after requestTime-maxAge is recent enough, including the result of a call completed while waiting.
+            if (entry.valid && entry.time + maxAge >= requestTime)
+            {
+                if (waited)
+                    ++m_statistics.coalescedReads;
+                else
+                    ++m_statistics.cacheHits;
+                *value = entry.value;
+                return entry.status;
+            }
+
+            if (!entry.inFlight)
+                break;
+
+            m_cacheCondition.wait(lock);
+            waited = true;
+        }
+
+        entry.inFlight = true;
+        lock.unlock();
+
+        T result = T();
+        ViStatus const status = Call(session, Priority::Monitoring, [&]() { return read(session, repCap, attribute, &result); });
+
+        // A failed read is not cached: the next read, including the ones waiting for this call, calls the driver again.
+        lock.lock();
+        if (status >= 0)
+        {
+            entry.value = result;
+            entry.status = status;
+            entry.time = Clock::now();
+            entry.valid = true;
+        }
+        entry.inFlight = false;
+        lock.unlock();
+        m_cacheCondition.notify_all();
+
+        *value = result;
+        return status;
+    }
+}
+
+#endif
@@ -0,0 +1,278 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// SoftwareTrigger: secondary trigger conditions (edge, window, slope) evaluated on the samples of
+// the records, and segmentation of the records into sub-records aligned on those triggers.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_SOFTWARETRIGGER_H
+#define LIBTOOL_SOFTWARETRIGGER_H
+
+#include "LibTool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+namespace LibTool
+{
+    //! Software trigger utils.
+    /*! Long records lower the hardware trigger rate, but a record may then hold several events of interest. #Segmenter scans
+        every record for a secondary trigger condition, and describes a sub-record of #Parameters::preSamples samples before and
+        #Parameters::postSamples samples from every trigger:
+
+            SoftwareTrigger::Segmenter segmenter(parameters, sampleInterval, timestampPeriod);
+
+            subRecords.clear();
+            segmenter.Process(triggerMarker, samples, recordSize, subRecords);
+            for (SoftwareTrigger::SubRecord const& subRecord : subRecords)
+                Save(subRecord, samples + subRecord.firstSample);
+
+        Like the hardware trigger, a condition fires once per event: it must be armed (hysteresis) before firing again, and
+        #Parameters::holdOffSamples after the previous trigger at the earliest. Records are not contiguous: every record starts
+        disarmed, and the sub-records which would exceed the record are counted but not emitted.
+
+        The scan alternates between the search of the arming and of the firing sample, each testing blocks of samples with
+        branch-free loops the compiler vectorizes.
+    */
+    namespace SoftwareTrigger
+    {
+        //! Trigger condition.
+        enum class Condition
+        {
+            Edge,           //!< the signal crosses #Parameters::level, armed #Parameters::hysteresis away on the other side.
+            Window,         //!< the signal leaves [#Parameters::windowLow, #Parameters::windowHigh], armed #Parameters::hysteresis inside.
+            Slope,          //!< the signal changes by #Parameters::level within #Parameters::slopeSamples samples.
+        };
+
+        //! Direction of Edge and Slope conditions.
+        enum class Slope
+        {
+            Rising,
+            Falling,
+        };
+
+        //! Trigger and segmentation parameters (levels in ADC codes, lengths in samples).
+        struct Parameters
+        {
+            Condition condition = Condition::Edge;
+            Slope slope = Slope::Rising;
+            int32_t level = 0;                  //!< Edge level, or Slope amplitude (positive).
+            int32_t hysteresis = 50;
+            int32_t windowLow = -1000;
+            int32_t windowHigh = 1000;
+            int32_t slopeSamples = 4;
+            int32_t preSamples = 64;            //!< sub-record samples before the trigger sample.
+            int32_t postSamples = 192;          //!< sub-record samples from the trigger sample.
+            int32_t holdOffSamples = 192;       //!< shortest distance between two triggers.
+
+            //! Return the number of samples of a sub-record.
+            int32_t GetSubRecordSize() const
+            { return preSamples + postSamples; }
+
+            //! \throw #std::invalid_argument if the parameters are inconsistent.
+            void Validate() const;
+        };
+
+        //! Sub-record of a record, aligned on a software trigger.
+        struct SubRecord
+        {
+            uint64_t recordIndex;       //!< running index of the sub-record.
+            uint32_t parentRecordIndex; //!< index of the record holding the sub-record.
+            int32_t firstSample;        //!< index of the first sample of the sub-record in its parent record.
+            double triggerPosition;     //!< trigger time in samples from the first sample of the sub-record (interpolated for Edge and Window conditions).
+            double initialXTime;        //!< absolute time of the first sample of the sub-record, in seconds.
+
+            //! Return the absolute time of the trigger, in seconds.
+            double GetTriggerTime(double sampleInterval) const
+            { return initialXTime + triggerPosition * sampleInterval; }
+        };
+
+        //! Segmentation statistics.
+        struct Statistics
+        {
+            uint64_t nbrRecords = 0;
+            uint64_t nbrTriggers = 0;
+            uint64_t nbrSubRecords = 0;
+            uint64_t nbrTruncated = 0;          //!< triggers too close to the record edges for a whole sub-record.
+            uint64_t maxTriggersPerRecord = 0;
+            double seconds = 0.0;               //!< processing time.
+
+            void Print(std::ostream& output) const;
+        };
+
+        //! Secondary trigger and segmentation of records.
+        class Segmenter
+        {
+        public:
+            //! \throw #std::invalid_argument if parameters are inconsistent.
+            explicit Segmenter(Parameters const& parameters, double sampleInterval, double timestampPeriod);
+
+            //! Append the sub-records of the record of nbrSamples samples described by trigger.
+            /*! \return the number of sub-records appended.*/
+            size_t Process(TriggerMarker const& trigger, int16_t const* samples, int64_t nbrSamples, std::vector<SubRecord>& subRecords);
+
+            Parameters const& GetParameters() const
+            { return m_parameters; }
+
+            Statistics const& GetStatistics() const
+            { return m_statistics; }
+
+        private:
+            //! Return the index of the first sample in [begin, end[ for which predicate is true, end if none.
+            template <typename Predicate>
+            static int64_t FindFirst(int64_t begin, int64_t end, Predicate const& predicate);
+
+            Parameters const m_parameters;
+            double const m_sampleInterval;
+            double const m_timestampPeriod;
+            uint64_t m_nextSubRecordIndex;
+            Statistics m_statistics;
+        };
+    }
+
+    ///////
+    // SoftwareTrigger member definitions
+    //
+
+    inline void SoftwareTrigger::Parameters::Validate() const
+    {
+        bool const validCondition = (condition == Condition::Edge)
+                                 || (condition == Condition::Window && windowLow + hysteresis <= windowHigh - hysteresis)
+                                 || (condition == Condition::Slope && level > 0 && hysteresis <= level && slopeSamples > 0);
+        if (!validCondition || hysteresis < 0 || preSamples < 0 || postSamples <= 0 || holdOffSamples < 1)
+            throw std::invalid_argument("Invalid software trigger: level " + ToString(level) + ", hysteresis " + ToString(hysteresis) + ", window [" + ToString(windowLow) + ", "
+                                        + ToString(windowHigh) + "], slope samples " + ToString(slopeSamples) + ", sub-record " + ToString(preSamples) + "+" + ToString(postSamples)
+                                        + ", hold-off " + ToString(holdOffSamples));
+    }
+
+    inline void SoftwareTrigger::Statistics::Print(std::ostream& output) const
+    {
+        output << "\nSoftware trigger\n";
+        output << "  Records:            " << nbrRecords << '\n';
+        output << "  Triggers:           " << nbrTriggers << " (max " << maxTriggersPerRecord << " per record)\n";
+        output << "  Sub-records:        " << nbrSubRecords << " (" << nbrTruncated << " truncated)\n";
+        output << "  Processing:         " << seconds << " s";
+        if (nbrRecords > 0)
+            output << " (" << seconds / double(nbrRecords) * 1e6 << " us per record)";
+        output << '\n';
+    }
+
+    inline SoftwareTrigger::Segmenter::Segmenter(Parameters const& parameters, double sampleInterval, double timestampPeriod)
+        : m_parameters(parameters)
+        , m_sampleInterval(sampleInterval)
+        , m_timestampPeriod(timestampPeriod)
+        , m_nextSubRecordIndex(0)
+        , m_statistics()
+    {
+        parameters.Validate();
+    }
+
+    template <typename Predicate>
+    inline int64_t SoftwareTrigger::Segmenter::FindFirst(int64_t begin, int64_t end, Predicate const& predicate)
+    {
+        // Blocks of 64 samples are tested at once without branches, the sample is then located inside the block.
+        static int64_t const BlockSamples = 64;
+        int64_t i = begin;
+        for (; i + BlockSamples <= end; i += BlockSamples)
+        {
+            int found = 0;
+            for (int64_t j = 0; j < BlockSamples; ++j)
+                found |= int(predicate(i + j));
+            if (found)
+                break;
+        }
+
+        for (; i < end; ++i)
+        {
+            if (predicate(i))
+                return i;
+        }
+        return end;
+    }
+
+    inline size_t SoftwareTrigger::Segmenter::Process(TriggerMarker const& trigger, int16_t const* samples, int64_t nbrSamples, std::vector<SubRecord>& subRecords)
+    {
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point const start = Clock::now();
+        size_t const firstSubRecord = subRecords.size();
+        ++m_statistics.nbrRecords;
+
+        // Falling conditions are rising conditions on the opposite signal.
+        Parameters const& p = m_parameters;
+        int32_t const sign = (p.slope == Slope::Rising) ? 1 : -1;
+        int32_t const signedLevel = sign * p.level;
+        int32_t const armLevel = signedLevel - p.hysteresis;
+        int32_t const insideLow = p.windowLow + p.hysteresis;
+        int32_t const insideHigh = p.windowHigh - p.hysteresis;
+        int64_t const delay = p.slopeSamples;
+
+        double const initialXTime = trigger.GetInitialXTime(m_timestampPeriod);
+        int64_t const subRecordSize = p.GetSubRecordSize();
+        int64_t position = (p.condition == Condition::Slope) ? delay : 0;
+        uint64_t nbrTriggers = 0;
+        for (;;)
+        {
+            // The condition is dispatched once per search, so that its predicate is inlined in the block loop.
+            int64_t armed = nbrSamples;
+            int64_t fired = nbrSamples;
+            switch (p.condition)
+            {
+            case Condition::Edge:
+                armed = FindFirst(position, nbrSamples, [&](int64_t i) { return sign * samples[i] <= armLevel; });
+                fired = FindFirst(armed, nbrSamples, [&](int64_t i) { return sign * samples[i] >= signedLevel; });
+                break;
+            case Condition::Window:
+                armed = FindFirst(position, nbrSamples, [&](int64_t i) { return (samples[i] >= insideLow) & (samples[i] <= insideHigh); });
+                fired = FindFirst(armed, nbrSamples, [&](int64_t i) { return (samples[i] < p.windowLow) | (samples[i] > p.windowHigh); });
+                break;
+            case Condition::Slope:
+                armed = FindFirst(position, nbrSamples, [&](int64_t i) { return sign * (samples[i] - samples[i - delay]) <= p.level - p.hysteresis; });
+                fired = FindFirst(armed, nbrSamples, [&](int64_t i) { return sign * (samples[i] - samples[i - delay]) >= p.level; });
+                break;
+            }
+            if (fired >= nbrSamples)
+                break;
+            ++nbrTriggers;
+
+            // Interpolate the crossing of the level (or of the violated window bound) between the previous sample and the trigger sample.
+            double crossing = double(fired);
+            if (p.condition != Condition::Slope && fired > 0)
+            {
+                int32_t const threshold = (p.condition == Condition::Edge) ? p.level : (samples[fired] > p.windowHigh ? p.windowHigh : p.windowLow);
+                int32_t const previous = samples[fired - 1];
+                int32_t const current = samples[fired];
+                if (current != previous)
+                    crossing -= double(current - threshold) / double(current - previous);
+            }
+
+            int64_t const firstSample = fired - p.preSamples;
+            if (firstSample < 0 || firstSample + subRecordSize > nbrSamples)
+                ++m_statistics.nbrTruncated;
+            else
+            {
+                SubRecord subRecord;
+                subRecord.recordIndex = m_nextSubRecordIndex++;
+                subRecord.parentRecordIndex = trigger.recordIndex;
+                subRecord.firstSample = int32_t(firstSample);
+                subRecord.triggerPosition = crossing - double(firstSample);
+                subRecord.initialXTime = initialXTime + double(firstSample) * m_sampleInterval;
+                subRecords.push_back(subRecord);
+            }
+
+            position = fired + p.holdOffSamples;
+        }
+
+        size_t const nbrSubRecords = subRecords.size() - firstSubRecord;
+        m_statistics.nbrTriggers += nbrTriggers;
+        m_statistics.nbrSubRecords += nbrSubRecords;
+        m_statistics.maxTriggersPerRecord = (std::max)(m_statistics.maxTriggersPerRecord, nbrTriggers);
+        m_statistics.seconds += std::chrono::duration<double>(Clock::now() - start).count();
+        return nbrSubRecords;
+    }
+}
+
+#endif
@@ -0,0 +1,684 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// Spectrogram: short-time Fourier transform of continuous sample streams (real FFT with cached
+// plans, frames computed in parallel, averaged magnitude frames delivered through a ring buffer).
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_SPECTROGRAM_H
+#define LIBTOOL_SPECTROGRAM_H
+
+#include "LibTool.h"
+#include "ContinuousStreaming.h"
+#include "TaskScheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace LibTool
+{
+    //! Spectrogram of continuous sample streams.
+    /*! #StftEngine slices the unbounded int16 stream of #ContinuousStreaming chunks into windowed frames of #Parameters::fftSize
+        samples every #Parameters::hop samples, frames spanning chunk boundaries included. The power spectra of
+        #Parameters::nbrAveragedFrames consecutive frames are averaged into one output frame of fftSize/2+1 bins: the output bandwidth
+        is (fftSize/2+1) / (hop*nbrAveragedFrames) of the input one. Output frames are pushed into a #FrameRing read by the consumer.
+
+        Frames of a chunk are transformed on a #Tasks::TaskScheduler in tasks of #Parameters::framesPerTask frames, each worker adding
+        the power to its own partial sums of the output frames. The partial sums are reduced into output frames, and pushed, by a
+        background task while the frames of the next chunk are transformed. One core transforms about 0.04 GSamples/s (gcc -O2) to
+        0.09 GSamples/s (gcc -O3, auto-vectorized) with fftSize=4096 and hop=2048, twice as much with hop=fftSize (every sample is
+        transformed once): keeping up with 2 GSamples/s takes over 20 cores with 50% overlap. Typical use:
+
+            Tasks::TaskScheduler scheduler;
+            Spectrogram::FrameRing ring(256, Spectrogram::GetNbrBins(parameters.fftSize));
+            Spectrogram::StftEngine stft(parameters, scheduler, ring);
+            ...
+            stft.Process(chunk);
+            while (ring.Pop(frame))
+                Save(frame);
+            ...
+            stft.Finish();      // output frames of the last chunks.
+    */
+    namespace Spectrogram
+    {
+        //! Window applied to frames before transform.
+        enum class WindowType
+        {
+            Rectangular,
+            Hann,
+            Hamming,
+            BlackmanHarris,
+        };
+
+        //! Scale of output frames.
+        enum class Scale
+        {
+            Amplitude,          //!< amplitude in ADC codes: a sine of amplitude A reads A in its bin.
+            DecibelFullScale,   //!< power in dBFS: a full-scale sine reads 0 dB in its bin.
+        };
+
+        //! Return the coefficients of a window of size samples (periodic form, suited to spectral analysis).
+        std::vector<float> MakeWindow(WindowType type, size_t size);
+
+        //! Return the number of frequency bins of a real FFT of fftSize samples.
+        inline size_t GetNbrBins(size_t fftSize)
+        { return fftSize / 2 + 1; }
+
+        //! Per-thread work area of #FftPlan.
+        struct FftScratch
+        {
+            std::vector<float> real;
+            std::vector<float> imag;
+        };
+
+        //! Plan of a real FFT of a power-of-two size, computed as a complex FFT of half size on split real/imaginary arrays.
+        /*! Tables (bit reversal, twiddles of every stage and of the real post-processing) are computed once per size: use #Get to
+            share plans through the process-wide cache. Butterfly loops run over contiguous arrays without intrinsics, so that the
+            compiler vectorizes them for the target instruction set.*/
+        class FftPlan
+        {
+        public:
+            //! Build the plan of a real FFT of size samples (power of two, at least 8).
+            explicit FftPlan(size_t size);
+
+            //! Return the plan of size samples from the process-wide cache, building it on first request.
+            static std::shared_ptr<FftPlan const> Get(size_t size);
+
+            size_t GetSize() const
+            { return m_size; }
+
+            //! Compute the power spectrum (|X[k]|^2, k in [0, size/2]) of size int16 samples multiplied by window, and add it to power.
+            void AccumulatePower(int16_t const* input, float const* window, float* power, FftScratch& scratch) const;
+
+            //! Compute the spectrum X[k], k in [0, size/2], of size float samples (no window).
+            void Transform(float const* input, float* real, float* imag, FftScratch& scratch) const;
+
+        private:
+            //! Run the complex FFT of half size on scratch arrays loaded in bit-reversed order.
+            void RunButterflies(float* real, float* imag) const;
+
+            //! Number of butterflies computed together in the vectorized stages.
+            static size_t const NbrLanes = 8;
+
+            size_t const m_size;
+            size_t const m_half;
+            std::vector<uint32_t> m_bitReversed;   //!< bit-reversed position of every complex sample.
+            std::vector<float> m_stageCos;         //!< twiddles of stage of half-length h at offset h (h >= 4).
+            std::vector<float> m_stageSin;
+            std::vector<float> m_postCos;          //!< real post-processing twiddles exp(-2*pi*i*k/size), k in [0, size/2].
+            std::vector<float> m_postSin;
+        };
+
+        //! Output frame of the spectrogram.
+        struct Frame
+        {
+            uint64_t firstSampleIndex = 0;  //!< running index of the first sample of the first averaged frame.
+            std::vector<float> bins;
+        };
+
+        //! Bounded single-producer single-consumer ring of output frames.
+        /*! When the consumer does not keep up, new frames are dropped and counted: the producer never waits.*/
+        class FrameRing
+        {
+        public:
+            explicit FrameRing(size_t capacity, size_t frameSize);
+
+            //! Push a frame of frameSize values. Return false (frame dropped) if the ring is full.
+            bool Push(uint64_t firstSampleIndex, float const* values);
+
+            //! Pop the oldest frame into frame. Return false if the ring is empty.
+            bool Pop(Frame& frame);
+
+            size_t GetFrameSize() const
+            { return m_frameSize; }
+
+            //! Return the number of frames dropped because the ring was full.
+            uint64_t GetDroppedCount() const
+            { return m_nbrDropped.load(std::memory_order_relaxed); }
+
+        private:
+            size_t const m_capacity;
+            size_t const m_frameSize;
+            std::vector<float> m_values;
+            std::vector<uint64_t> m_sampleIndices;
+            std::atomic<uint64_t> m_writeCount;
+            std::atomic<uint64_t> m_readCount;
+            std::atomic<uint64_t> m_nbrDropped;
+        };
+
+        //! Parameters of the short-time Fourier transform.
+        struct Parameters
+        {
+            size_t fftSize = 1024;                  //!< frame size, power of two.
+            size_t hop = 1024;                      //!< samples between the starts of consecutive frames.
+            WindowType window = WindowType::Hann;
+            size_t nbrAveragedFrames = 16;          //!< number of frames whose power is averaged into an output frame.
+            Scale scale = Scale::DecibelFullScale;
+            double sampleRate = 1.0;                //!< used for the frequency axis only.
+            size_t framesPerTask = 4;               //!< frames transformed by every task of a chunk.
+        };
+
+        //! Short-time Fourier transform stage of the unbounded sample stream.
+        class StftEngine
+        {
+        public:
+            explicit StftEngine(Parameters const& parameters, Tasks::TaskScheduler& scheduler, FrameRing& ring);
+
+            //! Transform all frames completed by chunk, and push the output frames they complete to the ring in the background.
+            /*! The output frames of a chunk are pushed while the next chunk is transformed: call #Finish to wait for them.
+                \throw #ContinuousStreaming::StreamGapError if chunk does not follow the previous one.
+                \throw the exception raised while pushing the output frames of the previous chunk.*/
+            void Process(ContinuousStreaming::SampleChunk const& chunk);
+
+            //! Wait until the output frames of the chunks processed so far are pushed to the ring.
+            /*! \throw the exception raised while pushing them.*/
+            void Finish();
+
+            //! Return the frequency (Hz) of bin.
+            double GetBinFrequency(size_t bin) const
+            { return double(bin) * m_parameters.sampleRate / double(m_parameters.fftSize); }
+
+            size_t GetNbrBins() const
+            { return m_nbrBins; }
+
+            //! Return the number of transformed frames.
+            uint64_t GetTransformCount() const
+            { return m_nbrTransforms; }
+
+            //! Return the number of output frames completed by the chunks processed so far (pushed, dropped, or to be pushed).
+            uint64_t GetOutputCount() const
+            { return m_nbrOutputs; }
+
+        private:
+            //! Power sums of the frames of a chunk, per worker and per output frame.
+            struct PartialSums
+            {
+                size_t nbrGroups = 0;           //!< output frames the frames of the chunk belong to.
+                std::vector<float> power;       //!< [worker][group][bin], valid where used.
+                std::vector<uint8_t> used;      //!< [worker][group]: the worker transformed frames of the group.
+            };
+
+            //! Convert an accumulated power spectrum of nbrAveragedFrames frames into output values.
+            void Finalize(float const* power, float* output) const;
+
+            //! Reduce the partial sums of a chunk into its output frames, and push the nbrCompleted first ones.
+            void Reduce(PartialSums const& partials, uint64_t firstFrameNumber, size_t nbrCompleted);
+
+            Parameters const m_parameters;
+            size_t const m_nbrBins;
+            Tasks::TaskScheduler& m_scheduler;
+            FrameRing& m_ring;
+            std::shared_ptr<FftPlan const> m_plan;
+            std::vector<float> m_window;
+            double m_amplitudeScale;                //!< bin amplitude of a unit sine, with the window.
+            std::vector<FftScratch> m_scratch;      //!< one per worker of the scheduler.
+
+            std::vector<int16_t> m_pending;         //!< samples of the stream from m_pendingIndex still needed by future frames.
+            uint64_t m_pendingIndex;
+            std::vector<int16_t> m_stitched;        //!< pending samples followed by the head of the current chunk.
+            uint64_t m_nextFrameIndex;              //!< running index of the first sample of the next frame.
+            uint64_t m_nextInputIndex;              //!< running index of the next expected input sample.
+
+            std::vector<int16_t const*> m_frameSources;     //!< first sample of every frame of the current chunk.
+            PartialSums m_partials[2];                      //!< of the current chunk and of the previous one, still being reduced.
+            std::vector<float> m_groupPower;                //!< power accumulator of the output frame in progress.
+            std::vector<float> m_output;
+            uint64_t m_nbrChunks;
+            uint64_t m_nbrTransforms;
+            uint64_t m_nbrOutputs;
+            Tasks::TaskGroup m_reduction;                   //!< reduction of the previous chunk (last member: waited for first).
+        };
+    }
+
+    ///////
+    // Spectrogram member definitions
+    //
+
+    inline std::vector<float> Spectrogram::MakeWindow(WindowType type, size_t size)
+    {
+        double const pi = 3.14159265358979323846;
+        std::vector<float> window(size);
+        for (size_t i = 0; i < size; ++i)
+        {
+            double const x = 2.0 * pi * double(i) / double(size);
+            double value = 1.0;
+            switch (type)
+            {
+            case WindowType::Rectangular:    value = 1.0; break;
+            case WindowType::Hann:           value = 0.5 - 0.5 * std::cos(x); break;
+            case WindowType::Hamming:        value = 0.54 - 0.46 * std::cos(x); break;
+            case WindowType::BlackmanHarris: value = 0.35875 - 0.48829 * std::cos(x) + 0.14128 * std::cos(2.0 * x) - 0.01168 * std::cos(3.0 * x); break;
+            default:
+                throw std::invalid_argument("Unknown window type " + ToString(int(type)));
+            }
+            window[i] = float(value);
+        }
+        return window;
+    }
+
+    inline Spectrogram::FftPlan::FftPlan(size_t size)
+        : m_size(size)
+        , m_half(size / 2)
+        , m_bitReversed()
+        , m_stageCos()
+        , m_stageSin()
+        , m_postCos()
+        , m_postSin()
+    {
+        if (size < 8 || (size & (size - 1)) != 0)
+            throw std::invalid_argument("FFT size must be a power of two of at least 8, got " + ToString(size));
+
+        double const pi = 3.14159265358979323846;
+
+        int nbrBits = 0;
+        while ((size_t(1) << nbrBits) < m_half)
+            ++nbrBits;
+
+        m_bitReversed.resize(m_half);
+        for (size_t i = 0; i < m_half; ++i)
+        {
+            uint32_t reversed = 0;
+            for (int bit = 0; bit < nbrBits; ++bit)
+                reversed |= uint32_t((i >> bit) & 1) << (nbrBits - 1 - bit);
+            m_bitReversed[i] = reversed;
+        }
+
+        // twiddles exp(-2*pi*i*j/(2h)) of the stage of half-length h stored at [h, 2h[ (stages h=1 and h=2 are special-cased).
+        m_stageCos.assign(m_half, 1.0f);
+        m_stageSin.assign(m_half, 0.0f);
+        for (size_t h = 4; h < m_half; h *= 2)
+        {
+            for (size_t j = 0; j < h; ++j)
+            {
+                double const angle = -pi * double(j) / double(h);
+                m_stageCos[h + j] = float(std::cos(angle));
+                m_stageSin[h + j] = float(std::sin(angle));
+            }
+        }
+
+        m_postCos.resize(m_half + 1);
+        m_postSin.resize(m_half + 1);
+        for (size_t k = 0; k <= m_half; ++k)
+        {
+            double const angle = -2.0 * pi * double(k) / double(m_size);
+            m_postCos[k] = float(std::cos(angle));
+            m_postSin[k] = float(std::sin(angle));
+        }
+    }
+
+    inline std::shared_ptr<Spectrogram::FftPlan const> Spectrogram::FftPlan::Get(size_t size)
+    {
+        static std::mutex mutex;
+        static std::map<size_t, std::shared_ptr<FftPlan const>> cache;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<FftPlan const>& plan = cache[size];
+        if (!plan)
+            plan = std::make_shared<FftPlan const>(size);
+        return plan;
+    }
+
+    inline void Spectrogram::FftPlan::RunButterflies(float* re, float* im) const
+    {
+        size_t const n = m_half;
+
+        // stages h=1 and h=2 fused in radix-4 butterflies (twiddles 1 and -i).
+        for (size_t base = 0; base < n; base += 4)
+        {
+            float const r0 = re[base] + re[base + 1], i0 = im[base] + im[base + 1];
+            float const r1 = re[base] - re[base + 1], i1 = im[base] - im[base + 1];
+            float const r2 = re[base + 2] + re[base + 3], i2 = im[base + 2] + im[base + 3];
+            float const r3 = re[base + 2] - re[base + 3], i3 = im[base + 2] - im[base + 3];
+
+            re[base] = r0 + r2;      im[base] = i0 + i2;
+            re[base + 2] = r0 - r2;  im[base + 2] = i0 - i2;
+            // (r3 + i*i3) * -i = i3 - i*r3
+            re[base + 1] = r1 + i3;  im[base + 1] = i1 - r3;
+            re[base + 3] = r1 - i3;  im[base + 3] = i1 + r3;
+        }
+
+        for (size_t h = 4; h < n; h *= 2)
+        {
+            float const* const wr = m_stageCos.data() + h;
+            float const* const wi = m_stageSin.data() + h;
+            for (size_t base = 0; base < n; base += 2 * h)
+            {
+                float* const ar = re + base;
+                float* const ai = im + base;
+                float* const br = re + base + h;
+                float* const bi = im + base + h;
+                if (h < NbrLanes)
+                {
+                    for (size_t j = 0; j < h; ++j)
+                    {
+                        float const tr = wr[j] * br[j] - wi[j] * bi[j];
+                        float const ti = wr[j] * bi[j] + wi[j] * br[j];
+                        br[j] = ar[j] - tr;
+                        bi[j] = ai[j] - ti;
+                        ar[j] = ar[j] + tr;
+                        ai[j] = ai[j] + ti;
+                    }
+                    continue;
+                }
+
+                // blocks of NbrLanes butterflies go through local arrays: the compiler cannot assume that the six pointers
+                // do not overlap, but it vectorizes the arithmetic on the local copies.
+                for (size_t j0 = 0; j0 < h; j0 += NbrLanes)
+                {
+                    float xr[NbrLanes], xi[NbrLanes], yr[NbrLanes], yi[NbrLanes], tr[NbrLanes], ti[NbrLanes];
+                    for (size_t l = 0; l < NbrLanes; ++l)
+                    {
+                        xr[l] = ar[j0 + l]; xi[l] = ai[j0 + l];
+                        yr[l] = br[j0 + l]; yi[l] = bi[j0 + l];
+                    }
+                    for (size_t l = 0; l < NbrLanes; ++l)
+                    {
+                        tr[l] = wr[j0 + l] * yr[l] - wi[j0 + l] * yi[l];
+                        ti[l] = wr[j0 + l] * yi[l] + wi[j0 + l] * yr[l];
+                    }
+                    for (size_t l = 0; l < NbrLanes; ++l)
+                    {
+                        br[j0 + l] = xr[l] - tr[l]; bi[j0 + l] = xi[l] - ti[l];
+                        ar[j0 + l] = xr[l] + tr[l]; ai[j0 + l] = xi[l] + ti[l];
+                    }
+                }
+            }
+        }
+    }
+
+    inline void Spectrogram::FftPlan::AccumulatePower(int16_t const* input, float const* window, float* power, FftScratch& scratch) const
+    {
+        scratch.real.resize(m_half);
+        scratch.imag.resize(m_half);
+        float* const re = scratch.real.data();
+        float* const im = scratch.imag.data();
+
+        // even samples as real part, odd samples as imaginary part, windowed and in bit-reversed order.
+        for (size_t n = 0; n < m_half; ++n)
+        {
+            uint32_t const position = m_bitReversed[n];
+            re[position] = window[2 * n] * float(input[2 * n]);
+            im[position] = window[2 * n + 1] * float(input[2 * n + 1]);
+        }
+
+        RunButterflies(re, im);
+
+        // X[k] = E[k] - i*W^k*O[k] with E = (Z[k] + conj(Z[n-k]))/2 and O = (Z[k] - conj(Z[n-k]))/2.
+        {
+            float const x0 = re[0] + im[0];
+            float const xn = re[0] - im[0];
+            power[0] += x0 * x0;
+            power[m_half] += xn * xn;
+        }
+        for (size_t k = 1; k < m_half; ++k)
+        {
+            float const ar = re[k], ai = im[k];
+            float const br = re[m_half - k], bi = -im[m_half - k];
+            float const er = 0.5f * (ar + br), ei = 0.5f * (ai + bi);
+            float const orr = 0.5f * (ar - br), oi = 0.5f * (ai - bi);
+            float const xr = er + (m_postCos[k] * oi + m_postSin[k] * orr);
+            float const xi = ei - (m_postCos[k] * orr - m_postSin[k] * oi);
+            power[k] += xr * xr + xi * xi;
+        }
+    }
+
+    inline void Spectrogram::FftPlan::Transform(float const* input, float* real, float* imag, FftScratch& scratch) const
+    {
+        scratch.real.resize(m_half);
+        scratch.imag.resize(m_half);
+        float* const re = scratch.real.data();
+        float* const im = scratch.imag.data();
+
+        for (size_t n = 0; n < m_half; ++n)
+        {
+            uint32_t const position = m_bitReversed[n];
+            re[position] = input[2 * n];
+            im[position] = input[2 * n + 1];
+        }
+
+        RunButterflies(re, im);
+
+        real[0] = re[0] + im[0];
+        imag[0] = 0.0f;
+        real[m_half] = re[0] - im[0];
+        imag[m_half] = 0.0f;
+        for (size_t k = 1; k < m_half; ++k)
+        {
+            float const ar = re[k], ai = im[k];
+            float const br = re[m_half - k], bi = -im[m_half - k];
+            float const er = 0.5f * (ar + br), ei = 0.5f * (ai + bi);
+            float const orr = 0.5f * (ar - br), oi = 0.5f * (ai - bi);
+            real[k] = er + (m_postCos[k] * oi + m_postSin[k] * orr);
+            imag[k] = ei - (m_postCos[k] * orr - m_postSin[k] * oi);
+        }
+    }
+
+    inline Spectrogram::FrameRing::FrameRing(size_t capacity, size_t frameSize)
+        : m_capacity(capacity)
+        , m_frameSize(frameSize)
+        , m_values(capacity * frameSize)
+        , m_sampleIndices(capacity)
+        , m_writeCount(0)
+        , m_readCount(0)
+        , m_nbrDropped(0)
+    {
+        if (capacity == 0 || frameSize == 0)
+            throw std::invalid_argument("Invalid frame ring: capacity=" + ToString(capacity) + ", frame size=" + ToString(frameSize));
+    }
+
+    inline bool Spectrogram::FrameRing::Push(uint64_t firstSampleIndex, float const* values)
+    {
+        uint64_t const writeCount = m_writeCount.load(std::memory_order_relaxed);
+        if (writeCount - m_readCount.load(std::memory_order_acquire) >= m_capacity)
+        {
+            m_nbrDropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        size_t const slot = size_t(writeCount % m_capacity);
+        std::memcpy(m_values.data() + slot * m_frameSize, values, m_frameSize * sizeof(float));
+        m_sampleIndices[slot] = firstSampleIndex;
+        m_writeCount.store(writeCount + 1, std::memory_order_release);
+        return true;
+    }
+
+    inline bool Spectrogram::FrameRing::Pop(Frame& frame)
+    {
+        uint64_t const readCount = m_readCount.load(std::memory_order_relaxed);
+        if (readCount == m_writeCount.load(std::memory_order_acquire))
+            return false;
+
+        size_t const slot = size_t(readCount % m_capacity);
+        float const* const values = m_values.data() + slot * m_frameSize;
+        frame.bins.assign(values, values + m_frameSize);
+        frame.firstSampleIndex = m_sampleIndices[slot];
+        m_readCount.store(readCount + 1, std::memory_order_release);
+        return true;
+    }
+
+    inline Spectrogram::StftEngine::StftEngine(Parameters const& parameters, Tasks::TaskScheduler& scheduler, FrameRing& ring)
+        : m_parameters(parameters)
+        , m_nbrBins(Spectrogram::GetNbrBins(parameters.fftSize))
+        , m_scheduler(scheduler)
+        , m_ring(ring)
+        , m_plan(FftPlan::Get(parameters.fftSize))
+        , m_window(MakeWindow(parameters.window, parameters.fftSize))
+        , m_amplitudeScale(0.0)
+        , m_scratch(scheduler.GetNbrWorkers())
+        , m_pending()
+        , m_pendingIndex(0)
+        , m_stitched()
+        , m_nextFrameIndex(0)
+        , m_nextInputIndex(0)
+        , m_frameSources()
+        , m_partials()
+        , m_groupPower(m_nbrBins, 0.0f)
+        , m_output(m_nbrBins)
+        , m_nbrChunks(0)
+        , m_nbrTransforms(0)
+        , m_nbrOutputs(0)
+        , m_reduction()
+    {
+        if (parameters.hop == 0 || parameters.nbrAveragedFrames == 0 || parameters.framesPerTask == 0)
+            throw std::invalid_argument("Invalid STFT parameters: hop=" + ToString(parameters.hop) + ", averaged frames=" + ToString(parameters.nbrAveragedFrames)
+                                        + ", frames per task=" + ToString(parameters.framesPerTask));
+        if (ring.GetFrameSize() != m_nbrBins)
+            throw std::invalid_argument("Frame ring size " + ToString(ring.GetFrameSize()) + " does not match the " + ToString(m_nbrBins) + " bins of the STFT");
+
+        // a sine of amplitude A reads A*sum(window)/2 in its bin.
+        double sum = 0.0;
+        for (float const coefficient : m_window)
+            sum += coefficient;
+        m_amplitudeScale = 0.5 * sum;
+    }
+
+    inline void Spectrogram::StftEngine::Finalize(float const* power, float* output) const
+    {
+        double const averaging = 1.0 / double(m_parameters.nbrAveragedFrames);
+        if (m_parameters.scale == Scale::Amplitude)
+        {
+            for (size_t k = 0; k < m_nbrBins; ++k)
+                output[k] = float(std::sqrt(double(power[k]) * averaging) / m_amplitudeScale);
+        }
+        else
+        {
+            double const fullScale = 32768.0 * m_amplitudeScale;
+            double const reference = averaging / (fullScale * fullScale);
+            for (size_t k = 0; k < m_nbrBins; ++k)
+                output[k] = float(10.0 * std::log10(double(power[k]) * reference + 1e-30));
+        }
+    }
+
+    inline void Spectrogram::StftEngine::Process(ContinuousStreaming::SampleChunk const& chunk)
+    {
+        if (chunk.firstSampleIndex != m_nextInputIndex)
+            throw ContinuousStreaming::StreamGapError("STFT expects sample " + ToString(m_nextInputIndex) + ", got chunk starting at " + ToString(chunk.firstSampleIndex));
+        m_nextInputIndex = chunk.GetEndSampleIndex();
+
+        size_t const fftSize = m_parameters.fftSize;
+        size_t const hop = m_parameters.hop;
+        uint64_t const chunkEnd = chunk.GetEndSampleIndex();
+
+        // 1. Sources of the frames completed by this chunk. Frames starting in pending samples end before the first fftSize
+        //    samples of the chunk: they read a copy of the pending samples followed by the head of the chunk.
+        m_frameSources.clear();
+        if (!m_pending.empty())
+        {
+            size_t const head = size_t((std::min)(uint64_t(fftSize), uint64_t(chunk.nbrSamples)));
+            m_stitched.assign(m_pending.begin(), m_pending.end());
+            m_stitched.insert(m_stitched.end(), chunk.samples, chunk.samples + head);
+        }
+        for (; m_nextFrameIndex + fftSize <= chunkEnd; m_nextFrameIndex += hop)
+        {
+            if (m_nextFrameIndex >= chunk.firstSampleIndex)
+                m_frameSources.push_back(chunk.samples + size_t(m_nextFrameIndex - chunk.firstSampleIndex));
+            else
+                m_frameSources.push_back(m_stitched.data() + size_t(m_nextFrameIndex - m_pendingIndex));
+        }
+
+        // 2. Keep the samples still needed by the next frames.
+        uint64_t const keepFrom = (std::min)(m_nextFrameIndex, chunkEnd);
+        if (keepFrom >= chunk.firstSampleIndex)
+        {
+            m_pending.assign(chunk.samples + size_t(keepFrom - chunk.firstSampleIndex), chunk.samples + chunk.nbrSamples);
+        }
+        else
+        {
+            // the next frame starts in the pending samples (chunk shorter than a frame): keep them with the chunk.
+            std::vector<int16_t> kept(m_pending.begin() + size_t(keepFrom - m_pendingIndex), m_pending.end());
+            kept.insert(kept.end(), chunk.samples, chunk.samples + chunk.nbrSamples);
+            m_pending.swap(kept);
+        }
+        m_pendingIndex = keepFrom;
+
+        if (m_frameSources.empty())
+            return;
+
+        // 3. Output frames of this chunk: the first one continues the accumulator kept from previous chunks.
+        size_t const averaged = m_parameters.nbrAveragedFrames;
+        uint64_t const firstFrameNumber = m_nbrTransforms;
+        size_t const nbrFrames = m_frameSources.size();
+        size_t const firstGroupFrames = (std::min)(nbrFrames, size_t(averaged - firstFrameNumber % averaged));
+        size_t const nbrGroups = 1 + (nbrFrames - firstGroupFrames + averaged - 1) / averaged;
+
+        // 4. Transform in parallel, framesPerTask frames per task: every worker adds the power of its frames to its own partial
+        //    sums of their output frames, cleared on first use. The partial sums of the previous chunk are still being reduced.
+        size_t const nbrWorkers = m_scratch.size();
+        PartialSums& partials = m_partials[m_nbrChunks++ % 2];
+        partials.nbrGroups = nbrGroups;
+        partials.power.resize(nbrWorkers * nbrGroups * m_nbrBins);
+        partials.used.assign(nbrWorkers * nbrGroups, 0);
+        m_scheduler.ParallelFor(Tasks::Priority::Normal, Tasks::RecordRange{ 0, int64_t(nbrFrames) }, int64_t(m_parameters.framesPerTask), [&](Tasks::RecordRange const& frames, size_t worker)
+        {
+            for (size_t frame = size_t(frames.first); frame < size_t(frames.GetEnd()); ++frame)
+            {
+                size_t const group = (frame < firstGroupFrames) ? 0 : 1 + (frame - firstGroupFrames) / averaged;
+                size_t const slot = worker * nbrGroups + group;
+                float* const power = partials.power.data() + slot * m_nbrBins;
+                if (partials.used[slot] == 0)
+                {
+                    std::fill(power, power + m_nbrBins, 0.0f);
+                    partials.used[slot] = 1;
+                }
+                m_plan->AccumulatePower(m_frameSources[frame], m_window.data(), power, m_scratch[worker]);
+            }
+        });
+        m_nbrTransforms += nbrFrames;
+
+        // 5. Reduce and push the output frames in the background, after those of the previous chunk; the last one may be incomplete
+        //    and is kept as accumulator.
+        size_t nbrCompleted = nbrGroups;
+        if (m_nbrTransforms % averaged != 0)
+            --nbrCompleted;
+        m_nbrOutputs += nbrCompleted;
+
+        m_scheduler.Wait(m_reduction);
+        m_scheduler.Submit(m_reduction, Tasks::Priority::Normal, Tasks::RecordRange{ 0, 1 }, [this, &partials, firstFrameNumber, nbrCompleted](Tasks::RecordRange const&, size_t)
+        {
+            Reduce(partials, firstFrameNumber, nbrCompleted);
+        });
+    }
+
+    inline void Spectrogram::StftEngine::Finish()
+    {
+        m_scheduler.Wait(m_reduction);
+    }
+
+    inline void Spectrogram::StftEngine::Reduce(PartialSums const& partials, uint64_t firstFrameNumber, size_t nbrCompleted)
+    {
+        size_t const averaged = m_parameters.nbrAveragedFrames;
+        size_t const nbrWorkers = partials.used.size() / partials.nbrGroups;
+        float* const power = m_groupPower.data();
+        for (size_t group = 0; group < partials.nbrGroups; ++group)
+        {
+            for (size_t worker = 0; worker < nbrWorkers; ++worker)
+            {
+                size_t const slot = worker * partials.nbrGroups + group;
+                if (partials.used[slot] == 0)
+                    continue;
+
+                float const* const partial = partials.power.data() + slot * m_nbrBins;
+                for (size_t k = 0; k < m_nbrBins; ++k)
+                    power[k] += partial[k];
+            }
+
+            if (group < nbrCompleted)
+            {
+                uint64_t const groupFirstFrame = (firstFrameNumber / averaged + group) * averaged;
+                Finalize(power, m_output.data());
+                m_ring.Push(groupFirstFrame * m_parameters.hop, m_output.data());
+                std::fill(power, power + m_nbrBins, 0.0f);
+            }
+        }
+    }
+}
+
+#endif
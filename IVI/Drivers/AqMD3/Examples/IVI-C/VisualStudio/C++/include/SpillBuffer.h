@@ -0,0 +1,504 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// SpillBuffer: queue of fetched batches between the fetch thread and the processing thread,
+// spilling to a scratch file when processing falls behind.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_SPILLBUFFER_H
+#define LIBTOOL_SPILLBUFFER_H
+
+#include "LibTool.h"
+#include "DirectFile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace LibTool
+{
+    //! Spill-to-disk buffering.
+    /*! The device memory only absorbs a few hundred milliseconds of stream. When the processing thread stalls longer than that
+        (slow consumer, disk hiccup, ...), the fetch thread must keep draining the device or the stream overflows. #SpillQueue
+        holds fetched batches in memory up to a high-water mark; past it, batches are written to a preallocated scratch file
+        (#DirectIo::DirectFile, used as a ring) and read back in order once the consumer catches up. A stall then costs latency,
+        not data. Typical use:
+
+            DirectIo::DirectFile file("Streaming.spill", 8LL << 30);
+            Spill::SpillQueue queue(file, 16);
+            Spill::FetchLoop fetchLoop(queue, [&](Spill::Batch& batch) { return FetchRecords(batch); }, std::chrono::milliseconds(10));
+
+            fetchLoop.Start();
+            while (running)
+            {
+                Spill::Batch batch;
+                if (queue.Pop(batch, timeout))
+                    Process(batch);
+            }
+            fetchLoop.Stop();
+
+        Batches are delivered in push order: once a batch has been spilled, all following batches are spilled too until the
+        consumer has read the spill back. The producer only blocks when the scratch file is full.
+    */
+    namespace Spill
+    {
+        //! Maximum number of element arrays of a batch.
+        static size_t const MaxParts = 4;
+
+        //! Batch of fetched elements: up to #MaxParts arrays (e.g. markers and samples) and a tag free for the application.
+        struct Batch
+        {
+            uint64_t sequence = 0;                  //!< push order, set by #SpillQueue::Push.
+            int64_t tag = 0;
+            size_t nbrParts = 0;
+            std::vector<int32_t> parts[MaxParts];
+
+            //! Return the number of bytes of all parts.
+            size_t GetPayloadBytes() const
+            {
+                size_t bytes = 0;
+                for (size_t i = 0; i < nbrParts; ++i)
+                    bytes += parts[i].size() * sizeof(int32_t);
+                return bytes;
+            }
+        };
+
+        //! Counters collected by the queue.
+        struct Statistics
+        {
+            uint64_t nbrBatches = 0;                //!< number of pushed batches.
+            uint64_t nbrSpilledBatches = 0;         //!< number of batches written to the scratch file.
+            int64_t spilledBytes = 0;               //!< number of bytes written to the scratch file.
+            size_t peakMemoryBatches = 0;           //!< maximum number of batches held in memory.
+            int64_t peakSpillBytes = 0;             //!< maximum occupancy of the scratch file.
+            double spillWriteSeconds = 0.0;         //!< time spent writing to the scratch file.
+            double spillReadSeconds = 0.0;          //!< time spent reading from the scratch file.
+            double producerStallSeconds = 0.0;      //!< time the producer waited for room in a full scratch file.
+
+            //! Print the counters in human readable format.
+            void Print(std::ostream& output) const;
+        };
+
+        //! FIFO of batches between one producer and one consumer, spilling to a scratch file past a high-water mark.
+        class SpillQueue
+        {
+        public:
+            //! Build a queue holding up to highWaterBatches batches in memory, and spilling the others to file.
+            explicit SpillQueue(DirectIo::DirectFile& file, size_t highWaterBatches);
+
+            SpillQueue(SpillQueue const&) = delete;
+            SpillQueue& operator=(SpillQueue const&) = delete;
+
+            //! Append batch to the queue (producer side).
+            /*! Blocks only while the scratch file has no room for the batch. Batches pushed after #Close are discarded.
+                \throw #std::length_error if the batch is larger than the scratch file, #std::runtime_error on I/O error.*/
+            void Push(Batch&& batch);
+
+            //! Wait up to timeout for the oldest batch (consumer side).
+            /*! \return false on timeout, or when the queue is closed and empty.
+                \throw the error reported by the producer with #Fail, once all batches pushed before it have been delivered.*/
+            bool Pop(Batch& batch, std::chrono::milliseconds timeout);
+
+            //! Tell the consumer that no more batch will be pushed.
+            void Close();
+
+            //! Report a producer error, rethrown by #Pop.
+            void Fail(std::exception_ptr error);
+
+            //! Return the number of batches waiting in memory.
+            size_t GetMemoryBatches() const;
+
+            //! Return the number of batches waiting in the scratch file.
+            size_t GetSpilledBatches() const;
+
+            //! Return a copy of the collected counters.
+            Statistics GetStatistics() const;
+
+        private:
+            //! Batch written in the scratch file.
+            struct SpillEntry
+            {
+                uint64_t sequence;
+                int64_t offset;
+                size_t size;        //!< size in file, multiple of the file alignment.
+                size_t skipped;     //!< bytes left unused at the end of the file before the entry (ring wrap-around).
+            };
+
+            //! Header of a batch in the scratch file.
+            struct SpillHeader
+            {
+                uint64_t sequence;
+                int64_t tag;
+                uint64_t nbrParts;
+                uint64_t partElements[MaxParts];
+            };
+
+            static size_t const HeaderSize = 64;
+            static_assert(sizeof(SpillHeader) <= HeaderSize, "Spill header too large");
+
+            //! Write batch in the scratch file (producer thread, without lock), and return its entry.
+            SpillEntry WriteEntry(Batch const& batch, int64_t offset, size_t size, size_t skipped);
+
+            //! Read the batch of entry from the scratch file (consumer thread, without lock).
+            void ReadEntry(SpillEntry const& entry, Batch& batch);
+
+            DirectIo::DirectFile& m_file;
+            size_t const m_highWaterBatches;
+
+            mutable std::mutex m_mutex;
+            std::condition_variable m_condition;
+            std::deque<Batch> m_memory;
+            std::deque<SpillEntry> m_spilled;
+            int64_t m_writeOffset;          //!< next write offset in the scratch file.
+            int64_t m_usedBytes;            //!< bytes of the scratch file in use, including skipped ends.
+            uint64_t m_nextSequence;
+            bool m_closed;
+            std::exception_ptr m_error;
+            Statistics m_statistics;
+
+            DirectIo::AlignedBuffer m_writeBuffer;  //!< staging buffer of the producer.
+            DirectIo::AlignedBuffer m_readBuffer;   //!< staging buffer of the consumer.
+        };
+
+        //! Fetch thread pushing batches into a #SpillQueue as fast as the device delivers them.
+        class FetchLoop
+        {
+        public:
+            //! Fill the batch with the next fetched elements. Return false if nothing is available yet.
+            using FetchFunction = std::function<bool(Batch&)>;
+
+            //! Build a loop calling fetch, and waiting idleWait after a fetch returning false.
+            explicit FetchLoop(SpillQueue& queue, FetchFunction fetch, std::chrono::milliseconds idleWait);
+
+            ~FetchLoop()
+            { Stop(); }
+
+            FetchLoop(FetchLoop const&) = delete;
+            FetchLoop& operator=(FetchLoop const&) = delete;
+
+            //! Start the fetch thread.
+            void Start();
+
+            //! Stop the fetch thread and close the queue.
+            void Stop();
+
+        private:
+            //! Body of the fetch thread.
+            void Run();
+
+            SpillQueue& m_queue;
+            FetchFunction m_fetch;
+            std::chrono::milliseconds const m_idleWait;
+            std::atomic<bool> m_stopRequested;
+            std::thread m_thread;
+        };
+    }
+
+    ///////
+    // Spill member definitions
+    //
+
+    inline void Spill::Statistics::Print(std::ostream& output) const
+    {
+        output << "Spill buffer statistics:\n";
+        output << "  Batches:            " << nbrBatches << '\n';
+        output << "  Spilled batches:    " << nbrSpilledBatches << " (" << spilledBytes / (1024 * 1024) << " MBytes)\n";
+        output << "  Peak memory queue:  " << peakMemoryBatches << " batches\n";
+        output << "  Peak spill:         " << peakSpillBytes / (1024 * 1024) << " MBytes\n";
+        output << "  Spill write time:   " << spillWriteSeconds << " s\n";
+        output << "  Spill read time:    " << spillReadSeconds << " s\n";
+        output << "  Producer stalls:    " << producerStallSeconds << " s\n";
+    }
+
+    inline Spill::SpillQueue::SpillQueue(DirectIo::DirectFile& file, size_t highWaterBatches)
+        : m_file(file)
+        , m_highWaterBatches(highWaterBatches)
+        , m_mutex()
+        , m_condition()
+        , m_memory()
+        , m_spilled()
+        , m_writeOffset(0)
+        , m_usedBytes(0)
+        , m_nextSequence(0)
+        , m_closed(false)
+        , m_error()
+        , m_statistics()
+        , m_writeBuffer()
+        , m_readBuffer()
+    {
+        if (highWaterBatches == 0)
+            throw std::invalid_argument("Spill queue high-water mark must be strict positive");
+    }
+
+    inline void Spill::SpillQueue::Push(Batch&& batch)
+    {
+        if (batch.nbrParts > MaxParts)
+            throw std::invalid_argument("Batch has " + ToString(batch.nbrParts) + " parts, maximum is " + ToString(MaxParts));
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_closed)
+            return;
+
+        batch.sequence = m_nextSequence++;
+        ++m_statistics.nbrBatches;
+
+        // Batches stay in memory below the high-water mark, unless older batches wait in the scratch file.
+        if (m_spilled.empty() && m_memory.size() < m_highWaterBatches)
+        {
+            m_memory.push_back(std::move(batch));
+            m_statistics.peakMemoryBatches = (std::max)(m_statistics.peakMemoryBatches, m_memory.size());
+            lock.unlock();
+            m_condition.notify_all();
+            return;
+        }
+
+        size_t const size = DirectIo::AlignUp(HeaderSize + batch.GetPayloadBytes());
+        int64_t const fileSize = m_file.GetSize();
+        if (int64_t(size) > fileSize)
+            throw std::length_error("Batch of " + ToString(size) + " bytes does not fit in spill file of " + ToString(fileSize) + " bytes");
+
+        // Reserve room in the ring: a batch never wraps around the end of the file, the end is skipped instead.
+        int64_t offset = 0;
+        size_t skipped = 0;
+        auto const stallStart = std::chrono::steady_clock::now();
+        bool stalled = false;
+        for (;;)
+        {
+            offset = m_writeOffset;
+            skipped = 0;
+            if (offset + int64_t(size) > fileSize)
+            {
+                skipped = size_t(fileSize - offset);
+                offset = 0;
+            }
+
+            if (m_usedBytes + int64_t(skipped + size) <= fileSize)
+                break;
+            if (m_closed)
+                return;
+
+            // The scratch file is full: the device memory absorbs the stream until the consumer frees some room.
+            stalled = true;
+            m_condition.wait(lock);
+        }
+        if (stalled)
+            m_statistics.producerStallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - stallStart).count();
+
+        m_writeOffset = offset + int64_t(size);
+        m_usedBytes += int64_t(skipped + size);
+        m_statistics.peakSpillBytes = (std::max)(m_statistics.peakSpillBytes, m_usedBytes);
+        lock.unlock();
+
+        // The producer is the only writer: the entry is published once written, so the order of batches is preserved.
+        auto const writeStart = std::chrono::steady_clock::now();
+        SpillEntry const entry = WriteEntry(batch, offset, size, skipped);
+        double const writeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - writeStart).count();
+
+        lock.lock();
+        m_spilled.push_back(entry);
+        ++m_statistics.nbrSpilledBatches;
+        m_statistics.spilledBytes += int64_t(size);
+        m_statistics.spillWriteSeconds += writeSeconds;
+        lock.unlock();
+        m_condition.notify_all();
+    }
+
+    inline bool Spill::SpillQueue::Pop(Batch& batch, std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait_for(lock, timeout, [this]() { return !m_memory.empty() || !m_spilled.empty() || m_closed || m_error; });
+
+        // Batches in memory are older than the spilled ones: spilling only starts when memory is full.
+        if (!m_memory.empty())
+        {
+            batch = std::move(m_memory.front());
+            m_memory.pop_front();
+            lock.unlock();
+            m_condition.notify_all();
+            return true;
+        }
+
+        if (m_spilled.empty())
+        {
+            if (m_error)
+                std::rethrow_exception(m_error);
+            return false;
+        }
+
+        SpillEntry const entry = m_spilled.front();
+        lock.unlock();
+
+        auto const readStart = std::chrono::steady_clock::now();
+        ReadEntry(entry, batch);
+        double const readSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - readStart).count();
+
+        lock.lock();
+        m_spilled.pop_front();
+        m_usedBytes -= int64_t(entry.skipped + entry.size);
+        m_statistics.spillReadSeconds += readSeconds;
+        lock.unlock();
+        m_condition.notify_all();
+        return true;
+    }
+
+    inline void Spill::SpillQueue::Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+        }
+        m_condition.notify_all();
+    }
+
+    inline void Spill::SpillQueue::Fail(std::exception_ptr error)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_error = error;
+        }
+        m_condition.notify_all();
+    }
+
+    inline size_t Spill::SpillQueue::GetMemoryBatches() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_memory.size();
+    }
+
+    inline size_t Spill::SpillQueue::GetSpilledBatches() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_spilled.size();
+    }
+
+    inline Spill::Statistics Spill::SpillQueue::GetStatistics() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_statistics;
+    }
+
+    inline Spill::SpillQueue::SpillEntry Spill::SpillQueue::WriteEntry(Batch const& batch, int64_t offset, size_t size, size_t skipped)
+    {
+        m_writeBuffer.Resize(size);
+        char* const data = m_writeBuffer.Data();
+
+        SpillHeader header = {};
+        header.sequence = batch.sequence;
+        header.tag = batch.tag;
+        header.nbrParts = batch.nbrParts;
+        for (size_t i = 0; i < batch.nbrParts; ++i)
+            header.partElements[i] = batch.parts[i].size();
+        std::memset(data, 0, HeaderSize);
+        std::memcpy(data, &header, sizeof(header));
+
+        size_t position = HeaderSize;
+        for (size_t i = 0; i < batch.nbrParts; ++i)
+        {
+            size_t const bytes = batch.parts[i].size() * sizeof(int32_t);
+            if (bytes > 0)
+                std::memcpy(data + position, batch.parts[i].data(), bytes);
+            position += bytes;
+        }
+
+        m_file.Write(offset, data, size);
+
+        SpillEntry entry;
+        entry.sequence = batch.sequence;
+        entry.offset = offset;
+        entry.size = size;
+        entry.skipped = skipped;
+        return entry;
+    }
+
+    inline void Spill::SpillQueue::ReadEntry(SpillEntry const& entry, Batch& batch)
+    {
+        m_readBuffer.Resize(entry.size);
+        char const* const data = m_readBuffer.Data();
+        m_file.Read(entry.offset, m_readBuffer.Data(), entry.size);
+
+        SpillHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        if (header.sequence != entry.sequence || header.nbrParts > MaxParts)
+            throw std::runtime_error("Corrupted spill entry at offset " + ToString(entry.offset) + " of " + m_file.GetPath() + ": expected batch " + ToString(entry.sequence) + ", got " + ToString(header.sequence));
+
+        batch.sequence = header.sequence;
+        batch.tag = header.tag;
+        batch.nbrParts = size_t(header.nbrParts);
+
+        size_t position = HeaderSize;
+        for (size_t i = 0; i < batch.nbrParts; ++i)
+        {
+            size_t const nbrElements = size_t(header.partElements[i]);
+            batch.parts[i].resize(nbrElements);
+            if (nbrElements > 0)
+                std::memcpy(batch.parts[i].data(), data + position, nbrElements * sizeof(int32_t));
+            position += nbrElements * sizeof(int32_t);
+        }
+        for (size_t i = batch.nbrParts; i < MaxParts; ++i)
+            batch.parts[i].clear();
+    }
+
+    inline Spill::FetchLoop::FetchLoop(SpillQueue& queue, FetchFunction fetch, std::chrono::milliseconds idleWait)
+        : m_queue(queue)
+        , m_fetch(fetch)
+        , m_idleWait(idleWait)
+        , m_stopRequested(false)
+        , m_thread()
+    {
+        if (!m_fetch)
+            throw std::invalid_argument("Fetch loop requires a valid fetch function");
+    }
+
+    inline void Spill::FetchLoop::Start()
+    {
+        if (m_thread.joinable())
+            throw std::logic_error("Fetch loop already started");
+
+        m_stopRequested = false;
+        m_thread = std::thread(&FetchLoop::Run, this);
+    }
+
+    inline void Spill::FetchLoop::Stop()
+    {
+        // Closing the queue releases the fetch thread if it waits for room in the scratch file.
+        m_stopRequested = true;
+        m_queue.Close();
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+
+    inline void Spill::FetchLoop::Run()
+    {
+        try
+        {
+            while (!m_stopRequested)
+            {
+                Batch batch;
+                if (m_fetch(batch))
+                    m_queue.Push(std::move(batch));
+                else
+                    std::this_thread::sleep_for(m_idleWait);
+            }
+        }
+        catch (...)
+        {
+            m_queue.Fail(std::current_exception());
+        }
+        m_queue.Close();
+    }
+}
+
+#endif
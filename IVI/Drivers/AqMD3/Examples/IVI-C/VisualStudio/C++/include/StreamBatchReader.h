@@ -0,0 +1,378 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// StreamBatchReader: fetch batches of elements from a named stream (markers, samples, peaks) into
+// buffers it owns, with the retries and bookkeeping shared by all the streaming examples.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_STREAMBATCHREADER_H
+#define LIBTOOL_STREAMBATCHREADER_H
+
+#include "LibTool.h"
+#include <AqMD3.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace LibTool
+{
+    //! Stream reading utils.
+    /*! #StreamReading::StreamBatchReader wraps #AqMD3_StreamFetchDataInt32 for one stream. It sizes and owns the fetch buffers
+        (requested elements, plus the alignment overhead of the stream granularity and any unfolding overhead), and returns every
+        fetch as an #ArraySegment delimiting the valid elements in them:
+
+            StreamReading::Parameters params;
+            params.grainElements = StreamReading::GetGrainElements(session, "MarkersCh1");
+            StreamReading::StreamBatchReader<> markerReader(AqMD3_StreamFetchDataInt32, session, "MarkersCh1", maxMarkerElements, params);
+
+            ArraySegment<int32_t> markers = markerReader.FetchAvailable();   // whatever is available, up to maxMarkerElements
+            ArraySegment<int32_t> samples = sampleReader.FetchExact(nbrRecords * nbrRecordElements);
+
+        #FetchAvailable reads what the module holds, up to a maximum: when less than requested is available, the driver reads
+        nothing and reports the available volume, so the reader fetches again for exactly that volume. #FetchExact reads an exact
+        volume which is known to be acquired (e.g. the samples of records whose markers were read), but which might not be ready
+        for fetch yet: it retries after a wait which doubles up to #Parameters::maxRetryWait. The wait which succeeded is the
+        starting point of the next retry sequence, so the reader adapts its polling to the latency of the stream. #TryFetchExact
+        makes a single attempt. #FetchExactInto does the same into memory provided by the caller, e.g. the pages of a capture file
+        (see CaptureFile.h), which saves copying the samples out of the reader buffers.
+
+        With several buffers (#Parameters::nbrBuffers), successive fetches go to successive buffers: a segment stays valid until
+        nbrBuffers further fetches, so that a batch can be processed while the next ones are read.
+
+        Driver status codes are passed to the status check of the reader (typically the testApiCall function of the examples),
+        which throws on error. Without it, errors are raised as #std::runtime_error.
+    */
+    namespace StreamReading
+    {
+        using FetchFunction = std::function<ViStatus(ViSession, ViConstString, ViInt64, ViInt64, ViInt32*, ViInt64*, ViInt64*, ViInt64*)>;
+
+        //! Check the status returned by functionName, throw on error.
+        using StatusCheck = std::function<void(ViStatus, char const*)>;
+
+        //! Return the granularity of stream streamName, in 32-bit elements.
+        /*! \throw #std::runtime_error if the attribute cannot be read.*/
+        int64_t GetGrainElements(ViSession session, std::string const& streamName);
+
+        //! Configuration of a reader.
+        struct Parameters
+        {
+            int64_t grainElements = 1;                              //!< granularity of the stream, in elements (alignment overhead).
+            int64_t overheadElements = 0;                           //!< extra buffer elements, e.g. the unfolding overhead of sample streams.
+            size_t nbrBuffers = 1;                                  //!< number of buffers fetches rotate over.
+            int maxAttempts = 3;                                    //!< attempts of #StreamBatchReader::FetchExact before giving up.
+            std::chrono::microseconds initialRetryWait{1000};       //!< first wait before retrying a not-ready exact fetch.
+            std::chrono::microseconds maxRetryWait{100000};         //!< maximum wait between attempts.
+            bool verbose = false;                                   //!< print every non-empty fetch on std::cout.
+        };
+
+        //! Fetch statistics of a stream.
+        struct Statistics
+        {
+            uint64_t nbrFetches = 0;            //!< calls to the fetch function.
+            uint64_t nbrBatches = 0;            //!< non-empty segments returned.
+            uint64_t nbrEmptyPolls = 0;         //!< available-count fetches which found nothing.
+            uint64_t nbrRetries = 0;            //!< exact-count fetches retried because data were not ready.
+            int64_t nbrElements = 0;            //!< elements returned.
+            int64_t peakRemainingElements = 0;  //!< maximum number of elements left on the module after a fetch.
+            double fetchSeconds = 0.0;          //!< time spent in the fetch function.
+            double retryWaitSeconds = 0.0;      //!< time spent waiting before retries.
+
+            void Print(std::ostream& output, std::string const& streamName) const;
+        };
+
+        //! Fetch batches of elements of one stream into buffers of type Buffer (contiguous int32_t container).
+        template <typename Buffer = std::vector<int32_t>>
+        class StreamBatchReader
+        {
+        public:
+            //! Prepare a reader of streamName fetching up to maxElements at once.
+            /*! \param[in] check: status check applied to every fetch. By default, errors throw #std::runtime_error.
+                \param[in] allocator: allocator of the buffers.*/
+            explicit StreamBatchReader(FetchFunction fetch, ViSession session, std::string const& streamName, int64_t maxElements,
+                                       Parameters const& params = Parameters(), StatusCheck check = StatusCheck(),
+                                       typename Buffer::allocator_type const& allocator = typename Buffer::allocator_type());
+
+            StreamBatchReader(StreamBatchReader const&) = delete;
+            StreamBatchReader& operator=(StreamBatchReader const&) = delete;
+
+            //! Fetch the elements available on the module, up to #GetMaxElements.
+            /*! \return the fetched elements. The segment is empty if no data is available.*/
+            ArraySegment<int32_t> FetchAvailable()
+            { return FetchAvailable(m_maxElements); }
+
+            //! Fetch the elements available on the module, up to maxElements.
+            /*! \throw #std::invalid_argument if maxElements exceeds #GetMaxElements.*/
+            ArraySegment<int32_t> FetchAvailable(int64_t maxElements);
+
+            //! Fetch exactly nbrElements, retrying while they are not ready for fetch.
+            /*! Fetching 0 elements returns an empty segment without calling the driver (e.g. all the samples are suppressed).
+                \throw #std::runtime_error if the fetch returns another volume (e.g. after a stream overflow), or if the elements are still
+                       not available after #Parameters::maxAttempts.*/
+            ArraySegment<int32_t> FetchExact(int64_t nbrElements);
+
+            //! Fetch exactly nbrElements into destination, of capacity elements, with the retries of #FetchExact.
+            /*! The destination must hold the overhead of the reader beyond the requested elements (see #GetBufferOverhead).
+                \return the fetched elements, within destination.
+                \throw #std::invalid_argument if the capacity is too small, #std::runtime_error as #FetchExact.*/
+            ArraySegment<int32_t> FetchExactInto(int64_t nbrElements, int32_t* destination, int64_t capacity);
+
+            //! Make a single attempt to fetch exactly nbrElements.
+            /*! \return the fetched elements, or an empty segment if less than nbrElements are available.*/
+            ArraySegment<int32_t> TryFetchExact(int64_t nbrElements);
+
+            //! Return the number of elements left on the module after the last fetch.
+            int64_t GetRemainingElements() const
+            { return m_remainingElements; }
+
+            //! Return the maximum number of elements of a fetch.
+            int64_t GetMaxElements() const
+            { return m_maxElements; }
+
+            //! Return the number of elements a fetch buffer holds beyond the requested elements (unfolding and alignment overheads).
+            int64_t GetBufferOverhead() const
+            { return m_params.overheadElements + m_params.grainElements - 1; }
+
+            std::string const& GetStreamName() const
+            { return m_streamName; }
+
+            Statistics const& GetStatistics() const
+            { return m_statistics; }
+
+        private:
+            typedef std::chrono::steady_clock Clock;
+
+            //! Call the fetch function for nbrElements into the next buffer.
+            ArraySegment<int32_t> Fetch(int64_t nbrElements);
+
+            //! Call the fetch function for nbrElements into destination, update remaining elements and statistics.
+            ArraySegment<int32_t> FetchInto(int64_t nbrElements, int32_t* destination, int64_t capacity);
+
+            //! Call fetchOnce(nbrElements) until it returns exactly nbrElements, see #FetchExact.
+            template <typename FetchOnce>
+            ArraySegment<int32_t> RetryExact(int64_t nbrElements, FetchOnce fetchOnce);
+
+            //! Check that nbrElements fit in the buffers.
+            void CheckRequest(int64_t nbrElements) const;
+
+            FetchFunction m_fetch;
+            ViSession const m_session;
+            std::string const m_streamName;
+            int64_t const m_maxElements;
+            Parameters const m_params;
+            StatusCheck m_check;
+            std::vector<Buffer> m_buffers;
+            size_t m_nextBuffer;
+            int64_t m_remainingElements;
+            std::chrono::microseconds m_retryWait;  //!< first wait of the next retry sequence.
+            Statistics m_statistics;
+        };
+    }
+
+    ///////
+    // StreamReading member definitions
+    //
+
+    inline int64_t StreamReading::GetGrainElements(ViSession session, std::string const& streamName)
+    {
+        ViInt64 grainBytes = 0;
+        ViStatus const status = AqMD3_GetAttributeViInt64(session, streamName.c_str(), AQMD3_ATTR_STREAM_GRANULARITY_IN_BYTES, &grainBytes);
+        if (status < 0)
+            throw std::runtime_error("Failed to read the granularity of " + streamName + ": status " + ToString(status));
+
+        return (std::max)(int64_t(grainBytes / sizeof(int32_t)), int64_t(1));
+    }
+
+    inline void StreamReading::Statistics::Print(std::ostream& output, std::string const& streamName) const
+    {
+        output << "\nStream " << streamName << '\n';
+        output << "  Fetches:            " << nbrFetches << " (" << nbrBatches << " batches, " << nbrEmptyPolls << " empty polls, " << nbrRetries << " retries)\n";
+        output << "  Elements:           " << nbrElements << '\n';
+        output << "  Peak remaining:     " << peakRemainingElements << " elements\n";
+        output << "  Fetch time:         " << fetchSeconds << " s\n";
+        output << "  Retry waits:        " << retryWaitSeconds << " s\n";
+    }
+
+    template <typename Buffer>
+    inline StreamReading::StreamBatchReader<Buffer>::StreamBatchReader(FetchFunction fetch, ViSession session, std::string const& streamName, int64_t maxElements,
+                                                                      Parameters const& params, StatusCheck check, typename Buffer::allocator_type const& allocator)
+        : m_fetch(fetch)
+        , m_session(session)
+        , m_streamName(streamName)
+        , m_maxElements(maxElements)
+        , m_params(params)
+        , m_check(check)
+        , m_buffers()
+        , m_nextBuffer(0)
+        , m_remainingElements(0)
+        , m_retryWait(params.initialRetryWait)
+        , m_statistics()
+    {
+        if (maxElements <= 0 || params.grainElements <= 0 || params.overheadElements < 0 || params.nbrBuffers == 0 || params.maxAttempts <= 0)
+            throw std::invalid_argument("Invalid reader configuration for " + streamName + ": " + ToString(maxElements) + " elements, grain " + ToString(params.grainElements)
+                                        + ", overhead " + ToString(params.overheadElements) + ", " + ToString(params.nbrBuffers) + " buffers, " + ToString(params.maxAttempts) + " attempts");
+
+        if (!m_check)
+        {
+            m_check = [this](ViStatus status, char const* functionName)
+            {
+                if (status < 0)
+                    throw std::runtime_error(std::string(functionName) + " failed on " + m_streamName + ": status " + ToString(status));
+            };
+        }
+
+        size_t const bufferSize = size_t(maxElements          // required elements
+                                       + params.overheadElements  // unfolding overhead (sample streams in single channel mode)
+                                       + params.grainElements - 1);// alignment overhead
+        m_buffers.reserve(params.nbrBuffers);
+        for (size_t i = 0; i < params.nbrBuffers; ++i)
+            m_buffers.emplace_back(bufferSize, allocator);
+    }
+
+    template <typename Buffer>
+    inline ArraySegment<int32_t> StreamReading::StreamBatchReader<Buffer>::FetchAvailable(int64_t maxElements)
+    {
+        CheckRequest(maxElements);
+
+        // Try to fetch the requested volume of elements.
+        ArraySegment<int32_t> segment = Fetch(maxElements);
+
+        if (segment.Size() == 0 && m_remainingElements > 0)
+        {
+            /* Fetch failed to read data because the number of available elements is smaller than the requested volume. */
+            if (maxElements <= m_remainingElements)
+                throw std::logic_error("First fetch failed to read " + ToString(maxElements) + " elements from " + m_streamName + " when it reports " + ToString(m_remainingElements) + " available elements.");
+
+            // Read available elements
+            segment = Fetch(m_remainingElements);
+        }
+
+        if (segment.Size() == 0)
+            ++m_statistics.nbrEmptyPolls;
+        return segment;
+    }
+
+    template <typename Buffer>
+    inline ArraySegment<int32_t> StreamReading::StreamBatchReader<Buffer>::FetchExact(int64_t nbrElements)
+    {
+        // Handle the special case there is no need to fetch elements (this might happen when all samples are suppressed).
+        if (nbrElements == 0)
+            return ArraySegment<int32_t>(m_buffers.front(), 0, 0);
+
+        CheckRequest(nbrElements);
+        return RetryExact(nbrElements, [this](int64_t n) { return Fetch(n); });
+    }
+
+    template <typename Buffer>
+    inline ArraySegment<int32_t> StreamReading::StreamBatchReader<Buffer>::FetchExactInto(int64_t nbrElements, int32_t* destination, int64_t capacity)
+    {
+        if (nbrElements < 0 || capacity < nbrElements + GetBufferOverhead())
+            throw std::invalid_argument("Cannot fetch " + ToString(nbrElements) + " elements from " + m_streamName + " into " + ToString(capacity)
+                                        + " elements: the overhead of the stream is " + ToString(GetBufferOverhead()) + " elements");
+
+        if (nbrElements == 0)
+            return ArraySegment<int32_t>(destination, size_t(capacity), 0, 0);
+
+        return RetryExact(nbrElements, [this, destination, capacity](int64_t n) { return FetchInto(n, destination, capacity); });
+    }
+
+    template <typename Buffer>
+    template <typename FetchOnce>
+    inline ArraySegment<int32_t> StreamReading::StreamBatchReader<Buffer>::RetryExact(int64_t nbrElements, FetchOnce fetchOnce)
+    {
+        std::chrono::microseconds wait = m_retryWait;
+        for (int attempt = 0; attempt < m_params.maxAttempts; ++attempt)
+        {
+            ArraySegment<int32_t> const segment = fetchOnce(nbrElements);
+            if (int64_t(segment.Size()) == nbrElements)
+            {
+                // Start the next retry sequence where this one succeeded (or halfway back to the initial wait).
+                m_retryWait = (attempt > 0) ? wait / 2 : (std::max)(m_params.initialRetryWait, m_retryWait / 2);
+                return segment;
+            }
+
+            if (segment.Size() != 0 || m_remainingElements >= nbrElements)
+            {
+                /* The following error might occurs in case of stream overflow error where sample storage in memory is interrupted
+                   at overflow event. The very last record is incomplete in this case.*/
+                throw std::runtime_error("Number of fetched elements is different than requested on " + m_streamName + ". Requested=" + ToString(nbrElements) + " , fetched=" + ToString(segment.Size()) + ".");
+            }
+
+            /* Sometimes, the fetch fails because data might not be ready for fetch immediately.
+               Make another attempt after a wait. */
+            if (attempt + 1 < m_params.maxAttempts)
+            {
+                ++m_statistics.nbrRetries;
+                Clock::time_point const start = Clock::now();
+                std::this_thread::sleep_for(wait);
+                m_statistics.retryWaitSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+                wait = (std::min)(wait * 2, m_params.maxRetryWait);
+            }
+        }
+
+        throw std::runtime_error("Failed to fetch requested data from " + m_streamName + " after " + ToString(m_params.maxAttempts) + " attempts");
+    }
+
+    template <typename Buffer>
+    inline ArraySegment<int32_t> StreamReading::StreamBatchReader<Buffer>::TryFetchExact(int64_t nbrElements)
+    {
+        if (nbrElements == 0)
+            return ArraySegment<int32_t>(m_buffers.front(), 0, 0);
+
+        CheckRequest(nbrElements);
+        return Fetch(nbrElements);
+    }
+
+    template <typename Buffer>
+    inline ArraySegment<int32_t> StreamReading::StreamBatchReader<Buffer>::Fetch(int64_t nbrElements)
+    {
+        Buffer& buffer = m_buffers[m_nextBuffer];
+        m_nextBuffer = (m_nextBuffer + 1) % m_buffers.size();
+        return FetchInto(nbrElements, buffer.data(), int64_t(buffer.size()));
+    }
+
+    template <typename Buffer>
+    inline ArraySegment<int32_t> StreamReading::StreamBatchReader<Buffer>::FetchInto(int64_t nbrElements, int32_t* destination, int64_t capacity)
+    {
+        ViInt64 firstElement = 0;
+        ViInt64 actualElements = 0;
+        ViInt64 remainingElements = 0;
+
+        Clock::time_point const start = Clock::now();
+        ViStatus const status = m_fetch(m_session, m_streamName.c_str(), nbrElements, ViInt64(capacity), (ViInt32*)destination, &remainingElements, &actualElements, &firstElement);
+        m_statistics.fetchSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+        ++m_statistics.nbrFetches;
+
+        m_check(status, "AqMD3_StreamFetchDataInt32");
+
+        m_remainingElements = remainingElements;
+        m_statistics.peakRemainingElements = (std::max)(m_statistics.peakRemainingElements, int64_t(remainingElements));
+
+        if (actualElements > 0)
+        {
+            ++m_statistics.nbrBatches;
+            m_statistics.nbrElements += actualElements;
+            if (m_params.verbose)
+                std::cout << "Fetched " << actualElements << " elements from " << m_streamName << " stream. Remaining elements: " << remainingElements << "\n";
+        }
+
+        // the segment might be empty if fetch failed to read actual data.
+        return ArraySegment<int32_t>(destination, size_t(capacity), size_t(firstElement), size_t(actualElements));
+    }
+
+    template <typename Buffer>
+    inline void StreamReading::StreamBatchReader<Buffer>::CheckRequest(int64_t nbrElements) const
+    {
+        if (nbrElements < 0 || m_maxElements < nbrElements)
+            throw std::invalid_argument("Cannot fetch " + ToString(nbrElements) + " elements from " + m_streamName + ": the reader is sized for " + ToString(m_maxElements) + " elements");
+    }
+}
+
+#endif
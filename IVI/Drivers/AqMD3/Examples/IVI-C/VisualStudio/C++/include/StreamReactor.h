@@ -0,0 +1,439 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// StreamReactor: awaitable stream batches for C++20 coroutines, served by a single-thread reactor
+// polling all the registered streams.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_STREAMREACTOR_H
+#define LIBTOOL_STREAMREACTOR_H
+
+#include "LibTool.h"
+#include "StreamBatchReader.h"
+#include <AqMD3.h>
+
+#if !defined(__cpp_impl_coroutine)
+#error StreamReactor.h requires C++20 coroutines (/std:c++20)
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace LibTool
+{
+    //! Coroutine streaming utils.
+    /*! The blocking fetch loops of the examples need a thread per stream as soon as streams must be served concurrently (several
+        channels, cards, or marker and peak streams). Here, processing stages are coroutines which await batches of their streams,
+        and one thread runs a #Coroutines::StreamReactor which polls the streams awaited and resumes the coroutines whose data are
+        ready:
+
+            Coroutines::Task ProcessChannel(Coroutines::AsyncStream& markers, Coroutines::AsyncStream& samples)
+            {
+                for (;;)
+                {
+                    ArraySegment<int32_t> markerSegment = co_await markers.NextBatch(16, 16);       // whole markers
+                    int64_t const nbrRecords = markerSegment.Size() / 16;
+                    ArraySegment<int32_t> sampleSegment = co_await samples.NextExact(nbrRecords * nbrRecordElements);
+                    // ... process the records ...
+                }
+            }
+
+            Coroutines::StreamReactor reactor;
+            Coroutines::AsyncStream& markersCh1 = reactor.AddStream(AqMD3_StreamFetchDataInt32, session, "MarkersCh1", maxMarkerElements);
+            ...
+            reactor.Spawn(ProcessChannel(markersCh1, samplesCh1));
+            reactor.Spawn(ProcessChannel(markersCh2, samplesCh2));
+            reactor.RunUntil(endTime);
+
+        A stream is polled by fetching the volume it has reported available (at least the volume awaited): when less is available,
+        the fetch reads nothing and reports the new available volume, so polling costs one driver call per awaited stream and
+        round. When a round resumes nothing, the reactor sleeps for a wait which doubles from #Parameters::minIdleWait up to
+        #Parameters::maxIdleWait, and goes back to the minimum as soon as data flow again.
+
+        Streams are #StreamReading::StreamBatchReader underneath: a batch stays valid until the next batch of the same stream is
+        awaited. One coroutine at a time may await a given stream, and coroutines must await streams directly (a #Task does not
+        await another task). Everything runs on the thread calling #StreamReactor::RunUntil.
+    */
+    namespace Coroutines
+    {
+        class StreamReactor;
+
+        //! Coroutine run by a #StreamReactor.
+        /*! It starts once spawned on the reactor. An exception escaping the coroutine is raised by #StreamReactor::RunUntil.*/
+        class Task
+        {
+        public:
+            struct promise_type
+            {
+                std::exception_ptr exception;
+
+                Task get_return_object()
+                { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+                std::suspend_always initial_suspend() noexcept
+                { return {}; }
+
+                std::suspend_always final_suspend() noexcept
+                { return {}; }
+
+                void return_void()
+                {}
+
+                void unhandled_exception()
+                { exception = std::current_exception(); }
+            };
+
+            Task(Task&& other) noexcept
+                : m_handle(std::exchange(other.m_handle, nullptr))
+            {}
+
+            Task& operator=(Task&& other) noexcept
+            {
+                if (this != &other)
+                {
+                    if (m_handle)
+                        m_handle.destroy();
+                    m_handle = std::exchange(other.m_handle, nullptr);
+                }
+                return *this;
+            }
+
+            ~Task()
+            {
+                if (m_handle)
+                    m_handle.destroy();
+            }
+
+        private:
+            friend class StreamReactor;
+
+            explicit Task(std::coroutine_handle<promise_type> handle)
+                : m_handle(handle)
+            {}
+
+            std::coroutine_handle<promise_type> m_handle;
+        };
+
+        //! Stream registered on a #StreamReactor, awaited by coroutines.
+        class AsyncStream
+        {
+        public:
+            //! Awaiter of a batch, returned by #NextBatch and #NextExact.
+            class BatchAwaiter
+            {
+            public:
+                bool await_ready() const noexcept
+                { return false; }
+
+                void await_suspend(std::coroutine_handle<> handle)
+                { m_stream.Await(m_minElements, m_maxElements, m_elementMultiple, handle); }
+
+                ArraySegment<int32_t> await_resume()
+                { return m_stream.TakeResult(); }
+
+            private:
+                friend class AsyncStream;
+
+                BatchAwaiter(AsyncStream& stream, int64_t minElements, int64_t maxElements, int64_t elementMultiple)
+                    : m_stream(stream)
+                    , m_minElements(minElements)
+                    , m_maxElements(maxElements)
+                    , m_elementMultiple(elementMultiple)
+                {}
+
+                AsyncStream& m_stream;
+                int64_t const m_minElements;
+                int64_t const m_maxElements;
+                int64_t const m_elementMultiple;
+            };
+
+            AsyncStream(AsyncStream const&) = delete;
+            AsyncStream& operator=(AsyncStream const&) = delete;
+
+            //! Await at least minElements, and as many as available up to the reader size, in multiples of elementMultiple.
+            /*! \throw #std::invalid_argument if minElements is not a positive multiple of elementMultiple, or exceeds the reader size.*/
+            BatchAwaiter NextBatch(int64_t minElements, int64_t elementMultiple = 1);
+
+            //! Await exactly nbrElements.
+            /*! \throw #std::invalid_argument if nbrElements is not positive or exceeds the reader size.*/
+            BatchAwaiter NextExact(int64_t nbrElements);
+
+            StreamReading::StreamBatchReader<>& GetReader()
+            { return m_reader; }
+
+            std::string const& GetStreamName() const
+            { return m_reader.GetStreamName(); }
+
+        private:
+            friend class StreamReactor;
+
+            AsyncStream(StreamReading::FetchFunction fetch, ViSession session, std::string const& streamName, int64_t maxElements,
+                        StreamReading::Parameters const& params, StreamReading::StatusCheck check)
+                : m_reader(fetch, session, streamName, maxElements, params, check)
+                , m_minElements(0)
+                , m_maxElements(0)
+                , m_elementMultiple(1)
+                , m_waiter()
+                , m_result()
+                , m_error()
+            {}
+
+            //! Register handle as the coroutine waiting for the stream.
+            void Await(int64_t minElements, int64_t maxElements, int64_t elementMultiple, std::coroutine_handle<> handle);
+
+            //! Try to fetch the awaited batch. Return true if the waiting coroutine can be resumed (batch or error).
+            bool Poll();
+
+            //! Return the batch fetched for the resumed coroutine, or raise the error of the fetch.
+            ArraySegment<int32_t> TakeResult();
+
+            StreamReading::StreamBatchReader<> m_reader;
+            int64_t m_minElements;
+            int64_t m_maxElements;
+            int64_t m_elementMultiple;
+            std::coroutine_handle<> m_waiter;
+            std::optional<ArraySegment<int32_t>> m_result;
+            std::exception_ptr m_error;
+        };
+
+        //! Configuration of a reactor.
+        struct Parameters
+        {
+            std::chrono::microseconds minIdleWait{50};      //!< first wait after a round which resumed nothing.
+            std::chrono::microseconds maxIdleWait{2000};    //!< maximum wait between rounds.
+        };
+
+        //! Reactor statistics.
+        struct Statistics
+        {
+            uint64_t nbrRounds = 0;         //!< polling rounds.
+            uint64_t nbrPolls = 0;          //!< stream polls (fetch attempts).
+            uint64_t nbrResumes = 0;        //!< coroutine resumptions.
+            uint64_t nbrIdleWaits = 0;      //!< rounds followed by a wait.
+            double idleSeconds = 0.0;       //!< time spent waiting.
+
+            void Print(std::ostream& output) const;
+        };
+
+        //! Single-thread reactor serving the streams awaited by coroutines.
+        class StreamReactor
+        {
+        public:
+            typedef std::chrono::steady_clock Clock;
+
+            explicit StreamReactor(Parameters const& params = Parameters());
+
+            StreamReactor(StreamReactor const&) = delete;
+            StreamReactor& operator=(StreamReactor const&) = delete;
+
+            //! Register a stream, see #StreamReading::StreamBatchReader for the arguments.
+            /*! The stream lives as long as the reactor.*/
+            AsyncStream& AddStream(StreamReading::FetchFunction fetch, ViSession session, std::string const& streamName, int64_t maxElements,
+                                   StreamReading::Parameters const& params = StreamReading::Parameters(), StreamReading::StatusCheck check = StreamReading::StatusCheck());
+
+            //! Schedule task, which starts at the next round.
+            void Spawn(Task task);
+
+            //! Run the tasks until all of them complete, or until deadline.
+            /*! Tasks still suspended at deadline stay so: a later call resumes them.
+                \throw the exception escaping a task, after destroying it.*/
+            void RunUntil(Clock::time_point deadline);
+
+            //! Run the tasks until all of them complete.
+            void Run()
+            { RunUntil(Clock::time_point::max()); }
+
+            //! Return the number of tasks not completed.
+            size_t GetNbrTasks() const
+            { return m_tasks.size(); }
+
+            Statistics const& GetStatistics() const
+            { return m_statistics; }
+
+        private:
+            //! Destroy the completed tasks, raise the first exception among them.
+            void ReapTasks();
+
+            Parameters const m_params;
+            std::vector<std::unique_ptr<AsyncStream>> m_streams;
+            std::vector<Task> m_tasks;
+            std::vector<std::coroutine_handle<>> m_spawned;     //!< tasks to start at the next round.
+            Statistics m_statistics;
+        };
+    }
+
+    ///////
+    // Coroutines member definitions
+    //
+
+    inline Coroutines::AsyncStream::BatchAwaiter Coroutines::AsyncStream::NextBatch(int64_t minElements, int64_t elementMultiple)
+    {
+        int64_t const maxElements = elementMultiple > 0 ? m_reader.GetMaxElements() / elementMultiple * elementMultiple : 0;
+        if (elementMultiple <= 0 || minElements <= 0 || minElements % elementMultiple != 0 || maxElements < minElements)
+            throw std::invalid_argument("Cannot await " + ToString(minElements) + " elements in multiples of " + ToString(elementMultiple) + " from " + GetStreamName()
+                                        + ": the reader is sized for " + ToString(m_reader.GetMaxElements()) + " elements");
+
+        return BatchAwaiter(*this, minElements, maxElements, elementMultiple);
+    }
+
+    inline Coroutines::AsyncStream::BatchAwaiter Coroutines::AsyncStream::NextExact(int64_t nbrElements)
+    {
+        if (nbrElements <= 0 || m_reader.GetMaxElements() < nbrElements)
+            throw std::invalid_argument("Cannot await " + ToString(nbrElements) + " elements from " + GetStreamName() + ": the reader is sized for " + ToString(m_reader.GetMaxElements()) + " elements");
+
+        return BatchAwaiter(*this, nbrElements, nbrElements, 1);
+    }
+
+    inline void Coroutines::AsyncStream::Await(int64_t minElements, int64_t maxElements, int64_t elementMultiple, std::coroutine_handle<> handle)
+    {
+        if (m_waiter)
+            throw std::logic_error("Stream " + GetStreamName() + " is already awaited by another coroutine");
+
+        m_minElements = minElements;
+        m_maxElements = maxElements;
+        m_elementMultiple = elementMultiple;
+        m_waiter = handle;
+    }
+
+    inline bool Coroutines::AsyncStream::Poll()
+    {
+        try
+        {
+            // Request what the stream reported available, at least the minimum. If less is available, the fetch reads nothing and
+            // reports the available volume for the next poll.
+            int64_t const available = (std::max)(m_minElements, (std::min)(m_reader.GetRemainingElements(), m_maxElements));
+            ArraySegment<int32_t> const segment = m_reader.TryFetchExact(available / m_elementMultiple * m_elementMultiple);
+            if (segment.Size() == 0)
+                return false;
+
+            m_result.emplace(segment);
+        }
+        catch (...)
+        {
+            m_error = std::current_exception();
+        }
+        return true;
+    }
+
+    inline ArraySegment<int32_t> Coroutines::AsyncStream::TakeResult()
+    {
+        if (m_error)
+            std::rethrow_exception(std::exchange(m_error, nullptr));
+
+        ArraySegment<int32_t> const segment = *m_result;
+        m_result.reset();
+        return segment;
+    }
+
+    inline void Coroutines::Statistics::Print(std::ostream& output) const
+    {
+        output << "\nStream reactor\n";
+        output << "  Rounds:             " << nbrRounds << " (" << nbrPolls << " polls, " << nbrResumes << " resumes)\n";
+        output << "  Idle waits:         " << nbrIdleWaits << " (" << idleSeconds << " s)\n";
+    }
+
+    inline Coroutines::StreamReactor::StreamReactor(Parameters const& params)
+        : m_params(params)
+        , m_streams()
+        , m_tasks()
+        , m_spawned()
+        , m_statistics()
+    {
+        if (params.minIdleWait.count() <= 0 || params.maxIdleWait < params.minIdleWait)
+            throw std::invalid_argument("Invalid reactor idle waits: " + ToString(params.minIdleWait.count()) + " us to " + ToString(params.maxIdleWait.count()) + " us");
+    }
+
+    inline Coroutines::AsyncStream& Coroutines::StreamReactor::AddStream(StreamReading::FetchFunction fetch, ViSession session, std::string const& streamName, int64_t maxElements,
+                                                                         StreamReading::Parameters const& params, StreamReading::StatusCheck check)
+    {
+        m_streams.push_back(std::unique_ptr<AsyncStream>(new AsyncStream(fetch, session, streamName, maxElements, params, check)));
+        return *m_streams.back();
+    }
+
+    inline void Coroutines::StreamReactor::Spawn(Task task)
+    {
+        m_spawned.push_back(task.m_handle);
+        m_tasks.push_back(std::move(task));
+    }
+
+    inline void Coroutines::StreamReactor::RunUntil(Clock::time_point deadline)
+    {
+        std::chrono::microseconds idleWait = m_params.minIdleWait;
+        while (!m_tasks.empty() && Clock::now() < deadline)
+        {
+            ++m_statistics.nbrRounds;
+            bool progress = false;
+
+            // Start the tasks spawned since the last round (possibly by the tasks themselves).
+            std::vector<std::coroutine_handle<>> spawned;
+            spawned.swap(m_spawned);
+            for (std::coroutine_handle<> const handle : spawned)
+            {
+                handle.resume();
+                ++m_statistics.nbrResumes;
+                progress = true;
+            }
+
+            // Poll the awaited streams, and resume the coroutines whose batch is ready.
+            for (std::unique_ptr<AsyncStream> const& stream : m_streams)
+            {
+                if (!stream->m_waiter)
+                    continue;
+
+                ++m_statistics.nbrPolls;
+                if (stream->Poll())
+                {
+                    std::exchange(stream->m_waiter, nullptr).resume();
+                    ++m_statistics.nbrResumes;
+                    progress = true;
+                }
+            }
+
+            ReapTasks();
+
+            if (progress)
+            {
+                idleWait = m_params.minIdleWait;
+                continue;
+            }
+
+            // Nothing was ready: back off.
+            Clock::time_point const start = Clock::now();
+            if (deadline <= start)
+                break;
+
+            std::this_thread::sleep_for((std::min)(Clock::duration(idleWait), deadline - start));
+            ++m_statistics.nbrIdleWaits;
+            m_statistics.idleSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+            idleWait = (std::min)(idleWait * 2, m_params.maxIdleWait);
+        }
+    }
+
+    inline void Coroutines::StreamReactor::ReapTasks()
+    {
+        std::exception_ptr exception;
+        auto const completed = std::stable_partition(m_tasks.begin(), m_tasks.end(), [](Task const& task) { return !task.m_handle.done(); });
+        for (auto task = completed; task != m_tasks.end(); ++task)
+        {
+            if (!exception)
+                exception = task->m_handle.promise().exception;
+        }
+        m_tasks.erase(completed, m_tasks.end());
+
+        if (exception)
+            std::rethrow_exception(exception);
+    }
+}
+
+#endif
@@ -0,0 +1,1013 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// SyntheticWaveform: deterministic generator of realistic sample streams (noise, pulses, tones,
+// saturation) and of the matching marker streams, packed in the element formats decoded by
+// LibTool and the streaming examples.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_SYNTHETICWAVEFORM_H
+#define LIBTOOL_SYNTHETICWAVEFORM_H
+
+#include "LibTool.h"
+#include "Distributions.h"
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace LibTool
+{
+    //! Synthetic stream generation, used by benchmarks and by off-line tests of the processing loops.
+    /*! All generators are seeded: the same parameters and seed always produce the same streams. Typical use:
+
+            Synthetic::WaveformParameters params;
+            params.noiseSigma = 0.002;
+            params.pulses.rate = 1e-4;
+            Synthetic::WaveformGenerator generator(params, seed);
+
+            std::vector<int16_t> record(recordSize);
+            generator.Generate(record.data(), record.size());
+
+            std::vector<int32_t> markers;
+            Synthetic::AppendTriggerMarker(markers, MarkerTag::TriggerNormal, recordIndex, generator.GetSampleIndex() - recordSize, 0.0);
+    */
+    namespace Synthetic
+    {
+        //! Return the next value of a splitmix64 sequence. Used to expand a single seed into generator states.
+        inline uint64_t SplitMix64(uint64_t& state)
+        {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            return z ^ (z >> 31);
+        }
+
+        //! Multi-lane xoshiro128++ generator.
+        /*! #NbrLanes independent generators are stored as structure-of-arrays and advanced together, so that the inner loop of #Fill is
+            vectorized by the compiler (SSE2/AVX2/AVX-512/NEON) without intrinsics. Outputs of the lanes are interleaved.*/
+        class LaneRandom
+        {
+        public:
+            static constexpr size_t NbrLanes = 16;
+
+            explicit LaneRandom(uint64_t seed);
+
+            //! Fill #output with #count uniformly distributed 32-bit values.
+            void Fill(uint32_t* output, size_t count);
+
+            //! Return a uniformly distributed 32-bit value (scalar path, for sparse events).
+            uint32_t Next();
+
+            //! Return a uniformly distributed value in ]0, 1[.
+            double NextUniform() { return (double(Next()) + 0.5) * (1.0 / 4294967296.0); }
+
+            //! Return an exponentially distributed value of mean #mean.
+            double NextExponential(double mean) { return -mean * std::log(NextUniform()); }
+
+        private:
+            //! Advance all lanes by one step and store one output per lane in #output.
+            void Step(uint32_t* output);
+
+            alignas(32) uint32_t m_s0[NbrLanes];
+            alignas(32) uint32_t m_s1[NbrLanes];
+            alignas(32) uint32_t m_s2[NbrLanes];
+            alignas(32) uint32_t m_s3[NbrLanes];
+            alignas(32) uint32_t m_pending[NbrLanes];   //!< outputs of the last step not yet consumed by #Next or #Fill.
+            size_t m_nbrPending;
+        };
+
+        //! Conversion of uniform random bits into standard normal values by table lookup.
+        /*! Every 32-bit uniform value yields two normal values, one per 16-bit half. The upper 12 bits of a half select one of 4096
+            equiprobable bins, tabulated at the inverse normal CDF of their centers. The two outermost bins are resolved further by the
+            lower 4 bits, so that the tails reach about +/-4.3 sigma as with 65536 levels, while the table holds 4128 floats (16 KB,
+            resident in the L1 cache next to the output block). The table is scaled to unit variance. This is accurate enough for ADC
+            noise and avoids the transcendental functions of Box-Muller.*/
+        class GaussianTable
+        {
+        public:
+            static constexpr size_t NbrBins = 4096;
+
+            //! Return the process-wide table.
+            static GaussianTable const& Instance()
+            {
+                static GaussianTable const table;
+                return table;
+            }
+
+            //! Write #baseline plus #count normal values scaled by #sigma into #output, consuming #count/2 (rounded up) uniform values.
+            void Generate(uint32_t const* uniform, float* output, size_t count, float baseline, float sigma) const;
+
+        private:
+            explicit GaussianTable();
+
+            std::vector<float> m_values;
+        };
+
+        //! Shape of the pulses of a pulse train.
+        enum class PulseShape
+        {
+            Gaussian,           //!< gaussian of standard deviation #PulseTrainParameters::riseSamples, peak at +3 sigma from the pulse start.
+            DoubleExponential,  //!< detector-like pulse: exponential rise (#riseSamples) and exponential decay (#decaySamples).
+            Rectangular,        //!< flat pulse of #PulseTrainParameters::decaySamples samples.
+            Triangular,         //!< linear rise over #riseSamples, linear decay over #decaySamples.
+        };
+
+        //! Sine tone added to the waveform. Amplitudes are expressed in full-scale units (1.0 is full scale).
+        struct Tone
+        {
+            double amplitude = 0.0;  //!< peak amplitude.
+            double frequency = 0.0;  //!< frequency in cycles per sample (i.e. frequency / sample rate).
+            double phase = 0.0;      //!< phase in radians at sample index 0.
+        };
+
+        //! Poisson pulse train parameters. Amplitudes are expressed in full-scale units.
+        struct PulseTrainParameters
+        {
+            double rate = 0.0;              //!< mean number of pulses per sample (0 disables pulses).
+            double amplitudeMin = 0.1;      //!< minimum peak amplitude (uniformly distributed up to #amplitudeMax).
+            double amplitudeMax = 0.5;      //!< maximum peak amplitude.
+            PulseShape shape = PulseShape::DoubleExponential;
+            double riseSamples = 2.0;       //!< rise time constant (or gaussian sigma) in samples.
+            double decaySamples = 12.0;     //!< decay time constant (or flat width) in samples.
+            int polarity = 1;               //!< +1 for positive pulses, -1 for negative pulses.
+        };
+
+        //! Parameters of the generated waveforms. Levels are expressed in full-scale units: [-1, 1[ maps to the full ADC range.
+        struct WaveformParameters
+        {
+            double baseline = 0.0;          //!< DC level.
+            double noiseSigma = 0.0;        //!< standard deviation of the gaussian noise.
+            int adcBits = 12;               //!< ADC resolution in [4, 24]: samples are quantized to 2^adcBits levels before packing in the output type.
+            std::vector<Tone> tones;        //!< sine tones.
+            PulseTrainParameters pulses;    //!< Poisson pulse train.
+            double saturationRate = 0.0;    //!< mean number of saturation events per sample.
+            int saturationSamples = 64;     //!< duration of saturation events in samples.
+        };
+
+        //! Pulse emitted by the generator (ground truth for peak finding tests).
+        struct PulseEvent
+        {
+            int64_t sampleIndex;    //!< absolute index of the first sample of the pulse.
+            double amplitude;       //!< peak amplitude (signed, full-scale units).
+        };
+
+        //! Generator of continuous waveforms. Consecutive calls to #Generate produce consecutive samples of the same stream.
+        class WaveformGenerator
+        {
+        public:
+            static constexpr size_t BlockSamples = 4096;
+
+            explicit WaveformGenerator(WaveformParameters const& params, uint64_t seed);
+
+            //! Generate #count samples in full-scale units into #output.
+            void Generate(float* output, size_t count);
+
+            //! Generate #count ADC samples into #output, quantized to #WaveformParameters::adcBits and left-justified in the range of T.
+            /*! T is int8_t, int16_t or int32_t. \return the number of saturated (over-range) samples.*/
+            template <typename T>
+            size_t Generate(T* output, size_t count);
+
+            //! Return the absolute index of the next sample to generate.
+            int64_t GetSampleIndex() const { return m_sampleIndex; }
+
+            //! Return the pulses started since the last call to #ClearPulseEvents.
+            std::vector<PulseEvent> const& GetPulseEvents() const { return m_pulseEvents; }
+            void ClearPulseEvents() { m_pulseEvents.clear(); }
+
+            //! Return the pulse shape value at #t samples from the pulse start, for a unit amplitude.
+            static double EvaluateShape(PulseTrainParameters const& params, double t);
+
+            //! Return the number of samples beyond which the pulse shape is negligible.
+            static double GetShapeSupport(PulseTrainParameters const& params);
+
+        private:
+            struct ActivePulse
+            {
+                int64_t start;
+                double amplitude;
+            };
+
+            //! Generate one block of at most #BlockSamples samples.
+            void GenerateBlock(float* output, size_t count);
+
+            WaveformParameters const m_params;
+            LaneRandom m_noiseRandom;
+            LaneRandom m_eventRandom;
+            int64_t m_sampleIndex;
+            double m_nextPulse;
+            double m_nextSaturation;
+            int64_t m_saturationEnd;
+            std::deque<ActivePulse> m_activePulses;
+            std::vector<PulseEvent> m_pulseEvents;
+            std::vector<double> m_phasorRe;     //!< tone phasors, LaneRandom::NbrLanes interleaved phasors per tone.
+            std::vector<double> m_phasorIm;
+            std::vector<double> m_stepRe;       //!< per-tone rotation over NbrLanes samples.
+            std::vector<double> m_stepIm;
+            float m_toneCarry[LaneRandom::NbrLanes];  //!< tone values computed ahead of the stream.
+            size_t m_nbrToneCarry;
+            std::vector<float> m_pulseShape;    //!< pulse shape of unit amplitude, sampled at integer offsets from the pulse start.
+            GaussianTable const& m_gaussian;
+            std::vector<uint32_t> m_uniform;
+            std::vector<float> m_block;
+        };
+
+        //! Return the number of 32-bit elements needed to pack #nbrSamples samples of type T.
+        template <typename T>
+        inline size_t GetElementCount(size_t nbrSamples)
+        {
+            return CeilDiv(nbrSamples * sizeof(T), sizeof(int32_t));
+        }
+
+        //! Pack #nbrSamples samples in the element format of sample streams (little-endian, first sample in the least significant bits).
+        /*! Unused bits of the last element are zero. #elements must hold #GetElementCount<T>(nbrSamples) elements.*/
+        template <typename T>
+        inline void PackSamples(T const* samples, size_t nbrSamples, int32_t* elements)
+        {
+            size_t const nbrElements = GetElementCount<T>(nbrSamples);
+            elements[nbrElements - 1] = 0;
+            for (size_t i = 0; i < nbrSamples; ++i)
+            {
+                size_t const bitOffset = i * sizeof(T) * 8;
+                uint32_t const value = uint32_t(typename std::make_unsigned<T>::type(samples[i]));
+                uint32_t& element = reinterpret_cast<uint32_t&>(elements[bitOffset / 32]);
+                if (bitOffset % 32 == 0)
+                    element = value;
+                else
+                    element |= value << (bitOffset % 32);
+            }
+        }
+
+        //! Append a 512-bit trigger marker (16 elements) to #stream, as decoded by #StandardStreaming::DecodeTriggerMarker.
+        /*! \param triggerTimeSamples: sub-sample trigger time as returned by the decoder, in ]-1, 0].*/
+        void AppendTriggerMarker(std::vector<int32_t>& stream, MarkerTag tag, uint32_t recordIndex, uint64_t absoluteSampleIndex, double triggerTimeSamples);
+
+        //! Marker streams of the ZeroSuppress acquisition mode.
+        namespace ZeroSuppress
+        {
+            using LibTool::ZeroSuppress::ProcessingParameters;
+
+            //! Append a 64-bit gate marker (2 elements) with the given raw fields.
+            void AppendGateMarker(std::vector<int32_t>& stream, MarkerTag tag, int64_t blockIndex, int32_t sampleIndex);
+
+            //! Encoder emulating the gating of the firmware on 16-bit records.
+            /*! For every record, it produces the marker stream (trigger, gate start/stop, record stop and dummy alignment markers) and the
+                stored samples (gates with pre/post-gate samples, padded to storage blocks), laid out as expected by
+                #LibTool::ZeroSuppress::MarkerStreamDecoder and the unpack function of the ZeroSuppress example.*/
+            class RecordEncoder
+            {
+            public:
+                explicit RecordEncoder(ProcessingParameters const& params, int32_t threshold, int32_t hysteresis);
+
+                //! Encode the record #samples of #recordSize samples.
+                /*! Markers are appended to #markerStream (aligned on 16 elements), stored samples are appended to #sampleStream.
+                    \return the number of gates of the record.*/
+                size_t Encode(uint32_t recordIndex, uint64_t absoluteSampleIndex, int16_t const* samples, int64_t recordSize,
+                    std::vector<int32_t>& markerStream, std::vector<int16_t>& sampleStream) const;
+
+            private:
+                ProcessingParameters const m_params;
+                int32_t const m_threshold;
+                int32_t const m_hysteresis;
+            };
+        }
+
+        //! Descriptor streams of the PeakList acquisition mode.
+        namespace PeakList
+        {
+            //! Layout of the compact (128-bit) pulse descriptors.
+            enum class CompactKind : uint8_t
+            {
+                Peak = 0x04,            //!< peak position and value.
+                CenterOfMass = 0x05,    //!< center of mass position and value.
+                Area = 0x06,            //!< pulse area.
+            };
+
+            //! Content of a pulse descriptor, in the units printed by the PeakList example.
+            struct PulseDescriptor
+            {
+                uint32_t recordIndex = 0;
+                int64_t timestamp = 0;          //!< index of the first pulse sample, relative to the first sample of the record.
+                int32_t width = 0;              //!< number of samples above threshold.
+                bool overflow = false;          //!< width exceeds the descriptor field.
+                int32_t nbrOverrangeSamples = 0;
+                int64_t sumOfSquares = 0;       //!< sum of squared samples relative to baseline.
+                int64_t area = 0;               //!< sum of samples relative to baseline.
+                double peakX = 0.0;             //!< peak position relative to the first pulse sample.
+                double peakY = 0.0;             //!< peak value (ADC code).
+                double comX = 0.0;              //!< center of mass position relative to the first pulse sample.
+                double comY = 0.0;              //!< mean value relative to baseline (ADC code).
+            };
+
+            //! Find pulses in #samples (runs of samples above #threshold) and return their descriptors.
+            std::vector<PulseDescriptor> ExtractPulses(uint32_t recordIndex, int16_t const* samples, int64_t recordSize, int32_t baseline, int32_t threshold);
+
+            //! Append a 256-bit trigger descriptor (8 elements, tag 0x11).
+            void AppendExtendedTrigger(std::vector<int32_t>& stream, uint32_t recordIndex, uint64_t absoluteSampleIndex, double triggerTimeSamples);
+
+            //! Append a 256-bit pulse descriptor (8 elements, tag 0x14).
+            void AppendExtendedPulse(std::vector<int32_t>& stream, PulseDescriptor const& pulse);
+
+            //! Append a 128-bit trigger descriptor (4 elements, tag 0x01).
+            void AppendCompactTrigger(std::vector<int32_t>& stream, uint32_t recordIndex, uint64_t absoluteSampleIndex, double triggerTimeSamples);
+
+            //! Append a 128-bit pulse descriptor (4 elements) of the given kind.
+            void AppendCompactPulse(std::vector<int32_t>& stream, PulseDescriptor const& pulse, CompactKind kind);
+
+            //! Append alignment descriptors (tag 0x1f in extended format, 0x0f in compact format) until the stream size is a multiple of 16 elements.
+            void AppendAlignment(std::vector<int32_t>& stream, bool extended);
+
+            //! Encode a fixed-point value with #nbrIntegerBits and #nbrFractionBits bits (inverse of #LibTool::ScaleSigned).
+            inline int32_t ToFixedPoint(double value, int nbrIntegerBits, int nbrFractionBits)
+            {
+                int const nbrBits = nbrIntegerBits + nbrFractionBits;
+                int64_t const raw = int64_t(std::llround(value * double(int64_t(1) << nbrFractionBits)));
+                return int32_t(raw & ((int64_t(1) << nbrBits) - 1));
+            }
+        }
+    }
+
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    // Synthetic::LaneRandom member definitions
+    //
+
+    inline Synthetic::LaneRandom::LaneRandom(uint64_t seed)
+        : m_nbrPending(0)
+    {
+        uint64_t state = seed;
+        for (size_t lane = 0; lane < NbrLanes; ++lane)
+        {
+            uint64_t const a = SplitMix64(state);
+            uint64_t const b = SplitMix64(state);
+            m_s0[lane] = uint32_t(a);
+            m_s1[lane] = uint32_t(a >> 32);
+            m_s2[lane] = uint32_t(b);
+            m_s3[lane] = uint32_t(b >> 32) | 1u; // the all-zero state is forbidden.
+        }
+    }
+
+    inline void Synthetic::LaneRandom::Step(uint32_t* output)
+    {
+        for (size_t lane = 0; lane < NbrLanes; ++lane)
+        {
+            uint32_t const sum = m_s0[lane] + m_s3[lane];
+            output[lane] = ((sum << 7) | (sum >> 25)) + m_s0[lane];
+
+            uint32_t const t = m_s1[lane] << 9;
+            m_s2[lane] ^= m_s0[lane];
+            m_s3[lane] ^= m_s1[lane];
+            m_s1[lane] ^= m_s2[lane];
+            m_s0[lane] ^= m_s3[lane];
+            m_s2[lane] ^= t;
+            m_s3[lane] = (m_s3[lane] << 11) | (m_s3[lane] >> 21);
+        }
+    }
+
+    inline void Synthetic::LaneRandom::Fill(uint32_t* output, size_t count)
+    {
+        while (count > 0 && m_nbrPending > 0)
+        {
+            *output++ = m_pending[NbrLanes - m_nbrPending--];
+            --count;
+        }
+
+        // the state is copied to locals so that the compiler keeps it in vector registers across steps.
+        uint32_t s0[NbrLanes], s1[NbrLanes], s2[NbrLanes], s3[NbrLanes];
+        std::memcpy(s0, m_s0, sizeof(s0));
+        std::memcpy(s1, m_s1, sizeof(s1));
+        std::memcpy(s2, m_s2, sizeof(s2));
+        std::memcpy(s3, m_s3, sizeof(s3));
+
+        size_t const nbrFullSteps = count / NbrLanes;
+        for (size_t i = 0; i < nbrFullSteps; ++i)
+        {
+            uint32_t* const step = output + i * NbrLanes;
+            for (size_t lane = 0; lane < NbrLanes; ++lane)
+            {
+                uint32_t const sum = s0[lane] + s3[lane];
+                step[lane] = ((sum << 7) | (sum >> 25)) + s0[lane];
+
+                uint32_t const t = s1[lane] << 9;
+                s2[lane] ^= s0[lane];
+                s3[lane] ^= s1[lane];
+                s1[lane] ^= s2[lane];
+                s0[lane] ^= s3[lane];
+                s2[lane] ^= t;
+                s3[lane] = (s3[lane] << 11) | (s3[lane] >> 21);
+            }
+        }
+
+        std::memcpy(m_s0, s0, sizeof(s0));
+        std::memcpy(m_s1, s1, sizeof(s1));
+        std::memcpy(m_s2, s2, sizeof(s2));
+        std::memcpy(m_s3, s3, sizeof(s3));
+
+        size_t const remainder = count % NbrLanes;
+        if (remainder > 0)
+        {
+            Step(m_pending);
+            std::memcpy(output + nbrFullSteps * NbrLanes, m_pending, remainder * sizeof(uint32_t));
+            m_nbrPending = NbrLanes - remainder;
+        }
+    }
+
+    inline uint32_t Synthetic::LaneRandom::Next()
+    {
+        if (m_nbrPending == 0)
+        {
+            Step(m_pending);
+            m_nbrPending = NbrLanes;
+        }
+        return m_pending[NbrLanes - m_nbrPending--];
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    // Synthetic::GaussianTable member definitions
+    //
+
+    inline Synthetic::GaussianTable::GaussianTable()
+        : m_values(NbrBins + 32)
+    {
+        // Bin centers, followed by the 16 levels of the lowest bin and the 16 levels of the highest bin (see #Generate).
+        double sumOfSquares = 0.0;
+        for (size_t i = 1; i < NbrBins - 1; ++i)
+        {
+            double const value = Distributions::NormalQuantile((double(i) + 0.5) / double(NbrBins));
+            m_values[i] = float(value);
+            sumOfSquares += 16.0 * value * value;
+        }
+        for (size_t j = 0; j < 32; ++j)
+        {
+            size_t const level = j < 16 ? j : NbrBins * 16 - 32 + j;
+            double const value = Distributions::NormalQuantile((double(level) + 0.5) / double(NbrBins * 16));
+            m_values[NbrBins + j] = float(value);
+            sumOfSquares += value * value;
+        }
+
+        float const scale = float(1.0 / std::sqrt(sumOfSquares / double(NbrBins * 16)));
+        for (auto& value : m_values)
+            value *= scale;
+    }
+
+    inline void Synthetic::GaussianTable::Generate(uint32_t const* uniform, float* output, size_t count, float baseline, float sigma) const
+    {
+        float const* const values = m_values.data();
+        auto const lookup = [values](uint32_t half)
+        {
+            // Halves 0x0000-0x000f and 0xfff0-0xffff (the outermost bins) map to the tail levels at NbrBins + (half & 0x1f).
+            uint32_t const bin = half >> 4;
+            return values[bin - 1 < uint32_t(NbrBins - 2) ? bin : uint32_t(NbrBins) + (half & 0x1f)];
+        };
+
+        size_t const nbrPairs = count / 2;
+        for (size_t i = 0; i < nbrPairs; ++i)
+        {
+            output[2 * i] = baseline + sigma * lookup(uniform[i] & 0xffff);
+            output[2 * i + 1] = baseline + sigma * lookup(uniform[i] >> 16);
+        }
+        if (count % 2 != 0)
+            output[count - 1] = baseline + sigma * lookup(uniform[nbrPairs] & 0xffff);
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    // Synthetic::WaveformGenerator member definitions
+    //
+
+    inline Synthetic::WaveformGenerator::WaveformGenerator(WaveformParameters const& params, uint64_t seed)
+        : m_params(params)
+        , m_noiseRandom(seed)
+        , m_eventRandom(seed ^ 0x6a09e667f3bcc909ull)
+        , m_sampleIndex(0)
+        , m_nextPulse(0.0)
+        , m_nextSaturation(0.0)
+        , m_saturationEnd(0)
+        , m_activePulses()
+        , m_pulseEvents()
+        , m_nbrToneCarry(0)
+        , m_pulseShape()
+        , m_gaussian(GaussianTable::Instance())
+        , m_uniform(BlockSamples)
+        , m_block(BlockSamples)
+    {
+        if (params.adcBits < 4 || 24 < params.adcBits)
+            throw std::invalid_argument("ADC resolution must be in [4, 24] bits, got " + ToString(params.adcBits));
+        if (params.pulses.rate < 0.0 || params.saturationRate < 0.0)
+            throw std::invalid_argument("Event rates must be positive.");
+
+        size_t const nbrLanes = LaneRandom::NbrLanes;
+        double const twoPi = 6.283185307179586;
+        for (Tone const& tone : params.tones)
+        {
+            for (size_t lane = 0; lane < nbrLanes; ++lane)
+            {
+                double const phase = tone.phase + twoPi * tone.frequency * double(lane);
+                m_phasorRe.push_back(tone.amplitude * std::cos(phase));
+                m_phasorIm.push_back(tone.amplitude * std::sin(phase));
+            }
+            m_stepRe.push_back(std::cos(twoPi * tone.frequency * double(nbrLanes)));
+            m_stepIm.push_back(std::sin(twoPi * tone.frequency * double(nbrLanes)));
+        }
+
+        if (params.pulses.rate > 0.0)
+        {
+            size_t const support = size_t(GetShapeSupport(params.pulses));
+            for (size_t i = 0; i < support; ++i)
+                m_pulseShape.push_back(float(EvaluateShape(params.pulses, double(i))));
+            m_nextPulse = m_eventRandom.NextExponential(1.0 / params.pulses.rate);
+        }
+        if (params.saturationRate > 0.0)
+            m_nextSaturation = m_eventRandom.NextExponential(1.0 / params.saturationRate);
+    }
+
+    inline double Synthetic::WaveformGenerator::EvaluateShape(PulseTrainParameters const& params, double t)
+    {
+        if (t < 0.0)
+            return 0.0;
+
+        switch (params.shape)
+        {
+        case PulseShape::Gaussian:
+        {
+            double const x = (t - 3.0 * params.riseSamples) / params.riseSamples;
+            return std::exp(-0.5 * x * x);
+        }
+        case PulseShape::DoubleExponential:
+        {
+            // normalized so that the maximum is 1.
+            double const rise = params.riseSamples;
+            double const decay = params.decaySamples;
+            double const tPeak = rise * decay / (decay - rise) * std::log(decay / rise);
+            double const peak = std::exp(-tPeak / decay) - std::exp(-tPeak / rise);
+            return (std::exp(-t / decay) - std::exp(-t / rise)) / peak;
+        }
+        case PulseShape::Rectangular:
+            return (t < params.decaySamples) ? 1.0 : 0.0;
+        case PulseShape::Triangular:
+            if (t < params.riseSamples)
+                return t / params.riseSamples;
+            return (std::max)(0.0, 1.0 - (t - params.riseSamples) / params.decaySamples);
+        default:
+            throw std::logic_error("Unexpected pulse shape " + ToString(int(params.shape)));
+        }
+    }
+
+    inline double Synthetic::WaveformGenerator::GetShapeSupport(PulseTrainParameters const& params)
+    {
+        switch (params.shape)
+        {
+        case PulseShape::Gaussian:          return 6.0 * params.riseSamples + 1.0;
+        case PulseShape::DoubleExponential: return 10.0 * (std::max)(params.riseSamples, params.decaySamples) + 1.0;
+        case PulseShape::Rectangular:       return params.decaySamples + 1.0;
+        case PulseShape::Triangular:        return params.riseSamples + params.decaySamples + 1.0;
+        default:
+            throw std::logic_error("Unexpected pulse shape " + ToString(int(params.shape)));
+        }
+    }
+
+    inline void Synthetic::WaveformGenerator::Generate(float* output, size_t count)
+    {
+        while (count > 0)
+        {
+            size_t const nbrSamples = (std::min)(count, size_t(BlockSamples));
+            GenerateBlock(output, nbrSamples);
+            output += nbrSamples;
+            count -= nbrSamples;
+        }
+    }
+
+    inline void Synthetic::WaveformGenerator::GenerateBlock(float* output, size_t count)
+    {
+        int64_t const blockStart = m_sampleIndex;
+        int64_t const blockEnd = blockStart + int64_t(count);
+
+        // 1. baseline and gaussian noise.
+        if (m_params.noiseSigma > 0.0)
+        {
+            m_noiseRandom.Fill(m_uniform.data(), (count + 1) / 2);
+            m_gaussian.Generate(m_uniform.data(), output, count, float(m_params.baseline), float(m_params.noiseSigma));
+        }
+        else
+            std::fill(output, output + count, float(m_params.baseline));
+
+        // 2. sine tones: NbrLanes interleaved phasors per tone, each advanced by NbrLanes samples per step. Values computed beyond the
+        //    end of the block are carried over to the next block.
+        size_t const nbrLanes = LaneRandom::NbrLanes;
+        size_t const nbrTones = m_stepRe.size();
+        if (nbrTones > 0)
+        {
+            size_t first = 0;
+            while (first < count && m_nbrToneCarry > 0)
+                output[first++] += m_toneCarry[nbrLanes - m_nbrToneCarry--];
+
+            // full steps are accumulated in place into the output, the last partial step into #lastStep.
+            size_t const nbrFullSteps = (count - first) / nbrLanes;
+            size_t const nbrSteps = CeilDiv(count - first, nbrLanes);
+            float lastStep[LaneRandom::NbrLanes] = {};
+
+            for (size_t tone = 0; tone < nbrTones; ++tone)
+            {
+                // the phasors are rotated in single precision within the block, which doubles the vector width (errors stay below 2e-6
+                // full scale).
+                double* const phasorRe = &m_phasorRe[tone * nbrLanes];
+                double* const phasorIm = &m_phasorIm[tone * nbrLanes];
+                float re[LaneRandom::NbrLanes];
+                float im[LaneRandom::NbrLanes];
+                for (size_t lane = 0; lane < nbrLanes; ++lane)
+                {
+                    re[lane] = float(phasorRe[lane]);
+                    im[lane] = float(phasorIm[lane]);
+                }
+                float const stepRe = float(m_stepRe[tone]);
+                float const stepIm = float(m_stepIm[tone]);
+
+                for (size_t step = 0; step < nbrSteps; ++step)
+                {
+                    float* const values = (step < nbrFullSteps) ? output + first + step * nbrLanes : lastStep;
+                    for (size_t lane = 0; lane < nbrLanes; ++lane)
+                    {
+                        values[lane] += im[lane];
+                        float const r = re[lane] * stepRe - im[lane] * stepIm;
+                        im[lane] = re[lane] * stepIm + im[lane] * stepRe;
+                        re[lane] = r;
+                    }
+                }
+
+                // the double precision phasors are advanced by the whole block, so that single precision rounding errors do not
+                // accumulate from block to block, and renormalized to the tone amplitude.
+                double const twoPi = 6.283185307179586;
+                Tone const& parameters = m_params.tones[tone];
+                double const blockRe = std::cos(twoPi * parameters.frequency * double(nbrSteps * nbrLanes));
+                double const blockIm = std::sin(twoPi * parameters.frequency * double(nbrSteps * nbrLanes));
+                for (size_t lane = 0; lane < nbrLanes; ++lane)
+                {
+                    double const r = phasorRe[lane] * blockRe - phasorIm[lane] * blockIm;
+                    double const i = phasorRe[lane] * blockIm + phasorIm[lane] * blockRe;
+                    double const norm = std::sqrt(r * r + i * i);
+                    phasorRe[lane] = (norm > 0.0) ? r * parameters.amplitude / norm : 0.0;
+                    phasorIm[lane] = (norm > 0.0) ? i * parameters.amplitude / norm : 0.0;
+                }
+            }
+
+            size_t const remainder = (count - first) % nbrLanes;
+            if (remainder > 0)
+            {
+                for (size_t lane = 0; lane < remainder; ++lane)
+                    output[count - remainder + lane] += lastStep[lane];
+                m_nbrToneCarry = nbrLanes - remainder;
+                std::copy(lastStep, lastStep + nbrLanes, m_toneCarry);
+            }
+        }
+
+        // 3. Poisson pulse train. Pulses started in previous blocks continue in this one.
+        PulseTrainParameters const& pulses = m_params.pulses;
+        if (pulses.rate > 0.0)
+        {
+            while (m_nextPulse < double(blockEnd))
+            {
+                ActivePulse pulse;
+                pulse.start = int64_t(std::ceil(m_nextPulse));
+                double const amplitude = pulses.amplitudeMin + (pulses.amplitudeMax - pulses.amplitudeMin) * m_eventRandom.NextUniform();
+                pulse.amplitude = (pulses.polarity < 0) ? -amplitude : amplitude;
+                m_activePulses.push_back(pulse);
+                m_pulseEvents.push_back(PulseEvent{ pulse.start, pulse.amplitude });
+                m_nextPulse += m_eventRandom.NextExponential(1.0 / pulses.rate);
+            }
+
+            int64_t const support = int64_t(m_pulseShape.size());
+            for (ActivePulse const& pulse : m_activePulses)
+            {
+                int64_t const first = (std::max)(pulse.start, blockStart);
+                int64_t const last = (std::min)(pulse.start + support, blockEnd);
+                float const amplitude = float(pulse.amplitude);
+                float const* const shape = m_pulseShape.data() + (first - pulse.start);
+                float* const destination = output + (first - blockStart);
+                for (int64_t i = 0; i < last - first; ++i)
+                    destination[i] += amplitude * shape[i];
+            }
+
+            while (!m_activePulses.empty() && m_activePulses.front().start + support <= blockEnd)
+                m_activePulses.pop_front();
+        }
+
+        // 4. saturation events: the input is driven beyond full scale.
+        if (m_params.saturationRate > 0.0)
+        {
+            for (;;)
+            {
+                int64_t const first = (std::max)(blockStart, int64_t(m_saturationEnd) - m_params.saturationSamples);
+                int64_t const last = (std::min)(blockEnd, m_saturationEnd);
+                for (int64_t index = first; index < last; ++index)
+                    output[index - blockStart] = 2.0f;
+
+                if (m_nextSaturation >= double(blockEnd))
+                    break;
+
+                m_saturationEnd = int64_t(std::ceil(m_nextSaturation)) + m_params.saturationSamples;
+                m_nextSaturation += m_eventRandom.NextExponential(1.0 / m_params.saturationRate);
+            }
+        }
+
+        m_sampleIndex = blockEnd;
+    }
+
+    template <typename T>
+    inline size_t Synthetic::WaveformGenerator::Generate(T* output, size_t count)
+    {
+        static_assert(std::is_integral<T>::value && std::is_signed<T>::value && sizeof(T) <= sizeof(int32_t), "Requires int8_t, int16_t or int32_t samples");
+
+        int const outputBits = int(sizeof(T) * 8);
+        int const adcBits = m_params.adcBits;
+        float const scale = float(int32_t(1) << (adcBits - 1));
+        float const codeMax = scale - 1.0f;
+        float const codeMin = -scale;
+        float const overrange = codeMax + 1.0f;
+        int32_t const multiplier = int32_t(1) << (std::max)(0, outputBits - adcBits);
+        int32_t const rightShift = (std::max)(0, adcBits - outputBits);
+
+        size_t nbrOverrange = 0;
+        while (count > 0)
+        {
+            size_t const nbrSamples = (std::min)(count, size_t(BlockSamples));
+            float* const block = m_block.data();
+            GenerateBlock(block, nbrSamples);
+
+            // branch-free quantization and saturation, vectorized by the compiler. All lanes are 32 bits wide (a size_t counter
+            // in the loop prevents the vectorization).
+            uint32_t nbrBlockOverrange = 0;
+            for (size_t i = 0; i < nbrSamples; ++i)
+            {
+                float const value = block[i] * scale + 0.5f;
+                nbrBlockOverrange += uint32_t(value >= overrange) + uint32_t(value < codeMin);
+                float const clamped = (std::min)((std::max)(value, codeMin), codeMax);
+                int32_t const truncated = int32_t(clamped);
+                int32_t const adcCode = truncated - int32_t(clamped < float(truncated)); // floor
+                output[i] = T((adcCode * multiplier) >> rightShift);
+            }
+            nbrOverrange += nbrBlockOverrange;
+
+            output += nbrSamples;
+            count -= nbrSamples;
+        }
+        return nbrOverrange;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    // Synthetic marker definitions
+    //
+
+    inline void Synthetic::AppendTriggerMarker(std::vector<int32_t>& stream, MarkerTag tag, uint32_t recordIndex, uint64_t absoluteSampleIndex, double triggerTimeSamples)
+    {
+        uint32_t const subsample = uint32_t(std::lround(-triggerTimeSamples * 256.0)) & 0xff;
+
+        size_t const offset = stream.size();
+        stream.resize(offset + StandardStreaming::NbrTriggerMarkerElements, 0);
+        stream[offset + 0] = int32_t(uint32_t(tag) | ((recordIndex & TriggerMarker::RecordIndexMask) << 8));
+        stream[offset + 1] = int32_t(uint32_t((absoluteSampleIndex & 0xffffff) << 8) | subsample);
+        stream[offset + 2] = int32_t(uint32_t(absoluteSampleIndex >> 24));
+    }
+
+    inline void Synthetic::ZeroSuppress::AppendGateMarker(std::vector<int32_t>& stream, MarkerTag tag, int64_t blockIndex, int32_t sampleIndex)
+    {
+        stream.push_back(int32_t(uint32_t(tag) | (uint32_t(blockIndex & 0xff) << 24)));
+        stream.push_back(int32_t(uint32_t((blockIndex >> 8) & 0xffffff) | (uint32_t(sampleIndex & 0xff) << 24)));
+    }
+
+    inline Synthetic::ZeroSuppress::RecordEncoder::RecordEncoder(ProcessingParameters const& params, int32_t threshold, int32_t hysteresis)
+        : m_params(params)
+        , m_threshold(threshold)
+        , m_hysteresis(hysteresis)
+    {
+        if (params.processingBlockSamples <= 0 || params.storageBlockSamples <= 0)
+            throw std::invalid_argument("Processing and storage block sizes must be strict positive.");
+    }
+
+    inline size_t Synthetic::ZeroSuppress::RecordEncoder::Encode(uint32_t recordIndex, uint64_t absoluteSampleIndex, int16_t const* samples, int64_t recordSize,
+        std::vector<int32_t>& markerStream, std::vector<int16_t>& sampleStream) const
+    {
+        int64_t const P = m_params.processingBlockSamples;
+        int64_t const pre = m_params.preGateSamples;
+        int64_t const post = m_params.postGateSamples;
+
+        // 1. detect gates: open on the first sample above threshold, close on the first sample below threshold-hysteresis.
+        std::vector<std::pair<int64_t, int64_t>> gates; // [start, stop[, stop == recordSize for gates closed by the record end.
+        bool open = false;
+        for (int64_t i = 0; i < recordSize; ++i)
+        {
+            if (!open && samples[i] > m_threshold)
+            {
+                // gates separated by less than the pre/post-gate samples, or sharing a processing block, are merged.
+                if (!gates.empty() && (i - gates.back().second < pre + post || (i / P) <= (gates.back().second - 1) / P + 1))
+                    gates.back().second = recordSize;
+                else
+                    gates.push_back(std::make_pair(i, recordSize));
+                open = true;
+            }
+            else if (open && samples[i] < m_threshold - m_hysteresis)
+            {
+                gates.back().second = i;
+                open = false;
+            }
+        }
+
+        // 2. marker stream.
+        size_t const markerOffset = markerStream.size();
+        AppendTriggerMarker(markerStream, MarkerTag::TriggerNormal, recordIndex, absoluteSampleIndex, 0.0);
+
+        int64_t const recordStopBlock = (recordSize - 1) / P + 2;
+        int32_t const recordStopIndex = int32_t((recordSize - 1) % P);
+
+        bool closedByRecordStop = false;
+        std::vector<std::pair<int64_t, int64_t>> gateBlocks;
+        for (auto const& gate : gates)
+        {
+            int64_t const startBlock = gate.first / P + 1;
+            AppendGateMarker(markerStream, MarkerTag::GateStartCst, startBlock, int32_t(gate.first % P));
+
+            if (gate.second >= recordSize)
+            {
+                AppendGateMarker(markerStream, MarkerTag::RecordStop, recordStopBlock, recordStopIndex);
+                gateBlocks.push_back(std::make_pair(startBlock, recordStopBlock));
+                closedByRecordStop = true;
+            }
+            else
+            {
+                int64_t const endIndex = ((gate.second - 1) % P) + 1;
+                int64_t const stopBlock = (gate.second - endIndex) / P + 2;
+                AppendGateMarker(markerStream, MarkerTag::GateStopCst, stopBlock, int32_t(endIndex));
+                gateBlocks.push_back(std::make_pair(startBlock, stopBlock));
+            }
+        }
+        if (!closedByRecordStop)
+            AppendGateMarker(markerStream, MarkerTag::RecordStop, recordStopBlock, recordStopIndex);
+
+        while ((markerStream.size() - markerOffset) % StandardStreaming::NbrTriggerMarkerElements != 0)
+            AppendGateMarker(markerStream, MarkerTag::DummyGate, 0, 0);
+
+        // 3. stored samples: each gate is stored from the pre-gate samples of its first processing block, padded to storage blocks.
+        for (auto const& blocks : gateBlocks)
+        {
+            int64_t const nbrGateSamples = (blocks.second - blocks.first) * P;
+            int64_t const postGateRecordSamples = (recordStopBlock - blocks.second) * P;
+            int64_t const nbrStoredSamples = AlignUp<int64_t>(nbrGateSamples + (std::min)(postGateRecordSamples, pre + post), m_params.storageBlockSamples);
+
+            int64_t const firstSample = (blocks.first - 1) * P - pre;
+            for (int64_t i = 0; i < nbrStoredSamples; ++i)
+            {
+                int64_t const position = firstSample + i;
+                sampleStream.push_back((0 <= position && position < recordSize) ? samples[position] : int16_t(0));
+            }
+        }
+
+        return gates.size();
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    // Synthetic::PeakList definitions
+    //
+
+    inline std::vector<Synthetic::PeakList::PulseDescriptor> Synthetic::PeakList::ExtractPulses(uint32_t recordIndex, int16_t const* samples, int64_t recordSize, int32_t baseline, int32_t threshold)
+    {
+        std::vector<PulseDescriptor> result;
+        int64_t i = 0;
+        while (i < recordSize)
+        {
+            if (samples[i] <= threshold)
+            {
+                ++i;
+                continue;
+            }
+
+            PulseDescriptor pulse;
+            pulse.recordIndex = recordIndex;
+            pulse.timestamp = i;
+
+            int64_t peakIndex = i;
+            double weightedSum = 0.0;
+            int64_t const first = i;
+            for (; i < recordSize && samples[i] > threshold; ++i)
+            {
+                int64_t const value = int64_t(samples[i]) - baseline;
+                pulse.sumOfSquares += value * value;
+                pulse.area += value;
+                weightedSum += double(i - first) * double(value);
+                if (samples[i] > samples[peakIndex])
+                    peakIndex = i;
+                if (samples[i] == (std::numeric_limits<int16_t>::max)() || samples[i] == (std::numeric_limits<int16_t>::min)())
+                    ++pulse.nbrOverrangeSamples;
+            }
+
+            pulse.width = int32_t(i - first);
+            pulse.peakX = double(peakIndex - first);
+            pulse.peakY = double(samples[peakIndex]);
+            pulse.comX = (pulse.area != 0) ? weightedSum / double(pulse.area) : 0.0;
+            pulse.comY = double(pulse.area) / double(pulse.width);
+            result.push_back(pulse);
+        }
+        return result;
+    }
+
+    inline void Synthetic::PeakList::AppendExtendedTrigger(std::vector<int32_t>& stream, uint32_t recordIndex, uint64_t absoluteSampleIndex, double triggerTimeSamples)
+    {
+        uint32_t const subsample = uint32_t(std::lround(-triggerTimeSamples * 256.0)) & 0xff;
+
+        size_t const offset = stream.size();
+        stream.resize(offset + 8, 0);
+        stream[offset + 0] = int32_t(0x11u | ((recordIndex & 0xffffff) << 8));
+        stream[offset + 1] = int32_t(uint32_t((absoluteSampleIndex & 0xffffff) << 8) | subsample);
+        stream[offset + 2] = int32_t(uint32_t(absoluteSampleIndex >> 24));
+    }
+
+    inline void Synthetic::PeakList::AppendExtendedPulse(std::vector<int32_t>& stream, PulseDescriptor const& pulse)
+    {
+        uint64_t const timestamp = uint64_t(pulse.timestamp) & 0xffffffffffffull;
+        uint64_t const sumOfSquares = uint64_t(pulse.sumOfSquares) & 0xffffffffffffull;
+        uint32_t const width = uint32_t((std::min)(pulse.width, 0x7fff));
+        bool const overflow = pulse.overflow || pulse.width > 0x7fff;
+
+        uint32_t const peakX = uint32_t(ToFixedPoint(pulse.peakX, 14, 8));
+        uint32_t const peakY = uint32_t(ToFixedPoint(pulse.peakY, 17, 3));
+        uint32_t const comX = uint32_t(ToFixedPoint(pulse.comX, 16, 8));
+        uint32_t const comY = uint32_t(ToFixedPoint(pulse.comY, 16, 1));
+
+        stream.push_back(int32_t(0x14u | ((pulse.recordIndex & 0xffffff) << 8)));
+        stream.push_back(int32_t(uint32_t(timestamp & 0xffffffff)));
+        stream.push_back(int32_t(uint32_t(timestamp >> 32) | (width << 16) | (overflow ? 0x80000000u : 0u)));
+        stream.push_back(int32_t((uint32_t(pulse.nbrOverrangeSamples) & 0x7fff) | uint32_t((sumOfSquares & 0xffff) << 16)));
+        stream.push_back(int32_t(uint32_t(sumOfSquares >> 16)));
+        stream.push_back(int32_t((peakX & 0xffffff) | ((peakY & 0xff) << 24)));
+        stream.push_back(int32_t(((peakY >> 8) & 0xffff) | ((comX & 0xffff) << 16)));
+        stream.push_back(int32_t(((comX >> 16) & 0xff) | ((comY & 0xffffff) << 8)));
+    }
+
+    inline void Synthetic::PeakList::AppendCompactTrigger(std::vector<int32_t>& stream, uint32_t recordIndex, uint64_t absoluteSampleIndex, double triggerTimeSamples)
+    {
+        uint32_t const subsample = uint32_t(std::lround(-triggerTimeSamples * 256.0)) & 0xff;
+
+        stream.push_back(int32_t(0x01u | ((recordIndex & 0xfffff) << 4)));
+        stream.push_back(int32_t(uint32_t((absoluteSampleIndex & 0xffffff) << 8) | subsample));
+        stream.push_back(int32_t(uint32_t(absoluteSampleIndex >> 24)));
+        stream.push_back(0);
+    }
+
+    inline void Synthetic::PeakList::AppendCompactPulse(std::vector<int32_t>& stream, PulseDescriptor const& pulse, CompactKind kind)
+    {
+        uint32_t const timestamp = uint32_t(pulse.timestamp);
+        uint32_t const width = uint32_t((std::min)(pulse.width, 0x7ff));
+        bool const overflow = pulse.overflow || pulse.width > 0x7ff;
+
+        uint32_t field = 0;         // 24-bit position (bits 16..39 of the descriptor payload)
+        uint32_t value = 0;         // 24-bit value
+        if (kind == CompactKind::Peak)
+        {
+            field = uint32_t(ToFixedPoint(pulse.peakX, 14, 8));
+            value = uint32_t(ToFixedPoint(pulse.peakY, 17, 3));
+        }
+        else if (kind == CompactKind::CenterOfMass)
+        {
+            field = uint32_t(ToFixedPoint(pulse.comX, 16, 8));
+            value = uint32_t(ToFixedPoint(pulse.comY, 16, 1));
+        }
+
+        uint32_t item2 = (width >> 8) | (overflow ? 0x8u : 0u) | ((uint32_t(pulse.nbrOverrangeSamples) & 0x7ff) << 4);
+        uint32_t item3 = 0;
+        if (kind == CompactKind::Area)
+        {
+            uint32_t const area = uint32_t(pulse.area);
+            item2 |= (area & 0xffff) << 16;
+            item3 = (area >> 16) & 0xffff;
+        }
+        else
+        {
+            item2 |= (field & 0xffff) << 16;
+            item3 = ((field >> 16) & 0xff) | ((value & 0xffffff) << 8);
+        }
+
+        stream.push_back(int32_t(uint32_t(kind) | ((pulse.recordIndex & 0xfffff) << 4) | ((timestamp & 0xff) << 24)));
+        stream.push_back(int32_t(((timestamp >> 8) & 0xffffff) | ((width & 0xff) << 24)));
+        stream.push_back(int32_t(item2));
+        stream.push_back(int32_t(item3));
+    }
+
+    inline void Synthetic::PeakList::AppendAlignment(std::vector<int32_t>& stream, bool extended)
+    {
+        size_t const descriptorElements = extended ? 8 : 4;
+        while (stream.size() % 16 != 0)
+        {
+            stream.push_back(extended ? 0x1f : 0x0f);
+            stream.resize(stream.size() + descriptorElements - 1, 0);
+        }
+    }
+}
+
+#endif
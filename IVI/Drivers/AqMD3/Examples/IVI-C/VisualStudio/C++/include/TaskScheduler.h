@@ -0,0 +1,607 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// TaskScheduler: work-stealing pool of pinned worker threads shared by the processing stages,
+// running prioritized tasks over ranges of records.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_TASKSCHEDULER_H
+#define LIBTOOL_TASKSCHEDULER_H
+
+#include "LibTool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace LibTool
+{
+    //! Task scheduling utils.
+    /*! When every processing stage (unpack, gate extraction, peak finding, spectra, writing) starts its own threads, the cores
+        are oversubscribed by some stages while others leave them idle. #Tasks::TaskScheduler runs the work of all the stages on
+        one worker thread per core:
+
+            Tasks::TaskScheduler scheduler;                                              // one worker per hardware thread
+
+            // Unpack the records of a batch in groups of 64, before any lower priority work.
+            scheduler.ParallelFor(Tasks::Priority::High, Tasks::RecordRange{0, nbrRecords}, 64, [&](Tasks::RecordRange const& range, size_t worker)
+            {
+                for (int64_t record = range.first; record < range.GetEnd(); ++record)
+                    Unpack(record, scratch[worker]);
+            });
+
+            // Run a stage in the background, and wait for it later.
+            Tasks::TaskGroup writing;
+            scheduler.Submit(writing, Tasks::Priority::Low, Tasks::RecordRange{0, nbrRecords}, SaveRecords);
+            ...
+            scheduler.Wait(writing);
+
+        Tasks carry a range of records, so that work is handed out per batch of records instead of per record. Every worker owns
+        one deque per #Tasks::Priority. It takes the oldest task of its own deques, and when they are empty, steals the newest task
+        of the other workers from the other end of their deques, so that load balances without partitioning the work by hand.
+        Priorities come first: a worker steals high priority work before it runs its own normal priority tasks. Use
+        #Tasks::Priority::High for the work the fetch loop waits for.
+
+        An idle worker spins on the deques for #Tasks::Parameters::spinIterations rounds (yielding in between), then sleeps on a
+        std::condition_variable until work is submitted. Workers are pinned to consecutive cores from
+        #Tasks::Parameters::firstCore, e.g. leave core 0 to the fetch thread.
+
+        A worker waiting for a group (nested parallelism) runs tasks in the meantime. Any other thread just blocks: the worker index
+        passed to task functions is always in [0, #Tasks::TaskScheduler::GetNbrWorkers()[, for per-worker scratch buffers.
+
+        A group destroyed with tasks still pending (e.g. when an exception unwinds the scope) waits for them, since they usually
+        reference objects of the same scope. Declare the group after those objects, and destroy it before its scheduler.
+    */
+    namespace Tasks
+    {
+        //! Task priorities, highest first.
+        enum class Priority
+        {
+            High,       //!< work the fetch loop depends on.
+            Normal,
+            Low,        //!< background work (e.g. writing).
+        };
+
+        static size_t const NbrPriorities = 3;
+
+        //! Range of records processed by a task.
+        struct RecordRange
+        {
+            int64_t first;
+            int64_t count;
+
+            int64_t GetEnd() const
+            { return first + count; }
+        };
+
+        //! Function of a task: process range on worker workerIndex.
+        typedef std::function<void(RecordRange const& range, size_t workerIndex)> TaskFunction;
+
+        class TaskScheduler;
+
+        //! Tasks waited for together, see #TaskScheduler::Wait.
+        class TaskGroup
+        {
+        public:
+            TaskGroup()
+                : m_scheduler(nullptr)
+                , m_nbrPending(0)
+                , m_mutex()
+                , m_doneCondition()
+                , m_error()
+            {}
+
+            //! Wait for the pending tasks of the group. Their exceptions are dropped.
+            ~TaskGroup();
+
+            TaskGroup(TaskGroup const&) = delete;
+            TaskGroup& operator=(TaskGroup const&) = delete;
+
+            //! Tell whether all the tasks of the group have completed.
+            bool IsDone() const
+            { return m_nbrPending.load() == 0; }
+
+        private:
+            friend class TaskScheduler;
+
+            TaskScheduler* m_scheduler;         //!< scheduler of the last task submitted to the group.
+            std::atomic<int64_t> m_nbrPending;
+            std::mutex m_mutex;
+            std::condition_variable m_doneCondition;
+            std::exception_ptr m_error;         //!< first exception raised by a task of the group.
+        };
+
+        //! Configuration of a scheduler.
+        struct Parameters
+        {
+            size_t nbrWorkers = 0;              //!< number of worker threads, 0 for the number of hardware threads.
+            bool pinWorkers = true;             //!< pin worker i to core (firstCore + i) modulo the number of cores.
+            size_t firstCore = 0;
+            unsigned spinIterations = 1000;     //!< idle rounds over the deques before sleeping.
+        };
+
+        //! Counters of a worker.
+        struct WorkerStatistics
+        {
+            uint64_t nbrTasks = 0;              //!< tasks run.
+            uint64_t nbrSteals = 0;             //!< tasks taken from another worker.
+            uint64_t nbrSleeps = 0;             //!< times the worker went to sleep.
+            double busySeconds = 0.0;           //!< time spent running tasks.
+        };
+
+        //! Counters of a scheduler.
+        struct Statistics
+        {
+            std::vector<WorkerStatistics> workers;
+            double elapsedSeconds = 0.0;        //!< time since the scheduler started.
+
+            //! Return the fraction of the time the workers spent running tasks, in [0, 1].
+            double GetUtilization() const;
+
+            void Print(std::ostream& output) const;
+        };
+
+        //! Work-stealing pool of worker threads.
+        class TaskScheduler
+        {
+        public:
+            //! Start the workers.
+            explicit TaskScheduler(Parameters const& params = Parameters());
+
+            //! Stop the workers once all the queued tasks are done.
+            ~TaskScheduler();
+
+            TaskScheduler(TaskScheduler const&) = delete;
+            TaskScheduler& operator=(TaskScheduler const&) = delete;
+
+            size_t GetNbrWorkers() const
+            { return m_workers.size(); }
+
+            //! Queue a task calling function(range, workerIndex), in group.
+            void Submit(TaskGroup& group, Priority priority, RecordRange const& range, TaskFunction function);
+
+            //! Call function on batches of batchSize records covering range, and return once all batches are processed.
+            /*! \throw the first exception raised by function.*/
+            void ParallelFor(Priority priority, RecordRange const& range, int64_t batchSize, TaskFunction const& function);
+
+            //! Return once all the tasks of group have completed.
+            /*! \throw the first exception raised by a task of the group (once).*/
+            void Wait(TaskGroup& group);
+
+            //! Return a snapshot of the counters.
+            Statistics GetStatistics() const;
+
+        private:
+            typedef std::chrono::steady_clock Clock;
+
+            struct Task
+            {
+                std::shared_ptr<TaskFunction const> function;
+                RecordRange range;
+                TaskGroup* group;
+            };
+
+            //! Deques and counters of a worker.
+            struct Worker
+            {
+                std::mutex mutex;
+                std::deque<Task> deques[NbrPriorities];
+                std::atomic<size_t> nbrQueued{0};       //!< tasks in the deques, read without the lock.
+                std::atomic<uint64_t> nbrTasks{0};
+                std::atomic<uint64_t> nbrSteals{0};
+                std::atomic<uint64_t> nbrSleeps{0};
+                std::atomic<int64_t> busyNanoseconds{0};
+                size_t runDepth = 0;                    //!< nested tasks run by Wait, only used by the worker thread.
+                char padding[64];                       //!< keeps the counters of workers on distinct cache lines.
+            };
+
+            //! Scheduler and worker index of the calling thread, set by the worker threads.
+            struct WorkerContext
+            {
+                TaskScheduler const* scheduler;
+                size_t worker;
+            };
+
+            static WorkerContext& GetWorkerContext();
+
+            //! Worker index of the calling thread for this scheduler, -1 for other threads.
+            int64_t GetCurrentWorker() const;
+
+            //! Queue task in the deque of priority of worker.
+            void Push(size_t worker, Priority priority, Task task);
+
+            //! Wake sleeping workers after tasks are queued.
+            void WakeWorkers(bool all);
+
+            //! Take the next task for worker: its own oldest, else the newest of another worker, by priority.
+            bool TakeTask(size_t worker, Task& task);
+
+            //! Run task on worker, and complete it in its group.
+            void Run(size_t worker, Task& task);
+
+            //! Body of the worker threads.
+            void WorkerMain(size_t worker);
+
+            //! Pin the calling thread on core.
+            static void PinThread(size_t core);
+
+            Parameters const m_params;
+            Clock::time_point const m_startTime;
+            std::vector<std::unique_ptr<Worker>> m_workers;
+            std::vector<std::thread> m_threads;
+            std::atomic<size_t> m_nextWorker;           //!< round-robin target of tasks submitted from other threads.
+            std::atomic<uint64_t> m_epoch;              //!< incremented when tasks are queued.
+            std::atomic<size_t> m_nbrSleeping;
+            std::mutex m_sleepMutex;
+            std::condition_variable m_wakeCondition;
+            bool m_stopRequested;
+        };
+    }
+
+    ///////
+    // Tasks member definitions
+    //
+
+    inline Tasks::TaskGroup::~TaskGroup()
+    {
+        if (m_scheduler != nullptr && !IsDone())
+        {
+            try
+            {
+                m_scheduler->Wait(*this);
+            }
+            catch (...)
+            {
+                // the error of a task is only reported by an explicit Wait.
+            }
+        }
+        else
+        {
+            // The last task completes under the lock of the group.
+            std::lock_guard<std::mutex> lock(m_mutex);
+        }
+    }
+
+    inline double Tasks::Statistics::GetUtilization() const
+    {
+        if (workers.empty() || elapsedSeconds <= 0.0)
+            return 0.0;
+
+        double busySeconds = 0.0;
+        for (WorkerStatistics const& worker : workers)
+            busySeconds += worker.busySeconds;
+        return (std::min)(busySeconds / (elapsedSeconds * double(workers.size())), 1.0);
+    }
+
+    inline void Tasks::Statistics::Print(std::ostream& output) const
+    {
+        uint64_t nbrTasks = 0;
+        uint64_t nbrSteals = 0;
+        for (WorkerStatistics const& worker : workers)
+        {
+            nbrTasks += worker.nbrTasks;
+            nbrSteals += worker.nbrSteals;
+        }
+
+        output << "\nTask scheduler\n";
+        output << "  Workers:            " << workers.size() << " (" << std::fixed << std::setprecision(1) << 100.0 * GetUtilization() << "% busy)\n";
+        output << "  Tasks:              " << nbrTasks << " (" << nbrSteals << " stolen)\n";
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            WorkerStatistics const& worker = workers[i];
+            output << "  Worker " << std::setw(3) << i << ":         " << std::setw(5) << 100.0 * worker.busySeconds / (std::max)(elapsedSeconds, 1e-9) << "% busy, "
+                   << worker.nbrTasks << " tasks, " << worker.nbrSteals << " steals, " << worker.nbrSleeps << " sleeps\n";
+        }
+        output << std::defaultfloat;
+    }
+
+    inline Tasks::TaskScheduler::TaskScheduler(Parameters const& params)
+        : m_params(params)
+        , m_startTime(Clock::now())
+        , m_workers()
+        , m_threads()
+        , m_nextWorker(0)
+        , m_epoch(0)
+        , m_nbrSleeping(0)
+        , m_sleepMutex()
+        , m_wakeCondition()
+        , m_stopRequested(false)
+    {
+        size_t const nbrWorkers = (params.nbrWorkers != 0) ? params.nbrWorkers : (std::max)(size_t(std::thread::hardware_concurrency()), size_t(1));
+        for (size_t i = 0; i < nbrWorkers; ++i)
+            m_workers.emplace_back(new Worker());
+
+        for (size_t i = 0; i < nbrWorkers; ++i)
+            m_threads.emplace_back(&TaskScheduler::WorkerMain, this, i);
+    }
+
+    inline Tasks::TaskScheduler::~TaskScheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            m_stopRequested = true;
+        }
+        m_wakeCondition.notify_all();
+        for (std::thread& thread : m_threads)
+            thread.join();
+    }
+
+    inline void Tasks::TaskScheduler::Submit(TaskGroup& group, Priority priority, RecordRange const& range, TaskFunction function)
+    {
+        int64_t const current = GetCurrentWorker();
+        size_t const worker = (current >= 0) ? size_t(current) : m_nextWorker.fetch_add(1) % m_workers.size();
+
+        group.m_scheduler = this;
+        group.m_nbrPending.fetch_add(1);
+        Task task = { std::make_shared<TaskFunction const>(std::move(function)), range, &group };
+        Push(worker, priority, std::move(task));
+        WakeWorkers(false);
+    }
+
+    inline void Tasks::TaskScheduler::ParallelFor(Priority priority, RecordRange const& range, int64_t batchSize, TaskFunction const& function)
+    {
+        if (batchSize <= 0)
+            throw std::invalid_argument("Invalid batch size: " + ToString(batchSize));
+        if (range.count <= 0)
+            return;
+
+        TaskGroup group;
+        group.m_scheduler = this;
+        std::shared_ptr<TaskFunction const> const shared = std::make_shared<TaskFunction const>(function);
+        int64_t const nbrBatches = (range.count + batchSize - 1) / batchSize;
+        group.m_nbrPending.store(nbrBatches);
+
+        // A worker keeps the batches, the others steal them. Other threads spread them over the workers.
+        int64_t const current = GetCurrentWorker();
+        size_t const firstWorker = (current >= 0) ? size_t(current) : m_nextWorker.fetch_add(size_t(nbrBatches));
+        for (int64_t batch = 0; batch < nbrBatches; ++batch)
+        {
+            int64_t const first = range.first + batch * batchSize;
+            Task task = { shared, RecordRange{ first, (std::min)(batchSize, range.GetEnd() - first) }, &group };
+            size_t const worker = (current >= 0) ? firstWorker : (firstWorker + size_t(batch)) % m_workers.size();
+            Push(worker, priority, std::move(task));
+        }
+        WakeWorkers(nbrBatches > 1);
+
+        Wait(group);
+    }
+
+    inline void Tasks::TaskScheduler::Wait(TaskGroup& group)
+    {
+        int64_t const current = GetCurrentWorker();
+        if (current >= 0)
+        {
+            // Run tasks, of this group or not, until the group is done.
+            Task task;
+            while (!group.IsDone())
+            {
+                if (TakeTask(size_t(current), task))
+                    Run(size_t(current), task);
+                else
+                    std::this_thread::yield();
+            }
+        }
+
+        // The last task completes under the lock of the group: taking it ensures the group is no longer used once returned.
+        std::unique_lock<std::mutex> lock(group.m_mutex);
+        group.m_doneCondition.wait(lock, [&group]() { return group.m_nbrPending.load() == 0; });
+        if (group.m_error)
+        {
+            std::exception_ptr const error = group.m_error;
+            group.m_error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    inline Tasks::Statistics Tasks::TaskScheduler::GetStatistics() const
+    {
+        Statistics statistics;
+        statistics.elapsedSeconds = std::chrono::duration<double>(Clock::now() - m_startTime).count();
+        for (std::unique_ptr<Worker> const& worker : m_workers)
+        {
+            WorkerStatistics counters;
+            counters.nbrTasks = worker->nbrTasks.load(std::memory_order_relaxed);
+            counters.nbrSteals = worker->nbrSteals.load(std::memory_order_relaxed);
+            counters.nbrSleeps = worker->nbrSleeps.load(std::memory_order_relaxed);
+            counters.busySeconds = double(worker->busyNanoseconds.load(std::memory_order_relaxed)) * 1e-9;
+            statistics.workers.push_back(counters);
+        }
+        return statistics;
+    }
+
+    inline Tasks::TaskScheduler::WorkerContext& Tasks::TaskScheduler::GetWorkerContext()
+    {
+        static thread_local WorkerContext context = { nullptr, 0 };
+        return context;
+    }
+
+    inline int64_t Tasks::TaskScheduler::GetCurrentWorker() const
+    {
+        WorkerContext const& context = GetWorkerContext();
+        return (context.scheduler == this) ? int64_t(context.worker) : -1;
+    }
+
+    inline void Tasks::TaskScheduler::Push(size_t worker, Priority priority, Task task)
+    {
+        Worker& target = *m_workers[worker];
+        std::lock_guard<std::mutex> lock(target.mutex);
+        target.deques[size_t(priority)].push_back(std::move(task));
+        target.nbrQueued.fetch_add(1);
+    }
+
+    inline void Tasks::TaskScheduler::WakeWorkers(bool all)
+    {
+        m_epoch.fetch_add(1);
+        if (m_nbrSleeping.load() == 0)
+            return;
+
+        // Taking the lock orders the wake-up after the epoch check of a worker about to sleep.
+        {
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+        }
+        if (all)
+            m_wakeCondition.notify_all();
+        else
+            m_wakeCondition.notify_one();
+    }
+
+    inline bool Tasks::TaskScheduler::TakeTask(size_t worker, Task& task)
+    {
+        size_t const nbrWorkers = m_workers.size();
+        for (size_t priority = 0; priority < NbrPriorities; ++priority)
+        {
+            // Own deque: oldest task first, records are processed roughly in order.
+            Worker& own = *m_workers[worker];
+            if (own.nbrQueued.load() > 0)
+            {
+                std::lock_guard<std::mutex> lock(own.mutex);
+                std::deque<Task>& deque = own.deques[priority];
+                if (!deque.empty())
+                {
+                    task = std::move(deque.front());
+                    deque.pop_front();
+                    own.nbrQueued.fetch_sub(1);
+                    return true;
+                }
+            }
+
+            // Other deques: newest task, from the other end.
+            for (size_t offset = 1; offset < nbrWorkers; ++offset)
+            {
+                Worker& victim = *m_workers[(worker + offset) % nbrWorkers];
+                if (victim.nbrQueued.load() == 0)
+                    continue;
+
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                std::deque<Task>& deque = victim.deques[priority];
+                if (!deque.empty())
+                {
+                    task = std::move(deque.back());
+                    deque.pop_back();
+                    victim.nbrQueued.fetch_sub(1);
+                    own.nbrSteals.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    inline void Tasks::TaskScheduler::Run(size_t worker, Task& task)
+    {
+        Worker& self = *m_workers[worker];
+        TaskGroup& group = *task.group;
+        std::exception_ptr error;
+
+        Clock::time_point const start = Clock::now();
+        ++self.runDepth;
+        try
+        {
+            (*task.function)(task.range, worker);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        // Tasks run while waiting inside a task are already accounted for by the outer one.
+        if (--self.runDepth == 0)
+            self.busyNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count(), std::memory_order_relaxed);
+        self.nbrTasks.fetch_add(1, std::memory_order_relaxed);
+        task.function.reset();
+
+        std::lock_guard<std::mutex> lock(group.m_mutex);
+        if (error && !group.m_error)
+            group.m_error = error;
+        if (group.m_nbrPending.fetch_sub(1) == 1)
+            group.m_doneCondition.notify_all();
+    }
+
+    inline void Tasks::TaskScheduler::WorkerMain(size_t worker)
+    {
+        if (m_params.pinWorkers)
+            PinThread(m_params.firstCore + worker);
+
+        GetWorkerContext() = WorkerContext{ this, worker };
+
+        Worker& self = *m_workers[worker];
+        Task task;
+        unsigned idleRounds = 0;
+        for (;;)
+        {
+            uint64_t const epoch = m_epoch.load();
+            if (TakeTask(worker, task))
+            {
+                Run(worker, task);
+                idleRounds = 0;
+                continue;
+            }
+
+            // Spin on the deques for a while: new work is usually a batch away.
+            if (idleRounds < m_params.spinIterations)
+            {
+                ++idleRounds;
+                std::this_thread::yield();
+                continue;
+            }
+
+            // Sleep until tasks are queued after the last look at the deques.
+            m_nbrSleeping.fetch_add(1);
+            {
+                std::unique_lock<std::mutex> lock(m_sleepMutex);
+                if (m_stopRequested)
+                {
+                    m_nbrSleeping.fetch_sub(1);
+                    return;
+                }
+                self.nbrSleeps.fetch_add(1, std::memory_order_relaxed);
+                m_wakeCondition.wait(lock, [&]() { return m_stopRequested || m_epoch.load() != epoch; });
+            }
+            m_nbrSleeping.fetch_sub(1);
+            idleRounds = 0;
+        }
+    }
+
+    inline void Tasks::TaskScheduler::PinThread(size_t core)
+    {
+        size_t const nbrCores = (std::max)(size_t(std::thread::hardware_concurrency()), size_t(1));
+        core %= nbrCores;
+
+        // Best effort: a worker which cannot be pinned still runs.
+#if defined(_WIN32)
+        if (core < sizeof(DWORD_PTR) * 8)
+            SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << core);
+#elif defined(__linux__)
+        cpu_set_t cores;
+        CPU_ZERO(&cores);
+        CPU_SET(core, &cores);
+        pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+#else
+        (void)core;
+#endif
+    }
+}
+
+#endif
@@ -0,0 +1,466 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// TimeDelay: pairing of the records of two channels by record index, and estimation of their
+// relative delay from the cross-correlation peak, with sub-sample interpolation.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_TIMEDELAY_H
+#define LIBTOOL_TIMEDELAY_H
+
+#include "LibTool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+namespace LibTool
+{
+    //! Time delay estimation utils.
+    /*! The records of two channels acquired on the same trigger carry the same record index, but their streams are read
+        independently. #RecordPairer keeps a copy of the records of one channel until the record of the other channel with the
+        same index arrives, then hands the pair over. #Estimator computes the cross-correlation of the pair for the lags in
+        [-maxLag, maxLag], and interpolates its peak:
+
+            TimeDelay::Estimator estimator(parameters);
+            TimeDelay::RecordPairer pairer(recordSize, 64);
+
+            pairer.Add(channel, recordIndex, samples, [&](uint64_t index, int16_t const* first, int16_t const* second)
+            {
+                TimeDelay::DelayEstimate const estimate = estimator.Estimate(index, first, second, recordSize);
+                ...
+            });
+
+        A positive delay means that the signal of the second channel comes after the signal of the first one. Correlation is
+        computed directly, with a cost of recordSize x (2 maxLag + 1) multiply-adds per pair: keep maxLag to the range of the
+        expected delays (cable lengths, detector geometry). The multiply-adds of a sample over all the lags are independent, so
+        that the compiler vectorizes them without relaxed floating-point semantics.
+    */
+    namespace TimeDelay
+    {
+        //! Sub-sample interpolation of the correlation peak.
+        enum class Interpolation
+        {
+            None,           //!< lag of the highest correlation.
+            Parabolic,      //!< vertex of the parabola through the peak and its two neighbours.
+            Sinc,           //!< maximum of the band-limited (Lanczos-windowed sinc) interpolation of the correlation.
+        };
+
+        //! Estimation parameters.
+        struct Parameters
+        {
+            int32_t maxLag = 32;                                    //!< largest delay searched, in samples.
+            Interpolation interpolation = Interpolation::Parabolic;
+
+            //! \throw #std::invalid_argument if the parameters are inconsistent.
+            void Validate() const;
+        };
+
+        //! Delay between the records of a pair.
+        struct DelayEstimate
+        {
+            uint64_t recordIndex;
+            double delay;               //!< delay of the second channel relative to the first one, in samples.
+            double correlation;         //!< normalized correlation at the peak, in [-1, 1].
+            bool atLagLimit;            //!< the peak is at +/-maxLag: the actual delay may be out of the searched range.
+        };
+
+        //! Running delay statistics.
+        struct Statistics
+        {
+            uint64_t nbrRecords = 0;
+            uint64_t nbrAtLagLimit = 0;         //!< estimates at the edge of the searched range (excluded from the delay statistics).
+            double meanDelay = 0.0;             //!< in samples.
+            double m2Delay = 0.0;               //!< sum of squared deviations from the mean (Welford).
+            double minDelay = std::numeric_limits<double>::max();
+            double maxDelay = std::numeric_limits<double>::lowest();
+            double meanCorrelation = 0.0;
+            double seconds = 0.0;               //!< processing time.
+
+            //! Account estimate.
+            void Add(DelayEstimate const& estimate);
+
+            //! Return the standard deviation of the delays, in samples.
+            double GetStdDevDelay() const
+            {
+                uint64_t const count = nbrRecords - nbrAtLagLimit;
+                return (count > 1) ? std::sqrt(m2Delay / double(count - 1)) : 0.0;
+            }
+
+            //! Print statistics, delays in samples and in seconds at sampleRate.
+            void Print(std::ostream& output, double sampleRate) const;
+        };
+
+        //! Delay estimator of record pairs.
+        class Estimator
+        {
+        public:
+            //! \throw #std::invalid_argument if parameters are inconsistent.
+            explicit Estimator(Parameters const& parameters);
+
+            //! Return the delay of the nbrSamples of second relative to the nbrSamples of first, and account it in the statistics.
+            /*! \throw #std::invalid_argument if nbrSamples is not larger than 2 maxLag.*/
+            DelayEstimate Estimate(uint64_t recordIndex, int16_t const* first, int16_t const* second, int64_t nbrSamples);
+
+            //! Return the normalized correlation of the last estimate, for lags -maxLag to maxLag.
+            std::vector<double> const& GetCorrelation() const
+            { return m_correlation; }
+
+            Parameters const& GetParameters() const
+            { return m_parameters; }
+
+            Statistics const& GetStatistics() const
+            { return m_statistics; }
+
+        private:
+            //! Return the Lanczos interpolation of the correlation at lag (relative to -maxLag).
+            double InterpolateSinc(double position) const;
+
+            static int64_t const TileSamples = 1024;
+            static int const SincHalfWidth = 4;
+
+            Parameters const m_parameters;
+            std::vector<float> m_first;         //!< first record, mean removed.
+            std::vector<float> m_second;        //!< second record, mean removed.
+            std::vector<double> m_correlation;
+            std::vector<float> m_tile;          //!< correlation accumulated over a tile of samples.
+            Statistics m_statistics;
+        };
+
+        //! Matcher of the records of two channels by record index.
+        class RecordPairer
+        {
+        public:
+            //! Pair records of recordSize samples, keeping at most maxPending records of a channel waiting for the other one.
+            explicit RecordPairer(int64_t recordSize, size_t maxPending);
+
+            //! Add the record recordIndex of channel (0 or 1), and call onPair(recordIndex, firstSamples, secondSamples) if it completes a pair.
+            /*! Record indexes of a channel must increase. Records of the other channel with a lower index are unmatched and dropped.
+                \return true if a pair was completed.*/
+            template <typename Callback>
+            bool Add(size_t channel, uint64_t recordIndex, int16_t const* samples, Callback&& onPair);
+
+            uint64_t GetNbrPairs() const
+            { return m_nbrPairs; }
+
+            //! Return the number of records dropped without their pair (missing on the other channel, or too many pending).
+            uint64_t GetNbrUnmatched() const
+            { return m_nbrUnmatched; }
+
+            size_t GetPeakPending() const
+            { return m_peakPending; }
+
+        private:
+            struct PendingRecord
+            {
+                uint64_t recordIndex;
+                std::vector<int16_t> samples;
+            };
+
+            //! Remove the oldest pending record of channel, and keep its buffer for reuse.
+            void PopFront(size_t channel);
+
+            int64_t const m_recordSize;
+            size_t const m_maxPending;
+            std::deque<PendingRecord> m_pending[2];
+            std::vector<std::vector<int16_t>> m_freeBuffers;
+            uint64_t m_nbrPairs;
+            uint64_t m_nbrUnmatched;
+            size_t m_peakPending;
+        };
+    }
+
+    ///////
+    // TimeDelay member definitions
+    //
+
+    inline void TimeDelay::Parameters::Validate() const
+    {
+        if (maxLag <= 0)
+            throw std::invalid_argument("Invalid maximum lag for time delay estimation: " + ToString(maxLag));
+    }
+
+    inline void TimeDelay::Statistics::Add(DelayEstimate const& estimate)
+    {
+        ++nbrRecords;
+        meanCorrelation += (estimate.correlation - meanCorrelation) / double(nbrRecords);
+        if (estimate.atLagLimit)
+        {
+            ++nbrAtLagLimit;
+            return;
+        }
+
+        uint64_t const count = nbrRecords - nbrAtLagLimit;
+        double const deviation = estimate.delay - meanDelay;
+        meanDelay += deviation / double(count);
+        m2Delay += deviation * (estimate.delay - meanDelay);
+        minDelay = (std::min)(minDelay, estimate.delay);
+        maxDelay = (std::max)(maxDelay, estimate.delay);
+    }
+
+    inline void TimeDelay::Statistics::Print(std::ostream& output, double sampleRate) const
+    {
+        output << "\nTime delay estimation\n";
+        output << "  Record pairs:       " << nbrRecords << " (" << nbrAtLagLimit << " at the lag limit)\n";
+        if (nbrRecords > nbrAtLagLimit)
+        {
+            output << "  Delay:              " << meanDelay << " samples (" << meanDelay / sampleRate * 1e12 << " ps), std dev " << GetStdDevDelay() << " samples ("
+                   << GetStdDevDelay() / sampleRate * 1e12 << " ps)\n";
+            output << "  Delay range:        [" << minDelay << ", " << maxDelay << "] samples\n";
+        }
+        output << "  Mean correlation:   " << meanCorrelation << '\n';
+        output << "  Processing:         " << seconds << " s";
+        if (nbrRecords > 0)
+            output << " (" << seconds / double(nbrRecords) * 1e6 << " us per pair)";
+        output << '\n';
+    }
+
+    inline TimeDelay::Estimator::Estimator(Parameters const& parameters)
+        : m_parameters(parameters)
+        , m_first()
+        , m_second()
+        , m_correlation(size_t(2 * parameters.maxLag + 1), 0.0)
+        , m_tile(m_correlation.size(), 0.0f)
+        , m_statistics()
+    {
+        parameters.Validate();
+    }
+
+    inline TimeDelay::DelayEstimate TimeDelay::Estimator::Estimate(uint64_t recordIndex, int16_t const* first, int16_t const* second, int64_t nbrSamples)
+    {
+        int64_t const maxLag = m_parameters.maxLag;
+        if (nbrSamples <= 2 * maxLag)
+            throw std::invalid_argument("Records of " + ToString(nbrSamples) + " samples are too short for a maximum lag of " + ToString(maxLag));
+
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point const start = Clock::now();
+
+        // Remove the means, which would otherwise dominate the correlation.
+        size_t const n = size_t(nbrSamples);
+        int64_t sumFirst = 0;
+        int64_t sumSecond = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            sumFirst += first[i];
+            sumSecond += second[i];
+        }
+        float const meanFirst = float(double(sumFirst) / double(n));
+        float const meanSecond = float(double(sumSecond) / double(n));
+        m_first.resize(n);
+        m_second.resize(n);
+        double energyFirst = 0.0;
+        double energySecond = 0.0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            m_first[i] = float(first[i]) - meanFirst;
+            m_second[i] = float(second[i]) - meanSecond;
+            energyFirst += double(m_first[i]) * double(m_first[i]);
+            energySecond += double(m_second[i]) * double(m_second[i]);
+        }
+        double const norm = (energyFirst > 0.0 && energySecond > 0.0) ? 1.0 / std::sqrt(energyFirst * energySecond) : 0.0;
+
+        // c[lag] = sum of first[i].second[i+lag], over the samples where both exist. Samples for which every lag exists are
+        // accumulated sample by sample over all the lags: the inner loop has no reduction, so it vectorizes without fast-math.
+        // Tiles bound the number of terms summed in single precision.
+        float const* const a = m_first.data();
+        float const* const b = m_second.data();
+        size_t const nbrLags = m_correlation.size();
+        std::fill(m_correlation.begin(), m_correlation.end(), 0.0);
+        float* const tile = m_tile.data();
+        for (int64_t tileStart = maxLag; tileStart < nbrSamples - maxLag; tileStart += TileSamples)
+        {
+            int64_t const tileEnd = (std::min)(tileStart + TileSamples, nbrSamples - maxLag);
+            std::fill(m_tile.begin(), m_tile.end(), 0.0f);
+            for (int64_t i = tileStart; i < tileEnd; ++i)
+            {
+                float const sample = a[i];
+                float const* const window = b + (i - maxLag);
+                for (size_t m = 0; m < nbrLags; ++m)
+                    tile[m] += sample * window[m];
+            }
+            for (size_t m = 0; m < nbrLags; ++m)
+                m_correlation[m] += double(tile[m]);
+        }
+
+        // Edges, where only part of the lags exist.
+        for (int64_t lag = -maxLag; lag <= maxLag; ++lag)
+        {
+            double sum = 0.0;
+            for (int64_t i = (std::max)(int64_t(0), -lag); i < maxLag; ++i)
+                sum += double(a[i]) * double(b[i + lag]);
+            for (int64_t i = nbrSamples - maxLag; i < (std::min)(nbrSamples, nbrSamples - lag); ++i)
+                sum += double(a[i]) * double(b[i + lag]);
+            m_correlation[size_t(lag + maxLag)] += sum;
+        }
+
+        size_t best = 0;
+        for (size_t m = 0; m < nbrLags; ++m)
+        {
+            m_correlation[m] *= norm;
+            if (m_correlation[m] > m_correlation[best])
+                best = m;
+        }
+
+        // Sub-sample peak.
+        DelayEstimate estimate;
+        estimate.recordIndex = recordIndex;
+        estimate.correlation = m_correlation[best];
+        estimate.atLagLimit = (best == 0 || best == m_correlation.size() - 1);
+        double position = double(best);
+        if (!estimate.atLagLimit)
+        {
+            switch (m_parameters.interpolation)
+            {
+            case Interpolation::None:
+                break;
+            case Interpolation::Parabolic:
+            {
+                double const left = m_correlation[best - 1];
+                double const center = m_correlation[best];
+                double const right = m_correlation[best + 1];
+                double const curvature = left - 2.0 * center + right;
+                if (curvature < 0.0)
+                    position += 0.5 * (left - right) / curvature;
+                break;
+            }
+            case Interpolation::Sinc:
+            {
+                // The interpolated correlation is unimodal around the peak: golden-section search within one sample of it.
+                double const ratio = 0.5 * (std::sqrt(5.0) - 1.0);
+                double low = position - 1.0;
+                double high = position + 1.0;
+                double x1 = high - ratio * (high - low);
+                double x2 = low + ratio * (high - low);
+                double f1 = InterpolateSinc(x1);
+                double f2 = InterpolateSinc(x2);
+                for (int iteration = 0; iteration < 40; ++iteration)
+                {
+                    if (f1 < f2)
+                    {
+                        low = x1;
+                        x1 = x2;
+                        f1 = f2;
+                        x2 = low + ratio * (high - low);
+                        f2 = InterpolateSinc(x2);
+                    }
+                    else
+                    {
+                        high = x2;
+                        x2 = x1;
+                        f2 = f1;
+                        x1 = high - ratio * (high - low);
+                        f1 = InterpolateSinc(x1);
+                    }
+                }
+                position = 0.5 * (low + high);
+                estimate.correlation = InterpolateSinc(position);
+                break;
+            }
+            }
+        }
+        estimate.delay = position - double(maxLag);
+
+        m_statistics.Add(estimate);
+        m_statistics.seconds += std::chrono::duration<double>(Clock::now() - start).count();
+        return estimate;
+    }
+
+    inline double TimeDelay::Estimator::InterpolateSinc(double position) const
+    {
+        double const pi = 3.14159265358979323846;
+        int64_t const center = int64_t(std::floor(position));
+        int64_t const first = (std::max)(center - SincHalfWidth + 1, int64_t(0));
+        int64_t const last = (std::min)(center + SincHalfWidth, int64_t(m_correlation.size()) - 1);
+        // Weights are normalized: the ripple of the truncated kernel would otherwise pull the maximum of a wide peak.
+        double value = 0.0;
+        double weights = 0.0;
+        for (int64_t k = first; k <= last; ++k)
+        {
+            double const x = position - double(k);
+            double weight = 1.0;
+            if (x != 0.0)
+            {
+                double const px = pi * x;
+                weight = std::sin(px) / px * std::sin(px / SincHalfWidth) / (px / SincHalfWidth);
+            }
+            value += weight * m_correlation[size_t(k)];
+            weights += weight;
+        }
+        return value / weights;
+    }
+
+    inline TimeDelay::RecordPairer::RecordPairer(int64_t recordSize, size_t maxPending)
+        : m_recordSize(recordSize)
+        , m_maxPending(maxPending)
+        , m_pending()
+        , m_freeBuffers()
+        , m_nbrPairs(0)
+        , m_nbrUnmatched(0)
+        , m_peakPending(0)
+    {
+        if (recordSize <= 0 || maxPending == 0)
+            throw std::invalid_argument("Invalid record pairing: records of " + ToString(recordSize) + " samples, " + ToString(maxPending) + " pending records");
+    }
+
+    template <typename Callback>
+    inline bool TimeDelay::RecordPairer::Add(size_t channel, uint64_t recordIndex, int16_t const* samples, Callback&& onPair)
+    {
+        if (channel > 1)
+            throw std::invalid_argument("Invalid channel for record pairing: " + ToString(channel));
+
+        // Records of the other channel older than this one will never be paired.
+        std::deque<PendingRecord>& other = m_pending[1 - channel];
+        while (!other.empty() && other.front().recordIndex < recordIndex)
+        {
+            PopFront(1 - channel);
+            ++m_nbrUnmatched;
+        }
+
+        if (!other.empty() && other.front().recordIndex == recordIndex)
+        {
+            int16_t const* const otherSamples = other.front().samples.data();
+            if (channel == 0)
+                onPair(recordIndex, samples, otherSamples);
+            else
+                onPair(recordIndex, otherSamples, samples);
+            ++m_nbrPairs;
+            PopFront(1 - channel);
+            return true;
+        }
+
+        // Wait for the other channel.
+        std::deque<PendingRecord>& own = m_pending[channel];
+        if (own.size() == m_maxPending)
+        {
+            PopFront(channel);
+            ++m_nbrUnmatched;
+        }
+
+        PendingRecord record;
+        record.recordIndex = recordIndex;
+        if (!m_freeBuffers.empty())
+        {
+            record.samples.swap(m_freeBuffers.back());
+            m_freeBuffers.pop_back();
+        }
+        record.samples.assign(samples, samples + m_recordSize);
+        own.push_back(std::move(record));
+        m_peakPending = (std::max)(m_peakPending, own.size());
+        return false;
+    }
+
+    inline void TimeDelay::RecordPairer::PopFront(size_t channel)
+    {
+        std::deque<PendingRecord>& pending = m_pending[channel];
+        m_freeBuffers.push_back(std::move(pending.front().samples));
+        pending.pop_front();
+    }
+}
+
+#endif
@@ -0,0 +1,530 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// TrapezoidalFilter: trapezoidal shaping of the sample stream with pole-zero correction, energy
+// picking on the flat top, and energy histogram.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_TRAPEZOIDALFILTER_H
+#define LIBTOOL_TRAPEZOIDALFILTER_H
+
+#include "LibTool.h"
+#include "ContinuousStreaming.h"
+#include "PulseShape.h"
+#include "TaskScheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+namespace LibTool
+{
+    //! Energy shaping utils.
+    /*! The trapezoidal filter turns every exponentially decaying pulse (decay constant tau) of a preamplifier into a trapezoid
+        of rise time k, flat top l-k and height proportional to the pulse amplitude, which is the energy deposited in the
+        detector. It is computed in the recursive form of Jordanov & Knoll, for delays k and l (l = k + flat top) and the
+        pole-zero correction M = 1/(exp(1/tau)-1):
+
+            d[n] = v[n] - v[n-k] - v[n-l] + v[n-k-l]
+            p[n] = p[n-1] + d[n]
+            s[n] = s[n-1] + p[n] + M.d[n]
+
+        The output is normalized by 1/(k.(M+1)) so that the flat top is the pulse amplitude in ADC codes. Without decay (step
+        pulses, #Parameters::decaySamples = 0) the trapezoid is p[n]/k. d[n] does not depend on the baseline.
+
+        The recursion is a finite filter in disguise: p[n] is the sum over k samples of v[n] - v[n-l], and q[n], the running sum
+        of p, is the sum of v over a trapezoidal window of k+l-1 samples, so that s[n] = q[n] + M.p[n] only depends on the last
+        k+l samples. #Shaper splits every chunk of the stream (see #ContinuousStreaming::SampleChunk) in slices of
+        #Parameters::sliceSamples, computes p and q (exact integers) at the start of every slice from the k+l samples before it,
+        and shapes the slices in parallel on a #Tasks::TaskScheduler. It keeps the last k+l samples across chunks.
+
+        It triggers on the rise of the trapezoid (output minus output k+1 samples earlier above #Parameters::threshold), and takes
+        the energy as the maximum of the trapezoid over the rise and flat top minus the output before the rise, which cancels the
+        residual offset left by an imperfect pole-zero correction. The slices collect the samples above the trigger level, and the
+        picking state machine then runs over them only, in order, across slices and chunks:
+
+            Shaping::Shaper shaper(parameters, scheduler);
+            Shaping::EnergyHistogram histogram(4096, 8192.0);
+
+            events.clear();
+            shaper.Process(chunk, events);
+            histogram.Fill(events);
+
+        Segments which are not contiguous (records of triggered acquisitions) are processed after #Shaper::Restart.
+        The difference d[n] of a slice is computed in a loop the compiler vectorizes; the recursion left is two additions and one
+        multiplication per sample.
+    */
+    namespace Shaping
+    {
+        typedef PulseShape::Polarity Polarity;
+
+        //! Shaping and energy picking parameters, in samples.
+        struct Parameters
+        {
+            Polarity polarity = Polarity::Negative;
+            int32_t riseSamples = 100;          //!< k, rise time of the trapezoid.
+            int32_t flatSamples = 50;           //!< l-k, flat top of the trapezoid.
+            double decaySamples = 2500.0;       //!< decay constant tau of the pulses (0 for step pulses, no pole-zero correction).
+            double threshold = 50.0;            //!< trigger level of the rise of the trapezoid, in ADC codes.
+            int32_t sliceSamples = 65536;       //!< samples shaped per task (at least k+l).
+
+            //! \throw #std::invalid_argument if the parameters are inconsistent.
+            void Validate() const;
+        };
+
+        //! Pulse energy found by #Shaper.
+        struct EnergyEvent
+        {
+            uint64_t sampleIndex;       //!< running index of the sample where the trapezoid crossed the trigger level.
+            double energy;              //!< height of the trapezoid, in ADC codes.
+        };
+
+        //! Shaping statistics.
+        struct Statistics
+        {
+            uint64_t nbrChunks = 0;
+            uint64_t nbrSamples = 0;
+            uint64_t nbrPulses = 0;             //!< events emitted.
+            uint64_t nbrTruncated = 0;          //!< pulses lost on #Shaper::Restart before the end of their flat top.
+            double seconds = 0.0;               //!< processing time.
+
+            void Print(std::ostream& output) const;
+        };
+
+        //! Histogram of energies in [0, maxEnergy[.
+        class EnergyHistogram
+        {
+        public:
+            explicit EnergyHistogram(size_t nbrBins, double maxEnergy);
+
+            //! Count event, or count it out of range.
+            void Fill(EnergyEvent const& event);
+
+            //! Count all events.
+            void Fill(std::vector<EnergyEvent> const& events)
+            {
+                for (EnergyEvent const& event : events)
+                    Fill(event);
+            }
+
+            uint64_t GetCount(size_t bin) const
+            { return m_counts[bin]; }
+
+            size_t GetNbrBins() const
+            { return m_counts.size(); }
+
+            //! Return the energy at the center of bin.
+            double GetBinEnergy(size_t bin) const
+            { return (double(bin) + 0.5) / m_scale; }
+
+            uint64_t GetNbrEntries() const
+            { return m_nbrEntries; }
+
+            uint64_t GetNbrOutOfRange() const
+            { return m_nbrOutOfRange; }
+
+            //! Write the counts as nbrBins uint64 values (native endianness).
+            void Save(std::ostream& output) const;
+
+            void Clear();
+
+        private:
+            double const m_scale;               //!< bins per energy unit.
+            std::vector<uint64_t> m_counts;
+            uint64_t m_nbrEntries;
+            uint64_t m_nbrOutOfRange;
+        };
+
+        //! Trapezoidal filter and energy picker of an unbounded sample stream.
+        class Shaper
+        {
+        public:
+            //! Shape on the workers of scheduler.
+            /*! \throw #std::invalid_argument if parameters are inconsistent.*/
+            explicit Shaper(Parameters const& parameters, Tasks::TaskScheduler& scheduler);
+
+            //! Filter chunk and append the energies of the pulses whose flat top ends in it. Returns once all its slices are shaped.
+            /*! \return the number of events appended.
+                \throw #ContinuousStreaming::StreamGapError if chunk does not follow the previous one.*/
+            size_t Process(ContinuousStreaming::SampleChunk const& chunk, std::vector<EnergyEvent>& events);
+
+            //! Restart the filter on a new, non-contiguous, segment of the stream starting at firstSampleIndex.
+            /*! The filter starts from the level of the first sample of the segment. A pulse being picked is lost.*/
+            void Restart(uint64_t firstSampleIndex);
+
+            //! Return the trapezoid of the last chunk (one value per sample, in ADC codes).
+            std::vector<double> const& GetLastOutput() const
+            { return m_output; }
+
+            Parameters const& GetParameters() const
+            { return m_parameters; }
+
+            Statistics const& GetStatistics() const
+            { return m_statistics; }
+
+        private:
+            enum class PickState
+            {
+                Armed,          //!< waiting for the rise of a trapezoid.
+                Picking,        //!< following the rise and flat top.
+                HoldOff,        //!< waiting for the end of the fall.
+            };
+
+            //! Shape the samples [begin, end[ of the current chunk, and collect its samples above the trigger level into candidates.
+            void ShapeSlice(size_t begin, size_t end, std::vector<size_t>& candidates, std::vector<double>& scratch);
+
+            //! Return sample index of the current chunk (in [-(k+l), chunk size[) with the polarity applied.
+            int32_t GetInput(ptrdiff_t index) const
+            { return (index < ptrdiff_t(m_nbrHeadSamples)) ? m_input[size_t(index + m_k + m_l)] : m_sign * int32_t(m_samples[index]); }
+
+            //! Follow the picking state machine over the first count outputs of the current chunk, from the current state.
+            /*! \return the number of outputs consumed: count, or less when the machine is armed again.*/
+            size_t FollowPick(double const* output, size_t count, std::vector<EnergyEvent>& events);
+
+            Parameters const m_parameters;
+            Tasks::TaskScheduler& m_scheduler;
+            int32_t const m_k;
+            int32_t const m_l;
+            int32_t const m_sign;               //!< polarity applied to the samples.
+            double const m_poleZero;            //!< M.
+            double const m_gain;                //!< normalization of the output.
+            std::vector<int32_t> m_input;       //!< k+l history samples followed by the first k+l samples of the current chunk.
+            int16_t const* m_samples;           //!< of the current chunk.
+            size_t m_nbrHeadSamples;            //!< samples of the current chunk in m_input.
+            int64_t m_levelOffset;              //!< q[n] of a segment which stayed at the level of its first sample.
+            std::vector<int32_t> m_difference;
+            std::vector<double> m_output;
+            std::vector<double> m_outputHistory; //!< last k+1 outputs of the previous chunks.
+            std::vector<std::vector<size_t>> m_candidates; //!< samples above the trigger level, per slice.
+            std::vector<std::vector<double>> m_scratch;    //!< outputs before a slice, per worker.
+            bool m_primed;                      //!< history holds samples of the segment.
+            PickState m_state;
+            int32_t m_remaining;                //!< samples left in the current pick state.
+            double m_baseline;
+            double m_peak;
+            uint64_t m_eventIndex;
+            uint64_t m_nextInputIndex;          //!< running index of the next expected input sample.
+            Statistics m_statistics;
+        };
+    }
+
+    ///////
+    // Shaping member definitions
+    //
+
+    inline void Shaping::Parameters::Validate() const
+    {
+        if (riseSamples <= 0 || flatSamples < 0 || !(decaySamples >= 0.0) || !(threshold > 0.0) || sliceSamples < 2 * riseSamples + flatSamples)
+            throw std::invalid_argument("Invalid trapezoidal filter: rise " + ToString(riseSamples) + ", flat top " + ToString(flatSamples) + ", decay " + ToString(decaySamples)
+                                        + ", threshold " + ToString(threshold) + ", slices of " + ToString(sliceSamples));
+    }
+
+    inline void Shaping::Statistics::Print(std::ostream& output) const
+    {
+        output << "\nTrapezoidal shaping\n";
+        output << "  Chunks:             " << nbrChunks << " (" << (nbrSamples >> 20) << " MSamples)\n";
+        output << "  Pulses:             " << nbrPulses << " (" << nbrTruncated << " truncated)\n";
+        output << "  Processing:         " << seconds << " s";
+        if (seconds > 0.0)
+            output << " (" << double(nbrSamples) / seconds / 1e6 << " MSamples/s)";
+        output << '\n';
+    }
+
+    inline Shaping::EnergyHistogram::EnergyHistogram(size_t nbrBins, double maxEnergy)
+        : m_scale(double(nbrBins) / maxEnergy)
+        , m_counts(nbrBins, 0)
+        , m_nbrEntries(0)
+        , m_nbrOutOfRange(0)
+    {
+        if (nbrBins == 0 || !(maxEnergy > 0.0))
+            throw std::invalid_argument("Invalid energy histogram: " + ToString(nbrBins) + " bins up to " + ToString(maxEnergy));
+    }
+
+    inline void Shaping::EnergyHistogram::Fill(EnergyEvent const& event)
+    {
+        ++m_nbrEntries;
+        double const bin = event.energy * m_scale;
+        if (bin < 0.0 || bin >= double(m_counts.size()))
+        {
+            ++m_nbrOutOfRange;
+            return;
+        }
+        ++m_counts[size_t(bin)];
+    }
+
+    inline void Shaping::EnergyHistogram::Save(std::ostream& output) const
+    {
+        output.write(reinterpret_cast<char const*>(m_counts.data()), std::streamsize(m_counts.size() * sizeof(uint64_t)));
+    }
+
+    inline void Shaping::EnergyHistogram::Clear()
+    {
+        std::fill(m_counts.begin(), m_counts.end(), uint64_t(0));
+        m_nbrEntries = 0;
+        m_nbrOutOfRange = 0;
+    }
+
+    inline Shaping::Shaper::Shaper(Parameters const& parameters, Tasks::TaskScheduler& scheduler)
+        : m_parameters(parameters)
+        , m_scheduler(scheduler)
+        , m_k(parameters.riseSamples)
+        , m_l(parameters.riseSamples + parameters.flatSamples)
+        , m_sign(parameters.polarity == Polarity::Positive ? 1 : -1)
+        , m_poleZero(parameters.decaySamples > 0.0 ? 1.0 / std::expm1(1.0 / parameters.decaySamples) : 0.0)
+        , m_gain(parameters.decaySamples > 0.0 ? 1.0 / (double(parameters.riseSamples) * (m_poleZero + 1.0)) : 1.0 / double(parameters.riseSamples))
+        , m_input()
+        , m_samples(nullptr)
+        , m_nbrHeadSamples(0)
+        , m_levelOffset(0)
+        , m_difference()
+        , m_output()
+        , m_outputHistory()
+        , m_candidates()
+        , m_scratch(scheduler.GetNbrWorkers())
+        , m_primed(false)
+        , m_state(PickState::Armed)
+        , m_remaining(0)
+        , m_baseline(0.0)
+        , m_peak(0.0)
+        , m_eventIndex(0)
+        , m_nextInputIndex(0)
+        , m_statistics()
+    {
+        parameters.Validate();
+        Restart(0);
+    }
+
+    inline void Shaping::Shaper::Restart(uint64_t firstSampleIndex)
+    {
+        if (m_state == PickState::Picking)
+            ++m_statistics.nbrTruncated;
+
+        m_input.assign(size_t(m_k + m_l), 0);
+        m_outputHistory.assign(size_t(m_k + 1), 0.0);
+        m_primed = false;
+        m_levelOffset = 0;
+        m_state = PickState::Armed;
+        m_remaining = 0;
+        m_nextInputIndex = firstSampleIndex;
+    }
+
+    inline size_t Shaping::Shaper::Process(ContinuousStreaming::SampleChunk const& chunk, std::vector<EnergyEvent>& events)
+    {
+        if (chunk.firstSampleIndex != m_nextInputIndex)
+            throw ContinuousStreaming::StreamGapError("Trapezoidal filter expects sample " + ToString(m_nextInputIndex) + ", got chunk starting at " + ToString(chunk.firstSampleIndex));
+
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point const start = Clock::now();
+        size_t const firstEvent = events.size();
+        size_t const n = chunk.nbrSamples;
+        ++m_statistics.nbrChunks;
+        m_statistics.nbrSamples += n;
+        if (n == 0)
+            return 0;
+
+        // Convert the first k+l samples of the chunk behind the history, with the polarity applied. A new segment starts from the
+        // level of its first sample.
+        size_t const history = size_t(m_k + m_l);
+        if (!m_primed)
+        {
+            int32_t const level = m_sign * int32_t(chunk.samples[0]);
+            std::fill(m_input.begin(), m_input.begin() + ptrdiff_t(history), level);
+            m_levelOffset = int64_t(m_k) * int64_t(m_l) * int64_t(level);
+            m_primed = true;
+        }
+        m_samples = chunk.samples;
+        m_nbrHeadSamples = (std::min)(n, history);
+        m_input.resize(history + m_nbrHeadSamples);
+        for (size_t i = 0; i < m_nbrHeadSamples; ++i)
+            m_input[history + i] = m_sign * int32_t(chunk.samples[i]);
+
+        // Shape the slices in parallel, behind the last k+1 outputs of the previous chunks.
+        size_t const outputHistory = size_t(m_k + 1);
+        m_output.resize(outputHistory + n);
+        std::copy(m_outputHistory.begin(), m_outputHistory.end(), m_output.begin());
+        m_difference.resize(n);
+
+        size_t const sliceSamples = size_t(m_parameters.sliceSamples);
+        size_t const nbrSlices = (n + sliceSamples - 1) / sliceSamples;
+        if (m_candidates.size() < nbrSlices)
+            m_candidates.resize(nbrSlices);
+        m_scheduler.ParallelFor(Tasks::Priority::High, Tasks::RecordRange{ 0, int64_t(nbrSlices) }, 1, [&](Tasks::RecordRange const& slices, size_t worker)
+        {
+            for (int64_t slice = slices.first; slice < slices.GetEnd(); ++slice)
+            {
+                size_t const begin = size_t(slice) * sliceSamples;
+                ShapeSlice(begin, (std::min)(begin + sliceSamples, n), m_candidates[size_t(slice)], m_scratch[worker]);
+            }
+        });
+
+        // Energy picking: finish the pick (or hold-off) of the previous chunk, then arm on the first candidate after every pick.
+        double const* const output = m_output.data() + outputHistory;
+        size_t next = FollowPick(output, n, events);
+        for (size_t slice = 0; slice < nbrSlices; ++slice)
+        {
+            for (size_t const i : m_candidates[slice])
+            {
+                if (i < next)
+                    continue;
+
+                m_state = PickState::Picking;
+                m_remaining = m_l;
+                m_baseline = output[ptrdiff_t(i) - m_k - 1];
+                m_peak = output[i];
+                m_eventIndex = chunk.firstSampleIndex + i;
+                next = i + 1 + FollowPick(output + i + 1, n - i - 1, events);
+            }
+        }
+
+        // Keep the last k+l samples and k+1 outputs for the next chunk.
+        if (n >= history)
+        {
+            for (size_t i = 0; i < history; ++i)
+                m_input[i] = m_sign * int32_t(chunk.samples[n - history + i]);
+        }
+        else
+            std::copy(m_input.begin() + ptrdiff_t(n), m_input.end(), m_input.begin());
+        m_input.resize(history);
+        std::copy(m_output.end() - ptrdiff_t(outputHistory), m_output.end(), m_outputHistory.begin());
+        m_nextInputIndex = chunk.GetEndSampleIndex();
+
+        size_t const nbrEvents = events.size() - firstEvent;
+        m_statistics.nbrPulses += nbrEvents;
+        m_statistics.seconds += std::chrono::duration<double>(Clock::now() - start).count();
+        return nbrEvents;
+    }
+
+    inline void Shaping::Shaper::ShapeSlice(size_t begin, size_t end, std::vector<size_t>& candidates, std::vector<double>& scratch)
+    {
+        ptrdiff_t const k = m_k;
+        ptrdiff_t const l = m_l;
+        ptrdiff_t const history = k + l;
+        int32_t* const difference = m_difference.data();
+        double* const output = m_output.data() + (k + 1);
+
+        // d[n] = v[n] - v[n-k] - v[n-l] + v[n-k-l]: independent per sample. Past the first k+l samples of the chunk, it is read
+        // straight from the chunk in a loop the compiler vectorizes.
+        for (size_t i = begin; i < (std::min)(end, size_t(history)); ++i)
+        {
+            ptrdiff_t const j = ptrdiff_t(i);
+            difference[i] = GetInput(j) - GetInput(j - k) - GetInput(j - l) + GetInput(j - k - l);
+        }
+        int16_t const* const samples = m_samples;
+        int32_t const sign = m_sign;
+        for (size_t i = (std::max)(begin, size_t(history)); i < end; ++i)
+        {
+            ptrdiff_t const j = ptrdiff_t(i);
+            difference[i] = sign * (int32_t(samples[j]) - int32_t(samples[j - k]) - int32_t(samples[j - l]) + int32_t(samples[j - k - l]));
+        }
+
+        // p and q at the sample before the slice, from the k+l samples before it: p is the sum of v[m] - v[m-l] over k samples,
+        // q the sum over l samples of the sums of v over k samples.
+        ptrdiff_t const last = ptrdiff_t(begin) - 1;
+        int64_t p = 0;
+        int64_t window = 0;
+        for (ptrdiff_t j = 0; j < k; ++j)
+        {
+            p += GetInput(last - j) - GetInput(last - j - l);
+            window += GetInput(last - l + 1 - j);
+        }
+        int64_t q = window;
+        for (ptrdiff_t m = last - l + 2; m <= last; ++m)
+        {
+            window += GetInput(m) - GetInput(m - k);
+            q += window;
+        }
+        q -= m_levelOffset;
+
+        bool const decay = m_parameters.decaySamples > 0.0;
+        double const poleZero = m_poleZero;
+        double const gain = m_gain;
+
+        // The k+1 outputs before the slice, which the trigger compares with: the recursion backwards from the slice start. Those
+        // of the first slice are the outputs of the previous chunk.
+        double const* before = output + ptrdiff_t(begin) - (k + 1);
+        if (begin > 0)
+        {
+            scratch.resize(size_t(k + 1));
+            int64_t pm = p;
+            int64_t qm = q;
+            for (ptrdiff_t j = k; j >= 0; --j)
+            {
+                scratch[size_t(j)] = decay ? (double(qm) + poleZero * double(pm)) * gain : double(pm) * gain;
+                ptrdiff_t const m = ptrdiff_t(begin) - (k + 1) + j;
+                qm -= pm;
+                pm -= GetInput(m) - GetInput(m - k) - GetInput(m - l) + GetInput(m - k - l);
+            }
+            before = scratch.data();
+        }
+
+        // Recursion.
+        if (decay)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                p += difference[i];
+                q += p;
+                output[i] = (double(q) + poleZero * double(p)) * gain;
+            }
+        }
+        else
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                p += difference[i];
+                output[i] = double(p) * gain;
+            }
+        }
+
+        // Samples where the rise of the trapezoid is above the trigger level.
+        double const threshold = m_parameters.threshold;
+        size_t const split = (std::min)(end, begin + size_t(k + 1));
+        candidates.clear();
+        for (size_t i = begin; i < split; ++i)
+        {
+            if (output[i] - before[i - begin] >= threshold)
+                candidates.push_back(i);
+        }
+        for (size_t i = split; i < end; ++i)
+        {
+            if (output[i] - output[i - size_t(k + 1)] >= threshold)
+                candidates.push_back(i);
+        }
+    }
+
+    inline size_t Shaping::Shaper::FollowPick(double const* output, size_t count, std::vector<EnergyEvent>& events)
+    {
+        size_t i = 0;
+        if (m_state == PickState::Picking)
+        {
+            size_t const nbrPicked = (std::min)(count, size_t(m_remaining));
+            for (; i < nbrPicked; ++i)
+                m_peak = (std::max)(m_peak, output[i]);
+            m_remaining -= int32_t(nbrPicked);
+            if (m_remaining > 0)
+                return i;
+
+            EnergyEvent event;
+            event.sampleIndex = m_eventIndex;
+            event.energy = m_peak - m_baseline;
+            events.push_back(event);
+            m_state = PickState::HoldOff;
+            m_remaining = m_k + 1;
+        }
+        if (m_state == PickState::HoldOff)
+        {
+            size_t const nbrHeld = (std::min)(count - i, size_t(m_remaining));
+            i += nbrHeld;
+            m_remaining -= int32_t(nbrHeld);
+            if (m_remaining == 0)
+                m_state = PickState::Armed;
+        }
+        return i;
+    }
+}
+
+#endif
@@ -0,0 +1,365 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) Acqiris SA 2019-2023
+//--------------------------------------------------------------------------------------------------
+// ZeroSuppressTuning: baseline and noise statistics of a calibration window acquired without data
+// reduction, and recommendation of the ZeroSuppress settings for a target false-gate rate.
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef LIBTOOL_ZEROSUPPRESSTUNING_H
+#define LIBTOOL_ZEROSUPPRESSTUNING_H
+
+#include "LibTool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+namespace LibTool
+{
+    //! ZeroSuppress tuning utils.
+    /*! A ZeroSuppress gate opens on the first sample above the threshold, and closes on the first sample below threshold minus
+        hysteresis. A threshold too close to the baseline opens gates on noise (poor suppression, high data rate), a threshold
+        too far from it loses the small pulses. #NoiseHistogram accumulates the samples of a calibration window acquired in
+        normal mode (no data reduction) on the baseline of the signal, along with the number of times each level is crossed
+        upwards. #Recommend derives from it:
+
+            - the threshold for which noise opens #Target::falseGateRate gates per second: the rate of up-crossings of a level t
+              by Gaussian noise of baseline b and deviation s is r0.exp(-(t-b)^2 / (2 s^2)) (Rice), with r0 measured at the
+              baseline. The threshold is raised further if the measured rate of the calibration window is higher (heavier tails).
+            - the hysteresis which closes the gates #Target::stopSigmas noise deviations above the baseline.
+            - the pre-gate and post-gate samples of the target, and the predicted data rate of the stream:
+
+            ZeroSuppressTuning::NoiseHistogram histogram;
+            for (every record of the calibration window)
+                histogram.Add(samples, recordSize);
+
+            ZeroSuppressTuning::NoiseStatistics const noise = ZeroSuppressTuning::Analyze(histogram, sampleRate);
+            ZeroSuppressTuning::Recommendation const settings = ZeroSuppressTuning::Recommend(noise, histogram, target, processingParams, recordRate, recordSize);
+
+        The calibration window must hold no pulse, or very few: the baseline and deviation are estimated from percentiles, which
+        pulses hardly move, but their edges are counted as crossings. Samples are counted into interleaved sub-histograms so that
+        consecutive samples of the same level do not wait for each other's increment, and every sample also carries its share of
+        the crossing counts into the same entry (one read-modify-write per sample).
+    */
+    namespace ZeroSuppressTuning
+    {
+        //! Histogram of the sample levels, and of their upward crossings.
+        class NoiseHistogram
+        {
+        public:
+            static size_t const NbrLevels = 65536;
+
+            explicit NoiseHistogram();
+
+            //! Account the nbrSamples consecutive samples of a segment (a record).
+            void Add(int16_t const* samples, size_t nbrSamples);
+
+            //! Return the number of samples of level.
+            uint64_t GetCount(int32_t level) const
+            {
+                Fold();
+                return m_counts[size_t(level - INT16_MIN)];
+            }
+
+            //! Return the number of times the signal went from below level to level or above it.
+            uint64_t GetUpCrossings(int32_t level) const
+            {
+                Fold();
+                return m_upCrossings[size_t(level - INT16_MIN)];
+            }
+
+            //! Return the lowest level with at least fraction of the samples at or below it.
+            int32_t GetPercentile(double fraction) const;
+
+            uint64_t GetNbrSamples() const
+            { return m_nbrSamples; }
+
+            //! Return the number of pairs of consecutive samples (the opportunities to cross a level).
+            uint64_t GetNbrTransitions() const
+            { return m_nbrTransitions; }
+
+            void Clear();
+
+        private:
+            static size_t const NbrSubHistograms = 4;
+
+            //! Add the sub-histograms into the totals, and update the up-crossings of every level.
+            void Fold() const;
+
+            mutable std::vector<uint64_t> m_counts;
+            mutable std::vector<uint64_t> m_subCounts;   //!< NbrSubHistograms interleaved histograms: sample counts (low 32 bits) and crossing steps (high 32 bits), folded before overflow.
+            mutable uint64_t m_pendingSamples;          //!< samples counted in the sub-histograms.
+            mutable std::vector<int64_t> m_crossingSteps; //!< up-crossings of level l: sum of the steps up to l.
+            mutable std::vector<uint64_t> m_upCrossings;
+            uint64_t m_nbrSamples;
+            uint64_t m_nbrTransitions;
+        };
+
+        //! Baseline and noise of the calibration window, in ADC codes.
+        struct NoiseStatistics
+        {
+            uint64_t nbrSamples = 0;
+            double durationSeconds = 0.0;       //!< acquisition time of the samples.
+            int32_t minLevel = 0;
+            int32_t maxLevel = 0;
+            double baseline = 0.0;              //!< median level.
+            double sigma = 0.0;                 //!< half the distance between the 15.87% and 84.13% percentiles (standard deviation of Gaussian noise).
+            double mean = 0.0;
+            double rms = 0.0;                   //!< standard deviation of the samples.
+            double baselineCrossingRate = 0.0;  //!< up-crossings of the baseline per second.
+
+            void Print(std::ostream& output) const;
+        };
+
+        //! Tuning target.
+        struct Target
+        {
+            double falseGateRate = 1.0;         //!< gates opened by noise per second.
+            double stopSigmas = 2.0;            //!< gate closing level, in noise deviations above the baseline.
+            int32_t preGateSamples = 16;        //!< samples kept before every gate (baseline of the pulse).
+            int32_t postGateSamples = 32;       //!< samples kept after every gate (tail of the pulse below the closing level).
+            double pulseRate = 0.0;             //!< expected pulses per second, for the data rate prediction.
+            double pulseGateSamples = 32.0;     //!< expected samples of a pulse above the closing level.
+        };
+
+        //! Recommended settings, and predictions.
+        struct Recommendation
+        {
+            int32_t threshold = 0;
+            int32_t hysteresis = 0;
+            int32_t preGateSamples = 0;
+            int32_t postGateSamples = 0;
+            double falseGateRate = 0.0;         //!< predicted by the Gaussian model, per second.
+            double measuredFalseGateRate = 0.0; //!< up-crossings of the threshold in the calibration window, per second.
+            double dataRate = 0.0;              //!< predicted stream data rate (samples and markers), in bytes per second.
+            double fullDataRate = 0.0;          //!< stream data rate without data reduction, in bytes per second.
+
+            void Print(std::ostream& output) const;
+        };
+
+        //! Return the statistics of histogram, for samples acquired at sampleRate.
+        /*! \throw #std::invalid_argument if histogram is empty.*/
+        NoiseStatistics Analyze(NoiseHistogram const& histogram, double sampleRate);
+
+        //! Return the settings meeting target on the noise of the calibration window, and the data rate predicted for records of recordSize samples at recordRate.
+        /*! params are the processing parameters of the model, their pre-gate and post-gate samples are ignored.*/
+        Recommendation Recommend(NoiseStatistics const& noise, NoiseHistogram const& histogram, Target const& target, ZeroSuppress::ProcessingParameters const& params,
+                                 double recordRate, int64_t recordSize);
+    }
+
+    ///////
+    // ZeroSuppressTuning member definitions
+    //
+
+    inline ZeroSuppressTuning::NoiseHistogram::NoiseHistogram()
+        : m_counts(NbrLevels, 0)
+        , m_subCounts(NbrLevels * NbrSubHistograms, 0)
+        , m_pendingSamples(0)
+        , m_crossingSteps(NbrLevels + 1, 0)
+        , m_upCrossings(NbrLevels, 0)
+        , m_nbrSamples(0)
+        , m_nbrTransitions(0)
+    {}
+
+    inline void ZeroSuppressTuning::NoiseHistogram::Add(int16_t const* samples, size_t nbrSamples)
+    {
+        // A rise from a to b crosses the levels ]a, b]: one step up at a+1, one step down at b+1. Sample k is the end of the
+        // transition from k-1 and the start of the transition to k+1, so the steps at its level+1 sum up to rising(k+1) - rising(k).
+        // They are added to the high half of the sample count entry.
+        auto const entry = [](uint32_t risingIn, uint32_t risingOut)
+        { return uint64_t(1) + (uint64_t(int64_t(int32_t(risingOut) - int32_t(risingIn))) << 32); };
+
+        // Keep every sub-histogram count below 2^32, and every sum of steps in the range of int32_t.
+        size_t const maxPending = size_t(std::numeric_limits<int32_t>::max());
+        uint32_t risingIn = 0;
+        size_t offset = 0;
+        while (offset < nbrSamples)
+        {
+            if (m_pendingSamples >= maxPending)
+                Fold();
+            size_t const count = (std::min)(nbrSamples - offset, size_t(maxPending - m_pendingSamples));
+            size_t const end = offset + count;
+
+            // Consecutive samples go to different sub-histograms. The last sample of the segment starts no transition.
+            uint64_t* const sub = m_subCounts.data();
+            size_t const last = (std::min)(end, nbrSamples - 1);
+            size_t k = offset;
+            for (; k + NbrSubHistograms <= last; k += NbrSubHistograms)
+            {
+                for (size_t j = 0; j < NbrSubHistograms; ++j)
+                {
+                    int32_t const level = samples[k + j] - INT16_MIN;
+                    uint32_t const risingOut = (samples[k + j + 1] - INT16_MIN > level) ? 1 : 0;
+                    sub[j * NbrLevels + size_t(level)] += entry(risingIn, risingOut);
+                    risingIn = risingOut;
+                }
+            }
+            for (; k < last; ++k)
+            {
+                int32_t const level = samples[k] - INT16_MIN;
+                uint32_t const risingOut = (samples[k + 1] - INT16_MIN > level) ? 1 : 0;
+                sub[size_t(level)] += entry(risingIn, risingOut);
+                risingIn = risingOut;
+            }
+            if (end == nbrSamples)
+                sub[size_t(samples[nbrSamples - 1] - INT16_MIN)] += entry(risingIn, 0);
+
+            m_pendingSamples += count;
+            offset = end;
+        }
+
+        m_nbrSamples += nbrSamples;
+        m_nbrTransitions += (nbrSamples > 0) ? nbrSamples - 1 : 0;
+    }
+
+    inline void ZeroSuppressTuning::NoiseHistogram::Fold() const
+    {
+        if (m_pendingSamples == 0)
+            return;
+
+        for (size_t j = 0; j < NbrSubHistograms; ++j)
+        {
+            uint64_t* const sub = m_subCounts.data() + j * NbrLevels;
+            for (size_t level = 0; level < NbrLevels; ++level)
+            {
+                m_counts[level] += uint32_t(sub[level]);
+                m_crossingSteps[level + 1] += int32_t(uint32_t(sub[level] >> 32));
+            }
+            std::fill(sub, sub + NbrLevels, uint64_t(0));
+        }
+        m_pendingSamples = 0;
+
+        int64_t crossings = 0;
+        for (size_t level = 0; level < NbrLevels; ++level)
+        {
+            crossings += m_crossingSteps[level];
+            m_upCrossings[level] = uint64_t(crossings);
+        }
+    }
+
+    inline int32_t ZeroSuppressTuning::NoiseHistogram::GetPercentile(double fraction) const
+    {
+        Fold();
+        double const rank = fraction * double(m_nbrSamples);
+        uint64_t cumulated = 0;
+        for (size_t level = 0; level < NbrLevels; ++level)
+        {
+            cumulated += m_counts[level];
+            if (cumulated > 0 && double(cumulated) >= rank)
+                return int32_t(level) + INT16_MIN;
+        }
+        return INT16_MAX;
+    }
+
+    inline void ZeroSuppressTuning::NoiseHistogram::Clear()
+    {
+        std::fill(m_counts.begin(), m_counts.end(), uint64_t(0));
+        std::fill(m_subCounts.begin(), m_subCounts.end(), uint64_t(0));
+        std::fill(m_crossingSteps.begin(), m_crossingSteps.end(), int64_t(0));
+        std::fill(m_upCrossings.begin(), m_upCrossings.end(), uint64_t(0));
+        m_pendingSamples = 0;
+        m_nbrSamples = 0;
+        m_nbrTransitions = 0;
+    }
+
+    inline void ZeroSuppressTuning::NoiseStatistics::Print(std::ostream& output) const
+    {
+        output << "\nCalibration window\n";
+        output << "  Samples:            " << nbrSamples << " (" << durationSeconds * 1e3 << " ms)\n";
+        output << "  Levels:             [" << minLevel << ", " << maxLevel << "]\n";
+        output << "  Baseline:           " << baseline << " (mean " << mean << ")\n";
+        output << "  Noise:              " << sigma << " (rms " << rms << ")\n";
+        output << "  Baseline crossings: " << baselineCrossingRate / 1e6 << " M/s\n";
+    }
+
+    inline void ZeroSuppressTuning::Recommendation::Print(std::ostream& output) const
+    {
+        output << "\nRecommended ZeroSuppress settings\n";
+        output << "  Threshold:          " << threshold << '\n';
+        output << "  Hysteresis:         " << hysteresis << '\n';
+        output << "  PreGate Samples:    " << preGateSamples << '\n';
+        output << "  PostGate Samples:   " << postGateSamples << '\n';
+        output << "  False gates:        " << falseGateRate << " /s (" << measuredFalseGateRate << " /s measured)\n";
+        output << "  Data rate:          " << dataRate / (1024 * 1024) << " MB/s (" << fullDataRate / (1024 * 1024) << " MB/s without ZeroSuppress)\n";
+    }
+
+    inline ZeroSuppressTuning::NoiseStatistics ZeroSuppressTuning::Analyze(NoiseHistogram const& histogram, double sampleRate)
+    {
+        if (histogram.GetNbrSamples() == 0)
+            throw std::invalid_argument("Cannot analyze the noise of an empty calibration window");
+
+        NoiseStatistics noise;
+        noise.nbrSamples = histogram.GetNbrSamples();
+        noise.durationSeconds = double(noise.nbrSamples) / sampleRate;
+        noise.minLevel = histogram.GetPercentile(0.0);
+        noise.maxLevel = histogram.GetPercentile(1.0);
+        noise.baseline = double(histogram.GetPercentile(0.5));
+        noise.sigma = 0.5 * double(histogram.GetPercentile(0.8413) - histogram.GetPercentile(0.1587));
+
+        double sum = 0.0;
+        double sumSquares = 0.0;
+        for (int32_t level = noise.minLevel; level <= noise.maxLevel; ++level)
+        {
+            double const count = double(histogram.GetCount(level));
+            sum += count * double(level);
+            sumSquares += count * double(level) * double(level);
+        }
+        noise.mean = sum / double(noise.nbrSamples);
+        noise.rms = std::sqrt((std::max)(sumSquares / double(noise.nbrSamples) - noise.mean * noise.mean, 0.0));
+
+        // Levels are integers: cross the level just above the baseline (the median itself is crossed by half the ties).
+        noise.baselineCrossingRate = double(histogram.GetUpCrossings(int32_t(std::floor(noise.baseline)) + 1)) / noise.durationSeconds;
+        return noise;
+    }
+
+    inline ZeroSuppressTuning::Recommendation ZeroSuppressTuning::Recommend(NoiseStatistics const& noise, NoiseHistogram const& histogram, Target const& target,
+                                                                             ZeroSuppress::ProcessingParameters const& params, double recordRate, int64_t recordSize)
+    {
+        if (!(target.falseGateRate > 0.0) || target.stopSigmas < 0.0 || target.preGateSamples < 0 || target.postGateSamples < 0)
+            throw std::invalid_argument("Invalid ZeroSuppress target: " + ToString(target.falseGateRate) + " false gates/s, closing " + ToString(target.stopSigmas) + " sigmas");
+
+        // A null deviation (quiet or saturated input) still needs the threshold one code above the baseline.
+        double const sigma = (std::max)(noise.sigma, 0.5);
+        double const ratio = noise.baselineCrossingRate / target.falseGateRate;
+        double const modelOffset = (ratio > 1.0) ? sigma * std::sqrt(2.0 * std::log(ratio)) : sigma;
+        int32_t threshold = int32_t(std::ceil(noise.baseline + modelOffset));
+
+        // Heavier tails than Gaussian: raise the threshold until the calibration window agrees (within its resolution).
+        double const maxCrossings = target.falseGateRate * noise.durationSeconds;
+        while (threshold < INT16_MAX && double(histogram.GetUpCrossings(threshold)) > (std::max)(maxCrossings, 1.0))
+            ++threshold;
+        threshold = (std::min)(threshold, int32_t(INT16_MAX));
+
+        Recommendation settings;
+        settings.threshold = threshold;
+        int32_t const stopLevel = int32_t(std::floor(noise.baseline + target.stopSigmas * sigma));
+        settings.hysteresis = (std::max)(threshold - stopLevel, int32_t(1));
+        settings.preGateSamples = target.preGateSamples;
+        settings.postGateSamples = target.postGateSamples;
+        double const offset = double(threshold) - noise.baseline;
+        settings.falseGateRate = noise.baselineCrossingRate * std::exp(-offset * offset / (2.0 * sigma * sigma));
+        settings.measuredFalseGateRate = double(histogram.GetUpCrossings(threshold)) / noise.durationSeconds;
+
+        // Stored samples of a gate: whole processing blocks, pre/post-gate samples, storage alignment. A false gate spans one block.
+        auto const storedSamples = [&](double gateSamples) -> double
+        {
+            int64_t const blocks = int64_t(std::ceil(gateSamples / double(params.processingBlockSamples)));
+            return double(AlignUp<int64_t>(blocks * params.processingBlockSamples + settings.preGateSamples + settings.postGateSamples, params.storageBlockSamples));
+        };
+        // Gates only open inside records: scale the rates by the fraction of the time covered by records.
+        double const sampleInterval = noise.durationSeconds / double(noise.nbrSamples);
+        double const dutyCycle = (std::min)(recordRate * double(recordSize) * sampleInterval, 1.0);
+        double const gatesPerRecord = (recordRate > 0.0) ? (target.pulseRate + settings.falseGateRate) * dutyCycle / recordRate : 0.0;
+        double const markerElementsPerRecord = double(AlignUp<int64_t>(16 + 4 * int64_t(std::ceil(gatesPerRecord)), 16));
+        double const sampleBytes = (target.pulseRate * storedSamples(target.pulseGateSamples) + settings.falseGateRate * storedSamples(1.0)) * dutyCycle * sizeof(int16_t);
+        settings.dataRate = sampleBytes + recordRate * markerElementsPerRecord * sizeof(int32_t);
+        settings.fullDataRate = recordRate * (double(recordSize) * sizeof(int16_t) + 16 * sizeof(int32_t));
+        return settings;
+    }
+}
+
+#endif
@@ -12,6 +12,27 @@
 ///
 
 #include "LibTool.h"
+#include "FaultInjection.h"
+#include "MemoryProfiler.h"
+namespace MemoryProfiler = LibTool::MemoryProfiler;
+#include "ClockCorrelation.h"
+namespace ClockCorrelation = LibTool::ClockCorrelation;
+#include "CalibrationCache.h"
+namespace Calibration = LibTool::Calibration;
+#include "SessionScheduler.h"
+namespace SessionScheduling = LibTool::SessionScheduling;
+#include "SpillBuffer.h"
+namespace Spill = LibTool::Spill;
+#include "StreamBatchReader.h"
+namespace StreamReading = LibTool::StreamReading;
+#include "CaptureSegments.h"
+namespace Capture = LibTool::Capture;
+#include "PulseShape.h"
+namespace PulseShape = LibTool::PulseShape;
+#include "OutlierDetector.h"
+namespace Outliers = LibTool::Outliers;
+#include "SoftwareTrigger.h"
+namespace SoftwareTrigger = LibTool::SoftwareTrigger;
 #include <filesystem>
 using LibTool::ToString;
 #include <AqMD3.h>
@@ -37,37 +58,26 @@ using std::this_thread::sleep_for;
 #include <fstream>
 #include <queue>
 #include <functional>
+#include <memory>
 
 
 #define checkApiCall( f ) do { ViStatus s = f; testApiCall( s, #f ); } while( false )
 
-typedef std::vector<int32_t> FetchBuffer;
+typedef StreamReading::StreamBatchReader<MemoryProfiler::TrackedVector<int32_t>> FetchReader;
 
 //! Validate success status of the given functionName.
 void testApiCall(ViStatus status, char const* functionName);
 
-//! Fetch all elements available on module for stream streamName.
-/*! The resulting array segment might be empty if no data are available on module.
-     \param[in] session: session handle associated with the instrument to read from.
-     \param[in] streamName: the stream identifier to read from.
-     \param[in] maxElementsToFetch: the maximum number of elements to read.
-     \param[in] buffer: buffer used by fetch for read operation.
-     \return the array-segment delimiting actual valid data returned by the instrument. The segment might be empty if no data has been read.*/
-LibTool::ArraySegment<int32_t> FetchAvailableElements(ViSession session, ViConstString streamName, ViInt64 maxElementsToFetch, FetchBuffer& buffer);
-
-//! Perform a fetch of exact 'nbrElementsToFetch' elements into the given fetch "buffer".
-/*! This is a wrapper for low-level function #AqMD3_StreamFetchDataInt32 which adds the following:
-      - Return an array-segment to delimit the fetched elements in user-provided buffer.
-      - Handle the case where the user request to fetch 0 elements from the stream by returning an empty array-segment. This might be useful when
-        all the samples of a record are suppressed (i.e. nothing to read from sample stream).
-      - Check the consistency of returned
-    \param[in] session: session handle associated with the instrument to read from.
-    \param[in] streamName: the stream identifier to read from.
-    \param[in] nbrElementsToFetch: the number of elements to read.
-    \param[in] buffer: buffer used by fetch for read operation.
-    \return the array-segment delimiting actual valid data returned by the instrument. The segment might be empty if no data has been read.
-    \throw #std::runtime_error when the buffer size is too small for the requested fetch, or the number fetched elements is different than requested.*/
-LibTool::ArraySegment<int32_t> FetchElements(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, FetchBuffer& buffer);
+//! Fetch the markers available on the module, and the samples of the records they describe, into batch.
+/*! The batch holds the markers in part 0 and the samples in part 1, its tag is the host time of the marker fetch (#ClockCorrelation::HostClock ticks).
+    \return false if no marker is available.*/
+bool FetchRecordBatch(FetchReader& markerReader, FetchReader& sampleReader, Spill::Batch& batch);
+
+//! Fetch the markers available on the module, and the samples of the records they describe straight into capture.
+/*! The markers are validated (tag and record index, from expectedRecordIndex) before the samples are committed, then a header is added to the
+    index of the current capture segment for every record.
+    \return the number of captured records, 0 if no marker is available.*/
+int64_t CaptureRecordBatch(FetchReader& markerReader, FetchReader& sampleReader, Capture::SegmentedCapture& capture, ViInt64& expectedRecordIndex);
 
 //! Save waveform information into output stream
 std::string SaveRecord(LibTool::TriggerMarker const& triggerMarker, ViInt64 nbrRecordElements, LibTool::ArraySegment<int32_t> const& elementBuffer, double timestampInterval, std::ostream& output);
@@ -150,9 +160,97 @@ namespace
     //It allows continuous, real-time streaming instead of just grabbing one batch and stopping
     auto const streamingDuration = minutes(2);
 
+    /* Fault injection parameters, used to exercise the recovery paths of the fetch helpers under load.
+       NOTE: Keep all rates at zero for normal operation, fetch calls are then forwarded untouched to the driver.*/
+    uint64_t const faultInjectionSeed = 0x5eed;
+    LibTool::FaultInjection::FaultRates const faultInjectionRates = {};
+
+    /* Session scheduling: the fetch loop and the temperature monitor share the session. All their driver calls go through the
+       scheduler, fetches first, so monitoring reads never delay a fetch by more than one call.*/
+    auto const temperatureMaxAge = seconds(1);
+    SessionScheduling::Scheduler sessionScheduler(AqMD3_StreamFetchDataInt32);
+
+    //Every fetch goes through this interposer instead of calling AqMD3_StreamFetchDataInt32 directly
+    LibTool::FaultInjection::StreamFetchInterposer streamFetch(sessionScheduler.GetFetchFunction(), LibTool::FaultInjection::Schedule(faultInjectionSeed, faultInjectionRates));
+
+    /* Memory instrumentation: buffers and queues are accounted per component (only when enabled), and bytes moved per stage.
+       NOTE: set the footprint cap (in bytes) to abort the streaming before the host runs short of memory for analysis. 0 means no limit.*/
+    bool const memoryProfilingEnabled = true;
+    int64_t const memoryFootprintCap = 0;
+
+    /* Trigger-to-result latency: the host clock is sampled against the newest marker timestamp after every marker fetch, and the
+       fitted clock relation converts the trigger time of every processed record into host time.
+       NOTE: latencies exclude the minimum transfer delay (see ClockCorrelation.h), set it as transport delay when it is known.*/
+    bool const latencyMonitoringEnabled = true;
+    auto const clockSamplingInterval = milliseconds(100);
+    auto const latencyReportInterval = seconds(10);
+    double const latencyTransportDelay = 0.0;
+
+    /* Calibration profile cache: the calibration of each (instrument, configuration, temperature band) is saved once and loaded
+       instead of running the self-calibration again. The board temperature is monitored while streaming, and the instrument is
+       recalibrated once stopped if it has drifted out of the band of the loaded profile.
+       NOTE: when enabled, the example creates the cache directory and may skip AqMD3_SelfCalibrate for a profile up to
+       calibrationMaxAge old.*/
+    bool const calibrationCacheEnabled = false;
+    std::string const calibrationCacheDirectory("CalibrationProfiles");
+    double const calibrationTemperatureBand = 5.0;
+    auto const calibrationMaxAge = std::chrono::hours(24);
+    auto const temperatureMonitorInterval = seconds(5);
+
+    /* Spill buffer: records are fetched from a dedicated thread and queued for processing. Past the high-water mark, batches of
+       records are written to a preallocated scratch file (unbuffered I/O), and processed from it in order once processing
+       catches up. A processing stall then delays records instead of overflowing the device memory.
+       NOTE: put the scratch file on a fast local drive (NVMe), and size it for the longest stall to absorb.*/
+    bool const spillEnabled = false;
+    std::string const spillFileName("Streaming.spill");
+    int64_t const spillFileSize = int64_t(8) << 30;
+    size_t const spillHighWaterBatches = 16;
+
+    /* Raw capture: the samples of every batch are fetched straight into the pages of a preallocated, memory-mapped capture file,
+       and committed once the markers of the batch are validated. A header per record goes to the index file (capture file + ".idx").
+       Records are neither spilled nor unpacked in this mode: fetching is the only data movement.
+       The capture is split in segment files (rawCapturePrefix_00000.cap, ...) of rawCaptureSegmentSize bytes or rawCaptureSegmentDuration,
+       created ahead of time in the background, and listed with their record and timestamp ranges in rawCapturePrefix.manifest.
+       Committed data are synced and journaled (capture file + ".jnl") every rawCaptureCommitBytes or rawCaptureCommitInterval:
+       after a crash, "CPP_Tool_CaptureRecovery rawCapturePrefix" truncates the segment missing from the manifest to its last group
+       commit, losing at most one interval, and lists it in the manifest.*/
+    bool const rawCaptureEnabled = false;
+    std::string const rawCapturePrefix("Streaming");
+    int64_t const rawCaptureSegmentSize = int64_t(4) << 30;
+    auto const rawCaptureSegmentDuration = minutes(10);
+    int64_t const rawCaptureCommitBytes = int64_t(256) << 20;
+    auto const rawCaptureCommitInterval = milliseconds(500);
+
+    /* Pulse-shape discrimination: the pulses of every record are located with a threshold and integrated over a prompt and a
+       total window. Each pulse gives an event (record, time, total charge, tail-to-total ratio) written to psdEventFileName, and
+       the ratio versus charge histogram is saved to psdHistogramFileName. The raw samples of the records holding an event in
+       psdSelection (e.g. the neutron band) are saved to psdSelectedFileName, the other records are dropped.*/
+    bool const psdEnabled = false;
+    PulseShape::Parameters const psdParameters = { PulseShape::Polarity::Negative, 200, 32, 8, 24, 200 };
+    PulseShape::Selection const psdSelection = { 2000.0, 1e300, 0.25, 1.0 };
+    double const psdHistogramMaxCharge = 1e6;
+    std::string const psdEventFileName("Psd.events");
+    std::string const psdHistogramFileName("PsdHistogram.bin");
+    std::string const psdSelectedFileName("PsdSelected.bin");
+
+    /* Outlier records: every record is aligned on its trigger and compared to the running template of the usual records.
+       Only the records unusually far from it are saved (record index and samples) to outlierFileName; the others are
+       summarized by the template, saved to outlierTemplateFileName (float32 samples), and the distance statistics.*/
+    bool const outlierDetectionEnabled = false;
+    Outliers::Parameters const outlierParameters;
+    std::string const outlierFileName("Outliers.bin");
+    std::string const outlierTemplateFileName("OutlierTemplate.bin");
+
+    /* Sub-records: every record is scanned for a secondary (software) trigger condition, and a sub-record is cut around every
+       trigger. Sub-records are saved to subRecordFileName, each one as its SubRecord descriptor (parent record, position in
+       the parent, absolute time of its first sample and interpolated trigger position) followed by its samples.*/
+    bool const subRecordsEnabled = false;
+    SoftwareTrigger::Parameters const subRecordTrigger = { SoftwareTrigger::Condition::Edge, SoftwareTrigger::Slope::Rising, 2000, 200, -1000, 1000, 4, 64, 448, 512 };
+    std::string const subRecordFileName("SubRecords.bin");
+
     // Output file
     std::string  outputFile("C:\\Users\\Hani\\OneDrive\\Desktop\\acquirisDataAcquisition\\Streaming.log");
-    std::vector<std::string> recordWriteBuffer;
+    MemoryProfiler::TrackedVector<std::string> recordWriteBuffer(MemoryProfiler::MakeAllocator<std::string>("writer.queue", memoryProfilingEnabled));
 
 
 
@@ -257,37 +355,71 @@ int main()
 
 
         // Calibrate the instrument.
-        std::cout << "\nApply setup and run self-calibration\n";
-        checkApiCall(AqMD3_ApplySetup(session));
-        checkApiCall(AqMD3_SelfCalibrate(session));
-
-        // Prepare readout buffer
-        //the minimum data chunk size that must fetch from this waveform stream
-        ViInt64 sampleStreamGrain = 0;
+        std::unique_ptr<Calibration::ProfileCache> calibrationCache;
+        if (calibrationCacheEnabled)
+        {
+            std::cout << "\nApply setup and calibrate from profile cache\n";
+            checkApiCall(AqMD3_ApplySetup(session));
+
+            Calibration::Configuration calibrationConfiguration;
+            calibrationConfiguration.Set("Model", instrumentModel)
+                .Set("ChannelInterleaving", channelInterleavingEnabled)
+                .Set("SampleRate", sampleRate)
+                .Set("AcquisitionMode", acquisitionMode)
+                .Set("Channel1.Range", range)
+                .Set("Channel1.Offset", offset)
+                .Set("Channel1.Coupling", coupling);
+
+            calibrationCache.reset(new Calibration::ProfileCache(session, calibrationCacheDirectory, calibrationTemperatureBand, calibrationMaxAge));
+            calibrationCache->SetTemperatureReader([session](ViReal64* temperature)
+            {
+                return sessionScheduler.GetAttributeViReal64(session, "", AQMD3_ATTR_BOARD_TEMPERATURE, temperature, milliseconds(temperatureMaxAge));
+            });
+            Calibration::SwitchResult const calibration = calibrationCache->Calibrate(calibrationConfiguration);
+            std::cout << "  Profile:            " << calibration.key.GetFileName() << " (" << calibration.temperature << " degC)\n";
+            std::cout << "  " << (calibration.action == Calibration::Action::Loaded ? "Loaded" : "Self-calibrated (" + calibration.reason + ")")
+                      << " in " << calibration.seconds << " s\n";
+            calibrationCache->StartMonitor(temperatureMonitorInterval);
+        }
+        else
+        {
+            std::cout << "\nApply setup and run self-calibration\n";
+            checkApiCall(AqMD3_ApplySetup(session));
+            checkApiCall(AqMD3_SelfCalibrate(session));
+        }
 
-        //Which record (trigger shot) this data belongs to and Where exactly in the data the trigger happened
-        ViInt64 markerStreamGrain = 0;
+        MemoryProfiler::Registry& memoryRegistry = MemoryProfiler::Registry::Instance();
+        memoryRegistry.SetFootprintCap(memoryFootprintCap);
 
-        //You must fetch at least N KB of waveform data at a time.
-        checkApiCall(AqMD3_GetAttributeViInt64(session, sampleStreamName, AQMD3_ATTR_STREAM_GRANULARITY_IN_BYTES, &sampleStreamGrain));
+        // Prepare the stream readers, they own the readout buffers. Every fetch goes through the fault injection interposer.
+        StreamReading::FetchFunction const fetch = [](ViSession vi, ViConstString stream, ViInt64 nbrElementsToFetch, ViInt64 bufferSize, ViInt32* buffer, ViInt64* remaining, ViInt64* actual, ViInt64* first)
+        {
+            return streamFetch.StreamFetchDataInt32(vi, stream, nbrElementsToFetch, bufferSize, buffer, remaining, actual, first);
+        };
 
-        //You must fetch at least N bytes of marker data at a time
-        checkApiCall(AqMD3_GetAttributeViInt64(session, markerStreamName, AQMD3_ATTR_STREAM_GRANULARITY_IN_BYTES, &markerStreamGrain));
+        //The fetch buffers hold the requested elements plus the grain alignment overhead: fetches must be multiples of the stream granularity.
+        StreamReading::Parameters sampleReaderParams;
+        sampleReaderParams.grainElements = StreamReading::GetGrainElements(session, sampleStreamName);
+        sampleReaderParams.overheadElements = maxAcquisitionElements / 2;   // unfolding overhead (only in single channel mode)
+        sampleReaderParams.maxAttempts = nbrWaitForSamplesAttempts;
+        sampleReaderParams.initialRetryWait = milliseconds(recordDurationInMs);
+        FetchReader sampleReader(fetch, session, sampleStreamName, maxAcquisitionElements, sampleReaderParams, testApiCall, MemoryProfiler::MakeAllocator<int32_t>("fetch.samples", memoryProfilingEnabled));
 
-        //This converts the grain size from bytes to number of elements. If each sample is int32_t (4 bytes), and the grain is 16,384 bytes:
-        //So your data fetches must be in multiples of 4096 samples.
-        ViInt64 const sampleStreamGrainElements = sampleStreamGrain / sizeof(int32_t);
-        ViInt64 const markerStreamGrainElements = markerStreamGrain / sizeof(int32_t);
+        StreamReading::Parameters markerReaderParams;
+        markerReaderParams.grainElements = StreamReading::GetGrainElements(session, markerStreamName);
+        FetchReader markerReader(fetch, session, markerStreamName, maxMarkerElements, markerReaderParams, testApiCall, MemoryProfiler::MakeAllocator<int32_t>("fetch.markers", memoryProfilingEnabled));
 
-        ViInt64 const sampleStreamBufferSize = maxAcquisitionElements        // required elements
-            + maxAcquisitionElements / 2      // unfolding overhead (only in single channel mode)
-            + sampleStreamGrainElements - 1;// alignment overhead
+        MemoryProfiler::StageCounter& markerFetchStage = memoryRegistry.GetStage("fetch.markers");
+        MemoryProfiler::StageCounter& sampleFetchStage = memoryRegistry.GetStage("fetch.samples");
+        MemoryProfiler::StageCounter& unpackStage = memoryRegistry.GetStage("unpack");
 
-        ViInt64 const markerStreamBufferSize = maxMarkerElements             // required elements
-            + markerStreamGrainElements - 1;// alignment overhead
+        // Unpacked waveform of the current record, reused from record to record.
+        MemoryProfiler::TrackedVector<float> waveFormData(MemoryProfiler::MakeAllocator<float>("records", memoryProfilingEnabled));
+        waveFormData.reserve(size_t(recordSize));
 
-        FetchBuffer sampleStreamBuffer(static_cast<size_t>(sampleStreamBufferSize));
-        FetchBuffer markerStreamBuffer(static_cast<size_t>(markerStreamBufferSize));
+        // Tag and record index faults only make sense on the marker stream. Short reads report whole markers and whole records available.
+        streamFetch.AddMarkerStream(markerStreamName, LibTool::StandardStreaming::NbrTriggerMarkerElements);
+        streamFetch.SetGrainElements(sampleStreamName, nbrRecordElements);
 
 
         // Expected values and statistics
@@ -307,11 +439,80 @@ int main()
 
 
 
+        // Fetch thread and its queue, spilling to disk when processing falls behind.
+        std::unique_ptr<LibTool::DirectIo::DirectFile> spillFile;
+        std::unique_ptr<Spill::SpillQueue> spillQueue;
+        std::unique_ptr<Spill::FetchLoop> fetchLoop;
+        if (spillEnabled && !rawCaptureEnabled)
+        {
+            spillFile.reset(new LibTool::DirectIo::DirectFile(spillFileName, spillFileSize));
+            spillQueue.reset(new Spill::SpillQueue(*spillFile, spillHighWaterBatches));
+            fetchLoop.reset(new Spill::FetchLoop(*spillQueue, [&](Spill::Batch& batch) { return FetchRecordBatch(markerReader, sampleReader, batch); }, dataWaitTime));
+            std::cout << "Spill file:           " << spillFileName << " (" << (spillFileSize >> 20) << " MBytes" << (spillFile->IsUnbuffered() ? ", unbuffered" : "") << ")\n";
+        }
+
+        // Raw capture segments, the fetch destination of the samples.
+        std::unique_ptr<Capture::SegmentedCapture> captureFile;
+        if (rawCaptureEnabled)
+        {
+            Capture::SegmentPolicy segmentPolicy;
+            segmentPolicy.segmentBytes = rawCaptureSegmentSize;
+            segmentPolicy.segmentDuration = rawCaptureSegmentDuration;
+            segmentPolicy.commit.bytes = rawCaptureCommitBytes;
+            segmentPolicy.commit.interval = rawCaptureCommitInterval;
+            captureFile.reset(new Capture::SegmentedCapture(rawCapturePrefix, segmentPolicy));
+            std::cout << "Capture segments:     " << Capture::SegmentedCapture::GetSegmentPath(rawCapturePrefix, 0) << ", ... (" << (rawCaptureSegmentSize >> 20) << " MBytes, "
+                      << rawCaptureSegmentDuration.count() << " min)\n";
+        }
+
+        // Pulse-shape discrimination of the unpacked records.
+        PulseShape::Discriminator psdDiscriminator(psdParameters);
+        PulseShape::Histogram2D psdHistogram(1024, psdHistogramMaxCharge, 256);
+        std::vector<PulseShape::PulseEvent> psdEvents;
+        std::ofstream psdEventFile;
+        std::ofstream psdSelectedFile;
+        if (psdEnabled)
+        {
+            psdEventFile.open(psdEventFileName, std::ios::binary);
+            psdSelectedFile.open(psdSelectedFileName, std::ios::binary);
+            if (!psdEventFile || !psdSelectedFile)
+                throw std::runtime_error("Cannot create pulse-shape output files " + psdEventFileName + " and " + psdSelectedFileName);
+        }
+
+        // Outlier detection of the records.
+        Outliers::Detector outlierDetector(outlierParameters, recordSize);
+        std::ofstream outlierFile;
+        if (outlierDetectionEnabled)
+        {
+            outlierFile.open(outlierFileName, std::ios::binary);
+            if (!outlierFile)
+                throw std::runtime_error("Cannot create outlier file " + outlierFileName);
+        }
+
+        // Software trigger segmentation of the records.
+        SoftwareTrigger::Segmenter segmenter(subRecordTrigger, sampleInterval, timestampPeriod);
+        std::vector<SoftwareTrigger::SubRecord> subRecords;
+        std::ofstream subRecordFile;
+        if (subRecordsEnabled)
+        {
+            subRecordFile.open(subRecordFileName, std::ios::binary);
+            if (!subRecordFile)
+                throw std::runtime_error("Cannot create sub-record file " + subRecordFileName);
+        }
+
+        ClockCorrelation::LatencyMonitor latencyMonitor(clockSamplingInterval);
+        latencyMonitor.SetTransportDelay(latencyTransportDelay);
+        double const recordDuration = double(recordSize) * sampleInterval;
+
         // Start the acquisition.
+        memoryRegistry.ResetStages();
         std::cout << "\nInitiating acquisition\n";
         checkApiCall(AqMD3_InitiateAcquisition(session));
         std::cout << "Acquisition is running\n\n";
 
+        if (fetchLoop)
+            fetchLoop->Start();
+
 
         // std::ofstream outputFile(outputFileName);
 
@@ -319,24 +520,63 @@ int main()
         //Assuming we start at time 12:00 and we set our time duration of 1 min
         //the loop should run till 1 min
         auto const endTime = system_clock::now() + streamingDuration;
+        auto nextLatencyReport = system_clock::now() + latencyReportInterval;
         while (system_clock::now() < endTime)
         {
-            // Fetch markers of requested records
-            LibTool::ArraySegment<int32_t> markerArraySegment = FetchAvailableElements(session, markerStreamName, maxMarkerElements, markerStreamBuffer);
-            totalMarkerElements += markerArraySegment.Size();
+            // Abort before the process footprint exceeds the configured cap.
+            memoryRegistry.CheckFootprint();
 
-            // std::cout << "Fetched marker values: " << markerArraySegment.Size() << "\n";
+            // Raw capture: record the batch, nothing else.
+            if (captureFile)
+            {
+                int64_t const nbrCapturedRecords = CaptureRecordBatch(markerReader, sampleReader, *captureFile, expectedRecordIndex);
+                if (nbrCapturedRecords == 0)
+                {
+                    captureFile->FlushIfDue();
+                    std::cout << "waiting for data\n";
+                    sleep_for(dataWaitTime);
+                    continue;
+                }
 
+                totalMarkerElements += nbrCapturedRecords * LibTool::StandardStreaming::NbrTriggerMarkerElements;
+                totalSampleElements += nbrCapturedRecords * nbrRecordElements;
+                markerFetchStage.AddBytes(int64_t(nbrCapturedRecords * LibTool::StandardStreaming::NbrTriggerMarkerElements * sizeof(int32_t)));
+                sampleFetchStage.AddBytes(int64_t(nbrCapturedRecords * nbrRecordElements * sizeof(int32_t)));
+                continue;
+            }
 
-            // If the fetch fails to read data, then wait before a new attempt.
-            if (markerArraySegment.Size() == 0)
+            // Fetch markers of requested records and the samples of those records, or take them from the fetch thread.
+            Spill::Batch batch;
+            if (spillQueue)
+            {
+                if (!spillQueue->Pop(batch, dataWaitTime))
+                    continue;
+            }
+            else if (!FetchRecordBatch(markerReader, sampleReader, batch))
             {
+                // If the fetch fails to read data, then wait before a new attempt.
                 std::cout << "waiting for data\n";
                 sleep_for(dataWaitTime);
                 continue;
             }
 
+            LibTool::ArraySegment<int32_t> markerArraySegment(batch.parts[0], 0, batch.parts[0].size());
+            ClockCorrelation::HostClock::time_point const markerFetchTime{ ClockCorrelation::HostClock::duration(batch.tag) };
+            totalMarkerElements += markerArraySegment.Size();
+            markerFetchStage.AddBytes(int64_t(markerArraySegment.Size() * sizeof(int32_t)));
+
+            // std::cout << "Fetched marker values: " << markerArraySegment.Size() << "\n";
+
             int64_t const numAvailableRecords = int64_t(markerArraySegment.Size() / LibTool::StandardStreaming::NbrTriggerMarkerElements);
+
+            // Sample the host clock against the end of the newest record: its marker is the last one of the fetched segment.
+            if (latencyMonitoringEnabled && numAvailableRecords > 0)
+            {
+                LibTool::ArraySegment<int32_t> newestMarkerSegment(markerArraySegment);
+                newestMarkerSegment.PopFront(size_t((numAvailableRecords - 1) * LibTool::StandardStreaming::NbrTriggerMarkerElements));
+                LibTool::TriggerMarker const newestMarker = LibTool::StandardStreaming::DecodeTriggerMarker(newestMarkerSegment);
+                latencyMonitor.ObserveDeviceTime(newestMarker.GetInitialXTime(timestampPeriod) + recordDuration, markerFetchTime);
+            }
             // std::cout << "Number of triggers (records) detected: " << numAvailableRecords << "\n";
             // std::cout << "Expecting to fetch samples: " << numAvailableRecords * nbrRecordElements << "\n";
 
@@ -349,11 +589,12 @@ int main()
 
 
 
-             // Fetch all samples of requested records
-             // Fetch the samples corresponding to those new records
-             // Multiply number of records  record size to know how many samples to fetch
-            LibTool::ArraySegment<int32_t> sampleArraySegment = FetchElements(session, sampleStreamName, numAvailableRecords * nbrRecordElements, sampleStreamBuffer);
+             // Samples of requested records
+             // The samples corresponding to those new records
+             // Multiply number of records  record size to know how many samples were fetched
+            LibTool::ArraySegment<int32_t> sampleArraySegment(batch.parts[1], 0, batch.parts[1].size());
             totalSampleElements += sampleArraySegment.Size();
+            sampleFetchStage.AddBytes(int64_t(sampleArraySegment.Size() * sizeof(int32_t)));
 
             // std::cout << "Fetched waveform elements: " << sampleArraySegment.Size() << "\n";
             // std::cout << "Expected waveform elements: " << numAvailableRecords * nbrRecordElements << "\n";
@@ -384,8 +625,7 @@ int main()
                 if (xtime <= minXtime)
                     throw std::runtime_error("InitialXTime not increasing: minimum expected=" + ToString(minXtime) + ", got " + ToString(xtime));
 
-                std::vector<float> waveFormData;
-                waveFormData.reserve(nbrRecordElements * nbrSamplesPerElement);
+                waveFormData.clear();
                 for (int64_t j = 0; j < nbrRecordElements; ++j)
                 {
                     int32_t packed = sampleArraySegment[j];
@@ -393,6 +633,12 @@ int main()
                     waveFormData.push_back(float(int16_t((packed >> 16) & 0xFFFF)));
                 }
 
+                unpackStage.AddBytes(int64_t(nbrRecordElements * sizeof(int32_t)));
+
+                // The unpacked waveform is the result of the record: account its latency from the trigger.
+                if (latencyMonitoringEnabled)
+                    latencyMonitor.RecordResult(xtime + nextTriggerMarker.GetInitialXOffset(sampleInterval));
+
                 if (waveFormData.size() != recordSize)
                 {
                     std::cout << "Error: Waveform size mismatch with expected recordSize!";
@@ -400,6 +646,46 @@ int main()
 
                 //now we fetched the current waveforms data and the time it was acquired at
 
+                // Discriminate the pulses of the record, and keep its raw samples only if it holds a selected event.
+                if (psdEnabled)
+                {
+                    int16_t const* const recordSamples = reinterpret_cast<int16_t const*>(sampleArraySegment.GetData());
+                    psdEvents.clear();
+                    psdDiscriminator.Process(recordSamples, recordSize, uint64_t(expectedRecordIndex), psdEvents);
+                    psdHistogram.Fill(psdEvents);
+                    psdEventFile.write(reinterpret_cast<char const*>(psdEvents.data()), std::streamsize(psdEvents.size() * sizeof(PulseShape::PulseEvent)));
+                    if (std::any_of(psdEvents.begin(), psdEvents.end(), [&](PulseShape::PulseEvent const& e) { return psdSelection.IsSelected(e); }))
+                    {
+                        psdSelectedFile.write(reinterpret_cast<char const*>(&expectedRecordIndex), sizeof(expectedRecordIndex));
+                        psdSelectedFile.write(reinterpret_cast<char const*>(recordSamples), std::streamsize(recordSize * sizeof(int16_t)));
+                    }
+                }
+
+                // Cut the sub-records aligned on the software triggers.
+                if (subRecordsEnabled)
+                {
+                    int16_t const* const recordSamples = reinterpret_cast<int16_t const*>(sampleArraySegment.GetData());
+                    subRecords.clear();
+                    segmenter.Process(nextTriggerMarker, recordSamples, recordSize, subRecords);
+                    for (SoftwareTrigger::SubRecord const& subRecord : subRecords)
+                    {
+                        subRecordFile.write(reinterpret_cast<char const*>(&subRecord), sizeof(subRecord));
+                        subRecordFile.write(reinterpret_cast<char const*>(recordSamples + subRecord.firstSample), std::streamsize(subRecordTrigger.GetSubRecordSize() * sizeof(int16_t)));
+                    }
+                }
+
+                // Keep the record only if it is unusual.
+                if (outlierDetectionEnabled)
+                {
+                    int16_t const* const recordSamples = reinterpret_cast<int16_t const*>(sampleArraySegment.GetData());
+                    Outliers::Result const outlier = outlierDetector.Process(uint64_t(expectedRecordIndex), recordSamples, nextTriggerMarker.triggerTimeSamples);
+                    if (outlier.isOutlier)
+                    {
+                        outlierFile.write(reinterpret_cast<char const*>(&expectedRecordIndex), sizeof(expectedRecordIndex));
+                        outlierFile.write(reinterpret_cast<char const*>(recordSamples), std::streamsize(recordSize * sizeof(int16_t)));
+                    }
+                }
+
 
                 std::vector<int> sampleData;
                 for (int i = 0; i < 5; i++)
@@ -416,9 +702,19 @@ int main()
                 //Updates last known timestamp to check for time ordering in the next record
                 minXtime = xtime;
             }
+
+            if (latencyMonitoringEnabled && system_clock::now() >= nextLatencyReport)
+            {
+                std::cout << "\n" << latencyMonitor.FormatPercentiles() << "\n";
+                nextLatencyReport += latencyReportInterval;
+            }
         }
 
 
+        // Stop the fetch thread: batches not yet processed are discarded.
+        if (fetchLoop)
+            fetchLoop->Stop();
+
         // outputFile.close();
 
         ViInt64 const totalSampleData = totalSampleElements * sizeof(ViInt32);
@@ -432,10 +728,63 @@ int main()
         ViInt64 const totalData = totalSampleData + totalMarkerData;
         std::cout << "Data rate: " << (totalData) / (1024 * 1024) / (streamingDuration / minutes(2)) << " MB/s.\n";
 
+        if (faultInjectionRates.GetTotal() > 0.0)
+            streamFetch.GetStatistics().Print(std::cout);
+
+        if (memoryProfilingEnabled)
+            memoryRegistry.Report(std::cout);
+
+        if (latencyMonitoringEnabled)
+            latencyMonitor.Report(std::cout);
+
+        sessionScheduler.GetStatistics().Print(std::cout);
+        markerReader.GetStatistics().Print(std::cout, markerStreamName);
+        sampleReader.GetStatistics().Print(std::cout, sampleStreamName);
+
+        if (spillQueue)
+            spillQueue->GetStatistics().Print(std::cout);
+
+        if (captureFile)
+        {
+            captureFile->Close();
+            captureFile->GetStatistics().Print(std::cout);
+        }
+
+        if (subRecordsEnabled)
+        {
+            segmenter.GetStatistics().Print(std::cout);
+            std::cout << "  Saved:              " << subRecordFileName << " (" << subRecordTrigger.GetSubRecordSize() << " samples per sub-record)\n";
+        }
+
+        if (outlierDetectionEnabled)
+        {
+            std::ofstream templateFile(outlierTemplateFileName, std::ios::binary);
+            outlierDetector.SaveTemplate(templateFile);
+            outlierDetector.GetStatistics().Print(std::cout);
+            std::cout << "  Saved:              " << outlierFileName << ", template " << outlierTemplateFileName << '\n';
+        }
+
+        if (psdEnabled)
+        {
+            std::ofstream histogramFile(psdHistogramFileName, std::ios::binary);
+            psdHistogram.Save(histogramFile);
+            psdDiscriminator.GetStatistics().Print(std::cout);
+            std::cout << "  Histogram:          " << psdHistogramFileName << " (" << psdHistogram.GetNbrEntries() << " entries, " << psdHistogram.GetNbrOutOfRange() << " out of range)\n";
+        }
+
 
         // Stop the acquisition.
         std::cout << "\nStopping acquisition\n";
-        checkApiCall(AqMD3_Abort(session));
+        checkApiCall(sessionScheduler.Call(session, SessionScheduling::Priority::Control, [session]() { return AqMD3_Abort(session); }));
+
+        // The instrument is idle: recalibrate if the temperature drifted out of the band of the profile.
+        if (calibrationCache)
+        {
+            calibrationCache->StopMonitor();
+            Calibration::SwitchResult refresh;
+            if (calibrationCache->RefreshIfPending(&refresh))
+                std::cout << "Temperature drifted to " << refresh.temperature << " degC, profile " << refresh.key.GetFileName() << " refreshed in " << refresh.seconds << " s\n";
+        }
 
         // Close the session.
         checkApiCall(AqMD3_close(session));
@@ -474,89 +823,68 @@ void testApiCall(ViStatus status, char const* functionName)
     }
 }
 
-LibTool::ArraySegment<int32_t> FetchAvailableElements(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, FetchBuffer& buffer)
+bool FetchRecordBatch(FetchReader& markerReader, FetchReader& sampleReader, Spill::Batch& batch)
 {
-    int32_t* bufferData = buffer.data();
-    ViInt64 const bufferSize = buffer.size();
-
-    if (bufferSize < nbrElementsToFetch)
-        throw std::invalid_argument("Buffer size is smaller than the requested elements to fetch");
-
-    ViInt64 firstValidElement = 0;
-    ViInt64 actualElements = 0;
-    ViInt64 remainingElements = 0;
-
-    // Try to fetch the requested volume of elements.
-    checkApiCall(AqMD3_StreamFetchDataInt32(session, streamName, nbrElementsToFetch, bufferSize, (ViInt32*)bufferData, &remainingElements, &actualElements, &firstValidElement));
-
-    if ((actualElements == 0) && (remainingElements > 0))
-    {
-        /* Fetch failed to read data because the number of available elements is smaller than the requested volume.*/
-
-        // Check that the number of available elements is smaller than requested
-        if (nbrElementsToFetch <= remainingElements)
-            throw std::logic_error("First fetch failed to read " + ToString(nbrElementsToFetch) + " elements when it reports " + ToString(remainingElements) + " available elements.");
-
-        // Read available elements
-        checkApiCall(AqMD3_StreamFetchDataInt32(session, streamName, remainingElements, bufferSize, (ViInt32*)bufferData, &remainingElements, &actualElements, &firstValidElement));
-    }
-
-    // if (actualElements > 0)
-    // {
-    //     std::cout << "Fetched " << actualElements << " elements from " << streamName << " stream. Remaining elements: " << remainingElements << "\n";
-    // }
-
-    // this buffer might be empty if fetch failed to read actual data.
-    return LibTool::ArraySegment<int32_t>(buffer, (size_t)firstValidElement, (size_t)actualElements);
+    // Fetch markers of requested records
+    LibTool::ArraySegment<int32_t> const markerSegment = markerReader.FetchAvailable();
+    ClockCorrelation::HostClock::time_point const markerFetchTime = ClockCorrelation::HostClock::now();
+    if (markerSegment.Size() == 0)
+        return false;
+
+    // Fetch all samples of the records described by the markers
+    int64_t const nbrRecords = int64_t(markerSegment.Size() / LibTool::StandardStreaming::NbrTriggerMarkerElements);
+    if (nbrRecords == 0)
+        return false;
+    LibTool::ArraySegment<int32_t> const sampleSegment = sampleReader.FetchExact(nbrRecords * nbrRecordElements);
+
+    batch.tag = markerFetchTime.time_since_epoch().count();
+    batch.nbrParts = 2;
+    batch.parts[0].assign(markerSegment.GetData(), markerSegment.GetData() + markerSegment.Size());
+    batch.parts[1].assign(sampleSegment.GetData(), sampleSegment.GetData() + sampleSegment.Size());
+    return true;
 }
 
-LibTool::ArraySegment<int32_t> FetchElements(ViSession session, ViConstString streamName, ViInt64 nbrElementsToFetch, FetchBuffer& buffer)
+int64_t CaptureRecordBatch(FetchReader& markerReader, FetchReader& sampleReader, Capture::SegmentedCapture& capture, ViInt64& expectedRecordIndex)
 {
-    // Handle the special case there is no need to fetch elements (this might happen when all samples are suppressed) by returning an empty array segment
-    if (nbrElementsToFetch == 0)
-        return LibTool::ArraySegment<int32_t>(buffer, 0, 0);
-
-    int32_t* bufferData = buffer.data();
-    ViInt64 const bufferSize = buffer.size();
+    // Fetch markers of requested records
+    LibTool::ArraySegment<int32_t> markerSegment = markerReader.FetchAvailable();
+    if (markerSegment.Size() == 0)
+        return 0;
 
-    if (bufferSize < nbrElementsToFetch)
-        throw std::invalid_argument("Buffer size is smaller than the requested elements to fetch");
+    // Fetch all samples of the records described by the markers into the free pages of the current capture segment.
+    int64_t const nbrRecords = int64_t(markerSegment.Size() / LibTool::StandardStreaming::NbrTriggerMarkerElements);
+    int64_t const nbrSamples = nbrRecords * nbrRecordElements;
+    Capture::Reservation const reservation = capture.Reserve(nbrSamples + sampleReader.GetBufferOverhead());
+    LibTool::ArraySegment<int32_t> const sampleSegment = sampleReader.FetchExactInto(nbrSamples, reservation.data, reservation.capacity);
 
-    for (int nbrAttempts = 0; nbrAttempts < nbrWaitForSamplesAttempts; ++nbrAttempts)
+    // Validate the markers before committing the samples. On error, the next reservation overwrites them.
+    std::vector<Capture::RecordHeader> headers(static_cast<size_t>(nbrRecords));
+    for (int64_t i = 0; i < nbrRecords; ++i)
     {
-        ViInt64 firstElement = 0;
-        ViInt64 actualElements = 0;
-        ViInt64 remainingElements = 0;
-
-        // Try to fetch the requested volume of elements.
-        checkApiCall(AqMD3_StreamFetchDataInt32(session, streamName, nbrElementsToFetch, bufferSize, (ViInt32*)bufferData, &remainingElements, &actualElements, &firstElement));
-
-        if (nbrElementsToFetch == actualElements)
+        LibTool::TriggerMarker const triggerMarker = LibTool::StandardStreaming::DecodeTriggerMarker(markerSegment);
+        if (LibTool::MarkerTag::TriggerNormal != triggerMarker.tag || (expectedRecordIndex & LibTool::TriggerMarker::RecordIndexMask) != triggerMarker.recordIndex)
         {
-            // Requested volume has been successfully  fetched.
-            // std::cout << "Fetched " << actualElements << " elements from " << streamName << " stream. Remaining elements: " << remainingElements << "\n";
-            return LibTool::ArraySegment<int32_t>(buffer, size_t(firstElement), size_t(actualElements));
+            capture.Discard();
+            throw std::runtime_error("Unexpected trigger marker: tag " + ToString(int(triggerMarker.tag)) + ", record index " + ToString(triggerMarker.recordIndex)
+                                     + ", expected record index " + ToString(expectedRecordIndex));
         }
-        else
-        {
-            if ((actualElements == 0) && (remainingElements < nbrElementsToFetch))
-            {
-                /* Sometimes, the fetch fail because data might not be ready for fetch immediately.
-                   Make another attempt after a short wait. */
-                std::cout << "Wait for record samples to be ready for fetch\n";
-                std::this_thread::sleep_for(std::chrono::milliseconds(recordDurationInMs));
-                continue;
-            }
 
-            /* The following error might occurs in case of stream overflow error where sample storage in memory is interrupted
-               at overflow event. The very last record is incomplete in this case.*/
-            throw std::runtime_error("Number of fetched elements is different than requested. Requested=" + ToString(nbrElementsToFetch) + " , fetched=" + ToString(actualElements) + ".");
-        }
+        headers[size_t(i)].recordIndex = uint64_t(expectedRecordIndex);
+        headers[size_t(i)].absoluteSampleIndex = triggerMarker.absoluteSampleIndex;
+        headers[size_t(i)].triggerTimeSamples = triggerMarker.triggerTimeSamples;
+        headers[size_t(i)].nbrElements = nbrRecordElements;
+        ++expectedRecordIndex;
     }
 
-    throw std::runtime_error("Failed to fetch requested data from " + ToString(streamName) + " after " + ToString(nbrWaitForSamplesAttempts) + " attempts");
-}
+    int64_t const dataOffset = capture.Commit(sampleSegment);
+    for (int64_t i = 0; i < nbrRecords; ++i)
+    {
+        headers[size_t(i)].dataOffset = dataOffset + i * nbrRecordElements * int64_t(sizeof(int32_t));
+        capture.AddRecord(headers[size_t(i)]);
+    }
 
+    return nbrRecords;
+}
 
 std::string SaveRecord(LibTool::TriggerMarker const& triggerMarker, ViInt64 nbrRecordElements, LibTool::ArraySegment<int32_t> const& elementBuffer, double timestampInterval, std::ostream& output)
 {